@@ -0,0 +1,328 @@
+// stdlib
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+// system
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <thread>
+// proj
+#include "aof.h"
+#include "log.h"
+#include "protocol.h"
+
+
+static uint64_t aof_now_ms() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+bool aof_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+// the whole group in as few syscalls as possible
+static bool writev_all(int fd, std::vector<struct iovec> &iov) {
+    size_t i = 0;
+    while (i < iov.size()) {
+        int n = (int)std::min(iov.size() - i, (size_t)IOV_MAX);
+        ssize_t rv = writev(fd, &iov[i], n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return false;
+        }
+        // skip what was written, possibly part of an iovec
+        size_t left = (size_t)rv;
+        while (i < iov.size() && left >= iov[i].iov_len) {
+            left -= iov[i].iov_len;
+            i++;
+        }
+        if (left > 0) {
+            iov[i].iov_base = (char *)iov[i].iov_base + left;
+            iov[i].iov_len -= left;
+        }
+    }
+    return true;
+}
+
+bool aof_open(Aof *aof, const char *path) {
+    aof->path = path;
+    aof->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (aof->fd < 0) {
+        return false;
+    }
+    struct stat st = {};
+    if (fstat(aof->fd, &st) < 0) {
+        return false;
+    }
+    aof->size = aof->base_size = (size_t)st.st_size;
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return false;
+    }
+    aof->wake_rfd = fds[0];
+    aof->wake_wfd = fds[1];
+    return true;
+}
+
+static void aof_wake(Aof *aof) {
+    // one wakeup per batch of submits, like shard_post()
+    if (!aof->wake_pending.exchange(true)) {
+        uint8_t one = 1;
+        if (write(aof->wake_wfd, &one, 1) < 0 && errno != EAGAIN) {
+            LOG_WARN("[errno:%d] aof wakeup write()", errno);
+        }
+    }
+}
+
+void aof_submit(Aof *aof, AofBatch *batch) {
+    aof->queue.push(batch);
+    aof_wake(aof);
+}
+
+void aof_rewrite(Aof *aof) {
+    aof->rewrite_requested.store(true);
+    aof_wake(aof);
+}
+
+// writes everything queued so far as one group. returns whether anything
+// was written.
+static bool aof_write_queued(Aof *aof, std::vector<AofBatch *> &done) {
+    std::vector<struct iovec> iov;
+    size_t bytes = 0;
+    while (MpscNode *node = aof->queue.pop()) {
+        AofBatch *b = static_cast<AofBatch *>(node);
+        iov.push_back({(void *)b->data.data(), b->data.size()});
+        bytes += b->data.size();
+        if (aof->child > 0) {
+            // the child's snapshot doesn't have these
+            aof->diff.append(b->data);
+        }
+        done.push_back(b);
+    }
+    if (iov.empty()) {
+        return false;
+    }
+    if (!writev_all(aof->fd, iov)) {
+        // the writes were already acknowledged unless the policy is always
+        if (aof->fsync_policy == AOF_FSYNC_ALWAYS) {
+            LOG_ERROR("[errno:%d] can't write the AOF, exiting", errno);
+            log_flush();
+            abort();
+        }
+        LOG_ERROR("[errno:%d] AOF write() failed, %zu bytes lost", errno, bytes);
+    }
+    aof->size += bytes;
+    return true;
+}
+
+static void aof_report(Aof *aof, std::vector<AofBatch *> &done) {
+    for (AofBatch *b : done) {
+        // nobody waits for writes under the other policies
+        if (aof->on_synced && aof->fsync_policy == AOF_FSYNC_ALWAYS) {
+            aof->on_synced(b->owner, b->seq);
+        }
+        delete b;
+    }
+    done.clear();
+}
+
+static void rewrite_start(Aof *aof) {
+    // a consistent point: the shards have queued all their mutations and
+    // are stopped until the fork is done
+    aof->pause();
+    std::vector<AofBatch *> done;
+    aof_write_queued(aof, done);
+    if (aof->fsync_policy == AOF_FSYNC_ALWAYS && !done.empty()) {
+        (void)fdatasync(aof->fd);
+    }
+
+    std::string tmp = aof->path + ".rewrite";
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: only this thread exists here, and the dataset is a
+        // copy-on-write snapshot of the paused shards
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && aof->dump(fd) && fsync(fd) == 0;
+        _exit(ok ? 0 : 1);
+    }
+    aof->resume();
+    aof_report(aof, done);
+
+    if (pid < 0) {
+        LOG_ERROR("[errno:%d] AOF rewrite fork()", errno);
+        return;
+    }
+    LOG_INFO("AOF rewrite started by pid %d", (int)pid);
+    aof->child = pid;
+    aof->diff.clear();
+}
+
+static void rewrite_done(Aof *aof, int status) {
+    std::string tmp = aof->path + ".rewrite";
+    aof->child = -1;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int fd = ok ? open(tmp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC) : -1;
+    // then what was written in the meantime, and the new file takes over
+    ok = fd >= 0 && aof_write_all(fd, aof->diff.data(), aof->diff.size())
+        && fsync(fd) == 0 && rename(tmp.c_str(), aof->path.c_str()) == 0;
+    if (!ok) {
+        LOG_ERROR("AOF rewrite failed");
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+        (void)unlink(tmp.c_str());
+    } else {
+        (void)close(aof->fd);
+        aof->fd = fd;
+        struct stat st = {};
+        (void)fstat(fd, &st);
+        LOG_INFO("AOF rewritten: %zu -> %zu bytes", aof->size, (size_t)st.st_size);
+        aof->size = aof->base_size = (size_t)st.st_size;
+    }
+    aof->diff.clear();
+    aof->diff.shrink_to_fit();
+}
+
+static void aof_main(Aof *aof) {
+    std::vector<AofBatch *> done;
+    uint64_t last_fsync = aof_now_ms();
+    bool dirty = false;     // written since the last fsync
+    while (true) {
+        int timeout = -1;
+        if (aof->fsync_policy == AOF_FSYNC_EVERYSEC && dirty) {
+            uint64_t since = aof_now_ms() - last_fsync;
+            timeout = since >= 1000 ? 0 : (int)(1000 - since);
+        }
+        if (aof->child > 0 && (timeout < 0 || timeout > 100)) {
+            timeout = 100;  // check on the child
+        }
+        struct pollfd pfd = {aof->wake_rfd, POLLIN, 0};
+        (void)poll(&pfd, 1, timeout);
+
+        // reset the wakeup before draining, so a submit racing with us re-arms it
+        uint8_t buf[256];
+        while (read(aof->wake_rfd, buf, sizeof(buf)) > 0) {
+        }
+        aof->wake_pending.store(false);
+
+        // group commit: everything every shard queued, in one go
+        if (aof_write_queued(aof, done)) {
+            dirty = true;
+            if (aof->fsync_policy == AOF_FSYNC_ALWAYS) {
+                (void)fdatasync(aof->fd);
+                dirty = false;
+            }
+        }
+        aof_report(aof, done);
+        if (dirty && aof->fsync_policy == AOF_FSYNC_EVERYSEC
+            && aof_now_ms() - last_fsync >= 1000)
+        {
+            (void)fdatasync(aof->fd);
+            last_fsync = aof_now_ms();
+            dirty = false;
+        }
+
+        if (aof->child > 0) {
+            int status = 0;
+            if (waitpid(aof->child, &status, WNOHANG) == aof->child) {
+                rewrite_done(aof, status);
+            }
+            continue;
+        }
+        bool grown = aof->rewrite_min_size && aof->size >= aof->rewrite_min_size
+            && aof->size >= 2 * aof->base_size;
+        if (aof->rewrite_requested.exchange(false) || grown) {
+            rewrite_start(aof);
+        }
+    }
+}
+
+void aof_start(Aof *aof) {
+    std::thread(aof_main, aof).detach();
+}
+
+int64_t aof_load(const char *path,
+    void (*apply)(std::vector<std::string_view> &cmd, void *arg), void *arg)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) < 0) {
+        (void)close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        (void)close(fd);
+        return 0;
+    }
+    // read through the page cache without a copy into our own buffer
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        (void)close(fd);
+        return -1;
+    }
+    (void)madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    int64_t ncmd = 0;
+    size_t off = 0;
+    std::vector<std::string_view> cmd;
+    while (off < size) {
+        uint32_t len = 0;
+        if (size - off < 4) {
+            break;
+        }
+        memcpy(&len, data + off, 4);
+        if (len > k_max_msg) {
+            ncmd = -1;  // not something we wrote
+            break;
+        }
+        if (size - off - 4 < len) {
+            break;
+        }
+        if (parse_req(data + off + 4, len, cmd) < 0) {
+            ncmd = -1;
+            break;
+        }
+        apply(cmd, arg);
+        ncmd++;
+        off += 4 + len;
+    }
+    (void)munmap((void *)data, size);
+
+    if (ncmd >= 0 && off < size) {
+        LOG_WARN("AOF ends with an incomplete command, truncating %zu bytes", size - off);
+        if (ftruncate(fd, (off_t)off) < 0) {
+            ncmd = -1;
+        }
+    }
+    (void)close(fd);
+    return ncmd;
+}
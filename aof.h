@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+// C++
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+// proj
+#include "mpsc_queue.h"
+
+
+// appendfsync
+enum {
+    AOF_FSYNC_NO = 0,       // leave it to the kernel
+    AOF_FSYNC_EVERYSEC = 1,
+    AOF_FSYNC_ALWAYS = 2,   // before the writes are acknowledged
+};
+
+// the mutations of one event loop iteration of one shard, in the request
+// wire format, handed to the AOF thread as a unit
+struct AofBatch : MpscNode {
+    std::string data;
+    void *owner = NULL;     // passed back to Aof::on_synced
+    uint64_t seq = 0;
+};
+
+// the append-only file. all disk io happens on one background thread: it
+// takes every batch queued by the shards since its last wakeup, writes them
+// with a single writev() and fsyncs per the policy. a rewrite forks a child
+// that dumps the dataset while new batches are also kept in memory, then
+// swaps the new file in.
+struct Aof {
+    std::string path;
+    int fd = -1;
+    int fsync_policy = AOF_FSYNC_EVERYSEC;
+    // rewrite once the file is this big and has doubled since the last one
+    size_t rewrite_min_size = 64 << 20;
+
+    // callbacks into the server, all called on the AOF thread
+    // a batch is durable, only under the always policy
+    void (*on_synced)(void *owner, uint64_t seq) = NULL;
+    // stop the shards at a point where the dataset is consistent, after
+    // they queued their last batch; and let them go again
+    void (*pause)() = NULL;
+    void (*resume)() = NULL;
+    // in the forked child: write the dataset as commands to `fd`
+    bool (*dump)(int fd) = NULL;
+
+    // internal
+    MpscQueue queue;
+    int wake_rfd = -1;
+    int wake_wfd = -1;
+    std::atomic<bool> wake_pending{false};
+    std::atomic<bool> rewrite_requested{false};
+    size_t size = 0;
+    size_t base_size = 0;   // after the last rewrite
+    pid_t child = -1;
+    std::string diff;       // written while the child runs
+};
+
+// opens or creates the file; false with errno set on failure
+bool aof_open(Aof *aof, const char *path);
+// starts the AOF thread
+void aof_start(Aof *aof);
+// any thread
+void aof_submit(Aof *aof, AofBatch *batch);
+void aof_rewrite(Aof *aof);
+// write() until done; for Aof::dump
+bool aof_write_all(int fd, const char *data, size_t len);
+
+// replays the file. an incomplete trailing command, from a crash mid-write,
+// is cut off. returns the number of commands, or -1 on a corrupt file.
+int64_t aof_load(const char *path,
+    void (*apply)(std::vector<std::string_view> &cmd, void *arg), void *arg);
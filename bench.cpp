@@ -0,0 +1,547 @@
+// a load generator: N pipelined connections over M threads, each keeping
+// `--pipeline` requests in flight. reports throughput and a log-linear
+// latency histogram (HdrHistogram style) as text, and optionally JSON.
+//
+// usage: bench --help
+// stdlib
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+// C++
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "event_loop.h"
+#include "protocol.h"
+
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+// latencies in ns: exact below 2^k_hist_sub_bits, then 2^k_hist_sub_bits
+// linear sub-buckets per power of 2, i.e. within ~1.6%
+const uint32_t k_hist_sub_bits = 6;
+const uint32_t k_hist_sub = 1 << k_hist_sub_bits;
+const size_t k_hist_buckets = (64 - k_hist_sub_bits + 1) * k_hist_sub;
+
+struct Histogram {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(k_hist_buckets);
+    uint64_t total = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    double sum = 0;
+};
+
+static size_t hist_index(uint64_t v) {
+    if (v < k_hist_sub) {
+        return (size_t)v;
+    }
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(v);     // >= k_hist_sub_bits
+    uint64_t mantissa = v >> (e - k_hist_sub_bits);     // in [sub, 2 * sub)
+    return (size_t)(e - k_hist_sub_bits + 1) * k_hist_sub + (size_t)(mantissa - k_hist_sub);
+}
+
+// the highest value that lands in bucket `idx`
+static uint64_t hist_value(size_t idx) {
+    if (idx < k_hist_sub) {
+        return idx;
+    }
+    uint32_t e = (uint32_t)(idx / k_hist_sub) + k_hist_sub_bits - 1;
+    uint64_t mantissa = idx % k_hist_sub + k_hist_sub;
+    uint32_t shift = e - k_hist_sub_bits;
+    return (mantissa << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_record(Histogram &h, uint64_t v) {
+    h.counts[hist_index(v)]++;
+    h.total++;
+    h.min = std::min(h.min, v);
+    h.max = std::max(h.max, v);
+    h.sum += (double)v;
+}
+
+static void hist_merge(Histogram &into, const Histogram &h) {
+    for (size_t i = 0; i < k_hist_buckets; i++) {
+        into.counts[i] += h.counts[i];
+    }
+    into.total += h.total;
+    into.min = std::min(into.min, h.min);
+    into.max = std::max(into.max, h.max);
+    into.sum += h.sum;
+}
+
+// `q` in [0, 100]
+static uint64_t hist_percentile(const Histogram &h, double q) {
+    if (h.total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(q / 100 * (double)h.total);
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_hist_buckets; i++) {
+        seen += h.counts[i];
+        if (seen >= rank) {
+            return std::min(hist_value(i), h.max);
+        }
+    }
+    return h.max;
+}
+
+struct Zipf {
+    std::vector<double> cdf;
+    Zipf(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += 1.0 / pow((double)(i + 1), s);
+            cdf[i] = sum;
+        }
+        for (double &c : cdf) {
+            c /= sum;
+        }
+    }
+    size_t next(std::mt19937_64 &rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return (size_t)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+};
+
+struct Options {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1234;
+    uint32_t conns = 50;
+    uint32_t threads = 4;
+    uint32_t pipeline = 1;
+    uint64_t keys = 100000;
+    bool zipf = false;
+    double zipf_s = 0.99;
+    uint32_t val_min = 32;
+    uint32_t val_max = 32;
+    double get_ratio = 0.9;     // the rest are SETs
+    double duration = 10;       // seconds, when `requests` is 0
+    uint64_t requests = 0;
+    bool populate = false;      // SET every key first
+    const char *json = NULL;    // path, "-" for stdout
+};
+
+static Options g_opt;
+static Zipf *g_zipf = NULL;
+static std::string g_value;     // values are prefixes of this
+static std::atomic<uint64_t> g_issued{0};
+static uint64_t g_deadline_ns = 0;
+
+struct Counters {
+    uint64_t gets = 0;
+    uint64_t sets = 0;
+    uint64_t misses = 0;
+    uint64_t errors = 0;
+};
+
+struct Conn {
+    int fd = -1;
+    std::string out;            // encoded, not yet written
+    size_t out_off = 0;
+    std::vector<uint8_t> in;
+    std::deque<uint64_t> sent;  // send times of the requests in flight
+    bool want_write = false;
+    bool done = false;          // stopped issuing
+};
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_opt.port);
+    if (inet_pton(AF_INET, g_opt.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad host %s\n", g_opt.host);
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        die("connect()");
+    }
+    int one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// claims one request from the budget
+static bool budget_take() {
+    if (g_opt.requests) {
+        return g_issued.fetch_add(1, std::memory_order_relaxed) < g_opt.requests;
+    }
+    return now_ns() < g_deadline_ns;
+}
+
+static void queue_request(Conn *conn, std::mt19937_64 &rng, Counters &c) {
+    uint64_t k = g_zipf ? g_zipf->next(rng) : rng() % g_opt.keys;
+    // scatter the popular ranks over the keyspace
+    k = k * 2654435761u % g_opt.keys;
+    std::string key = "key:" + std::to_string(k);
+    if (std::uniform_real_distribution<double>(0, 1)(rng) < g_opt.get_ratio) {
+        append_req(conn->out, {"get", key});
+        c.gets++;
+    } else {
+        uint32_t n = g_opt.val_min
+            + (uint32_t)(rng() % (g_opt.val_max - g_opt.val_min + 1));
+        append_req(conn->out, {"set", key, std::string_view(g_value.data(), n)});
+        c.sets++;
+    }
+    conn->sent.push_back(now_ns());
+}
+
+static void conn_fill(Conn *conn, std::mt19937_64 &rng, Counters &c) {
+    while (!conn->done && conn->sent.size() < g_opt.pipeline) {
+        if (!budget_take()) {
+            conn->done = true;
+            break;
+        }
+        queue_request(conn, rng, c);
+    }
+}
+
+static void conn_flush(Conn *conn) {
+    while (conn->out_off < conn->out.size()) {
+        ssize_t rv = write(conn->fd, conn->out.data() + conn->out_off,
+            conn->out.size() - conn->out_off);
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv < 0) {
+            die("write()");
+        }
+        conn->out_off += (size_t)rv;
+    }
+    if (conn->out_off == conn->out.size()) {
+        conn->out.clear();
+        conn->out_off = 0;
+    }
+    conn->want_write = !conn->out.empty();
+}
+
+// reads until EAGAIN and accounts for every complete response
+static void conn_read(Conn *conn, Histogram &h, Counters &c) {
+    while (true) {
+        uint8_t buf[64 * 1024];
+        ssize_t rv = read(conn->fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            fprintf(stderr, "connection lost\n");
+            exit(EXIT_FAILURE);
+        }
+        conn->in.insert(conn->in.end(), buf, buf + rv);
+    }
+    uint64_t now = now_ns();
+    size_t off = 0;
+    while (conn->in.size() - off >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->in[off], 4);
+        if (conn->in.size() - off - 4 < len) {
+            break;
+        }
+        uint32_t status = RES_ERR;
+        if (len >= 4) {
+            memcpy(&status, &conn->in[off + 4], 4);
+        }
+        c.misses += status == RES_NX;
+        c.errors += status == RES_ERR;
+        assert(!conn->sent.empty());
+        hist_record(h, now - conn->sent.front());
+        conn->sent.pop_front();
+        off += 4 + len;
+    }
+    conn->in.erase(conn->in.begin(), conn->in.begin() + off);
+}
+
+struct Worker {
+    std::vector<Conn *> conns;
+    Histogram hist;
+    Counters counters;
+};
+
+static void worker_run(Worker *w, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    EventLoop *loop = event_loop_new(NULL);
+    if (!loop) {
+        die("event_loop_new()");
+    }
+    std::vector<Conn *> by_fd;
+    for (Conn *conn : w->conns) {
+        if (by_fd.size() <= (size_t)conn->fd) {
+            by_fd.resize(conn->fd + 1);
+        }
+        by_fd[conn->fd] = conn;
+    }
+    size_t active = 0;
+    for (Conn *conn : w->conns) {
+        conn_fill(conn, rng, w->counters);
+        conn_flush(conn);
+        if (!conn->sent.empty()) {
+            loop->add(conn->fd, EV_READ | (conn->want_write ? EV_WRITE : 0));
+            active++;
+        }
+    }
+
+    std::vector<Event> events;
+    while (active > 0) {
+        if (loop->wait(events, 100) < 0 && errno != EINTR) {
+            die("wait()");
+        }
+        for (const Event &ev : events) {
+            Conn *conn = by_fd[ev.fd];
+            bool had_write = conn->want_write;
+            if (ev.events & (EV_READ | EV_ERR)) {
+                conn_read(conn, w->hist, w->counters);
+            }
+            conn_fill(conn, rng, w->counters);
+            conn_flush(conn);
+            if (conn->done && conn->sent.empty()) {
+                loop->del(conn->fd);
+                active--;
+                continue;
+            }
+            if (had_write != conn->want_write) {
+                loop->mod(conn->fd, EV_READ | (conn->want_write ? EV_WRITE : 0));
+            }
+        }
+    }
+    delete loop;
+}
+
+static void read_full(int fd, void *buf, size_t n) {
+    uint8_t *p = (uint8_t *)buf;
+    while (n > 0) {
+        ssize_t rv = read(fd, p, n);
+        if (rv <= 0) {
+            die("read()");
+        }
+        p += rv;
+        n -= (size_t)rv;
+    }
+}
+
+// sets every key once, so GETs hit
+static void populate() {
+    int fd = connect_server();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    const size_t batch = 1000;
+    std::mt19937_64 rng(1);
+    std::vector<uint8_t> body;
+    for (uint64_t i = 0; i < g_opt.keys; i += batch) {
+        uint64_t n = std::min<uint64_t>(batch, g_opt.keys - i);
+        std::string out;
+        for (uint64_t k = i; k < i + n; k++) {
+            uint32_t len = g_opt.val_min
+                + (uint32_t)(rng() % (g_opt.val_max - g_opt.val_min + 1));
+            std::string key = "key:" + std::to_string(k);
+            append_req(out, {"set", key, std::string_view(g_value.data(), len)});
+        }
+        if (write(fd, out.data(), out.size()) != (ssize_t)out.size()) {
+            die("write()");
+        }
+        // the replies; their content doesn't matter
+        for (uint64_t got = 0; got < n; got++) {
+            uint32_t len = 0;
+            read_full(fd, &len, 4);
+            body.resize(len);
+            read_full(fd, body.data(), len);
+        }
+    }
+    close(fd);
+}
+
+static const double k_percentiles[] = {50, 75, 90, 95, 99, 99.9, 99.99, 100};
+
+static void report_text(const Histogram &h, const Counters &c, double secs) {
+    printf("%llu requests in %.2f s: %.0f req/s\n", (unsigned long long)h.total, secs,
+        (double)h.total / secs);
+    printf("gets %llu (misses %llu), sets %llu, errors %llu\n",
+        (unsigned long long)c.gets, (unsigned long long)c.misses,
+        (unsigned long long)c.sets, (unsigned long long)c.errors);
+    printf("latency (us): min %.1f, mean %.1f, max %.1f\n", (double)h.min / 1e3,
+        h.sum / (double)std::max<uint64_t>(h.total, 1) / 1e3, (double)h.max / 1e3);
+    printf("%12s %12s\n", "percentile", "us");
+    for (double q : k_percentiles) {
+        printf("%12.2f %12.1f\n", q, (double)hist_percentile(h, q) / 1e3);
+    }
+}
+
+static void report_json(FILE *fp, const Histogram &h, const Counters &c, double secs) {
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"config\": {\"conns\": %u, \"threads\": %u, \"pipeline\": %u,"
+        " \"keys\": %llu, \"dist\": \"%s\", \"value_min\": %u, \"value_max\": %u,"
+        " \"get_ratio\": %.3f},\n", g_opt.conns, g_opt.threads, g_opt.pipeline,
+        (unsigned long long)g_opt.keys, g_opt.zipf ? "zipf" : "uniform",
+        g_opt.val_min, g_opt.val_max, g_opt.get_ratio);
+    fprintf(fp, "  \"requests\": %llu,\n  \"seconds\": %.3f,\n  \"rps\": %.1f,\n",
+        (unsigned long long)h.total, secs, (double)h.total / secs);
+    fprintf(fp, "  \"gets\": %llu,\n  \"sets\": %llu,\n  \"misses\": %llu,\n"
+        "  \"errors\": %llu,\n", (unsigned long long)c.gets, (unsigned long long)c.sets,
+        (unsigned long long)c.misses, (unsigned long long)c.errors);
+    fprintf(fp, "  \"latency_ns\": {\"min\": %llu, \"mean\": %.0f, \"max\": %llu",
+        (unsigned long long)(h.total ? h.min : 0),
+        h.sum / (double)std::max<uint64_t>(h.total, 1), (unsigned long long)h.max);
+    for (double q : k_percentiles) {
+        fprintf(fp, ", \"p%g\": %llu", q, (unsigned long long)hist_percentile(h, q));
+    }
+    fprintf(fp, "},\n");
+    // the non-empty buckets as [highest value, count]
+    fprintf(fp, "  \"histogram_ns\": [");
+    bool first = true;
+    for (size_t i = 0; i < k_hist_buckets; i++) {
+        if (h.counts[i]) {
+            fprintf(fp, "%s[%llu, %llu]", first ? "" : ", ",
+                (unsigned long long)hist_value(i), (unsigned long long)h.counts[i]);
+            first = false;
+        }
+    }
+    fprintf(fp, "]\n}\n");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--host IP] [--port N] [--conns N] [--threads N]"
+        " [--pipeline N]\n"
+        "       [--keys N] [--dist uniform|zipf] [--zipf-s S]"
+        " [--value-size N|MIN-MAX] [--get-ratio R]\n"
+        "       [--duration SEC | --requests N] [--populate] [--json PATH|-]\n",
+        argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--populate") == 0) {
+            g_opt.populate = true;
+            continue;
+        }
+        if (!val) {
+            usage(argv[0]);
+        }
+        i++;
+        if (strcmp(arg, "--host") == 0) {
+            g_opt.host = val;
+        } else if (strcmp(arg, "--port") == 0) {
+            g_opt.port = (uint16_t)atoi(val);
+        } else if (strcmp(arg, "--conns") == 0) {
+            g_opt.conns = (uint32_t)atoi(val);
+        } else if (strcmp(arg, "--threads") == 0) {
+            g_opt.threads = (uint32_t)atoi(val);
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            g_opt.pipeline = (uint32_t)atoi(val);
+        } else if (strcmp(arg, "--keys") == 0) {
+            g_opt.keys = (uint64_t)atoll(val);
+        } else if (strcmp(arg, "--dist") == 0) {
+            if (strcmp(val, "zipf") != 0 && strcmp(val, "uniform") != 0) {
+                usage(argv[0]);
+            }
+            g_opt.zipf = strcmp(val, "zipf") == 0;
+        } else if (strcmp(arg, "--zipf-s") == 0) {
+            g_opt.zipf_s = atof(val);
+        } else if (strcmp(arg, "--value-size") == 0) {
+            const char *dash = strchr(val, '-');
+            g_opt.val_min = (uint32_t)atoi(val);
+            g_opt.val_max = dash ? (uint32_t)atoi(dash + 1) : g_opt.val_min;
+        } else if (strcmp(arg, "--get-ratio") == 0) {
+            g_opt.get_ratio = atof(val);
+        } else if (strcmp(arg, "--duration") == 0) {
+            g_opt.duration = atof(val);
+        } else if (strcmp(arg, "--requests") == 0) {
+            g_opt.requests = (uint64_t)atoll(val);
+        } else if (strcmp(arg, "--json") == 0) {
+            g_opt.json = val;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (g_opt.conns < 1 || g_opt.threads < 1 || g_opt.pipeline < 1 || g_opt.keys < 1
+        || g_opt.val_min > g_opt.val_max || g_opt.val_max > k_max_msg / 2)
+    {
+        usage(argv[0]);
+    }
+    g_opt.threads = std::min(g_opt.threads, g_opt.conns);
+
+    g_value.assign(g_opt.val_max, 'v');
+    if (g_opt.zipf) {
+        g_zipf = new Zipf(g_opt.keys, g_opt.zipf_s);
+    }
+    if (g_opt.populate) {
+        populate();
+    }
+
+    std::vector<Worker> workers(g_opt.threads);
+    for (uint32_t i = 0; i < g_opt.conns; i++) {
+        Conn *conn = new Conn();
+        conn->fd = connect_server();
+        workers[i % g_opt.threads].conns.push_back(conn);
+    }
+
+    uint64_t start = now_ns();
+    g_deadline_ns = start + (uint64_t)(g_opt.duration * 1e9);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < g_opt.threads; i++) {
+        threads.emplace_back(worker_run, &workers[i], (uint64_t)i + 1);
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    Histogram h;
+    Counters c;
+    for (Worker &w : workers) {
+        hist_merge(h, w.hist);
+        c.gets += w.counters.gets;
+        c.sets += w.counters.sets;
+        c.misses += w.counters.misses;
+        c.errors += w.counters.errors;
+        for (Conn *conn : w.conns) {
+            close(conn->fd);
+            delete conn;
+        }
+    }
+
+    report_text(h, c, secs);
+    if (g_opt.json) {
+        bool to_stdout = strcmp(g_opt.json, "-") == 0;
+        FILE *fp = to_stdout ? stdout : fopen(g_opt.json, "w");
+        if (!fp) {
+            die("fopen()");
+        }
+        report_json(fp, h, c, secs);
+        if (!to_stdout) {
+            fclose(fp);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+// SET throughput with the append-only file under each appendfsync policy.
+// several connections pipeline at once, so under "always" their writes
+// share an fsync (group commit); the no-AOF run is the baseline.
+//
+// usage: bench_aof <path to server> [aof path] [clients] [depth] [ops]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+// system
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../protocol.h"
+#include "bench_util.h"
+
+// every client sends `depth` sets, then all the replies are read
+static double run(std::vector<int> &fds, size_t depth, size_t nops) {
+    const std::string val(100, 'v');
+    size_t done = 0, key = 0;
+    uint64_t start = now_ns();
+    while (done < nops) {
+        for (int fd : fds) {
+            std::string out;
+            for (size_t i = 0; i < depth; i++) {
+                append_req(out, {"set", "key:" + std::to_string(key++ % 100000), val});
+            }
+            write_all(fd, out.data(), out.size());
+        }
+        for (int fd : fds) {
+            read_responses(fd, depth);
+        }
+        done += fds.size() * depth;
+    }
+    return (double)done / ((double)(now_ns() - start) / 1e9) / 1000;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [aof path] [clients] [depth] [ops]\n",
+            argv[0]);
+        return 1;
+    }
+    const char *server = argv[1];
+    std::string aof = argc > 2 ? argv[2] : "/tmp/bench_aof.aof";
+    size_t nclients = argc > 3 ? (size_t)atol(argv[3]) : 16;
+    size_t depth = argc > 4 ? (size_t)atol(argv[4]) : 16;
+    size_t nops = argc > 5 ? (size_t)atol(argv[5]) : 500000;
+
+    printf("%zu clients, %zu pipelined sets each, %zu ops, AOF at %s\n",
+        nclients, depth, nops, aof.c_str());
+    printf("%-10s %10s\n", "fsync", "kops/s");
+    const char *policies[] = {"off", "no", "everysec", "always"};
+    for (const char *policy : policies) {
+        std::vector<std::string> args;
+        if (strcmp(policy, "off") != 0) {
+            args = {"--appendonly", aof, "--appendfsync", policy};
+        }
+        (void)unlink(aof.c_str());
+        pid_t pid = start_server(server, args);
+        std::vector<int> fds;
+        for (size_t i = 0; i < nclients; i++) {
+            fds.push_back(connect_server());
+        }
+        double kops = run(fds, depth, nops);
+        for (int fd : fds) {
+            close(fd);
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        printf("%-10s %10.1f\n", policy, kops);
+        fflush(stdout);
+    }
+    (void)unlink(aof.c_str());
+    return 0;
+}
@@ -0,0 +1,98 @@
+// feeds a burst of pipelined requests through a connection buffer the way
+// handle_read/try_one_request do: append in 64 KB reads, then consume one
+// frame at a time. compares the old std::vector erase() buffer with Buffer.
+//
+// usage: bench_buffer [requests per burst] [bursts]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../buffer.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// the previous implementation, for comparison
+struct VecBuffer {
+    std::vector<uint8_t> v;
+    uint8_t *data() { return v.data(); }
+    size_t size() const { return v.size(); }
+};
+
+static void buf_append(VecBuffer &buf, const uint8_t *data, size_t len) {
+    buf.v.insert(buf.v.end(), data, data + len);
+}
+
+static void buf_consume(VecBuffer &buf, size_t len) {
+    buf.v.erase(buf.v.begin(), buf.v.begin() + len);
+}
+
+// a burst of `get key:N` frames in the wire format
+static std::string make_burst(size_t nreq) {
+    std::string out;
+    for (size_t i = 0; i < nreq; i++) {
+        std::string key = "key:" + std::to_string(i);
+        uint32_t nstr = 2, l0 = 3, l1 = (uint32_t)key.size();
+        uint32_t len = 4 + 4 + l0 + 4 + l1;
+        out.append((const char *)&len, 4);
+        out.append((const char *)&nstr, 4);
+        out.append((const char *)&l0, 4);
+        out.append("get", 3);
+        out.append((const char *)&l1, 4);
+        out.append(key);
+    }
+    return out;
+}
+
+// returns ns per request
+template <class B>
+static double run(const std::string &burst, size_t nreq, size_t rounds) {
+    const size_t k_read = 64 * 1024;
+    B buf;
+    size_t done = 0;
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t off = 0; off < burst.size(); off += k_read) {
+            size_t n = burst.size() - off < k_read ? burst.size() - off : k_read;
+            buf_append(buf, (const uint8_t *)burst.data() + off, n);
+            // drain every complete frame, like try_one_request
+            while (buf.size() >= 4) {
+                uint32_t len = 0;
+                memcpy(&len, buf.data(), 4);
+                if (4 + len > buf.size()) {
+                    break;
+                }
+                buf_consume(buf, 4 + len);
+                done++;
+            }
+        }
+    }
+    double ns = (double)(now_ns() - start) / (double)done;
+    if (done != nreq * rounds || buf.size() != 0) {
+        fprintf(stderr, "framing error: %zu of %zu requests\n", done, nreq * rounds);
+        exit(1);
+    }
+    return ns;
+}
+
+int main(int argc, char **argv) {
+    size_t nreq = argc > 1 ? (size_t)atol(argv[1]) : 10000;
+    size_t rounds = argc > 2 ? (size_t)atol(argv[2]) : 20;
+
+    std::string burst = make_burst(nreq);
+    printf("%zu pipelined requests per burst (%zu bytes), %zu bursts\n",
+        nreq, burst.size(), rounds);
+    printf("%-20s %12.1f ns/request\n", "std::vector erase",
+        run<VecBuffer>(burst, nreq, rounds));
+    printf("%-20s %12.1f ns/request\n", "Buffer", run<Buffer>(burst, nreq, rounds));
+    return 0;
+}
@@ -0,0 +1,133 @@
+// GET throughput of one client thread through the client library: one
+// request at a time (what the old blocking client could do), then with
+// more and more requests in flight over a pool of 1 and 4 connections.
+// starts its own server.
+//
+// usage: bench_client <path to server> [ops] [keys]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../kvclient.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static pid_t start_server(const char *path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        execl(path, path, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static KvClient *connect_retry(uint32_t conns) {
+    KvOptions opt;
+    opt.conns = conns;
+    // the server may still be starting
+    for (int i = 0; i < 100; i++) {
+        if (KvClient *client = kv_connect(opt)) {
+            return client;
+        }
+        usleep(20 * 1000);
+    }
+    fprintf(stderr, "can't connect\n");
+    exit(1);
+}
+
+static std::vector<std::string> g_keys;
+static size_t g_errors = 0;
+
+static void on_reply(void *arg, uint32_t status, std::string_view data) {
+    (void)data;
+    (*(size_t *)arg)++;
+    g_errors += status != RES_OK;
+}
+
+// kops/s of `nops` GETs with `depth` in flight
+static double run(KvClient *client, size_t depth, size_t nops) {
+    size_t sent = 0, done = 0;
+    uint64_t start = now_ns();
+    while (done < nops) {
+        while (sent < nops && kv_inflight(client) < depth) {
+            kv_send(client, {"get", g_keys[sent % g_keys.size()]}, &on_reply, &done);
+            sent++;
+        }
+        kv_poll(client, -1);
+    }
+    return (double)nops / ((double)(now_ns() - start) / 1e9) / 1000;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [ops] [keys]\n", argv[0]);
+        return 1;
+    }
+    size_t nops = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    size_t nkeys = argc > 3 ? (size_t)atol(argv[3]) : 100000;
+    pid_t pid = start_server(argv[1]);
+
+    for (size_t i = 0; i < nkeys; i++) {
+        g_keys.push_back("key:" + std::to_string(i * 7919 % nkeys));
+    }
+    KvClient *client = connect_retry(1);
+    const std::string val(16, 'v');
+    size_t done = 0;
+    for (size_t i = 0; i < nkeys; i++) {
+        kv_send(client, {"set", g_keys[i], val}, &on_reply, &done);
+        if (kv_inflight(client) >= 1000) {
+            kv_poll(client, -1);
+        }
+    }
+    while (kv_inflight(client) > 0) {
+        kv_poll(client, -1);
+    }
+    kv_close(client);
+
+    printf("%zu GETs of %zu keys, one client thread\n", nops, nkeys);
+    printf("%-6s %-10s %10s\n", "conns", "in flight", "kops/s");
+    client = connect_retry(1);
+    // the blocking way: every request waits for its reply
+    KvFuture fut;
+    size_t nsync = nops / 10;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nsync; i++) {
+        kv_call(client, {"get", g_keys[i % nkeys]}, &fut);
+        kv_wait(client, &fut);
+    }
+    printf("%-6u %-10s %10.1f\n", 1, "1 (wait)",
+        (double)nsync / ((double)(now_ns() - start) / 1e9) / 1000);
+    kv_close(client);
+
+    for (uint32_t conns : {1, 4}) {
+        client = connect_retry(conns);
+        for (size_t depth : {1, 16, 128, 1024}) {
+            double kops = run(client, depth, depth == 1 ? nsync : nops);
+            printf("%-6u %-10zu %10.1f\n", conns, depth, kops);
+            fflush(stdout);
+        }
+        kv_close(client);
+    }
+    if (g_errors) {
+        printf("%zu errors\n", g_errors);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// measures the cost of one event loop wakeup as the number of idle,
+// registered fds grows. one eventfd is made readable per iteration while
+// `n` others stay idle, so a good backend should stay flat.
+//
+// usage: bench_event_loop [iterations]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+// system
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+// C++
+#include <vector>
+// proj
+#include "../event_loop.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// returns the average ns per wakeup, or 0 if the fds couldn't be created
+static double bench_one(const char *backend, size_t nidle, size_t iters) {
+    EventLoop *loop = event_loop_new(backend);
+    if (!loop) {
+        return 0;
+    }
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < nidle + 1; i++) {
+        int fd = eventfd(0, EFD_NONBLOCK);
+        if (fd < 0) {
+            break;
+        }
+        fds.push_back(fd);
+        (void)loop->add(fd, EV_READ);
+    }
+
+    double res = 0;
+    if (fds.size() == nidle + 1) {
+        int active = fds.back();
+        std::vector<Event> events;
+        uint64_t one = 1, val = 0;
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < iters; i++) {
+            (void)!write(active, &one, sizeof(one));
+            (void)loop->wait(events, -1);
+            (void)!read(active, &val, sizeof(val));
+        }
+        res = (double)(now_ns() - start) / (double)iters;
+    }
+
+    for (int fd : fds) {
+        (void)close(fd);
+    }
+    delete loop;
+    return res;
+}
+
+int main(int argc, char **argv) {
+    size_t iters = argc > 1 ? (size_t)atol(argv[1]) : 2000;
+
+    // idle fds need a generous fd limit
+    struct rlimit rl = {};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    const size_t counts[] = {10, 100, 1000, 10000, 20000};
+    printf("%10s %14s %14s\n", "idle fds", "poll ns/wake", "epoll ns/wake");
+    for (size_t n : counts) {
+        double p = bench_one("poll", n, iters);
+        double e = bench_one("epoll", n, iters);
+        if (p == 0 || e == 0) {
+            printf("%10zu  (not enough fds, raise ulimit -n)\n", n);
+            continue;
+        }
+        printf("%10zu %14.0f %14.0f\n", n, p, e);
+    }
+    return 0;
+}
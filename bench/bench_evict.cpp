@@ -0,0 +1,123 @@
+// a cache-aside workload against the server under each eviction policy:
+// GET a Zipfian-distributed key, SET it on a miss. reports the hit rate
+// and throughput; the unlimited run is the baseline for eviction cost.
+//
+// usage: bench_evict <path to server> [keys] [maxmemory] [ops]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <signal.h>
+// system
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+// proj
+#include "../protocol.h"
+#include "bench_util.h"
+
+struct Zipf {
+    std::vector<double> cdf;
+    Zipf(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += 1.0 / pow((double)(i + 1), s);
+            cdf[i] = sum;
+        }
+        for (double &c : cdf) {
+            c /= sum;
+        }
+    }
+    size_t next(std::mt19937_64 &rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return (size_t)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+};
+
+struct Result {
+    double hit_rate = 0;
+    double kops = 0;
+};
+
+static Result run(int fd, Zipf &zipf, size_t warmup, size_t nops) {
+    std::mt19937_64 rng(42);
+    // scatter popularity over the keyspace, so hot keys aren't all adjacent
+    std::vector<size_t> perm(zipf.cdf.size());
+    for (size_t i = 0; i < perm.size(); i++) {
+        perm[i] = i * 2654435761u % perm.size();
+    }
+    const std::string val(100, 'v');
+    const size_t batch = 100;
+    size_t hits = 0, done = 0;
+    uint64_t start = 0;
+    while (done < warmup + nops) {
+        if (done == warmup) {
+            hits = 0;
+            start = now_ns();
+        }
+        std::vector<std::string> keys;
+        std::string out;
+        for (size_t i = 0; i < batch; i++) {
+            keys.push_back("key:" + std::to_string(perm[zipf.next(rng)]));
+            append_req(out, {"get", keys.back()});
+        }
+        write_all(fd, out.data(), out.size());
+        std::vector<uint32_t> st = read_responses(fd, batch);
+        // fill the misses
+        out.clear();
+        size_t nset = 0;
+        for (size_t i = 0; i < batch; i++) {
+            if (st[i] == 0) {
+                hits++;
+            } else {
+                append_req(out, {"set", keys[i], val});
+                nset++;
+            }
+        }
+        write_all(fd, out.data(), out.size());
+        (void)read_responses(fd, nset);
+        done += batch;
+    }
+    Result r;
+    r.hit_rate = (double)hits / (double)nops;
+    r.kops = (double)nops / ((double)(now_ns() - start) / 1e9) / 1000;
+    return r;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [keys] [maxmemory] [ops]\n", argv[0]);
+        return 1;
+    }
+    const char *server = argv[1];
+    size_t nkeys = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    std::string maxmemory = argc > 3 ? argv[3] : "32m";
+    size_t nops = argc > 4 ? (size_t)atol(argv[4]) : 2000000;
+
+    Zipf zipf(nkeys, 0.99);
+    printf("%zu keys, zipf 0.99, maxmemory %s, %zu ops after %zu warmup\n",
+        nkeys, maxmemory.c_str(), nops, nops);
+    printf("%-16s %10s %10s\n", "policy", "hit rate", "kops/s");
+    const char *policies[] = {"unlimited", "allkeys-lru", "allkeys-lfu", "noeviction"};
+    for (const char *policy : policies) {
+        std::vector<std::string> args;
+        if (strcmp(policy, "unlimited") != 0) {
+            args = {"--maxmemory", maxmemory, "--maxmemory-policy", policy};
+        }
+        pid_t pid = start_server(server, args);
+        int fd = connect_server();
+        Result r = run(fd, zipf, nops, nops);
+        close(fd);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        printf("%-16s %9.1f%% %10.1f\n", policy, r.hit_rate * 100, r.kops);
+        fflush(stdout);
+    }
+    return 0;
+}
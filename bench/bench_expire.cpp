@@ -0,0 +1,77 @@
+// drives a running server like a session cache: SET + PEXPIRE on fresh keys
+// with a short TTL, pipelined. the live set stays at about rate * TTL keys,
+// so the server's memory should level off instead of growing with the
+// total number of keys written.
+//
+// usage: bench_expire <server pid> [keys] [ttl ms]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+// system
+#include <unistd.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../protocol.h"
+#include "bench_util.h"
+
+// resident memory of `pid` in KB
+static long rss_kb(long pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <server pid> [keys] [ttl ms]\n", argv[0]);
+        return 1;
+    }
+    long pid = atol(argv[1]);
+    size_t nkeys = argc > 2 ? (size_t)atol(argv[2]) : 10 * 1000 * 1000;
+    std::string ttl = argc > 3 ? argv[3] : "1000";
+
+    int fd = connect_server();
+
+    const size_t batch = 1000;
+    const std::string val(32, 'x');
+    std::string out;
+    uint64_t start = now_ns();
+    printf("%12s %10s %12s\n", "keys", "secs", "server RSS MB");
+    for (size_t i = 0; i < nkeys; ) {
+        out.clear();
+        size_t n = 0;
+        for (; n < batch && i < nkeys; n++, i++) {
+            std::string key = "sess:" + std::to_string(i);
+            append_req(out, {"set", key, val});
+            append_req(out, {"pexpire", key, ttl});
+        }
+        if (!write_all(fd, out.data(), out.size())) {
+            perror("write");
+            return 1;
+        }
+        (void)read_responses(fd, 2 * n);
+        if (i % (nkeys / 10 ? nkeys / 10 : 1) == 0) {
+            printf("%12zu %10.1f %12.1f\n", i, (double)(now_ns() - start) / 1e9,
+                (double)rss_kb(pid) / 1024);
+            fflush(stdout);
+        }
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,211 @@
+// light clients next to heavy pipeliners: a few connections send bursts of
+// 100k pipelined GETs over and over, while others each time one GET at a
+// time. reports the light GETs' latency percentiles, the heavy clients'
+// throughput and how far the server's peak RSS grew, once with the per turn
+// budgets and output limits off and once with the defaults, on epoll and
+// on io_uring. starts its own server, one shard, for each.
+//
+// usage: bench_fairness <path to server> [seconds] [heavy conns] [light conns]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "../kvclient.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static pid_t start_server(const char *path, const std::vector<const char *> &args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        std::vector<const char *> argv = {path};
+        argv.insert(argv.end(), args.begin(), args.end());
+        argv.push_back(NULL);
+        execv(path, (char **)argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// an io_uring server's listening socket outlives it for a moment, until the
+// kernel is done tearing the ring down
+static void wait_port_free(uint16_t port) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    for (int i = 0; i < 100; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+        bool free = bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (free) {
+            return;
+        }
+        usleep(20 * 1000);
+    }
+}
+
+static KvClient *connect_retry() {
+    // the server may still be starting
+    for (int i = 0; i < 100; i++) {
+        if (KvClient *client = kv_connect(KvOptions())) {
+            return client;
+        }
+        usleep(20 * 1000);
+    }
+    fprintf(stderr, "can't connect\n");
+    exit(1);
+}
+
+// the peak resident set of `pid`, in bytes
+static size_t peak_rss(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = (size_t)atol(line + 6);
+        }
+    }
+    fclose(f);
+    return kb << 10;
+}
+
+static void call(KvClient *client, const std::vector<std::string_view> &cmd) {
+    KvFuture fut;
+    kv_call(client, cmd, &fut);
+    kv_wait(client, &fut);
+    if (fut.status == RES_ERR) {
+        fprintf(stderr, "error: %s\n", fut.data.c_str());
+        exit(1);
+    }
+}
+
+static void on_reply(void *arg, uint32_t status, std::string_view data) {
+    (void)status;
+    (void)data;
+    (*(std::atomic<uint64_t> *)arg)++;
+}
+
+const size_t k_burst = 100000;
+
+struct Config {
+    const char *name;
+    std::vector<const char *> args;
+};
+
+static void run(const char *server, const Config &cfg, double secs, int nheavy, int nlight) {
+    pid_t pid = start_server(server, cfg.args);
+    KvClient *setup = connect_retry();
+    // replies of a few hundred bytes, so the heavy clients' output adds up
+    call(setup, {"set", "heavy", std::string(400, 'h')});
+    call(setup, {"set", "light", "value"});
+    size_t rss_before = peak_rss(pid);
+
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> heavy_done{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nheavy; i++) {
+        threads.emplace_back([&] {
+            KvClient *client = connect_retry();
+            while (running) {
+                for (size_t n = 0; n < k_burst; n++) {
+                    kv_send(client, {"get", "heavy"}, &on_reply, &heavy_done);
+                }
+                while (kv_inflight(client) > 0) {
+                    kv_poll(client, -1);
+                }
+            }
+            kv_close(client);
+        });
+    }
+    std::vector<std::vector<uint64_t>> lats(nlight);
+    for (int i = 0; i < nlight; i++) {
+        threads.emplace_back([&, i] {
+            KvClient *client = connect_retry();
+            while (running) {
+                uint64_t start = now_ns();
+                call(client, {"get", "light"});
+                lats[i].push_back(now_ns() - start);
+            }
+            kv_close(client);
+        });
+    }
+    uint64_t start = now_ns();
+    usleep((useconds_t)(secs * 1e6));
+    running = false;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    size_t growth = peak_rss(pid) - rss_before;
+
+    std::vector<uint64_t> lat;
+    for (const std::vector<uint64_t> &l : lats) {
+        lat.insert(lat.end(), l.begin(), l.end());
+    }
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&](double p) { return (double)lat[(size_t)(p * (double)(lat.size() - 1))] / 1000; };
+    printf("%-16s %8.1f %8.1f %9.1f %9.1f %9zu %10.1f %9.1f\n", cfg.name, pct(0.5), pct(0.99),
+        pct(0.999), pct(1.0), lat.size(), (double)heavy_done / elapsed / 1000,
+        (double)growth / (1 << 20));
+    fflush(stdout);
+    kv_close(setup);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    wait_port_free(1234);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [seconds] [heavy conns] [light conns]\n",
+            argv[0]);
+        return 1;
+    }
+    double secs = argc > 2 ? atof(argv[2]) : 5;
+    int nheavy = argc > 3 ? atoi(argv[3]) : 4;
+    int nlight = argc > 4 ? atoi(argv[4]) : 8;
+    const Config configs[] = {
+        {"unbounded", {"--turn-requests", "0", "--turn-usec", "0", "--output-soft-limit", "0"}},
+        {"defaults", {}},
+        {"uring unbounded", {"--event-loop", "uring", "--turn-requests", "0", "--turn-usec", "0",
+            "--output-soft-limit", "0"}},
+        {"uring defaults", {"--event-loop", "uring"}},
+    };
+    printf("%d heavy conns (bursts of %zu GETs), %d light conns (one GET at a time), %.0fs\n",
+        nheavy, k_burst, nlight, secs);
+    printf("%-16s %8s %8s %9s %9s %9s %10s %9s\n", "", "p50 us", "p99 us", "p99.9 us",
+        "max us", "GETs", "heavy k/s", "RSS+ MB");
+    for (const Config &cfg : configs) {
+        run(argv[1], cfg, secs, nheavy, nlight);
+    }
+    return 0;
+}
@@ -0,0 +1,153 @@
+// compares HMap against std::map and std::unordered_map on the server's
+// workload: string keys, insert / hit / miss / delete. also reports the
+// slowest single insert, which is where a stop-the-world rehash shows up.
+//
+// usage: bench_hashtable [nkeys]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+// C++
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+// proj
+#include "../common.h"
+#include "../hashtable.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+struct Entry {
+    HNode node;
+    std::string key;
+    std::string val;
+};
+
+static bool entry_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Entry, node)->key == container_of(rhs, Entry, node)->key;
+}
+
+struct Result {
+    double insert_ns = 0;
+    double hit_ns = 0;
+    double miss_ns = 0;
+    double del_ns = 0;
+    uint64_t max_insert_ns = 0;
+};
+
+static void print(const char *name, const Result &r) {
+    printf("%-20s %10.1f %10.1f %10.1f %10.1f %14.1f\n", name,
+        r.insert_ns, r.hit_ns, r.miss_ns, r.del_ns, (double)r.max_insert_ns / 1000);
+}
+
+// `Ops` adapts each container to insert(key)/find(key)/erase(key)
+template <class Ops>
+static Result run(Ops &ops, const std::vector<std::string> &keys,
+    const std::vector<std::string> &missing, const std::vector<size_t> &order)
+{
+    Result r;
+    size_t n = keys.size();
+    uint64_t start = now_ns();
+    for (const std::string &k : keys) {
+        uint64_t t0 = now_ns();
+        ops.insert(k);
+        r.max_insert_ns = std::max(r.max_insert_ns, now_ns() - t0);
+    }
+    r.insert_ns = (double)(now_ns() - start) / n;
+
+    size_t found = 0;
+    start = now_ns();
+    for (size_t i : order) {
+        found += ops.find(keys[i]);
+    }
+    r.hit_ns = (double)(now_ns() - start) / n;
+
+    start = now_ns();
+    for (const std::string &k : missing) {
+        found += ops.find(k);
+    }
+    r.miss_ns = (double)(now_ns() - start) / n;
+    if (found != n) {
+        fprintf(stderr, "bad lookup count %zu\n", found);
+        exit(1);
+    }
+
+    start = now_ns();
+    for (size_t i : order) {
+        ops.erase(keys[i]);
+    }
+    r.del_ns = (double)(now_ns() - start) / n;
+    return r;
+}
+
+struct HMapOps {
+    HMap db;
+    void insert(const std::string &k) {
+        Entry *ent = new Entry();
+        ent->key = k;
+        ent->node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+        hm_insert(&db, &ent->node);
+    }
+    bool find(const std::string &k) {
+        Entry key;
+        key.key = k;
+        key.node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+        return hm_lookup(&db, &key.node, &entry_eq) != NULL;
+    }
+    void erase(const std::string &k) {
+        Entry key;
+        key.key = k;
+        key.node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+        delete container_of(hm_delete(&db, &key.node, &entry_eq), Entry, node);
+    }
+};
+
+template <class M>
+struct StdOps {
+    M db;
+    void insert(const std::string &k) { db[k] = std::string(); }
+    bool find(const std::string &k) { return db.find(k) != db.end(); }
+    void erase(const std::string &k) { db.erase(k); }
+};
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+
+    std::vector<std::string> keys, missing;
+    for (size_t i = 0; i < n; i++) {
+        keys.push_back("key:" + std::to_string(i));
+        missing.push_back("nokey:" + std::to_string(i));
+    }
+    // random access order, so the cache can't help
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(42));
+
+    printf("%zu keys, ns/op\n", n);
+    printf("%-20s %10s %10s %10s %10s %14s\n",
+        "", "insert", "hit", "miss", "delete", "max insert us");
+    {
+        HMapOps ops;
+        print("HMap", run(ops, keys, missing, order));
+        hm_clear(&ops.db);
+    }
+    {
+        StdOps<std::unordered_map<std::string, std::string>> ops;
+        print("std::unordered_map", run(ops, keys, missing, order));
+    }
+    {
+        StdOps<std::map<std::string, std::string>> ops;
+        print("std::map", run(ops, keys, missing, order));
+    }
+    return 0;
+}
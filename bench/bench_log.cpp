@@ -0,0 +1,67 @@
+// cost of logging on the calling thread: a disabled level, a record queued
+// for the writer thread, and the three fprintf()s the old make_response()
+// did per response into a buffered file.
+//
+// usage: bench_log [records] [log file]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+// proj
+#include "../log.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+    const char *path = argc > 2 ? argv[2] : "/tmp/bench_log.out";
+
+    FILE *fp = fopen(path, "w");
+    if (!fp || !log_init(path)) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    // a runtime-disabled level; a compiled-out one is free
+    g_log_level = LL_WARN;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        LOG_INFO("response: status %u, %u bytes", 0u, (unsigned)i);
+    }
+    double disabled = (double)(now_ns() - start) / n;
+
+    // queued; bursts longer than the ring are dropped, not waited for
+    g_log_level = LL_INFO;
+    size_t burst = 1000;
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i += burst) {
+        start = now_ns();
+        for (size_t j = 0; j < burst; j++) {
+            LOG_INFO("response: status %u, %u bytes", 0u, (unsigned)(i + j));
+        }
+        total += now_ns() - start;
+        log_flush();
+    }
+    double queued = (double)total / n;
+
+    const char *val = "value:0123456789";
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        fprintf(fp, "Response Length: %u\n", (unsigned)i);
+        fprintf(fp, "Response Status: %u\n", 0u);
+        fprintf(fp, "Response Data (%u bytes): %s\n", 16u, val);
+    }
+    double sync = (double)(now_ns() - start) / n;
+    fclose(fp);
+
+    printf("%zu records, ns per call\n", n);
+    printf("%-24s %10.1f\n", "disabled level", disabled);
+    printf("%-24s %10.1f\n", "async ring", queued);
+    printf("%-24s %10.1f\n", "3x fprintf", sync);
+    return 0;
+}
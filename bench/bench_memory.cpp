@@ -0,0 +1,138 @@
+// memory per key: loads N keys of 16 bytes with 32-byte values, then with
+// integer values, in-process through do_request(), and reports the growth of
+// the resident set and the server's own used_memory per key. then deletes 3
+// keys of 4 and reports again, before and after a defragmentation pass.
+// every scenario runs in a child of its own, on a fresh heap.
+//
+// usage: bench_memory [keys]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+// system
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../server.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t rss_bytes() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f || fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+        fprintf(stderr, "can't read /proc/self/statm\n");
+        exit(1);
+    }
+    fclose(f);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static Shard *shard_for_bench() {
+    Shard *shard = new Shard();
+    shard->now_ms = now_ns() / 1000000;
+    tw_init(&shard->timers, shard->now_ms);
+    g_shards.push_back(shard);
+    return shard;
+}
+
+static size_t used_memory(Shard *shard) {
+    Response resp;
+    do_request(shard, {"info", "memory"}, resp);
+    std::string text(resp.data.begin(), resp.data.end());
+    size_t pos = text.find("used_memory:");
+    return pos == std::string::npos ? 0 : (size_t)atoll(text.c_str() + pos + 12);
+}
+
+// 16 bytes: "key:" and 12 digits, in a buffer of 32
+static std::string_view key_name(char *buf, uint64_t i) {
+    snprintf(buf, 32, "key:%012llu", (unsigned long long)(i % 1000000000000));
+    return std::string_view(buf, 16);
+}
+
+static void report(const char *name, Shard *shard, size_t rss0, size_t nkeys, double ns) {
+    size_t rss = rss_bytes() - rss0;
+    printf("%-46s %10zu %10.1f %10.1f %10.1f %8.0f\n", name, nkeys, (double)rss / 1048576,
+        (double)rss / (double)nkeys, (double)used_memory(shard) / (double)nkeys, ns);
+    fflush(stdout);
+}
+
+static void run(const char *name, uint64_t nkeys, bool ints, bool churn) {
+    size_t rss0 = rss_bytes();
+    Shard *shard = shard_for_bench();
+    char kbuf[32], vbuf[64];
+    std::vector<std::string_view> cmd = {"set", "", ""};
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < nkeys; i++) {
+        cmd[1] = key_name(kbuf, i);
+        if (ints) {
+            int n = snprintf(vbuf, sizeof(vbuf), "%llu", (unsigned long long)(i * 7919));
+            cmd[2] = std::string_view(vbuf, (size_t)n);
+        } else {
+            snprintf(vbuf, sizeof(vbuf), "val:%028llu", (unsigned long long)i);
+            cmd[2] = std::string_view(vbuf, 32);
+        }
+        Response resp;
+        do_request(shard, cmd, resp);
+    }
+    double ns = (double)(now_ns() - start) / (double)nkeys;
+    if (!churn) {
+        report(name, shard, rss0, nkeys, ns);
+        return;
+    }
+    // every 4th key stays, so every page keeps a few live ones
+    cmd.resize(2);
+    cmd[0] = "del";
+    uint64_t left = 0;
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (i % 4 == 0) {
+            left++;
+            continue;
+        }
+        cmd[1] = key_name(kbuf, i);
+        Response resp;
+        do_request(shard, cmd, resp);
+    }
+    std::string label = std::string(name) + ", 3/4 deleted";
+    report(label.c_str(), shard, rss0, left, ns);
+    start = now_ns();
+    shard_defrag(shard);
+    ns = (double)(now_ns() - start) / (double)left;
+    label += ", defragged";
+    report(label.c_str(), shard, rss0, left, ns);
+}
+
+int main(int argc, char **argv) {
+    uint64_t nkeys = argc > 1 ? (uint64_t)atoll(argv[1]) : 10000000;
+    printf("%-46s %10s %10s %10s %10s %8s\n", "", "keys", "rss MB", "rss/key",
+        "used/key", "ns/key");
+    struct Scenario {
+        const char *name;
+        bool ints;
+        bool churn;
+    };
+    const Scenario scenarios[] = {
+        {"16B keys, 32B values", false, false},
+        {"16B keys, integer values", true, false},
+        {"16B keys, 32B values", false, true},
+    };
+    for (const Scenario &s : scenarios) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(s.name, nkeys, s.ints, s.churn);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,113 @@
+// request parsing cost and heap allocations per request: parse_req into
+// reused string_views vs. the previous copy-every-argument parser.
+//
+// usage: bench_parse [value size] [iterations]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+// C++
+#include <new>
+#include <string>
+#include <vector>
+// proj
+#include "../protocol.h"
+
+static uint64_t g_allocs = 0;
+static uint64_t g_alloc_bytes = 0;
+
+void *operator new(size_t n) {
+    g_allocs++;
+    g_alloc_bytes += n;
+    if (void *p = malloc(n)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// the previous parser, for comparison
+static int32_t parse_req_copy(const uint8_t *data, size_t size, std::vector<std::string> &out) {
+    const uint8_t *end = data + size;
+    uint32_t nstr = 0;
+    if (!read_u32(data, end, nstr) || nstr > k_max_args) {
+        return -1;
+    }
+    while (out.size() < nstr) {
+        uint32_t len = 0;
+        std::string_view sv;
+        if (!read_u32(data, end, len) || !read_str(data, end, len, sv)) {
+            return -1;
+        }
+        out.push_back(std::string(sv));
+    }
+    return data == end ? 0 : -1;
+}
+
+// body of `set key:12345 <value>`
+static std::string make_set(size_t vlen) {
+    std::string key = "key:12345", val(vlen, 'v');
+    std::string out;
+    uint32_t nstr = 3, l0 = 3, l1 = (uint32_t)key.size(), l2 = (uint32_t)vlen;
+    out.append((const char *)&nstr, 4);
+    out.append((const char *)&l0, 4);
+    out.append("set");
+    out.append((const char *)&l1, 4);
+    out.append(key);
+    out.append((const char *)&l2, 4);
+    out.append(val);
+    return out;
+}
+
+static void report(const char *name, uint64_t ns, uint64_t allocs, uint64_t bytes, size_t n) {
+    printf("%-24s %10.1f ns/req %8.2f allocs/req %10.1f bytes/req\n", name,
+        (double)ns / n, (double)allocs / n, (double)bytes / n);
+}
+
+int main(int argc, char **argv) {
+    size_t vlen = argc > 1 ? (size_t)atol(argv[1]) : 1024;
+    size_t n = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    std::string req = make_set(vlen);
+    const uint8_t *data = (const uint8_t *)req.data();
+    size_t sink = 0;
+
+    printf("set request with a %zu byte value\n", vlen);
+    {
+        std::vector<std::string_view> cmd;     // reused, like Shard::cmd
+        uint64_t a0 = g_allocs, b0 = g_alloc_bytes, t0 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            if (parse_req(data, req.size(), cmd) < 0) {
+                return 1;
+            }
+            sink += cmd[2].size();
+        }
+        report("parse_req (views)", now_ns() - t0, g_allocs - a0, g_alloc_bytes - b0, n);
+    }
+    {
+        uint64_t a0 = g_allocs, b0 = g_alloc_bytes, t0 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            std::vector<std::string> cmd;
+            if (parse_req_copy(data, req.size(), cmd) < 0) {
+                return 1;
+            }
+            sink += cmd[2].size();
+        }
+        report("parse_req (copies)", now_ns() - t0, g_allocs - a0, g_alloc_bytes - b0, n);
+    }
+    return sink == 0;
+}
@@ -0,0 +1,333 @@
+// pub/sub fan-out: thousands of subscribers, read by one thread over epoll,
+// and a publisher pipelining PUBLISH. reports the publish rate, how many
+// messages per second reach the subscribers, and the server's memory: per
+// subscriber, and how far its peak RSS grew while publishing. runs once
+// with every subscriber on one channel, once with each on a pattern of its
+// own (the messages go to one subscriber each, through the pattern trie),
+// and once on one channel next to a subscriber that never reads, which the
+// server should drop at its --pubsub-output-limit. (that one also gets 1 MB
+// messages on a channel of its own, to get through the kernel's socket
+// buffers within the run.) starts its own server for each.
+//
+// usage: bench_pubsub <path to server> [subscribers] [seconds] [message bytes] [threads]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+// C++
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "../kvclient.h"
+#include "../protocol.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static pid_t start_server(const char *path, const std::vector<const char *> &args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        std::vector<const char *> argv = {path};
+        argv.insert(argv.end(), args.begin(), args.end());
+        argv.push_back(NULL);
+        execv(path, (char **)argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+static KvClient *connect_retry() {
+    // the server may still be starting
+    for (int i = 0; i < 100; i++) {
+        if (KvClient *client = kv_connect(KvOptions())) {
+            return client;
+        }
+        usleep(20 * 1000);
+    }
+    fprintf(stderr, "can't connect\n");
+    exit(1);
+}
+
+// a field of /proc/<pid>/status, in bytes
+static size_t proc_mem(pid_t pid, const char *field) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t kb = 0;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0) {
+            kb = (size_t)atol(line + len);
+        }
+    }
+    fclose(f);
+    return kb << 10;
+}
+
+static std::string call(KvClient *client, const std::vector<std::string_view> &cmd) {
+    KvFuture fut;
+    kv_call(client, cmd, &fut);
+    kv_wait(client, &fut);
+    if (fut.status == RES_ERR) {
+        fprintf(stderr, "error: %s\n", fut.data.c_str());
+        exit(1);
+    }
+    return fut.data;
+}
+
+static uint64_t info_stat(KvClient *client, const char *name) {
+    std::string text = call(client, {"info", "stats"});
+    std::string key = std::string(name) + ":";
+    size_t pos = text.find(key);
+    return pos == std::string::npos ? 0 : (uint64_t)atoll(text.c_str() + pos + key.size());
+}
+
+// a raw connection that sends `cmd` and leaves the socket nonblocking.
+// `rcvbuf`: a receive buffer this small, 0 = the default.
+static int sub_connect(const std::vector<std::string_view> &cmd, int rcvbuf = 0) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rcvbuf) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1234);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("subscriber connect()");
+        exit(1);
+    }
+    std::string req;
+    append_req(req, cmd);
+    if (write(fd, req.data(), req.size()) != (ssize_t)req.size()) {
+        perror("subscriber write()");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// the subscribers: one thread reads them all and counts the frames
+struct Subscribers {
+    int epfd = -1;
+    std::vector<int> fds;
+    std::vector<std::string> bufs;
+    std::atomic<uint64_t> replies{0};
+    std::atomic<uint64_t> messages{0};
+    std::atomic<bool> running{true};
+};
+
+static void sub_consume(Subscribers &s, size_t idx) {
+    std::string &buf = s.bufs[idx];
+    size_t pos = 0;
+    uint64_t replies = 0, messages = 0;
+    while (buf.size() - pos >= 8) {
+        uint32_t len = 0, status = 0;
+        memcpy(&len, &buf[pos], 4);
+        if (buf.size() - pos < 4 + (size_t)len) {
+            break;
+        }
+        memcpy(&status, &buf[pos + 4], 4);
+        if (status == RES_PUSH) {
+            messages++;
+        } else {
+            replies++;
+        }
+        pos += 4 + len;
+    }
+    buf.erase(0, pos);
+    s.replies += replies;
+    s.messages += messages;
+}
+
+static void sub_loop(Subscribers &s) {
+    std::vector<struct epoll_event> events(256);
+    std::vector<char> rbuf(64 << 10);
+    while (s.running) {
+        int n = epoll_wait(s.epfd, events.data(), (int)events.size(), 50);
+        for (int i = 0; i < n; i++) {
+            size_t idx = events[i].data.u64;
+            while (true) {
+                ssize_t rv = read(s.fds[idx], rbuf.data(), rbuf.size());
+                if (rv <= 0) {
+                    break;
+                }
+                s.bufs[idx].append(rbuf.data(), (size_t)rv);
+            }
+            sub_consume(s, idx);
+        }
+    }
+}
+
+static void on_reply(void *arg, uint32_t status, std::string_view data) {
+    (void)status;
+    (void)data;
+    (*(std::atomic<uint64_t> *)arg)++;
+}
+
+struct Scenario {
+    const char *name;
+    bool patterns;      // a pattern per subscriber, else all on one channel
+    bool stalled;       // plus a subscriber that never reads
+};
+
+static void run(const char *server, const Scenario &sc, int nsubs, double secs,
+    size_t msg_size, const char *threads)
+{
+    std::vector<const char *> args = {"--threads", threads};
+    if (sc.stalled) {
+        args.insert(args.end(), {"--pubsub-output-limit", "64k"});
+    }
+    pid_t pid = start_server(server, args);
+    KvClient *publisher = connect_retry();
+    size_t rss_idle = proc_mem(pid, "VmRSS:");
+
+    Subscribers s;
+    s.epfd = epoll_create1(0);
+    s.bufs.resize((size_t)nsubs);
+    char name[64];
+    for (int i = 0; i < nsubs; i++) {
+        int fd = -1;
+        if (sc.patterns) {
+            snprintf(name, sizeof(name), "user.%d.*", i);
+            fd = sub_connect({"psubscribe", name});
+        } else {
+            fd = sub_connect({"subscribe", "news"});
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = (uint64_t)i;
+        epoll_ctl(s.epfd, EPOLL_CTL_ADD, fd, &ev);
+        s.fds.push_back(fd);
+    }
+    std::thread reader([&] { sub_loop(s); });
+    int stalled_fd = -1;
+    if (sc.stalled) {
+        stalled_fd = sub_connect({"subscribe", "news", "bulk"}, 4096);
+    }
+    while (s.replies < (uint64_t)nsubs) {
+        usleep(1000);
+    }
+    size_t rss_subscribed = proc_mem(pid, "VmRSS:");
+    size_t hwm_before = proc_mem(pid, "VmHWM:");
+
+    // publish for `secs`, a window of requests in flight
+    std::string msg(msg_size, 'm');
+    std::string bulk(sc.stalled ? 1 << 20 : 0, 'b');
+    std::atomic<uint64_t> published{0};
+    uint64_t sent = 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(secs * 1e9);
+    while (now_ns() < end) {
+        for (int n = 0; n < 64; n++, sent++) {
+            if (sc.patterns) {
+                snprintf(name, sizeof(name), "user.%d.login", (int)(sent % (uint64_t)nsubs));
+                kv_send(publisher, {"publish", name, msg}, &on_reply, &published);
+            } else {
+                kv_send(publisher, {"publish", "news", msg}, &on_reply, &published);
+            }
+        }
+        if (sc.stalled) {
+            kv_send(publisher, {"publish", "bulk", bulk}, &on_reply, &published);
+        }
+        while (kv_inflight(publisher) > 16) {
+            kv_poll(publisher, -1);
+        }
+    }
+    while (kv_inflight(publisher) > 0) {
+        kv_poll(publisher, -1);
+    }
+    double pub_secs = (double)(now_ns() - start) / 1e9;
+    // until the subscribers got everything, or it stops coming
+    uint64_t expected = sc.patterns ? sent : sent * (uint64_t)nsubs;
+    uint64_t last = 0, last_ns = now_ns();
+    while (s.messages < expected && now_ns() - last_ns < 1000000000) {
+        if (s.messages != last) {
+            last = s.messages;
+            last_ns = now_ns();
+        }
+        usleep(1000);
+    }
+    double all_secs = (double)(now_ns() - start) / 1e9;
+    size_t growth = proc_mem(pid, "VmHWM:") - hwm_before;
+    uint64_t dropped = info_stat(publisher, "pubsub_dropped_clients");
+
+    printf("%-22s %10.0f %12.0f %9.2f %10.0f %9.1f %8llu\n", sc.name,
+        (double)sent / pub_secs, (double)s.messages / all_secs,
+        (double)s.messages / (double)(expected ? expected : 1) * 100,
+        (double)(rss_subscribed - rss_idle) / nsubs,
+        (double)growth / (1 << 20), (unsigned long long)dropped);
+    fflush(stdout);
+
+    s.running = false;
+    reader.join();
+    for (int fd : s.fds) {
+        close(fd);
+    }
+    if (stalled_fd >= 0) {
+        close(stalled_fd);
+    }
+    close(s.epfd);
+    kv_close(publisher);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr,
+            "usage: %s <path to server> [subscribers] [seconds] [message bytes] [threads]\n",
+            argv[0]);
+        return 1;
+    }
+    int nsubs = argc > 2 ? atoi(argv[2]) : 5000;
+    double secs = argc > 3 ? atof(argv[3]) : 3;
+    size_t msg_size = argc > 4 ? (size_t)atol(argv[4]) : 128;
+    const char *threads = argc > 5 ? argv[5] : "1";
+
+    // the subscribers' sockets, here and in the server
+    struct rlimit rl = {};
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < (rlim_t)nsubs + 64) {
+        fprintf(stderr, "need %d fds, can have %llu\n", nsubs + 64,
+            (unsigned long long)rl.rlim_cur);
+        return 1;
+    }
+    const Scenario scenarios[] = {
+        {"channel", false, false},
+        {"pattern each", true, false},
+        {"channel + stalled sub", false, true},
+    };
+    printf("%d subscribers, %zu byte messages, %s shard(s), %.0fs\n", nsubs, msg_size, threads,
+        secs);
+    printf("%-22s %10s %12s %9s %10s %9s %8s\n", "", "publish/s", "delivered/s", "got %",
+        "B/sub", "RSS+ MB", "dropped");
+    for (const Scenario &sc : scenarios) {
+        run(argv[1], sc, nsubs, secs, msg_size, threads);
+    }
+    return 0;
+}
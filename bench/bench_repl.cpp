@@ -0,0 +1,301 @@
+// replication: starts a primary and a few replicas, each a server process of
+// its own on consecutive ports. reports how long the replicas take for a
+// full sync of a loaded primary; then how long a SET on the primary takes to
+// be visible on a replica (the replication lag), one write at a time and
+// next to a pipelined write load; then GET throughput when the readers all
+// use the primary versus when they are spread over the primary and the
+// replicas; and last, how long a replica stopped for longer than its timeout
+// takes to catch up through a partial resync.
+//
+// usage: bench_repl <path to server> [replicas] [keys] [seconds] [base port]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "../kvclient.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static pid_t start_server(const char *path, const std::vector<std::string> &args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        std::vector<const char *> argv = {path};
+        for (const std::string &arg : args) {
+            argv.push_back(arg.c_str());
+        }
+        argv.push_back(NULL);
+        execv(path, (char **)argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+static KvClient *connect_retry(uint16_t port) {
+    // the server may still be starting
+    KvOptions opt;
+    opt.port = port;
+    for (int i = 0; i < 100; i++) {
+        if (KvClient *client = kv_connect(opt)) {
+            return client;
+        }
+        usleep(20 * 1000);
+    }
+    fprintf(stderr, "can't connect to port %u\n", (unsigned)port);
+    exit(1);
+}
+
+static std::string call(KvClient *client, const std::vector<std::string_view> &cmd) {
+    KvFuture fut;
+    kv_call(client, cmd, &fut);
+    kv_wait(client, &fut);
+    if (fut.status == RES_ERR) {
+        fprintf(stderr, "error: %s\n", fut.data.c_str());
+        exit(1);
+    }
+    return fut.data;
+}
+
+// a field of INFO replication, as a number
+static uint64_t info_field(KvClient *client, const char *name) {
+    std::string text = call(client, {"info", "replication"});
+    std::string key = std::string(name) + ":";
+    size_t pos = text.find(key);
+    return pos == std::string::npos ? 0 : (uint64_t)atoll(text.c_str() + pos + key.size());
+}
+
+static bool link_up(KvClient *client) {
+    std::string text = call(client, {"info", "replication"});
+    return text.find("master_link_status:up") != std::string::npos;
+}
+
+// until the replica has applied everything the primary had when called
+static void wait_caught_up(KvClient *primary, KvClient *replica) {
+    uint64_t offset = info_field(primary, "master_repl_offset");
+    while (!link_up(replica) || info_field(replica, "slave_repl_offset") < offset) {
+        usleep(1000);
+    }
+}
+
+static void on_reply(void *arg, uint32_t status, std::string_view data) {
+    (void)status;
+    (void)data;
+    (*(std::atomic<uint64_t> *)arg)++;
+}
+
+static double pct(std::vector<uint64_t> &lat, double p) {
+    std::sort(lat.begin(), lat.end());
+    return lat.empty() ? 0 : (double)lat[(size_t)(p * (double)(lat.size() - 1))] / 1000;
+}
+
+// SETs a counter on the primary and times until a replica GETs it back
+static void measure_lag(const char *name, KvClient *primary, KvClient *replica, double secs) {
+    std::vector<uint64_t> lat;
+    char buf[32];
+    uint64_t end = now_ns() + (uint64_t)(secs * 1e9);
+    for (uint64_t i = 0; now_ns() < end; i++) {
+        int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)i);
+        std::string_view val(buf, (size_t)n);
+        uint64_t start = now_ns();
+        call(primary, {"set", "lag", val});
+        while (call(replica, {"get", "lag"}) != val) {
+        }
+        lat.push_back(now_ns() - start);
+    }
+    size_t count = lat.size();
+    printf("%-34s %9.1f %9.1f %9.1f %9zu\n", name, pct(lat, 0.5), pct(lat, 0.99),
+        pct(lat, 1.0), count);
+    fflush(stdout);
+}
+
+// pipelined GETs from `nconns` connections for `secs`, each on one of `ports`
+static double read_rate(const std::vector<uint16_t> &ports, int nconns, double secs,
+    uint64_t nkeys)
+{
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> done{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nconns; i++) {
+        uint16_t port = ports[(size_t)i % ports.size()];
+        threads.emplace_back([&, port, i] {
+            KvClient *client = connect_retry(port);
+            char key[32];
+            uint64_t k = (uint64_t)i * 7919;
+            while (running) {
+                for (int n = 0; n < 1000; n++, k++) {
+                    snprintf(key, sizeof(key), "key:%llu", (unsigned long long)(k % nkeys));
+                    kv_send(client, {"get", key}, &on_reply, &done);
+                }
+                while (kv_inflight(client) > 0) {
+                    kv_poll(client, -1);
+                }
+            }
+            kv_close(client);
+        });
+    }
+    uint64_t start = now_ns();
+    usleep((useconds_t)(secs * 1e6));
+    running = false;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    return (double)done / ((double)(now_ns() - start) / 1e9);
+}
+
+static void load(KvClient *client, uint64_t nkeys) {
+    std::atomic<uint64_t> done{0};
+    char key[32], val[64];
+    for (uint64_t i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "key:%llu", (unsigned long long)i);
+        snprintf(val, sizeof(val), "val:%028llu", (unsigned long long)i);
+        kv_send(client, {"set", key, std::string_view(val, 32)}, &on_reply, &done);
+        if (kv_inflight(client) >= 10000) {
+            kv_poll(client, -1);
+        }
+    }
+    while (kv_inflight(client) > 0) {
+        kv_poll(client, -1);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [replicas] [keys] [seconds] [base port]\n",
+            argv[0]);
+        return 1;
+    }
+    int nreplicas = argc > 2 ? atoi(argv[2]) : 2;
+    uint64_t nkeys = argc > 3 ? (uint64_t)atoll(argv[3]) : 1000000;
+    double secs = argc > 4 ? atof(argv[4]) : 3;
+    uint16_t base = argc > 5 ? (uint16_t)atoi(argv[5]) : 7400;
+    if (nreplicas < 1) {
+        fprintf(stderr, "need a replica\n");
+        return 1;
+    }
+    char dir[] = "/tmp/bench_repl.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    auto args = [&](uint16_t port) {
+        return std::vector<std::string>{
+            "--port", std::to_string(port),
+            "--dbfilename", std::string(dir) + "/dump" + std::to_string(port) + ".rdb",
+        };
+    };
+
+    std::vector<pid_t> pids = {start_server(argv[1], args(base))};
+    KvClient *primary = connect_retry(base);
+    uint64_t start = now_ns();
+    load(primary, nkeys);
+    printf("%d replicas, %llu keys of 32 bytes loaded on the primary in %.2fs\n", nreplicas,
+        (unsigned long long)nkeys, (double)(now_ns() - start) / 1e9);
+
+    // all at once, so they share the one snapshot
+    std::vector<uint16_t> ports = {base};
+    std::vector<KvClient *> replicas;
+    start = now_ns();
+    for (int i = 1; i <= nreplicas; i++) {
+        uint16_t port = (uint16_t)(base + i);
+        std::vector<std::string> a = args(port);
+        // short, so the replica stopped below notices the link is stale
+        a.insert(a.end(), {"--replicaof", "127.0.0.1:" + std::to_string(base),
+            "--repl-timeout", "2"});
+        pids.push_back(start_server(argv[1], a));
+        ports.push_back(port);
+    }
+    for (int i = 1; i <= nreplicas; i++) {
+        replicas.push_back(connect_retry(ports[(size_t)i]));
+        wait_caught_up(primary, replicas.back());
+    }
+    printf("full sync of all replicas: %.2fs\n\n", (double)(now_ns() - start) / 1e9);
+
+    printf("%-34s %9s %9s %9s %9s\n", "write to replica read", "p50 us", "p99 us", "max us",
+        "writes");
+    measure_lag("idle primary", primary, replicas[0], secs);
+    {
+        // another connection keeps the primary busy with pipelined SETs
+        std::atomic<bool> running{true};
+        std::thread writer([&] {
+            KvClient *client = connect_retry(base);
+            std::atomic<uint64_t> done{0};
+            std::string val(100, 'w');
+            char key[32];
+            for (uint64_t k = 0; running; k++) {
+                snprintf(key, sizeof(key), "busy:%llu", (unsigned long long)(k % 100000));
+                kv_send(client, {"set", key, val}, &on_reply, &done);
+                if (kv_inflight(client) >= 1000) {
+                    kv_poll(client, -1);
+                }
+            }
+            while (kv_inflight(client) > 0) {
+                kv_poll(client, -1);
+            }
+            kv_close(client);
+        });
+        measure_lag("primary under pipelined SETs", primary, replicas[0], secs);
+        running = false;
+        writer.join();
+        wait_caught_up(primary, replicas[0]);
+    }
+
+    int nconns = 4 * (int)ports.size();
+    printf("\n%d connections of pipelined GETs\n", nconns);
+    double alone = read_rate({base}, nconns, secs, nkeys);
+    printf("%-34s %9.0f k/s\n", "primary only", alone / 1000);
+    double spread = read_rate(ports, nconns, secs, nkeys);
+    printf("%-34s %9.0f k/s (%.2fx)\n", "spread over primary and replicas", spread / 1000,
+        spread / alone);
+    fflush(stdout);
+
+    // stop a replica for longer than its timeout while writes go on: it
+    // drops the link, reconnects and continues from the backlog
+    pid_t stopped = pids[1];
+    uint64_t partial = info_field(replicas[0], "partial_syncs");
+    kill(stopped, SIGSTOP);
+    for (int i = 0; i < 10000; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key:%d", i);
+        call(primary, {"set", key, "changed"});
+    }
+    usleep(3 * 1000 * 1000);
+    kill(stopped, SIGCONT);
+    start = now_ns();
+    wait_caught_up(primary, replicas[0]);
+    printf("\nreplica stopped for 3s over 10000 SETs caught up in %.1f ms (partial resyncs: %llu)\n",
+        (double)(now_ns() - start) / 1e6,
+        (unsigned long long)(info_field(replicas[0], "partial_syncs") - partial));
+
+    for (KvClient *client : replicas) {
+        kv_close(client);
+    }
+    kv_close(primary);
+    for (pid_t pid : pids) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    std::string cmd = std::string("rm -rf ") + dir;
+    if (system(cmd.c_str()) != 0) {
+        fprintf(stderr, "can't remove %s\n", dir);
+    }
+    return 0;
+}
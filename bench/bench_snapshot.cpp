@@ -0,0 +1,85 @@
+// how long the server takes to come back with N keys: fills it, SAVEs, and
+// times a restart that loads the snapshot until it accepts connections.
+//
+// usage: bench_snapshot <path to server> [keys] [snapshot path]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+// system
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <string>
+#include <vector>
+// proj
+#include "../protocol.h"
+#include "bench_util.h"
+
+static void fill(int fd, size_t nkeys) {
+    const std::string val(32, 'v');
+    const size_t batch = 1000;
+    for (size_t i = 0; i < nkeys; i += batch) {
+        size_t n = std::min(batch, nkeys - i);
+        std::string out;
+        for (size_t j = 0; j < n; j++) {
+            append_req(out, {"set", "key:" + std::to_string(i + j), val});
+        }
+        write_all(fd, out.data(), out.size());
+        read_responses(fd, n);
+    }
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [keys] [snapshot path]\n", argv[0]);
+        return 1;
+    }
+    const char *server = argv[1];
+    size_t nkeys = argc > 2 ? (size_t)atol(argv[2]) : 2000000;
+    std::string path = argc > 3 ? argv[3] : "/tmp/bench_snapshot.kvs";
+    std::vector<std::string> args = {"--dbfilename", path};
+    (void)unlink(path.c_str());
+
+    pid_t pid = start_server(server, args);
+    int fd = connect_server();
+    uint64_t t0 = now_ns();
+    fill(fd, nkeys);
+    uint64_t t1 = now_ns();
+    std::string out;
+    append_req(out, {"save"});
+    write_all(fd, out.data(), out.size());
+    read_responses(fd, 1);
+    uint64_t t2 = now_ns();
+    close(fd);
+    stop_server(pid);
+
+    struct stat st = {};
+    (void)stat(path.c_str(), &st);
+    printf("%zu keys: filled in %.2f s, SAVE %.2f s, %.1f MB\n", nkeys,
+        (double)(t1 - t0) / 1e9, (double)(t2 - t1) / 1e9, (double)st.st_size / (1 << 20));
+
+    // the port is bound before the load, so time the first reply
+    uint64_t t3 = now_ns();
+    pid = start_server(server, args);
+    fd = connect_server();
+    out.clear();
+    append_req(out, {"get", "key:" + std::to_string(nkeys - 1)});
+    write_all(fd, out.data(), out.size());
+    read_responses(fd, 1);
+    uint64_t t4 = now_ns();
+    close(fd);
+    stop_server(pid);
+    printf("restart with the snapshot: %.2f s\n", (double)(t4 - t3) / 1e9);
+    (void)unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,129 @@
+// large SETs against the server's memory and the latency of everyone else:
+// one thread SETs and DELs a large value over and over while another times
+// small GETs on its own connection. reports the GET latency percentiles and
+// how far the server's peak RSS grew, as a multiple of the value size.
+// starts its own server.
+//
+// usage: bench_stream <path to server> [value MB] [rounds]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "../kvclient.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static pid_t start_server(const char *path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        execl(path, path, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static KvClient *connect_retry() {
+    // the server may still be starting
+    for (int i = 0; i < 100; i++) {
+        if (KvClient *client = kv_connect(KvOptions())) {
+            return client;
+        }
+        usleep(20 * 1000);
+    }
+    fprintf(stderr, "can't connect\n");
+    exit(1);
+}
+
+// the peak resident set of `pid`, in bytes
+static size_t peak_rss(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = (size_t)atol(line + 6);
+        }
+    }
+    fclose(f);
+    return kb << 10;
+}
+
+static void call(KvClient *client, const std::vector<std::string_view> &cmd) {
+    KvFuture fut;
+    kv_call(client, cmd, &fut);
+    kv_wait(client, &fut);
+    if (fut.status == RES_ERR) {
+        fprintf(stderr, "error: %s\n", fut.data.c_str());
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [value MB] [rounds]\n", argv[0]);
+        return 1;
+    }
+    size_t mb = argc > 2 ? (size_t)atol(argv[2]) : 30;
+    int rounds = argc > 3 ? atoi(argv[3]) : 20;
+    pid_t pid = start_server(argv[1]);
+    KvClient *small = connect_retry();
+    KvClient *big = connect_retry();
+    call(small, {"set", "small", "value"});
+    size_t rss_before = peak_rss(pid);
+
+    std::atomic<bool> running{true};
+    std::thread writer([&] {
+        const std::string val(mb << 20, 'v');
+        for (int i = 0; i < rounds; i++) {
+            call(big, {"set", "big", val});
+            call(big, {"del", "big"});
+        }
+        running = false;
+    });
+    std::vector<uint64_t> lat;
+    while (running) {
+        uint64_t start = now_ns();
+        call(small, {"get", "small"});
+        lat.push_back(now_ns() - start);
+    }
+    writer.join();
+    size_t growth = peak_rss(pid) - rss_before;
+
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&](double p) { return (double)lat[(size_t)(p * (double)(lat.size() - 1))] / 1000; };
+    printf("%d x SET+DEL of %zu MB, small GETs on another connection meanwhile\n", rounds, mb);
+    printf("GET latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  (%zu GETs)\n",
+        pct(0.5), pct(0.99), pct(0.999), pct(1.0), lat.size());
+    printf("server peak RSS growth: %.1f MB (%.2fx the value)\n", (double)growth / (1 << 20),
+        (double)growth / (double)(mb << 20));
+    kv_close(small);
+    kv_close(big);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
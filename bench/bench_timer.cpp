@@ -0,0 +1,70 @@
+// the timer wheel with many connection timers: re-arming a timer on every
+// request, and the cost of the wakeups the wheel asks for while 100k idle
+// timers are pending, until they all expire.
+//
+// usage: bench_timer [timers]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+// C++
+#include <random>
+#include <vector>
+// proj
+#include "../timer.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t g_fired = 0;
+
+static void on_expire(Timer *t, void *arg) {
+    (void)t;
+    (void)arg;
+    g_fired++;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 100000;
+    std::vector<Timer> timers(n);
+    std::mt19937_64 rng(42);
+
+    TimerWheel tw;
+    tw_init(&tw, 0);
+    // idle timeouts of ~5 minutes, spread out
+    uint64_t start = now_ns();
+    for (Timer &t : timers) {
+        tw_add(&tw, &t, 300000 + rng() % 1000);
+    }
+    double add_ns = (double)(now_ns() - start) / n;
+
+    // a request on a random connection pushes its deadline out
+    size_t nrearm = n * 10;
+    start = now_ns();
+    for (size_t i = 0; i < nrearm; i++) {
+        tw_add(&tw, &timers[rng() % n], 300000 + rng() % 1000);
+    }
+    double rearm_ns = (double)(now_ns() - start) / nrearm;
+
+    // wakeups as late as tw_next_timeout() allows, until all have fired
+    size_t wakeups = 0;
+    uint64_t now = 0;
+    start = now_ns();
+    while (tw.count > 0) {
+        now += (uint64_t)tw_next_timeout(&tw);
+        tw_advance(&tw, now, &on_expire, NULL);
+        wakeups++;
+    }
+    double advance_ns = (double)(now_ns() - start) / wakeups;
+
+    printf("%zu timers\n", n);
+    printf("%-24s %10.1f ns\n", "add", add_ns);
+    printf("%-24s %10.1f ns\n", "re-arm", rearm_ns);
+    printf("%-24s %10.1f ns (%zu wakeups, %zu fired)\n", "wakeup",
+        advance_ns, wakeups, g_fired);
+    return 0;
+}
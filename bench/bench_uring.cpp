@@ -0,0 +1,137 @@
+// the server's event loops against each other: pipelined GETs over several
+// connections, throughput and network syscalls per request (the server's
+// own count, from INFO stats). starts a server per event loop.
+//
+// usage: bench_uring <path to server> [ops] [conns] [depth]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+// C++
+#include <string>
+#include <vector>
+// proj
+#include "../kvclient.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static pid_t start_server(const char *path, const char *loop) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        execl(path, path, "--event-loop", loop, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static KvClient *connect_retry(uint32_t conns) {
+    KvOptions opt;
+    opt.conns = conns;
+    // the server may still be starting
+    for (int i = 0; i < 100; i++) {
+        if (KvClient *client = kv_connect(opt)) {
+            return client;
+        }
+        usleep(20 * 1000);
+    }
+    fprintf(stderr, "can't connect\n");
+    exit(1);
+}
+
+// a field of INFO stats
+static uint64_t info_stat(KvClient *client, const char *name) {
+    KvFuture fut;
+    kv_call(client, {"info", "stats"}, &fut);
+    kv_wait(client, &fut);
+    size_t pos = fut.data.find(std::string(name) + ":");
+    if (pos == std::string::npos) {
+        fprintf(stderr, "no %s in INFO\n", name);
+        exit(1);
+    }
+    return strtoull(fut.data.c_str() + pos + strlen(name) + 1, NULL, 10);
+}
+
+static std::vector<std::string> g_keys;
+static size_t g_errors = 0;
+
+static void on_reply(void *arg, uint32_t status, std::string_view data) {
+    (void)data;
+    (*(size_t *)arg)++;
+    g_errors += status != RES_OK;
+}
+
+static void run(KvClient *client, size_t depth, size_t nops) {
+    size_t sent = 0, done = 0;
+    while (done < nops) {
+        while (sent < nops && kv_inflight(client) < depth) {
+            kv_send(client, {"get", g_keys[sent % g_keys.size()]}, &on_reply, &done);
+            sent++;
+        }
+        kv_poll(client, -1);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path to server> [ops] [conns] [depth]\n", argv[0]);
+        return 1;
+    }
+    size_t nops = argc > 2 ? (size_t)atol(argv[2]) : 2000000;
+    uint32_t conns = argc > 3 ? (uint32_t)atoi(argv[3]) : 8;
+    size_t depth = argc > 4 ? (size_t)atol(argv[4]) : 128;
+    const size_t nkeys = 10000;
+    for (size_t i = 0; i < nkeys; i++) {
+        g_keys.push_back("key:" + std::to_string(i));
+    }
+
+    printf("%zu GETs, %u conns, %zu in flight\n", nops, conns, depth);
+    printf("%-6s %10s %14s %14s\n", "loop", "kops/s", "syscalls/req", "reqs/syscall");
+    for (const char *loop : {"poll", "epoll", "uring"}) {
+        pid_t pid = start_server(argv[1], loop);
+        KvClient *client = connect_retry(conns);
+        size_t done = 0;
+        for (size_t i = 0; i < nkeys; i++) {
+            kv_send(client, {"set", g_keys[i], "value"}, &on_reply, &done);
+        }
+        while (kv_inflight(client) > 0) {
+            kv_poll(client, -1);
+        }
+        // the depth 1 round trips are latency bound, so they say how much
+        // each request costs when nothing can be batched
+        for (size_t d : {(size_t)1, depth}) {
+            size_t n = d == 1 ? nops / 20 : nops;
+            uint64_t cmds = info_stat(client, "total_commands_processed");
+            uint64_t calls = info_stat(client, "io_syscalls");
+            uint64_t start = now_ns();
+            run(client, d, n);
+            double secs = (double)(now_ns() - start) / 1e9;
+            // the INFO itself is a request too, and costs a few syscalls
+            cmds = info_stat(client, "total_commands_processed") - cmds - 1;
+            calls = info_stat(client, "io_syscalls") - calls;
+            printf("%-6s %10.1f %14.3f %14.1f   (depth %zu)\n", loop,
+                (double)n / secs / 1000, (double)calls / (double)cmds,
+                (double)cmds / (double)calls, d);
+            fflush(stdout);
+        }
+        kv_close(client);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    if (g_errors) {
+        printf("%zu errors\n", g_errors);
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+// stdlib
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+// proj
+#include "../protocol.h"
+#include "bench_util.h"
+
+
+const uint16_t k_port = 1234;
+
+uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int try_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(k_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd >= 0 && connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+pid_t start_server(const char *path, const std::vector<std::string> &args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<char *> argv;
+        argv.push_back((char *)path);
+        for (const std::string &a : args) {
+            argv.push_back((char *)a.c_str());
+        }
+        argv.push_back(NULL);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        execv(path, argv.data());
+        _exit(127);
+    }
+    // wait for the listening socket
+    for (int i = 0; i < 100; i++) {
+        usleep(20 * 1000);
+        int fd = try_connect();
+        if (fd >= 0) {
+            close(fd);
+            break;
+        }
+    }
+    return pid;
+}
+
+int connect_server() {
+    int fd = try_connect();
+    if (fd < 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+bool write_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0) {
+            return false;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return true;
+}
+
+bool read_full(int fd, uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            return false;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return true;
+}
+
+std::vector<uint32_t> read_responses(int fd, size_t n) {
+    std::vector<uint32_t> status;
+    std::vector<uint8_t> buf(1 << 16);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t len = 0;
+        if (!read_full(fd, (uint8_t *)&len, 4) || len < 4 || len > k_max_msg) {
+            fprintf(stderr, "bad response\n");
+            exit(1);
+        }
+        if (len > buf.size()) {
+            buf.resize(len);
+        }
+        if (!read_full(fd, buf.data(), len)) {
+            fprintf(stderr, "bad response\n");
+            exit(1);
+        }
+        uint32_t st = 0;
+        memcpy(&st, buf.data(), 4);
+        status.push_back(st);
+    }
+    return status;
+}
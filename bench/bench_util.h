@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+// C++
+#include <string>
+#include <vector>
+
+
+// for the benchmarks that start a server of their own and talk to it over
+// plain sockets, in the wire format of protocol.h's append_req()
+
+uint64_t now_ns();
+// forks and execs the server at `path`, its stderr to /dev/null, and
+// returns once it accepts connections on the default port
+pid_t start_server(const char *path, const std::vector<std::string> &args);
+// a blocking connection to the server; exits on failure
+int connect_server();
+bool write_all(int fd, const char *buf, size_t n);
+bool read_full(int fd, uint8_t *buf, size_t n);
+// reads `n` responses, returns their status codes; exits on a bad one
+std::vector<uint32_t> read_responses(int fd, size_t n);
@@ -0,0 +1,162 @@
+// the sorted set (a B+tree with subtree counts, plus a member table) against
+// the obvious alternative, a std::set of (score, member) next to a
+// std::unordered_map of member -> score. ZADD with random and with
+// increasing scores, ZSCORE, ZRANK, ZRANGE by rank, ZRANGEBYSCORE scans and
+// ZREM, on one big set. std::set has no rank, so no ZRANK or ZRANGE for it.
+//
+// usage: bench_zset [nmembers]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+// C++
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+// proj
+#include "../zset.h"
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static volatile uint64_t g_sink = 0;
+
+// ns per operation of `n` calls of `f(i)`
+template <class F>
+static double timed(size_t n, F f) {
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        f(i);
+    }
+    return (double)(now_ns() - start) / (double)n;
+}
+
+static void row(const char *name, double zset_ns, double std_ns) {
+    if (std_ns < 0) {
+        printf("%-28s %12.1f %12s\n", name, zset_ns, "-");
+    } else {
+        printf("%-28s %12.1f %12.1f\n", name, zset_ns, std_ns);
+    }
+}
+
+struct StdZSet {
+    std::set<std::pair<double, std::string>> tree;
+    std::unordered_map<std::string, double> members;
+
+    void add(const std::string &name, double score) {
+        auto it = members.find(name);
+        if (it != members.end()) {
+            tree.erase({it->second, name});
+            it->second = score;
+        } else {
+            members.emplace(name, score);
+        }
+        tree.emplace(score, name);
+    }
+    void rem(const std::string &name) {
+        auto it = members.find(name);
+        tree.erase({it->second, name});
+        members.erase(it);
+    }
+};
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+    const size_t nq = std::min<size_t>(n, 200000);
+    std::mt19937_64 rng(42);
+
+    std::vector<std::string> names;
+    std::vector<double> scores;
+    for (size_t i = 0; i < n; i++) {
+        names.push_back("member:" + std::to_string(i));
+        scores.push_back((double)(rng() % (n * 10)));
+    }
+    // lookups in random order, so the cache can't help
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+
+    printf("%zu members, ns/op\n", n);
+    printf("%-28s %12s %12s\n", "", "ZSet", "std::set+map");
+
+    ZSet zset;
+    StdZSet ref;
+    double z_ns = timed(n, [&](size_t i) { zset_add(&zset, names[i], scores[i]); });
+    double s_ns = timed(n, [&](size_t i) { ref.add(names[i], scores[i]); });
+    row("zadd random scores", z_ns, s_ns);
+    printf("%-28s %12.1f %12s\n", "  bytes/member", (double)zset_mem_usage(&zset) / n, "");
+
+    z_ns = timed(nq, [&](size_t i) {
+        g_sink += (uint64_t)zset_lookup(&zset, names[order[i]])->score;
+    });
+    s_ns = timed(nq, [&](size_t i) {
+        g_sink += (uint64_t)ref.members.find(names[order[i]])->second;
+    });
+    row("zscore", z_ns, s_ns);
+
+    z_ns = timed(nq, [&](size_t i) {
+        g_sink += zset_rank(&zset, zset_lookup(&zset, names[order[i]]));
+    });
+    row("zrank", z_ns, -1);
+
+    // updates that move a member somewhere else in the order
+    z_ns = timed(nq, [&](size_t i) { zset_add(&zset, names[order[i]], scores[i]); });
+    s_ns = timed(nq, [&](size_t i) { ref.add(names[order[i]], scores[i]); });
+    row("zadd new score", z_ns, s_ns);
+
+    for (size_t len : {10, 100, 1000}) {
+        size_t nr = nq / len;
+        z_ns = timed(nr, [&](size_t i) {
+            ZIter it = zset_seek_rank(&zset, order[i] % (n - len));
+            for (size_t k = 0; k < len; k++, zit_next(it)) {
+                g_sink += zit_node(it)->len;
+            }
+        });
+        std::string name = "zrange " + std::to_string(len);
+        row(name.c_str(), z_ns, -1);
+    }
+    for (size_t len : {10, 100, 1000}) {
+        size_t nr = nq / len;
+        z_ns = timed(nr, [&](size_t i) {
+            double min = scores[order[i]];
+            ZIter it = zset_seek_score(&zset, min, false);
+            for (size_t k = 0; k < len && it.leaf; k++, zit_next(it)) {
+                g_sink += zit_node(it)->len;
+            }
+        });
+        s_ns = timed(nr, [&](size_t i) {
+            double min = scores[order[i]];
+            auto it = ref.tree.lower_bound({min, std::string()});
+            for (size_t k = 0; k < len && it != ref.tree.end(); k++, ++it) {
+                g_sink += it->second.size();
+            }
+        });
+        std::string name = "zrangebyscore " + std::to_string(len);
+        row(name.c_str(), z_ns, s_ns);
+    }
+
+    z_ns = timed(n, [&](size_t i) { zset_rem(&zset, names[order[i]]); });
+    s_ns = timed(n, [&](size_t i) { ref.rem(names[order[i]]); });
+    row("zrem", z_ns, s_ns);
+
+    // increasing scores, like timestamps: always the right edge of the tree
+    ZSet seq;
+    StdZSet seq_ref;
+    z_ns = timed(n, [&](size_t i) { zset_add(&seq, names[i], (double)i); });
+    s_ns = timed(n, [&](size_t i) { seq_ref.add(names[i], (double)i); });
+    row("zadd increasing scores", z_ns, s_ns);
+    printf("%-28s %12.1f %12s\n", "  bytes/member", (double)zset_mem_usage(&seq) / n, "");
+
+    zset_clear(&zset);
+    zset_clear(&seq);
+    return 0;
+}
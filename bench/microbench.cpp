@@ -0,0 +1,290 @@
+// micro-benchmarks of the request path, in-process and without sockets:
+// protocol parsing, buffers, response building, try_one_request() on a
+// pipelined buffer and do_request() on keyspaces of 1K to 10M keys, and
+// one MGET of 100 keys against 100 pipelined GETs.
+// reports ns, heap allocations and allocated bytes per operation.
+//
+// usage: microbench [--max-keys N] [--filter SUBSTR]
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+// C++
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+// proj
+#include "../buffer.h"
+#include "../outqueue.h"
+#include "../protocol.h"
+#include "../server.h"
+
+// every heap allocation, operator new included, goes through these
+static uint64_t g_allocs = 0;
+static uint64_t g_alloc_bytes = 0;
+
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+
+void *malloc(size_t n) {
+    g_allocs++;
+    g_alloc_bytes += n;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    g_allocs++;
+    g_alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    g_allocs++;
+    g_alloc_bytes += n;
+    return __libc_realloc(p, n);
+}
+}
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static const char *g_filter = NULL;
+static volatile uint64_t g_sink = 0;
+
+// times `f(i)` for n values of i after a warmup of n / 10, every i distinct.
+// `ops` is the number of operations one call stands for
+template <class F>
+static void run(const std::string &name, uint64_t n, uint64_t ops, F f) {
+    if (g_filter && !strstr(name.c_str(), g_filter)) {
+        return;
+    }
+    for (uint64_t i = 0; i < n / 10; i++) {
+        f(i);
+    }
+    uint64_t allocs = g_allocs, bytes = g_alloc_bytes;
+    uint64_t start = now_ns();
+    for (uint64_t i = n / 10; i < n / 10 + n; i++) {
+        f(i);
+    }
+    double total = (double)(n * ops);
+    double ns = (double)(now_ns() - start) / total;
+    printf("%-36s %10.1f %12.2f %12.1f\n", name.c_str(), ns,
+        (double)(g_allocs - allocs) / total, (double)(g_alloc_bytes - bytes) / total);
+    fflush(stdout);
+}
+
+static std::string frame(const std::vector<std::string_view> &cmd) {
+    std::string out;
+    append_req(out, cmd);
+    return out;
+}
+
+static void bench_protocol() {
+    std::string val(16, 'v');
+    std::string req = frame({"set", "key:12345", val});
+    const uint8_t *body = (const uint8_t *)req.data() + 4;
+    size_t len = req.size() - 4;
+
+    std::vector<std::string_view> cmd;
+    run("parse_req set 16B", 5000000, 1, [&](uint64_t) {
+        parse_req(body, len, cmd);
+        g_sink += cmd.size();
+    });
+    run("read_u32+read_str x3", 5000000, 1, [&](uint64_t) {
+        const uint8_t *p = body, *end = body + len;
+        uint32_t nstr = 0;
+        read_u32(p, end, nstr);
+        for (uint32_t i = 0; i < nstr; i++) {
+            uint32_t n = 0;
+            std::string_view sv;
+            read_u32(p, end, n);
+            read_str(p, end, n, sv);
+            g_sink += sv.size();
+        }
+    });
+}
+
+static void bench_buffers() {
+    uint8_t chunk[4096] = {};
+    Buffer buf;
+    run("buf_append+buf_consume 64B", 10000000, 1, [&](uint64_t) {
+        buf_append(buf, chunk, 64);
+        buf_consume(buf, 64);
+    });
+    // a read of 16 requests, consumed one at a time
+    run("buf_append 1KB, buf_consume 16x64B", 1000000, 16, [&](uint64_t) {
+        buf_append(buf, chunk, 1024);
+        for (int i = 0; i < 16; i++) {
+            buf_consume(buf, 64);
+        }
+    });
+
+    OutQueue q;
+    run("make_response 8B inline", 5000000, 1, [&](uint64_t) {
+        Response resp;
+        resp.data.assign(chunk, chunk + 8);
+        make_response(resp, q);
+        oq_consume(q, q.size());
+    });
+    RcStr *big = rcstr_new((const char *)chunk, sizeof(chunk));
+    run("make_response 4KB ref", 5000000, 1, [&](uint64_t) {
+        Response resp;
+        resp.ref = rcstr_ref(big);
+        make_response(resp, q);
+        oq_consume(q, q.size());
+    });
+    rcstr_unref(big);
+}
+
+static Shard *shard_for_bench() {
+    Shard *shard = new Shard();
+    shard->now_ms = now_ns() / 1000000;
+    tw_init(&shard->timers, shard->now_ms);
+    g_shards.push_back(shard);
+    return shard;
+}
+
+static std::string key_name(uint64_t i) {
+    return "key:" + std::to_string(i);
+}
+
+static void bench_pipeline(Shard *shard) {
+    // 64 pipelined GETs of existing keys, as one read would deliver them
+    std::string val(16, 'v');
+    for (uint64_t i = 0; i < 1000; i++) {
+        std::string key = key_name(i);
+        Response resp;
+        do_request(shard, {"set", key, val}, resp);
+    }
+    std::string batch;
+    for (uint64_t i = 0; i < 64; i++) {
+        std::string key = key_name(i * 7 % 1000);
+        append_req(batch, {"get", key});
+    }
+    Conn *conn = new Conn();
+    conn->shard = shard;
+    run("try_one_request get x64 pipelined", 200000, 64, [&](uint64_t) {
+        buf_append(conn->incoming, (const uint8_t *)batch.data(), batch.size());
+        while (try_one_request(conn)) {
+        }
+        oq_consume(conn->outgoing, conn->outgoing.size());
+    });
+    delete conn;
+}
+
+static void bench_keyspace(Shard *shard, uint64_t max_keys) {
+    std::string val(16, 'v');
+    std::mt19937_64 rng(1);
+    uint64_t nkeys = 0;
+    for (uint64_t size = 1000; size <= max_keys; size *= 10) {
+        // grow the same keyspace to the next size
+        for (; nkeys < size; nkeys++) {
+            std::string key = key_name(nkeys);
+            Response resp;
+            do_request(shard, {"set", key, val}, resp);
+        }
+        // random existing keys, formatted up front
+        size_t nsample = (size_t)std::min<uint64_t>(size, 1 << 16);
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < nsample; i++) {
+            keys.push_back(key_name(rng() % size));
+        }
+        std::string suffix = " " + std::to_string(size / 1000) + "K keys";
+        std::vector<std::string_view> cmd(3);
+
+        cmd.resize(2);
+        cmd[0] = "get";
+        run("do_request get" + suffix, 2000000, 1, [&](uint64_t i) {
+            cmd[1] = keys[i % nsample];
+            Response r;
+            do_request(shard, cmd, r);
+            g_sink += r.status;
+        });
+        cmd.resize(3);
+        cmd[0] = "set";
+        cmd[2] = val;
+        run("do_request set (overwrite)" + suffix, 2000000, 1, [&](uint64_t i) {
+            cmd[1] = keys[i % nsample];
+            Response r;
+            do_request(shard, cmd, r);
+        });
+        // deletes of distinct keys, put back afterwards
+        std::vector<std::string> victims;
+        for (size_t i = 0; i < nsample; i++) {
+            victims.push_back(key_name(i * (size / nsample)));
+        }
+        cmd.resize(2);
+        cmd[0] = "del";
+        run("do_request del" + suffix, nsample * 10 / 11, 1, [&](uint64_t i) {
+            cmd[1] = victims[i];
+            Response r;
+            do_request(shard, cmd, r);
+        });
+        for (const std::string &key : victims) {
+            Response resp;
+            do_request(shard, {"set", key, val}, resp);
+        }
+
+        // the same 100 random keys as one MGET or as 100 pipelined GETs,
+        // from request bytes to output queue; ns per key. every batch has
+        // keys of its own, so the big keyspaces miss the cache
+        const size_t nbatch = nsample / 100;
+        std::vector<std::string> mgets(nbatch), gets(nbatch);
+        for (size_t b = 0; b < nbatch; b++) {
+            std::vector<std::string_view> mget = {"mget"};
+            for (size_t i = 0; i < 100; i++) {
+                const std::string &key = keys[(b * 100 + i) % nsample];
+                mget.push_back(key);
+                append_req(gets[b], {"get", key});
+            }
+            append_req(mgets[b], mget);
+        }
+        Conn *conn = new Conn();
+        conn->shard = shard;
+        run("try_one_request mget x100" + suffix, 20000, 100, [&](uint64_t i) {
+            const std::string &batch = mgets[i % nbatch];
+            buf_append(conn->incoming, (const uint8_t *)batch.data(), batch.size());
+            while (try_one_request(conn)) {
+            }
+            oq_consume(conn->outgoing, conn->outgoing.size());
+        });
+        run("try_one_request get x100 pipelined" + suffix, 20000, 100, [&](uint64_t i) {
+            const std::string &batch = gets[i % nbatch];
+            buf_append(conn->incoming, (const uint8_t *)batch.data(), batch.size());
+            while (try_one_request(conn)) {
+            }
+            oq_consume(conn->outgoing, conn->outgoing.size());
+        });
+        delete conn;
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t max_keys = 10000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-keys") == 0 && i + 1 < argc) {
+            max_keys = (uint64_t)atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            g_filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--max-keys N] [--filter SUBSTR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-36s %10s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "bytes/op");
+    bench_protocol();
+    bench_buffers();
+    Shard *shard = shard_for_bench();
+    bench_pipeline(shard);
+    bench_keyspace(shard, max_keys);
+    return 0;
+}
@@ -0,0 +1,83 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+// C++
+#include <utility>
+// proj
+#include "buffer.h"
+
+
+const size_t k_min_capacity = 4 * 1024;
+// an emptied buffer bigger than this is given back to the allocator, so one
+// large request doesn't pin memory for the rest of the connection
+const size_t k_max_idle_capacity = 1 << 20;
+
+Buffer::~Buffer() {
+    free(buffer_begin);
+}
+
+void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
+    size_t space_at_end = buf.buffer_end - buf.data_end;
+    if (space_at_end < len) {
+        size_t size = buf.size();
+        size_t space_at_start = buf.data_begin - buf.buffer_begin;
+        if (space_at_start + space_at_end >= len && space_at_start >= size) {
+            // shift data to beginning of buffer, paid for by the consumes
+            // that freed at least as many bytes as we move
+            memmove(buf.buffer_begin, buf.data_begin, size);
+        } else {
+            // reallocate the buffer
+            size_t cap = buf.capacity();
+            size_t new_cap = cap * 2 > size + len ? cap * 2 : size + len;
+            if (new_cap < k_min_capacity) {
+                new_cap = k_min_capacity;
+            }
+            uint8_t *new_buffer = (uint8_t *)malloc(new_cap);
+            if (!new_buffer) {
+                fprintf(stderr, "buf_append: out of memory\n");
+                abort();
+            }
+            if (size > 0) {
+                memcpy(new_buffer, buf.data_begin, size);
+            }
+            free(buf.buffer_begin);
+            buf.buffer_begin = new_buffer;
+            buf.buffer_end = new_buffer + new_cap;
+        }
+        // adjust pointers to data begin and end
+        buf.data_begin = buf.buffer_begin;
+        buf.data_end = buf.buffer_begin + size;
+    }
+
+    memcpy(buf.data_end, data, len);
+    buf.data_end += len;
+}
+
+void buf_swap(Buffer &a, Buffer &b) {
+    std::swap(a.buffer_begin, b.buffer_begin);
+    std::swap(a.buffer_end, b.buffer_end);
+    std::swap(a.data_begin, b.data_begin);
+    std::swap(a.data_end, b.data_end);
+}
+
+void buf_truncate(Buffer &buf, size_t len) {
+    assert(len <= buf.size());
+    buf.data_end = buf.data_begin + len;
+}
+
+void buf_consume(Buffer &buf, size_t len) {
+    assert(len <= buf.size());
+    // removes length len from the beginning of the buffer
+    buf.data_begin += len;
+    if (buf.data_begin != buf.data_end) {
+        return;
+    }
+    // empty: start over at the front, for free
+    if (buf.capacity() > k_max_idle_capacity) {
+        free(buf.buffer_begin);
+        buf.buffer_begin = buf.buffer_end = NULL;
+    }
+    buf.data_begin = buf.data_end = buf.buffer_begin;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// byte queue for connection io. consuming from the front only advances
+// `data_begin`; the data is moved back to `buffer_begin` lazily, once the
+// space wasted at the front is at least as large as the data left, so every
+// byte is moved at most a constant number of times. growth is geometric.
+struct Buffer {
+    uint8_t *buffer_begin = NULL;
+    uint8_t *buffer_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+
+    Buffer() = default;
+    ~Buffer();
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    uint8_t *data() const { return data_begin; }
+    size_t size() const { return (size_t)(data_end - data_begin); }
+    size_t capacity() const { return (size_t)(buffer_end - buffer_begin); }
+};
+
+void buf_append(Buffer &buf, const uint8_t *data, size_t len);
+void buf_consume(Buffer &buf, size_t len);
+// drops everything after the first `len` bytes
+void buf_truncate(Buffer &buf, size_t len);
+void buf_swap(Buffer &a, Buffer &b);
@@ -1,163 +1,90 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
-#include <errno.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/ip.h>
-#include <assert.h>
 #include <vector>
 #include <string>
-
-const size_t k_max_msg = 4096;
-// const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
+#include "kvclient.h"
 
 void msg(const char *message)
 {
     fprintf(stderr, "%s\n", message);
 }
 
-void die(const char *message)
-{
-    perror(message);
-    exit(EXIT_FAILURE);
-}
-
-static int32_t read_full(int fd, char *buf, size_t n)
-{
-    while (n > 0)
-    {
-        // read returns the number of bytes read
-        ssize_t rv = read(fd, buf, n);
-        if (rv <= 0)
-        {
-            // error -> rv == -1
-            // EOF -> rv == 0
+static int32_t print_res(uint32_t rescode, std::string_view data) {
+    if (rescode == RES_ARR || rescode == RES_PUSH) {
+        // an array: u32 count, then u32 len + bytes per element
+        const char *p = data.data(), *end = data.data() + data.size();
+        uint32_t n = 0;
+        if (end - p < 4) {
+            msg("bad response");
             return -1;
         }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
-    }
-    return 0;
-}
-
-static int32_t write_all(int fd, const char *buf, size_t n) {
-    while (n > 0) {
-        ssize_t rv = write(fd, buf, n);
-        if (rv <= 0) {
-            return -1;  // error
+        memcpy(&n, p, 4);
+        p += 4;
+        printf("server says: [%u] (%u elements)\n", rescode, n);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t elen = 0;
+            if (end - p < 4) {
+                msg("bad response");
+                return -1;
+            }
+            memcpy(&elen, p, 4);
+            p += 4;
+            if (elen == k_arr_nil) {
+                printf("%u) (nil)\n", i + 1);
+                continue;
+            }
+            if ((size_t)(end - p) < elen) {
+                msg("bad response");
+                return -1;
+            }
+            printf("%u) %.*s\n", i + 1, (int)elen, p);
+            p += elen;
         }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
+        return 0;
     }
+    printf("server says: [%u] %.*s\n", rescode, (int)data.size(), data.data());
     return 0;
 }
 
-static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
-    // inserts data to data + len into the end of the buffer
-    buf.insert(buf.end(), data, data + len);
-}
-
-static void buf_consume(std::vector<uint8_t> &buf, size_t len) {
-    // removes length len from the beginning of the buffer
-    buf.erase(buf.begin(), buf.begin() + len);
-}
-
-static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
-    uint32_t len = 4;
-    for (const std::string &s : cmd) {
-        len += 4 + s.size();
-    }
-    if (len > k_max_msg) {
-        return -1;
-    }
-
-    char wbuf[4 + k_max_msg];
-    memcpy(&wbuf[0], &len, 4);  // assume little endian
-    uint32_t n = cmd.size();
-    memcpy(&wbuf[4], &n, 4);
-    size_t cur = 8;
-    for (const std::string &s : cmd) {
-        uint32_t p = (uint32_t)s.size();
-        memcpy(&wbuf[cur], &p, 4);
-        memcpy(&wbuf[cur + 4], s.data(), s.size());
-        cur += 4 + s.size();
-    }
-    return write_all(fd, wbuf, 4 + len);
-}
-
-static int32_t read_res(int fd) {
-    // 4 bytes header
-    char rbuf[4 + k_max_msg + 1];
-    errno = 0;
-    int32_t err = read_full(fd, rbuf, 4);
-    if (err) {
-        if (errno == 0) {
-            msg("EOF");
-        } else {
-            msg("read() error");
-        }
-        return err;
-    }
-
-    uint32_t len = 0;
-    memcpy(&len, rbuf, 4);  // assume little endian
-    if (len > k_max_msg) {
-        msg("too long");
-        return -1;
-    }
-
-    // reply body
-    err = read_full(fd, &rbuf[4], len);
-    if (err) {
-        msg("read() error");
-        return err;
-    }
-
-    // print the result
-    uint32_t rescode = 0;
-    if (len < 4) {
-        msg("bad response");
-        return -1;
-    }
-    memcpy(&rescode, &rbuf[4], 4);
-    printf("server says: [%u] %.*s\n", rescode, len - 4, &rbuf[8]);
-    return 0;
+static void on_push(void *arg, uint32_t status, std::string_view data) {
+    (void)arg;
+    print_res(status, data);
+    fflush(stdout);
 }
 
 int main(int argc, char **argv) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        die("socket()");
+    // SUBSCRIBE and PSUBSCRIBE print messages until interrupted
+    bool subscribe = argc > 1 && (strcasecmp(argv[1], "subscribe") == 0
+        || strcasecmp(argv[1], "psubscribe") == 0);
+    KvOptions opt;
+    if (subscribe) {
+        opt.on_push = &on_push;
     }
-
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);  // 127.0.0.1
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("connect");
+    KvClient *client = kv_connect(opt);
+    if (!client) {
+        perror("connect");
+        exit(EXIT_FAILURE);
     }
 
-    std::vector<std::string> cmd;
+    std::vector<std::string_view> cmd;
     for (int i = 1; i < argc; ++i) {
         cmd.push_back(argv[i]);
     }
-    int32_t err = send_req(fd, cmd);
-    if (err) {
-        goto L_DONE;
+    KvFuture res;
+    if (!kv_call(client, cmd, &res)) {
+        msg("too long");
+        kv_close(client);
+        return 0;
     }
-    err = read_res(fd);
-    if (err) {
-        goto L_DONE;
+    kv_wait(client, &res);
+    print_res(res.status, res.data);
+    fflush(stdout);
+    while (subscribe && res.status != RES_ERR) {
+        kv_poll(client, -1);
     }
-
-L_DONE:
-    close(fd);
+    kv_close(client);
     return 0;
 }
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <string_view>
+#include <vector>
+// proj
+#include "protocol.h"
+
+
+struct Shard;
+
+// Command::flags
+enum {
+    CMD_WRITE = 1 << 0,     // may change the keyspace
+    CMD_READONLY = 1 << 1,
+    CMD_FAST = 1 << 2,      // O(1) or O(log n), no scans
+    CMD_ADMIN = 1 << 3,     // persistence and introspection
+    CMD_NOKEY = 1 << 4,     // no key: runs on the shard it arrived on
+};
+
+typedef void (*CmdHandler)(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out);
+
+struct Command {
+    std::string_view name;      // lowercase
+    CmdHandler handler;
+    // arguments, the name included; -N for N or more
+    int32_t arity;
+    uint32_t flags;
+    // multi-key commands: a key every `key_step` arguments from cmd[1], with
+    // the rest of the step belonging to it. 0 if cmd[1] is the only key.
+    uint32_t key_step = 0;
+};
+
+static inline bool cmd_arity_ok(const Command *c, size_t nargs) {
+    return c->arity >= 0 ? nargs == (size_t)c->arity : nargs >= (size_t)-c->arity;
+}
+
+constexpr uint8_t ascii_lower(uint8_t c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// `lower` is lowercase already
+static inline bool str_eq_nocase(std::string_view s, std::string_view lower) {
+    if (s.size() != lower.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < s.size(); i++) {
+        if (ascii_lower((uint8_t)s[i]) != (uint8_t)lower[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// case-insensitive
+constexpr uint32_t cmd_hash(std::string_view name, uint32_t seed) {
+    uint32_t h = seed ^ (uint32_t)name.size();
+    for (char c : name) {
+        h = (h ^ ascii_lower((uint8_t)c)) * 0x01000193;    // FNV-1a
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    return h ^ (h >> 13);
+}
+
+// a perfect hash of the command names, found at compile time: the first
+// seed under which every name gets a slot of its own. a lookup is then one
+// hash, one slot and one compare, whatever the number of commands.
+template <size_t Slots>
+struct CmdIndex {
+    static_assert((Slots & (Slots - 1)) == 0, "Slots must be a power of 2");
+    uint32_t seed = 0;
+    uint8_t slot[Slots] = {};   // command index + 1, 0 = none
+    size_t max_len = 0;         // longer names are no command
+};
+
+template <size_t Slots, size_t N>
+constexpr CmdIndex<Slots> cmd_index_build(const Command (&cmds)[N]) {
+    static_assert(N < 255 && N <= Slots / 2, "too many commands for the index");
+    for (uint32_t seed = 1; ; seed++) {
+        CmdIndex<Slots> index;
+        index.seed = seed;
+        bool ok = true;
+        for (size_t i = 0; ok && i < N; i++) {
+            uint8_t &slot = index.slot[cmd_hash(cmds[i].name, seed) & (Slots - 1)];
+            ok = slot == 0;
+            slot = (uint8_t)(i + 1);
+            index.max_len = cmds[i].name.size() > index.max_len ? cmds[i].name.size()
+                : index.max_len;
+        }
+        if (ok) {
+            return index;
+        }
+    }
+}
+
+// NULL if `name` is no command, in any case
+template <size_t Slots, size_t N>
+inline const Command *cmd_index_find(const CmdIndex<Slots> &index, const Command (&cmds)[N],
+    std::string_view name)
+{
+    if (name.size() > index.max_len) {
+        return NULL;
+    }
+    uint8_t i = index.slot[cmd_hash(name, index.seed) & (Slots - 1)];
+    return i && str_eq_nocase(name, cmds[i - 1].name) ? &cmds[i - 1] : NULL;
+}
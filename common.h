@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+#define container_of(ptr, T, member) \
+    ((T *)( (char *)ptr - offsetof(T, member) ))
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// murmur3-style string hash: 8 bytes per step plus a full avalanche at the
+// end, so both the low bits (table fingerprints) and the high bits (table
+// index, shard selection) are well mixed
+static inline uint64_t str_hash(const uint8_t *data, size_t len) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8) {
+        uint64_t k = 0;
+        memcpy(&k, data, 8);
+        k = rotl64(k * c1, 31) * c2;
+        h = rotl64(h ^ k, 27) * 5 + 0x52dce729;
+        data += 8;
+        len -= 8;
+    }
+    if (len > 0) {
+        uint64_t k = 0;
+        memcpy(&k, data, len);
+        h ^= rotl64(k * c1, 31) * c2;
+    }
+    // fmix64
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -0,0 +1,192 @@
+// stdlib
+#include <errno.h>
+#include <string.h>
+// system
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+// proj
+#include "event_loop.h"
+
+
+// level-triggered fallback. the pollfd array is kept between calls and only
+// patched on add/mod/del, but the kernel and the result scan are still
+// O(registered fds) per wakeup.
+struct PollLoop : EventLoop {
+    std::vector<struct pollfd> pfds;
+    std::vector<int> fd2idx;    // index into pfds, -1 if not registered
+
+    static short to_poll(uint32_t events) {
+        short ev = 0;
+        if (events & EV_READ) {
+            ev |= POLLIN;
+        }
+        if (events & EV_WRITE) {
+            ev |= POLLOUT;
+        }
+        return ev;
+    }
+
+    const char *name() const override { return "poll"; }
+    bool edge_triggered() const override { return false; }
+
+    int add(int fd, uint32_t events) override {
+        if (fd2idx.size() <= (size_t)fd) {
+            fd2idx.resize(fd + 1, -1);
+        }
+        if (fd2idx[fd] >= 0) {
+            errno = EEXIST;
+            return -1;
+        }
+        fd2idx[fd] = (int)pfds.size();
+        pfds.push_back({fd, to_poll(events), 0});
+        return 0;
+    }
+
+    int mod(int fd, uint32_t events) override {
+        if (fd2idx.size() <= (size_t)fd || fd2idx[fd] < 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        pfds[fd2idx[fd]].events = to_poll(events);
+        return 0;
+    }
+
+    int del(int fd) override {
+        if (fd2idx.size() <= (size_t)fd || fd2idx[fd] < 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        // swap with the last entry so removal is O(1)
+        int idx = fd2idx[fd];
+        pfds[idx] = pfds.back();
+        fd2idx[pfds[idx].fd] = idx;
+        pfds.pop_back();
+        fd2idx[fd] = -1;
+        return 0;
+    }
+
+    int wait(std::vector<Event> &out, int timeout_ms) override {
+        out.clear();
+        int rv = poll(pfds.data(), (nfds_t)pfds.size(), timeout_ms);
+        if (rv <= 0) {
+            return rv;
+        }
+        for (const struct pollfd &pfd : pfds) {
+            if (!pfd.revents) {
+                continue;
+            }
+            Event ev;
+            ev.fd = pfd.fd;
+            // a hangup still needs a read() to observe the EOF
+            if (pfd.revents & (POLLIN | POLLHUP)) {
+                ev.events |= EV_READ;
+            }
+            if (pfd.revents & POLLOUT) {
+                ev.events |= EV_WRITE;
+            }
+            if (pfd.revents & (POLLERR | POLLNVAL)) {
+                ev.events |= EV_ERR;
+            }
+            out.push_back(ev);
+            if ((int)out.size() == rv) {
+                break;  // no more ready fds
+            }
+        }
+        return (int)out.size();
+    }
+};
+
+#ifdef __linux__
+// edge-triggered epoll. the kernel keeps the interest set, so a wakeup only
+// costs O(ready fds) no matter how many idle connections are registered.
+struct EpollLoop : EventLoop {
+    int epfd = -1;
+    std::vector<struct epoll_event> evs;
+
+    EpollLoop() : evs(1024) {}
+    ~EpollLoop() override {
+        if (epfd >= 0) {
+            (void)close(epfd);
+        }
+    }
+
+    int ctl(int op, int fd, uint32_t events) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLET;
+        if (events & EV_READ) {
+            ev.events |= EPOLLIN;
+        }
+        if (events & EV_WRITE) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.fd = fd;
+        return epoll_ctl(epfd, op, fd, &ev);
+    }
+
+    const char *name() const override { return "epoll"; }
+    bool edge_triggered() const override { return true; }
+
+    int add(int fd, uint32_t events) override {
+        return ctl(EPOLL_CTL_ADD, fd, events);
+    }
+    int mod(int fd, uint32_t events) override {
+        // re-arming also reports the current readiness, so nothing that
+        // happened while we weren't interested gets lost
+        return ctl(EPOLL_CTL_MOD, fd, events);
+    }
+    int del(int fd) override {
+        return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    int wait(std::vector<Event> &out, int timeout_ms) override {
+        out.clear();
+        int rv = epoll_wait(epfd, evs.data(), (int)evs.size(), timeout_ms);
+        if (rv <= 0) {
+            return rv;
+        }
+        for (int i = 0; i < rv; i++) {
+            Event ev;
+            ev.fd = evs[i].data.fd;
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+                ev.events |= EV_READ;
+            }
+            if (evs[i].events & EPOLLOUT) {
+                ev.events |= EV_WRITE;
+            }
+            if (evs[i].events & EPOLLERR) {
+                ev.events |= EV_ERR;
+            }
+            out.push_back(ev);
+        }
+        // the batch was full, so more may be ready; grow for next time
+        if ((size_t)rv == evs.size()) {
+            evs.resize(evs.size() * 2);
+        }
+        return rv;
+    }
+};
+#endif
+
+EventLoop *event_loop_new(const char *name) {
+#ifdef __linux__
+    if (!name || strcmp(name, "epoll") == 0) {
+        EpollLoop *loop = new EpollLoop();
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd >= 0) {
+            return loop;
+        }
+        delete loop;
+        if (name) {
+            return NULL;
+        }
+        // no epoll, fall back to poll
+    }
+#endif
+    if (!name || strcmp(name, "poll") == 0) {
+        return new PollLoop();
+    }
+    return NULL;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// readiness / interest flags shared by all backends
+enum {
+    EV_READ = 1,
+    EV_WRITE = 2,
+    EV_ERR = 4,     // only ever reported, never requested
+};
+
+struct Event {
+    int fd = -1;
+    uint32_t events = 0;
+};
+
+// a readiness-based event loop backend. interest is registered once per fd
+// and only updated when it changes, so a wakeup costs O(ready fds) on
+// backends that support it (epoll) instead of O(registered fds) (poll).
+struct EventLoop {
+    virtual ~EventLoop() {}
+
+    virtual const char *name() const = 0;
+    // edge-triggered backends only report transitions, so callers must
+    // drain reads/writes until EAGAIN
+    virtual bool edge_triggered() const = 0;
+
+    virtual int add(int fd, uint32_t events) = 0;
+    virtual int mod(int fd, uint32_t events) = 0;
+    virtual int del(int fd) = 0;
+
+    // blocks for at most timeout_ms (-1 = forever); replaces `out` with the
+    // ready fds and returns their count, or -1 with errno set
+    virtual int wait(std::vector<Event> &out, int timeout_ms) = 0;
+};
+
+// `name` is "epoll" or "poll"; NULL picks the best backend available.
+// returns NULL if the backend is unknown or cannot be created.
+EventLoop *event_loop_new(const char *name);
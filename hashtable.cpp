@@ -0,0 +1,371 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// proj
+#include "hashtable.h"
+
+
+// control byte values; a full slot stores 0x80 | the low 7 bits of its hash.
+// empty is 0 so that a fresh table can come straight from calloc().
+enum : uint8_t {
+    k_empty = 0,
+    k_deleted = 1,
+    k_full = 0x80,
+};
+
+const uint32_t k_slot_mask = (1u << k_group_slots) - 1;    // ignores padding
+const size_t k_rehashing_work = 128;    // slots migrated per operation
+
+static inline uint8_t h2(uint64_t hcode) {
+    return (uint8_t)(k_full | (hcode & 0x7f));
+}
+
+static inline size_t h1(uint64_t hcode) {
+    return (size_t)(hcode >> 7);
+}
+
+// bitmask of the slots in the group whose control byte is `b`
+static inline uint32_t group_match(const HGroup *g, uint8_t b) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)g->ctrl);
+    uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)b), ctrl));
+#else
+    uint32_t m = 0;
+    for (size_t i = 0; i < k_group_slots; i++) {
+        m |= (uint32_t)(g->ctrl[i] == b) << i;
+    }
+#endif
+    return m & k_slot_mask;
+}
+
+// full slots are the only ones with the high bit set
+static inline uint32_t group_match_free(const HGroup *g) {
+#ifdef __SSE2__
+    uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)g->ctrl));
+#else
+    uint32_t m = 0;
+    for (size_t i = 0; i < k_group_slots; i++) {
+        m |= (uint32_t)(g->ctrl[i] >> 7) << i;
+    }
+#endif
+    return ~m & k_slot_mask;
+}
+
+static inline bool ctrl_is_full(uint8_t c) {
+    return c & k_full;
+}
+
+static void h_init(HTab *htab, size_t ngroups) {
+    assert(ngroups > 0 && (ngroups & (ngroups - 1)) == 0);
+    // calloc() hands out lazily zeroed pages for big tables, so creating the
+    // new table of a resize doesn't touch all of its memory up front
+    size_t align = alignof(HGroup);
+    htab->mem = calloc(ngroups * sizeof(HGroup) + align, 1);
+    assert(htab->mem);
+    htab->groups = (HGroup *)(((uintptr_t)htab->mem + align - 1) & ~(uintptr_t)(align - 1));
+    htab->gmask = ngroups - 1;
+    htab->size = 0;
+    // keep at least 1/8 of the slots empty so probes stay short
+    size_t cap = ngroups * k_group_slots;
+    htab->growth_left = cap - cap / 8;
+}
+
+static void h_free(HTab *htab) {
+    free(htab->mem);
+    *htab = HTab{};
+}
+
+// quadratic probing over groups: visits every group when the group count
+// is a power of 2
+#define FOR_EACH_GROUP(htab, hcode, pos)                                    \
+    for (size_t pos = h1(hcode) & (htab)->gmask, stride_ = 0;               \
+        ; stride_++, pos = (pos + stride_) & (htab)->gmask)
+
+// returns the group and slot of the key, or NULL
+static HGroup *h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *), size_t &slot) {
+    if (!htab->groups) {
+        return NULL;
+    }
+    uint8_t fp = h2(key->hcode);
+    FOR_EACH_GROUP(htab, key->hcode, pos) {
+        HGroup *g = &htab->groups[pos];
+        // the second cache line holds most of the slots; start fetching it
+        // alongside the control bytes instead of after them
+        __builtin_prefetch((const char *)g + 64);
+        for (uint32_t m = group_match(g, fp); m; m &= m - 1) {
+            size_t i = (size_t)__builtin_ctz(m);
+            HNode *node = g->slots[i];
+            if (node->hcode == key->hcode && eq(node, key)) {
+                slot = i;
+                return g;
+            }
+        }
+        // an empty slot ends the probe sequence
+        if (group_match(g, k_empty)) {
+            return NULL;
+        }
+    }
+}
+
+static void h_insert(HTab *htab, HNode *node) {
+    FOR_EACH_GROUP(htab, node->hcode, pos) {
+        HGroup *g = &htab->groups[pos];
+        uint32_t m = group_match_free(g);
+        if (!m) {
+            continue;
+        }
+        size_t i = (size_t)__builtin_ctz(m);
+        if (g->ctrl[i] == k_empty) {
+            htab->growth_left--;
+        }
+        g->ctrl[i] = h2(node->hcode);
+        g->slots[i] = node;
+        htab->size++;
+        return;
+    }
+}
+
+static HNode *h_detach(HTab *htab, HGroup *g, size_t i) {
+    HNode *node = g->slots[i];
+    htab->size--;
+    // if the group still has an empty slot, no probe ever continued past it,
+    // so this slot can go straight back to empty instead of a tombstone
+    if (group_match(g, k_empty)) {
+        g->ctrl[i] = k_empty;
+        htab->growth_left++;
+    } else {
+        g->ctrl[i] = k_deleted;
+    }
+    return node;
+}
+
+// move about `nwork` slots from `older` into `newer`, a group at a time
+static void hm_help_rehashing(HMap *hmap, size_t nwork) {
+    HTab *older = &hmap->older;
+    while (nwork > 0 && older->size > 0) {
+        assert(hmap->migrate_pos <= older->gmask);
+        HGroup *g = &older->groups[hmap->migrate_pos++];
+        for (size_t i = 0; i < k_group_slots; i++) {
+            if (ctrl_is_full(g->ctrl[i])) {
+                g->ctrl[i] = k_deleted;
+                older->size--;
+                h_insert(&hmap->newer, g->slots[i]);
+            }
+        }
+        nwork = nwork > k_group_slots ? nwork - k_group_slots : 0;
+    }
+    if (older->groups && older->size == 0) {
+        h_free(older);
+        hmap->migrate_pos = 0;
+    }
+}
+
+static void hm_trigger_rehashing(HMap *hmap, size_t ngroups) {
+    // only one resize at a time; this is rare, as a migration finishes long
+    // before the new table fills up
+    if (hmap->older.groups) {
+        hm_help_rehashing(hmap, (size_t)-1);
+    }
+    hmap->older = hmap->newer;
+    h_init(&hmap->newer, ngroups);
+    hmap->migrate_pos = 0;
+}
+
+// number of groups for `n` live entries at less than 7/8 load
+static size_t groups_for(size_t n) {
+    size_t ngroups = 1;
+    while (ngroups * k_group_slots * 7 / 8 <= n) {
+        ngroups *= 2;
+    }
+    return ngroups;
+}
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    hm_help_rehashing(hmap, k_rehashing_work);
+    size_t i = 0;
+    if (HGroup *g = h_lookup(&hmap->newer, key, eq, i)) {
+        return g->slots[i];
+    }
+    if (HGroup *g = h_lookup(&hmap->older, key, eq, i)) {
+        return g->slots[i];
+    }
+    return NULL;
+}
+
+static void h_prefetch(HTab *htab, uint64_t hcode) {
+    if (htab->groups) {
+        const char *g = (const char *)&htab->groups[h1(hcode) & htab->gmask];
+        __builtin_prefetch(g);
+        __builtin_prefetch(g + 64);
+    }
+}
+
+void hm_prefetch(HMap *hmap, uint64_t hcode) {
+    h_prefetch(&hmap->newer, hcode);
+    h_prefetch(&hmap->older, hcode);
+}
+
+static void h_prefetch_nodes(HTab *htab, uint64_t hcode) {
+    if (!htab->groups) {
+        return;
+    }
+    const HGroup *g = &htab->groups[h1(hcode) & htab->gmask];
+    for (uint32_t m = group_match(g, h2(hcode)); m; m &= m - 1) {
+        // nodes sit at the start of bigger structs; their keys usually
+        // spill into the next line
+        const char *node = (const char *)g->slots[__builtin_ctz(m)];
+        __builtin_prefetch(node);
+        __builtin_prefetch(node + 64);
+    }
+}
+
+void hm_prefetch_nodes(HMap *hmap, uint64_t hcode) {
+    h_prefetch_nodes(&hmap->newer, hcode);
+    h_prefetch_nodes(&hmap->older, hcode);
+}
+
+void hm_insert(HMap *hmap, HNode *node) {
+    if (!hmap->newer.groups) {
+        h_init(&hmap->newer, 1);
+    }
+    h_insert(&hmap->newer, node);
+
+    if (hmap->newer.growth_left == 0) {
+        // out of empty slots. grow if it is really full, otherwise the
+        // tombstones are the problem and a same-sized table cleans them up
+        size_t ngroups = hmap->newer.gmask + 1;
+        size_t live = hmap->newer.size + hmap->older.size;
+        bool grow = live > ngroups * k_group_slots / 2;
+        hm_trigger_rehashing(hmap, grow ? ngroups * 2 : ngroups);
+    }
+    hm_help_rehashing(hmap, k_rehashing_work);
+}
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    hm_help_rehashing(hmap, k_rehashing_work);
+    size_t i = 0;
+    if (HGroup *g = h_lookup(&hmap->newer, key, eq, i)) {
+        return h_detach(&hmap->newer, g, i);
+    }
+    if (HGroup *g = h_lookup(&hmap->older, key, eq, i)) {
+        // the migration cursor skips free slots, so a tombstone is fine here
+        HNode *node = h_detach(&hmap->older, g, i);
+        if (hmap->older.size == 0) {
+            h_free(&hmap->older);
+            hmap->migrate_pos = 0;
+        }
+        return node;
+    }
+    return NULL;
+}
+
+static bool node_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+void hm_replace(HMap *hmap, HNode *old, HNode *node) {
+    assert(old->hcode == node->hcode);
+    size_t i = 0;
+    HGroup *g = h_lookup(&hmap->newer, old, &node_same, i);
+    if (!g) {
+        g = h_lookup(&hmap->older, old, &node_same, i);
+    }
+    assert(g);
+    g->slots[i] = node;
+}
+
+void hm_reserve(HMap *hmap, size_t n) {
+    size_t ngroups = groups_for(n);
+    if (hmap->newer.groups && hmap->newer.gmask + 1 >= ngroups) {
+        return;
+    }
+    if (!hmap->newer.groups) {
+        h_init(&hmap->newer, ngroups);
+        return;
+    }
+    // an explicit bulk operation, so migrate everything right away
+    hm_trigger_rehashing(hmap, ngroups);
+    hm_help_rehashing(hmap, (size_t)-1);
+}
+
+void hm_clear(HMap *hmap) {
+    h_free(&hmap->newer);
+    h_free(&hmap->older);
+    hmap->migrate_pos = 0;
+}
+
+size_t hm_size(HMap *hmap) {
+    return hmap->newer.size + hmap->older.size;
+}
+
+static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
+    for (size_t pos = 0; htab->groups && pos <= htab->gmask; pos++) {
+        HGroup *g = &htab->groups[pos];
+        for (size_t i = 0; i < k_group_slots; i++) {
+            if (ctrl_is_full(g->ctrl[i]) && !f(g->slots[i], arg)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
+    if (h_foreach(&hmap->newer, f, arg)) {
+        h_foreach(&hmap->older, f, arg);
+    }
+}
+
+size_t hm_scan(HMap *hmap, size_t cursor, size_t ngroups, HNode *(*f)(HNode *, void *),
+    void *arg)
+{
+    size_t nnewer = hmap->newer.groups ? hmap->newer.gmask + 1 : 0;
+    size_t nolder = hmap->older.groups ? hmap->older.gmask + 1 : 0;
+    for (; ngroups > 0 && cursor < nnewer + nolder; ngroups--, cursor++) {
+        HGroup *g = cursor < nnewer ? &hmap->newer.groups[cursor]
+            : &hmap->older.groups[cursor - nnewer];
+        for (size_t i = 0; i < k_group_slots; i++) {
+            if (ctrl_is_full(g->ctrl[i])) {
+                g->slots[i] = f(g->slots[i], arg);
+            }
+        }
+    }
+    return cursor < nnewer + nolder ? cursor : 0;
+}
+
+HNode *hm_random(HMap *hmap, uint64_t rnd) {
+    size_t total = hm_size(hmap);
+    if (total == 0) {
+        return NULL;
+    }
+    // pick a table in proportion to its size, then scan from a random group
+    HTab *htab = (rnd >> 40) % total < hmap->newer.size ? &hmap->newer : &hmap->older;
+    for (size_t n = 0, pos = (size_t)rnd; n <= htab->gmask; n++, pos++) {
+        HGroup *g = &htab->groups[pos & htab->gmask];
+        uint32_t full = ~group_match_free(g) & k_slot_mask;
+        if (!full) {
+            continue;
+        }
+        // one of the full slots
+        for (size_t k = (size_t)(rnd >> 20) % (size_t)__builtin_popcount(full); k > 0; k--) {
+            full &= full - 1;
+        }
+        return g->slots[__builtin_ctz(full)];
+    }
+    return NULL;
+}
+
+size_t hm_mem_usage(HMap *hmap) {
+    size_t ngroups = 0;
+    if (hmap->newer.groups) {
+        ngroups += hmap->newer.gmask + 1;
+    }
+    if (hmap->older.groups) {
+        ngroups += hmap->older.gmask + 1;
+    }
+    return ngroups * sizeof(HGroup);
+}
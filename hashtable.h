@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// hashtable node, should be embedded into the payload
+struct HNode {
+    uint64_t hcode = 0;
+};
+
+// slots per group; the group's control bytes and slots share one 128-byte
+// aligned block, i.e. an adjacent pair of cache lines
+const size_t k_group_slots = 14;
+
+// one 1-byte control word per slot holds a 7-bit fingerprint of the slot's
+// hash, so a probe checks a whole group with a few SIMD instructions and
+// only dereferences a node when its fingerprint matches
+struct alignas(128) HGroup {
+    uint8_t ctrl[16];           // the last 2 are padding
+    HNode *slots[k_group_slots];
+};
+
+// a Swiss-table style open addressing table of node pointers
+struct HTab {
+    HGroup *groups = NULL;
+    void *mem = NULL;           // unaligned allocation behind `groups`
+    size_t gmask = 0;           // number of groups - 1, a power of 2
+    size_t size = 0;            // live entries
+    size_t growth_left = 0;     // inserts left before a resize
+};
+
+// the real hashtable interface. a resize does not move everything at once:
+// each operation migrates a bounded number of slots from `older` to `newer`.
+struct HMap {
+    HTab newer;
+    HTab older;
+    size_t migrate_pos = 0;
+};
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// for batches of lookups: hm_prefetch() every key, then hm_prefetch_nodes()
+// every key, then look them up. the first starts loading the groups a
+// lookup probes first, the second the nodes whose fingerprints match in
+// them, so a batch waits for memory about twice instead of twice per key.
+void hm_prefetch(HMap *hmap, uint64_t hcode);
+void hm_prefetch_nodes(HMap *hmap, uint64_t hcode);
+// the key must not already be in the table
+void hm_insert(HMap *hmap, HNode *node);
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// puts `node` where `old` is, for a payload that moved; same hash
+void hm_replace(HMap *hmap, HNode *old, HNode *node);
+// pre-size for `n` entries, e.g. before a bulk load
+void hm_reserve(HMap *hmap, size_t n);
+void hm_clear(HMap *hmap);
+size_t hm_size(HMap *hmap);
+// stops early if `f` returns false
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// goes over up to `ngroups` groups from `cursor` on, both tables as one
+// range, and stores whatever `f` returns in place of each node, which may
+// be a moved copy. returns the cursor to go on from, 0 at the end. nodes
+// that a resize migrates while a scan is under way may be missed.
+size_t hm_scan(HMap *hmap, size_t cursor, size_t ngroups, HNode *(*f)(HNode *, void *),
+    void *arg);
+// a random entry, NULL if empty. `rnd` should be a fresh random number;
+// like any open-addressing pick it favours entries after empty runs.
+HNode *hm_random(HMap *hmap, uint64_t rnd);
+// bytes taken by the tables themselves
+size_t hm_mem_usage(HMap *hmap);
@@ -0,0 +1,331 @@
+// stdlib
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+// system
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+// proj
+#include "buffer.h"
+#include "event_loop.h"
+#include "kvclient.h"
+
+
+static const char k_lost[] = "connection lost";
+
+struct KvPending {
+    KvCallback cb = NULL;
+    void *arg = NULL;
+};
+
+// the callbacks of a connection's requests in flight, oldest first. it only
+// ever grows, so a busy connection stops allocating once it's warmed up.
+struct KvRing {
+    std::vector<KvPending> slots = std::vector<KvPending>(64);   // a power of 2
+    size_t head = 0;
+    size_t count = 0;
+};
+
+static void ring_push(KvRing &r, KvPending p) {
+    if (r.count == r.slots.size()) {
+        std::vector<KvPending> bigger(r.slots.size() * 2);
+        for (size_t i = 0; i < r.count; i++) {
+            bigger[i] = r.slots[(r.head + i) & (r.slots.size() - 1)];
+        }
+        r.slots.swap(bigger);
+        r.head = 0;
+    }
+    r.slots[(r.head + r.count) & (r.slots.size() - 1)] = p;
+    r.count++;
+}
+
+static KvPending ring_pop(KvRing &r) {
+    assert(r.count > 0);
+    KvPending p = r.slots[r.head];
+    r.head = (r.head + 1) & (r.slots.size() - 1);
+    r.count--;
+    return p;
+}
+
+struct KvConn {
+    int fd = -1;
+    std::string out;        // encoded requests, not yet written
+    size_t out_off = 0;
+    Buffer in;
+    KvRing pending;
+    uint32_t events = 0;    // interest registered with the loop
+};
+
+struct KvClient {
+    KvOptions opt;
+    std::vector<KvConn *> conns;
+    EventLoop *loop = NULL;
+    std::vector<Event> events;
+    size_t inflight = 0;
+    size_t next = 0;        // rotates the tie break between idle connections
+};
+
+static bool conn_open(KvClient *client, KvConn *conn) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(client->opt.port);
+    if (inet_pton(AF_INET, client->opt.host, &addr.sin_addr) != 1
+        || connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    // requests are batched here already; don't let Nagle hold them back
+    int one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (client->loop->add(fd, EV_READ) < 0) {
+        close(fd);
+        return false;
+    }
+    conn->fd = fd;
+    conn->events = EV_READ;
+    return true;
+}
+
+// closes the connection and fails its requests. it's reopened the next
+// time kv_send() wants it.
+static void conn_fail(KvClient *client, KvConn *conn) {
+    if (conn->fd >= 0) {
+        client->loop->del(conn->fd);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->out.clear();
+    conn->out_off = 0;
+    buf_consume(conn->in, conn->in.size());
+    // the callbacks may send again, on a fresh ring
+    KvRing failed;
+    std::swap(failed, conn->pending);
+    client->inflight -= failed.count;
+    while (failed.count > 0) {
+        KvPending p = ring_pop(failed);
+        p.cb(p.arg, RES_ERR, k_lost);
+    }
+}
+
+static void conn_flush(KvClient *client, KvConn *conn) {
+    while (conn->out_off < conn->out.size()) {
+        ssize_t rv = write(conn->fd, conn->out.data() + conn->out_off,
+            conn->out.size() - conn->out_off);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv < 0) {
+            conn_fail(client, conn);
+            return;
+        }
+        conn->out_off += (size_t)rv;
+    }
+    if (conn->out_off == conn->out.size()) {
+        // keeps the capacity for the next batch
+        conn->out.clear();
+        conn->out_off = 0;
+    }
+    uint32_t want = EV_READ | (conn->out.empty() ? 0 : EV_WRITE);
+    if (want != conn->events) {
+        client->loop->mod(conn->fd, want);
+        conn->events = want;
+    }
+}
+
+// reads until EAGAIN and runs the callbacks of the complete replies. on
+// EOF or an error, the replies that came before it still count.
+static size_t conn_read(KvClient *client, KvConn *conn) {
+    bool lost = false;
+    while (true) {
+        uint8_t buf[64 * 1024];
+        ssize_t rv = read(conn->fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            lost = true;
+            break;
+        }
+        buf_append(conn->in, buf, (size_t)rv);
+    }
+    size_t n = 0;
+    while (conn->in.size() >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, conn->in.data(), 4);
+        if (len < 4 || len > k_max_msg) {
+            conn_fail(client, conn);    // not our protocol
+            return n;
+        }
+        if (4 + (size_t)len > conn->in.size()) {
+            break;
+        }
+        uint32_t status = 0;
+        memcpy(&status, conn->in.data() + 4, 4);
+        std::string_view data((const char *)conn->in.data() + 8, len - 4);
+        if (status == RES_PUSH) {
+            if (client->opt.on_push) {
+                client->opt.on_push(client->opt.push_arg, status, data);
+            }
+            if (conn->fd < 0) {
+                return n;
+            }
+            buf_consume(conn->in, 4 + len);
+            continue;
+        }
+        if (conn->pending.count == 0) {
+            conn_fail(client, conn);    // a reply to nothing
+            return n;
+        }
+        KvPending p = ring_pop(conn->pending);
+        client->inflight--;
+        n++;
+        p.cb(p.arg, status, data);
+        if (conn->fd < 0) {
+            return n;   // a kv_send() from the callback lost the connection
+        }
+        buf_consume(conn->in, 4 + len);
+    }
+    if (lost) {
+        conn_fail(client, conn);
+    }
+    return n;
+}
+
+KvClient *kv_connect(const KvOptions &opt) {
+    KvClient *client = new KvClient();
+    client->opt = opt;
+    client->loop = event_loop_new(NULL);
+    if (!client->loop) {
+        delete client;
+        return NULL;
+    }
+    for (uint32_t i = 0; i < (opt.conns ? opt.conns : 1); i++) {
+        KvConn *conn = new KvConn();
+        client->conns.push_back(conn);
+        if (!conn_open(client, conn)) {
+            kv_close(client);
+            return NULL;
+        }
+    }
+    return client;
+}
+
+void kv_close(KvClient *client) {
+    for (KvConn *conn : client->conns) {
+        conn_fail(client, conn);
+        delete conn;
+    }
+    delete client->loop;
+    delete client;
+}
+
+// the connection with the fewest requests in flight, reopening closed ones
+static KvConn *pick_conn(KvClient *client) {
+    KvConn *best = NULL;
+    size_t n = client->conns.size();
+    for (size_t i = 0; i < n; i++) {
+        KvConn *conn = client->conns[(client->next + i) % n];
+        if (conn->fd < 0 && !conn_open(client, conn)) {
+            continue;
+        }
+        if (!best || conn->pending.count < best->pending.count) {
+            best = conn;
+        }
+    }
+    client->next++;
+    return best;
+}
+
+bool kv_send(KvClient *client, const std::vector<std::string_view> &cmd, KvCallback cb,
+    void *arg)
+{
+    size_t len = 4;
+    for (std::string_view s : cmd) {
+        len += 4 + s.size();
+    }
+    if (len > k_max_msg) {
+        return false;
+    }
+    KvConn *conn = pick_conn(client);
+    if (!conn) {
+        return false;
+    }
+    append_req(conn->out, cmd);
+    ring_push(conn->pending, KvPending{cb, arg});
+    client->inflight++;
+    if (conn->out.size() - conn->out_off >= client->opt.flush_bytes) {
+        conn_flush(client, conn);
+    }
+    return true;
+}
+
+void kv_flush(KvClient *client) {
+    for (KvConn *conn : client->conns) {
+        if (conn->fd >= 0 && conn->out_off < conn->out.size()) {
+            conn_flush(client, conn);
+        }
+    }
+}
+
+size_t kv_poll(KvClient *client, int timeout_ms) {
+    kv_flush(client);
+    bool idle = client->inflight == 0 && !client->opt.on_push;
+    if (idle || client->loop->wait(client->events, timeout_ms) < 0) {
+        return 0;
+    }
+    size_t n = 0;
+    for (const Event &ev : client->events) {
+        for (KvConn *conn : client->conns) {
+            if (conn->fd != ev.fd) {
+                continue;
+            }
+            if (ev.events & EV_WRITE) {
+                conn_flush(client, conn);
+            }
+            if (conn->fd >= 0 && (ev.events & (EV_READ | EV_ERR))) {
+                n += conn_read(client, conn);
+            }
+            break;
+        }
+    }
+    return n;
+}
+
+size_t kv_inflight(const KvClient *client) {
+    return client->inflight;
+}
+
+static void future_done(void *arg, uint32_t status, std::string_view data) {
+    KvFuture *fut = (KvFuture *)arg;
+    fut->status = status;
+    fut->data.assign(data);
+    fut->ready = true;
+}
+
+bool kv_call(KvClient *client, const std::vector<std::string_view> &cmd, KvFuture *fut) {
+    fut->ready = false;
+    return kv_send(client, cmd, &future_done, fut);
+}
+
+void kv_wait(KvClient *client, KvFuture *fut) {
+    // a future that was never sent can't become ready
+    while (!fut->ready && client->inflight > 0) {
+        kv_poll(client, -1);
+    }
+}
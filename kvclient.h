@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <string>
+#include <string_view>
+#include <vector>
+// proj
+#include "protocol.h"
+
+
+// an asynchronous client: a pool of connections, each with any number of
+// requests in flight. a request is encoded into its connection's output
+// buffer right away and written by kv_flush() or kv_poll(), so a burst of
+// them costs one write() per connection. replies come back in order per
+// connection and go to their callbacks from kv_poll().
+//
+// not thread safe: one thread makes the requests and drives kv_poll().
+
+// `data` points into the read buffer and is only valid during the call. a
+// lost connection fails its requests with RES_ERR and "connection lost".
+// callbacks may kv_send() follow-ups, but not kv_poll() or kv_wait().
+typedef void (*KvCallback)(void *arg, uint32_t status, std::string_view data);
+
+struct KvOptions {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1234;
+    uint32_t conns = 1;
+    // a connection's output is written as soon as this much is queued,
+    // without waiting for kv_flush()
+    size_t flush_bytes = 64 << 10;
+    // pub/sub messages, RES_PUSH frames, go here instead of to a request's
+    // callback; without one they are dropped
+    KvCallback on_push = NULL;
+    void *push_arg = NULL;
+};
+
+struct KvClient;
+
+// connects the whole pool; NULL if a connection fails
+KvClient *kv_connect(const KvOptions &opt);
+// requests still in flight are failed
+void kv_close(KvClient *client);
+
+// queues a request on the least busy connection; `cb` runs once its reply
+// is in. false if the request is too big or no connection can be had.
+bool kv_send(KvClient *client, const std::vector<std::string_view> &cmd, KvCallback cb,
+    void *arg);
+// writes what's queued, as far as the sockets take it
+void kv_flush(KvClient *client);
+// flushes, then waits at most `timeout_ms` (-1 = forever) for replies and
+// runs their callbacks. returns how many there were; doesn't wait if
+// nothing is in flight, unless there is an `on_push` to wait for.
+size_t kv_poll(KvClient *client, int timeout_ms);
+size_t kv_inflight(const KvClient *client);
+
+// a reply to wait for, for code that isn't callback driven
+struct KvFuture {
+    bool ready = false;
+    uint32_t status = RES_ERR;
+    std::string data;
+};
+
+// kv_send() into `fut`, which must outlive the request
+bool kv_call(KvClient *client, const std::vector<std::string_view> &cmd, KvFuture *fut);
+// drives the client until `fut` is ready
+void kv_wait(KvClient *client, KvFuture *fut);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+
+// intrusive circular doubly linked list; a node is its own empty list
+struct DList {
+    DList *prev = this;
+    DList *next = this;
+};
+
+inline void dlist_init(DList *node) {
+    node->prev = node->next = node;
+}
+
+inline bool dlist_empty(DList *node) {
+    return node->next == node;
+}
+
+inline void dlist_detach(DList *node) {
+    DList *prev = node->prev;
+    DList *next = node->next;
+    prev->next = next;
+    next->prev = prev;
+    dlist_init(node);
+}
+
+inline void dlist_insert_before(DList *target, DList *rookie) {
+    DList *prev = target->prev;
+    prev->next = rookie;
+    rookie->prev = prev;
+    rookie->next = target;
+    target->prev = rookie;
+}
@@ -0,0 +1,183 @@
+// stdlib
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+// C++
+#include <thread>
+// proj
+#include "log.h"
+
+
+int g_log_level = LL_INFO;
+
+const size_t k_log_slots = 4096;    // power of 2
+const size_t k_log_text = 240;      // longer messages are truncated
+
+// one record in the ring. `seq` tells producers and the writer whose turn
+// the slot is (Vyukov's bounded queue): == pos free for the producer of
+// `pos`, == pos + 1 filled and waiting for the writer.
+struct LogSlot {
+    std::atomic<uint64_t> seq{0};
+    uint64_t ts_ns = 0;
+    int level = 0;
+    char text[k_log_text];
+};
+
+static LogSlot g_ring[k_log_slots];
+static std::atomic<uint64_t> g_enqueue_pos{0};
+static std::atomic<uint64_t> g_written{0};      // records the writer is done with
+static std::atomic<uint64_t> g_dropped{0};
+static std::atomic<bool> g_started{false};
+static FILE *g_out = NULL;
+
+static uint64_t realtime_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static const char *k_level_names[] = {"debug", "info", "warn", "error"};
+
+const char *log_level_name(int level) {
+    return level >= LL_DEBUG && level <= LL_ERROR ? k_level_names[level] : "?";
+}
+
+int log_level_parse(const char *name) {
+    for (int i = LL_DEBUG; i <= LL_ERROR; i++) {
+        if (strcmp(name, k_level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void write_record(FILE *fp, uint64_t ts_ns, int level, const char *text) {
+    time_t sec = (time_t)(ts_ns / 1000000000);
+    struct tm tm = {};
+    localtime_r(&sec, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(fp, "%s.%03u [%s] %s\n", when, (unsigned)(ts_ns / 1000000 % 1000),
+        log_level_name(level), text);
+}
+
+void log_write(int level, const char *fmt, ...) {
+    uint64_t ts_ns = realtime_ns();
+    if (!g_started.load(std::memory_order_acquire)) {
+        // no writer thread yet (startup, or a tool linking kvcore)
+        char text[k_log_text];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        write_record(stderr, ts_ns, level, text);
+        return;
+    }
+
+    // claim a slot
+    uint64_t pos = g_enqueue_pos.load(std::memory_order_relaxed);
+    LogSlot *slot = NULL;
+    while (true) {
+        slot = &g_ring[pos & (k_log_slots - 1)];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (g_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed))
+            {
+                break;
+            }
+        } else if (seq < pos) {
+            // the writer is a whole ring behind; drop rather than block
+            g_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = g_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->ts_ns = ts_ns;
+    slot->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+static void writer_main() {
+    uint64_t pos = 0;
+    uint32_t idle_us = 100;
+    while (true) {
+        LogSlot *slot = &g_ring[pos & (k_log_slots - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+            // empty, or the producer of `pos` is still formatting
+            uint64_t dropped = g_dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped) {
+                char text[64];
+                snprintf(text, sizeof(text), "%llu log records dropped",
+                    (unsigned long long)dropped);
+                write_record(g_out, realtime_ns(), LL_WARN, text);
+            }
+            fflush(g_out);
+            // back off while idle, so a quiet server doesn't spin
+            struct timespec ts = {0, (long)idle_us * 1000};
+            nanosleep(&ts, NULL);
+            idle_us = idle_us < 10000 ? idle_us * 2 : idle_us;
+            continue;
+        }
+        idle_us = 100;
+        write_record(g_out, slot->ts_ns, slot->level, slot->text);
+        // hand the slot to the producer one ring ahead
+        slot->seq.store(pos + k_log_slots, std::memory_order_release);
+        pos++;
+        g_written.store(pos, std::memory_order_release);
+    }
+}
+
+bool log_init(const char *path) {
+    g_out = stderr;
+    if (path) {
+        g_out = fopen(path, "a");
+        if (!g_out) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < k_log_slots; i++) {
+        g_ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    std::thread(writer_main).detach();
+    g_started.store(true, std::memory_order_release);
+    return true;
+}
+
+void log_flush() {
+    if (!g_started.load(std::memory_order_acquire)) {
+        return;
+    }
+    // give up after about a second; this is only used on the way out
+    uint64_t target = g_enqueue_pos.load(std::memory_order_acquire);
+    for (int i = 0; i < 1000 && g_written.load(std::memory_order_acquire) < target; i++) {
+        struct timespec ts = {0, 1000 * 1000};
+        nanosleep(&ts, NULL);
+    }
+    fflush(g_out);
+}
+
+bool log_ratelimit(LogRateLimit *rl, uint32_t burst, uint32_t *dropped) {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec;
+    uint64_t window = rl->window.load(std::memory_order_relaxed);
+    if (window != now && rl->window.compare_exchange_strong(window, now,
+        std::memory_order_relaxed))
+    {
+        rl->count.store(0, std::memory_order_relaxed);
+    }
+    if (rl->count.fetch_add(1, std::memory_order_relaxed) < burst) {
+        *dropped = rl->suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    rl->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
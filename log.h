@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+// C++
+#include <atomic>
+
+
+enum LogLevel {
+    LL_DEBUG = 0,
+    LL_INFO = 1,
+    LL_WARN = 2,
+    LL_ERROR = 3,
+};
+
+// levels below this are compiled out entirely
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LL_INFO
+#endif
+
+// runtime level, set once at startup
+extern int g_log_level;
+
+// formats the record and queues it for the writer thread. never blocks: if
+// the ring is full the record is dropped and counted.
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// starts the writer thread. `path` NULL means stderr. until this is called,
+// records are written synchronously to stderr.
+bool log_init(const char *path);
+// waits until everything queued so far is written
+void log_flush();
+const char *log_level_name(int level);
+int log_level_parse(const char *name);  // -1 if unknown
+
+// at most `burst` records per second from one call site, then a summary of
+// how many were suppressed once the next second starts
+struct LogRateLimit {
+    std::atomic<uint64_t> window{0};    // current second
+    std::atomic<uint32_t> count{0};     // records in this window
+    std::atomic<uint32_t> suppressed{0};
+};
+
+// returns whether to log; `*dropped` is the number suppressed before this one
+bool log_ratelimit(LogRateLimit *rl, uint32_t burst, uint32_t *dropped);
+
+#define LOG_ENABLED(level) \
+    ((level) >= LOG_COMPILE_LEVEL && (level) >= g_log_level)
+
+#define LOG(level, ...) do {                                                \
+    if (LOG_ENABLED(level)) {                                               \
+        log_write((level), __VA_ARGS__);                                    \
+    }                                                                       \
+} while (0)
+
+#define LOG_DEBUG(...) LOG(LL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LL_ERROR, __VA_ARGS__)
+
+// for events a client can trigger at will, like connects and disconnects
+#define LOG_RATELIMITED(level, burst, ...) do {                             \
+    if (LOG_ENABLED(level)) {                                               \
+        static LogRateLimit rl_;                                            \
+        uint32_t dropped_ = 0;                                              \
+        if (log_ratelimit(&rl_, (burst), &dropped_)) {                      \
+            if (dropped_) {                                                 \
+                log_write((level), "(%u similar messages suppressed)", dropped_); \
+            }                                                               \
+            log_write((level), __VA_ARGS__);                                \
+        }                                                                   \
+    }                                                                       \
+} while (0)
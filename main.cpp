@@ -0,0 +1,7 @@
+// proj
+#include "server.h"
+
+
+int main(int argc, char **argv) {
+    return server_main(argc, argv);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+
+// intrusive multi-producer single-consumer queue (Vyukov). producers never
+// block each other: a push is one atomic exchange plus one store. embed an
+// MpscNode in the message type and static_cast back after pop().
+struct MpscNode {
+    std::atomic<MpscNode *> next{nullptr};
+};
+
+struct MpscQueue {
+    std::atomic<MpscNode *> head;   // producers push here
+    MpscNode *tail;                 // only touched by the consumer
+    MpscNode stub;
+
+    MpscQueue() : head(&stub), tail(&stub) {}
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // any thread
+    void push(MpscNode *node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        MpscNode *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // consumer thread only. may return NULL while a push is half done; that
+    // producer wakes the consumer again once it has finished.
+    MpscNode *pop() {
+        MpscNode *t = tail;
+        MpscNode *next = t->next.load(std::memory_order_acquire);
+        if (t == &stub) {
+            if (!next) {
+                return nullptr;     // empty
+            }
+            tail = next;
+            t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return t;
+        }
+        if (t != head.load(std::memory_order_acquire)) {
+            return nullptr;         // a producer is mid-push
+        }
+        // `t` is the last node; put the stub back behind it so it can leave
+        push(&stub);
+        next = t->next.load(std::memory_order_acquire);
+        if (next) {
+            tail = next;
+            return t;
+        }
+        return nullptr;
+    }
+};
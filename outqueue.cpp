@@ -0,0 +1,112 @@
+// stdlib
+#include <assert.h>
+// C++
+#include <utility>
+// proj
+#include "outqueue.h"
+
+
+OutQueue::~OutQueue() {
+    for (size_t i = head; i < segs.size(); i++) {
+        if (segs[i].ref) {
+            rcstr_unref(segs[i].ref);
+        }
+    }
+}
+
+void oq_append(OutQueue &q, const uint8_t *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    buf_append(q.bytes, data, len);
+    // extend the last segment if it is also inline
+    if (q.segs.size() > q.head && !q.segs.back().ref) {
+        q.segs.back().len += len;
+    } else {
+        OutQueue::Seg seg;
+        seg.len = len;
+        q.segs.push_back(seg);
+    }
+    q.total += len;
+}
+
+void oq_append_ref(OutQueue &q, RcStr *str) {
+    if (str->len < k_ref_min) {
+        // an iovec per small value costs more than the copy
+        oq_append(q, (const uint8_t *)str->data(), str->len);
+        rcstr_unref(str);
+        return;
+    }
+    oq_append_shared(q, str);
+}
+
+void oq_append_shared(OutQueue &q, RcStr *str) {
+    OutQueue::Seg seg;
+    seg.ref = str;
+    seg.len = str->len;
+    q.segs.push_back(seg);
+    q.total += str->len;
+}
+
+int oq_iov(OutQueue &q, struct iovec *iov, int max) {
+    int n = 0;
+    const uint8_t *inline_pos = q.bytes.data();
+    for (size_t i = q.head; i < q.segs.size() && n < max; i++) {
+        const OutQueue::Seg &seg = q.segs[i];
+        if (seg.ref) {
+            iov[n].iov_base = seg.ref->data() + seg.off;
+        } else {
+            // inline segments take their bytes from `bytes` in order
+            iov[n].iov_base = (void *)inline_pos;
+            inline_pos += seg.len;
+        }
+        iov[n].iov_len = seg.len;
+        n++;
+    }
+    return n;
+}
+
+void oq_swap(OutQueue &a, OutQueue &b) {
+    buf_swap(a.bytes, b.bytes);
+    a.segs.swap(b.segs);
+    std::swap(a.head, b.head);
+    std::swap(a.total, b.total);
+}
+
+OutQueue::Seg *oq_front_ref(OutQueue &q) {
+    if (q.head < q.segs.size() && q.segs[q.head].ref) {
+        return &q.segs[q.head];
+    }
+    return NULL;
+}
+
+void oq_consume(OutQueue &q, size_t len) {
+    assert(len <= q.total);
+    q.total -= len;
+    while (len > 0) {
+        OutQueue::Seg &seg = q.segs[q.head];
+        size_t n = len < seg.len ? len : seg.len;
+        if (seg.ref) {
+            seg.off += n;
+        } else {
+            buf_consume(q.bytes, n);
+        }
+        seg.len -= n;
+        len -= n;
+        if (seg.len == 0) {
+            if (seg.ref) {
+                rcstr_unref(seg.ref);
+            }
+            q.head++;
+        }
+    }
+    // reuse the segment array once it has been fully written, or drop the
+    // written prefix if a pipelining client never lets it drain
+    if (q.head == q.segs.size()) {
+        q.segs.clear();
+        q.head = 0;
+    } else if (q.head >= 64 && q.head * 2 >= q.segs.size()) {
+        q.segs.erase(q.segs.begin(), q.segs.begin() + q.head);
+        q.head = 0;
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+// C++
+#include <vector>
+// proj
+#include "buffer.h"
+#include "rcstr.h"
+
+
+// values at least this big are queued by reference instead of being copied
+const size_t k_ref_min = 1024;
+
+// bytes waiting to be written to a connection. small pieces are copied into
+// `bytes`; large values are queued as references, so they go from the store
+// to the kernel through writev() without a userspace copy.
+struct OutQueue {
+    struct Seg {
+        RcStr *ref = NULL;  // NULL: the next `len` bytes of `bytes`
+        size_t off = 0;     // into `ref`
+        size_t len = 0;     // bytes left to write
+    };
+
+    Buffer bytes;
+    std::vector<Seg> segs;
+    size_t head = 0;        // first unwritten segment
+    size_t total = 0;       // bytes left to write
+
+    OutQueue() = default;
+    ~OutQueue();
+    OutQueue(const OutQueue &) = delete;
+    OutQueue &operator=(const OutQueue &) = delete;
+
+    size_t size() const { return total; }
+};
+
+void oq_append(OutQueue &q, const uint8_t *data, size_t len);
+// takes over the caller's reference to `str`
+void oq_append_ref(OutQueue &q, RcStr *str);
+// the same, but by reference whatever the size: for bytes that many queues
+// share, where a copy each would cost more than their iovecs
+void oq_append_shared(OutQueue &q, RcStr *str);
+// describes up to `max` iovecs from the front of the queue, returns the count
+int oq_iov(OutQueue &q, struct iovec *iov, int max);
+// the front segment if it is a reference, otherwise NULL
+OutQueue::Seg *oq_front_ref(OutQueue &q);
+void oq_consume(OutQueue &q, size_t len);
+// exchanges the contents, capacity included
+void oq_swap(OutQueue &a, OutQueue &b);
@@ -0,0 +1,184 @@
+// stdlib
+#include <string.h>
+#include <stdio.h>
+// C++
+#include <string>
+// proj
+#include "log.h"
+#include "protocol.h"
+
+
+bool read_u32(const uint8_t *&curr, const uint8_t *end, uint32_t &out) {
+    // if there isn't enough space to read 4 bytes, return false
+    if (curr + 4 > end) {
+        return false;
+    }
+
+    // update out and curr
+    memcpy(&out, curr, 4);
+    curr += 4;
+    return true;
+}
+
+bool read_str(const uint8_t *&curr, const uint8_t *end, size_t n, std::string_view &out) {
+    if (n > (size_t)(end - curr)) {
+        return false;
+    }
+    // no copy, just point into the request
+    out = std::string_view((const char *)curr, n);
+    curr += n;
+    return true;
+}
+
+int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string_view> &out) {
+    out.clear();
+    // find end pointer of data
+    const uint8_t *end = data + size;
+
+    // find num of arguments in the request
+    uint32_t nstr = 0;
+    // if you can't read the number of arguments, return -1
+    if (!read_u32(data, end, nstr)) {
+        return -1;
+    }
+    // if the number of arguments is greater than the max, return -1
+    if (nstr > k_max_args) {
+        return -1;
+    }
+
+    // read the arguments
+    while (out.size() < nstr) {
+        uint32_t len = 0;  
+        if (!read_u32(data, end, len)) {
+            return -1;
+        }
+        out.push_back(std::string_view());
+        if(!read_str(data, end, len, out.back())) {
+            return -1;
+        }
+    }
+
+    // if there's still data left, return -1
+    if (data != end) {
+        return -1;
+    }
+    return 0;
+
+}
+
+int64_t parse_req_head(const uint8_t *data, size_t size, size_t msg_len, size_t min_last,
+    std::vector<std::string_view> &out)
+{
+    out.clear();
+    const uint8_t *start = data;
+    const uint8_t *end = data + size;
+    uint32_t nstr = 0;
+    if (!read_u32(data, end, nstr)) {
+        return 0;
+    }
+    if (nstr == 0 || nstr > k_max_args) {
+        return -1;
+    }
+    while (out.size() + 1 < nstr) {
+        uint32_t len = 0;
+        if (!read_u32(data, end, len)) {
+            return 0;
+        }
+        out.push_back(std::string_view());
+        if (!read_str(data, end, len, out.back())) {
+            return 0;
+        }
+    }
+    uint32_t len = 0;
+    if (!read_u32(data, end, len)) {
+        return 0;
+    }
+    size_t off = (size_t)(data - start);
+    if (len < min_last || off + len != msg_len) {
+        return -1;
+    }
+    return (int64_t)off;
+}
+
+void append_req(std::string &out, const std::vector<std::string_view> &cmd) {
+    uint32_t len = 4;
+    for (std::string_view s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    uint32_t nstr = (uint32_t)cmd.size();
+    out.append((const char *)&len, 4);
+    out.append((const char *)&nstr, 4);
+    for (std::string_view s : cmd) {
+        uint32_t n = (uint32_t)s.size();
+        out.append((const char *)&n, 4);
+        out.append(s.data(), s.size());
+    }
+}
+
+void make_response(Response &resp, OutQueue &out) {
+    size_t ref_len = resp.ref ? resp.ref->len : 0;
+    for (auto &r : resp.refs) {
+        ref_len += r.second->len;
+    }
+    uint32_t resp_len = 4 + (uint32_t)(resp.data.size() + ref_len);
+
+    LOG_DEBUG("response: status %u, %u bytes", resp.status, resp_len);
+    // appends response length, then response status and finally response data to buffer
+    oq_append(out, (const uint8_t *)&resp_len, 4);
+    oq_append(out, (const uint8_t *)&resp.status, 4);
+    size_t pos = 0;
+    for (auto &r : resp.refs) {
+        oq_append(out, resp.data.data() + pos, r.first - pos);
+        oq_append_ref(out, r.second);
+        pos = r.first;
+    }
+    resp.refs.clear();
+    oq_append(out, resp.data.data() + pos, resp.data.size() - pos);
+    if (resp.ref) {
+        // large values are queued by reference, not copied
+        oq_append_ref(out, resp.ref);
+        resp.ref = NULL;
+    }
+}
+
+RcStr *make_push(const std::vector<std::string_view> &elems) {
+    // the body is encoded like a request's
+    std::string frame;
+    append_req(frame, elems);
+    uint32_t len = (uint32_t)frame.size(), status = RES_PUSH;
+    RcStr *str = rcstr_alloc(8 + frame.size() - 4);
+    memcpy(str->data(), &len, 4);
+    memcpy(str->data() + 4, &status, 4);
+    memcpy(str->data() + 8, frame.data() + 4, frame.size() - 4);
+    return str;
+}
+
+void out_arr_begin(Response &out) {
+    out.data.clear();
+    out.data.resize(4);     // the count, once it's known
+}
+
+void out_arr_push(Response &out, std::string_view s) {
+    uint32_t n = (uint32_t)s.size();
+    out.data.insert(out.data.end(), (const uint8_t *)&n, (const uint8_t *)&n + 4);
+    out.data.insert(out.data.end(), s.begin(), s.end());
+}
+
+void out_arr_push_nil(Response &out) {
+    out.data.insert(out.data.end(), (const uint8_t *)&k_arr_nil, (const uint8_t *)&k_arr_nil + 4);
+}
+
+void out_arr_push_val(Response &out, RcStr *val) {
+    if (val->len < k_ref_min) {
+        out_arr_push(out, val->view());
+        return;
+    }
+    uint32_t n = val->len;
+    out.data.insert(out.data.end(), (const uint8_t *)&n, (const uint8_t *)&n + 4);
+    out.refs.emplace_back(out.data.size(), rcstr_ref(val));
+}
+
+void out_arr_end(Response &out, uint32_t n) {
+    memcpy(out.data.data(), &n, 4);
+    out.status = RES_ARR;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+// proj
+#include "outqueue.h"
+#include "rcstr.h"
+
+
+const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
+const size_t k_max_args = 200 * 1000;
+
+// Response::status
+enum {
+    RES_OK = 0,
+    RES_ERR = 1,    // error
+    RES_NX = 2,     // key not found
+    RES_ARR = 3,    // `data` is an array, encoded like a request body
+    // a pub/sub message: no reply to any request, so it comes in between
+    // the replies whenever. `data` like RES_ARR.
+    RES_PUSH = 4,
+};
+
+// the length of a missing element in a RES_ARR response
+const uint32_t k_arr_nil = 0xffffffff;
+
+struct Response {
+    uint32_t status = 0;
+    std::vector<uint8_t> data;
+    // a stored value to send after `data`; an owned reference that
+    // make_response() hands over to the output queue
+    RcStr *ref = NULL;
+    // more of them, each to go at an offset into `data`, in order
+    std::vector<std::pair<size_t, RcStr *>> refs;
+
+    Response() = default;
+    ~Response() {
+        if (ref) {
+            rcstr_unref(ref);
+        }
+        for (auto &r : refs) {
+            rcstr_unref(r.second);
+        }
+    }
+    Response(const Response &) = delete;
+    Response &operator=(const Response &) = delete;
+};
+
+bool read_u32(const uint8_t *&curr, const uint8_t *end, uint32_t &out);
+bool read_str(const uint8_t *&curr, const uint8_t *end, size_t n, std::string_view &out);
+// splits a request body into its arguments. `out` views into `data`, so it
+// is only valid as long as `data` is; pass the same vector every time to
+// reuse its capacity.
+int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string_view> &out);
+// for a body of `msg_len` bytes whose first `size` are in `data`: parses
+// every argument but the last and returns the offset of the last one's bytes,
+// so that they can be read elsewhere. 0 if `data` ends before that, -1 if
+// the last argument is shorter than `min_last` or the lengths don't add up.
+int64_t parse_req_head(const uint8_t *data, size_t size, size_t msg_len, size_t min_last,
+    std::vector<std::string_view> &out);
+// the reverse: appends a whole request frame, length prefix included
+void append_req(std::string &out, const std::vector<std::string_view> &cmd);
+void make_response(Response &resp, OutQueue &out);
+// a whole RES_PUSH frame of these elements, built once for every connection
+// that it goes to
+RcStr *make_push(const std::vector<std::string_view> &elems);
+// RES_ARR responses: out_arr_begin(), out_arr_push() for each element, then
+// out_arr_end() with the number of elements
+void out_arr_begin(Response &out);
+void out_arr_push(Response &out, std::string_view s);
+void out_arr_push_nil(Response &out);
+// a stored value: copied if it's small, otherwise referenced
+void out_arr_push_val(Response &out, RcStr *val);
+void out_arr_end(Response &out, uint32_t n);
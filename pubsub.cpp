@@ -0,0 +1,292 @@
+// stdlib
+#include <assert.h>
+// C++
+#include <algorithm>
+// proj
+#include "common.h"
+#include "pubsub.h"
+
+
+// a channel name to look up
+struct ChannelKey {
+    HNode node;
+    std::string_view name;
+};
+
+static bool channel_eq(HNode *node, HNode *key) {
+    return container_of(node, PubChannel, node)->name == container_of(key, ChannelKey, node)->name;
+}
+
+static void channel_key_init(ChannelKey &key, std::string_view name) {
+    key.name = name;
+    key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+}
+
+PubChannel *ps_channel_find(PubSub *ps, std::string_view name) {
+    ChannelKey key;
+    channel_key_init(key, name);
+    HNode *node = hm_lookup(&ps->channels, &key.node, &channel_eq);
+    return node ? container_of(node, PubChannel, node) : NULL;
+}
+
+PubChannel *ps_channel_add(PubSub *ps, std::string_view name) {
+    if (PubChannel *ch = ps_channel_find(ps, name)) {
+        return ch;
+    }
+    PubChannel *ch = new PubChannel();
+    ch->name = name;
+    ch->node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+    hm_insert(&ps->channels, &ch->node);
+    return ch;
+}
+
+void ps_channel_del(PubSub *ps, PubChannel *ch) {
+    assert(ch->subs.empty());
+    ChannelKey key;
+    channel_key_init(key, ch->name);
+    (void)hm_delete(&ps->channels, &key.node, &channel_eq);
+    delete ch;
+}
+
+// a step along a pattern
+enum {
+    TOK_LIT = 0,
+    TOK_ANY = 1,    // ?
+    TOK_STAR = 2,   // *
+    TOK_CLASS = 3,  // [...]
+};
+
+struct PatToken {
+    int kind = TOK_LIT;
+    uint8_t byte = 0;
+    std::string_view cls;   // between the brackets
+};
+
+// the token at `i`; returns where the next one starts. like Redis, a
+// trailing backslash is itself and an unclosed class runs to the end.
+static size_t pat_token(std::string_view p, size_t i, PatToken &t) {
+    char c = p[i];
+    if (c == '?' || c == '*') {
+        t.kind = c == '?' ? TOK_ANY : TOK_STAR;
+        return i + 1;
+    }
+    if (c == '[') {
+        size_t j = i + 1;
+        if (j < p.size() && p[j] == '^') {
+            j++;
+        }
+        while (j < p.size() && p[j] != ']') {
+            if (p[j] == '\\' && j + 1 < p.size()) {
+                j += 2;
+            } else if (j + 2 < p.size() && p[j + 1] == '-') {
+                j += 3;     // a range, which may end in ']'
+            } else {
+                j++;
+            }
+        }
+        t.kind = TOK_CLASS;
+        t.cls = p.substr(i + 1, std::min(j, p.size()) - (i + 1));
+        return j < p.size() ? j + 1 : p.size();
+    }
+    t.kind = TOK_LIT;
+    if (c == '\\' && i + 1 < p.size()) {
+        t.byte = (uint8_t)p[i + 1];
+        return i + 2;
+    }
+    t.byte = (uint8_t)c;
+    return i + 1;
+}
+
+static bool class_match(std::string_view cls, uint8_t c) {
+    size_t i = 0;
+    bool neg = !cls.empty() && cls[0] == '^';
+    if (neg) {
+        i++;
+    }
+    bool match = false;
+    while (i < cls.size()) {
+        if (cls[i] == '\\' && i + 1 < cls.size()) {
+            match |= (uint8_t)cls[i + 1] == c;
+            i += 2;
+        } else if (i + 2 < cls.size() && cls[i + 1] == '-') {
+            uint8_t lo = (uint8_t)cls[i], hi = (uint8_t)cls[i + 2];
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            match |= c >= lo && c <= hi;
+            i += 3;
+        } else {
+            match |= (uint8_t)cls[i] == c;
+            i++;
+        }
+    }
+    return neg ? !match : match;
+}
+
+static PatNode *node_new(PatNode *parent) {
+    PatNode *node = new PatNode();
+    node->parent = parent;
+    return node;
+}
+
+// the child for `t`, NULL if there's none and `create` is false
+static PatNode *node_child(PatNode *node, const PatToken &t, bool create) {
+    switch (t.kind) {
+    case TOK_ANY:
+        if (!node->any && create) {
+            node->any = node_new(node);
+        }
+        return node->any;
+    case TOK_STAR:
+        if (!node->kstar && create) {
+            node->kstar = node_new(node);
+            node->kstar->star = true;
+        }
+        return node->kstar;
+    case TOK_CLASS:
+        for (auto &kid : node->classes) {
+            if (kid.first == t.cls) {
+                return kid.second;
+            }
+        }
+        if (!create) {
+            return NULL;
+        }
+        node->classes.emplace_back(std::string(t.cls), node_new(node));
+        return node->classes.back().second;
+    default:
+        auto it = std::lower_bound(node->lits.begin(), node->lits.end(), t.byte,
+            [](const std::pair<uint8_t, PatNode *> &kid, uint8_t b) { return kid.first < b; });
+        if (it != node->lits.end() && it->first == t.byte) {
+            return it->second;
+        }
+        if (!create) {
+            return NULL;
+        }
+        return node->lits.insert(it, {t.byte, node_new(node)})->second;
+    }
+}
+
+// the node at the end of the pattern's path
+static PatNode *pat_walk(PubSub *ps, std::string_view pattern, bool create) {
+    PatNode *node = &ps->root;
+    for (size_t i = 0; node && i < pattern.size();) {
+        PatToken t;
+        i = pat_token(pattern, i, t);
+        node = node_child(node, t, create);
+    }
+    return node;
+}
+
+PubPattern *ps_pattern_find(PubSub *ps, std::string_view pattern) {
+    PatNode *node = pat_walk(ps, pattern, false);
+    if (node) {
+        for (PubPattern *pat : node->pats) {
+            if (pat->pattern == pattern) {
+                return pat;
+            }
+        }
+    }
+    return NULL;
+}
+
+PubPattern *ps_pattern_add(PubSub *ps, std::string_view pattern) {
+    PatNode *node = pat_walk(ps, pattern, true);
+    for (PubPattern *pat : node->pats) {
+        if (pat->pattern == pattern) {
+            return pat;
+        }
+    }
+    PubPattern *pat = new PubPattern();
+    pat->pattern = pattern;
+    pat->node = node;
+    node->pats.push_back(pat);
+    ps->npatterns++;
+    return pat;
+}
+
+static bool node_leaf(const PatNode *node) {
+    return node->pats.empty() && node->lits.empty() && !node->any && !node->kstar
+        && node->classes.empty();
+}
+
+static void node_unlink(PatNode *parent, PatNode *node) {
+    if (parent->any == node) {
+        parent->any = NULL;
+    } else if (parent->kstar == node) {
+        parent->kstar = NULL;
+    }
+    for (size_t i = 0; i < parent->lits.size(); i++) {
+        if (parent->lits[i].second == node) {
+            parent->lits.erase(parent->lits.begin() + (ptrdiff_t)i);
+            return;
+        }
+    }
+    for (size_t i = 0; i < parent->classes.size(); i++) {
+        if (parent->classes[i].second == node) {
+            parent->classes.erase(parent->classes.begin() + (ptrdiff_t)i);
+            return;
+        }
+    }
+}
+
+void ps_pattern_del(PubSub *ps, PubPattern *pat) {
+    assert(pat->subs.empty());
+    PatNode *node = pat->node;
+    node->pats.erase(std::find(node->pats.begin(), node->pats.end(), pat));
+    delete pat;
+    ps->npatterns--;
+    // the branch that only led here goes too
+    while (node != &ps->root && node_leaf(node)) {
+        PatNode *parent = node->parent;
+        node_unlink(parent, node);
+        delete node;
+        node = parent;
+    }
+}
+
+// puts `node` in the set of step `step`, with the '*'s after it, which
+// also match nothing
+static void set_add(std::vector<PatNode *> &set, PatNode *node, uint64_t step) {
+    while (node && node->mark != step) {
+        node->mark = step;
+        set.push_back(node);
+        node = node->kstar;
+    }
+}
+
+void ps_match(PubSub *ps, std::string_view channel, std::vector<PubPattern *> &out) {
+    if (ps->npatterns == 0) {
+        return;
+    }
+    ps->cur.clear();
+    set_add(ps->cur, &ps->root, ++ps->step);
+    for (char ch : channel) {
+        uint8_t c = (uint8_t)ch;
+        uint64_t step = ++ps->step;
+        ps->next.clear();
+        for (PatNode *node : ps->cur) {
+            if (node->star) {
+                set_add(ps->next, node, step);
+            }
+            auto it = std::lower_bound(node->lits.begin(), node->lits.end(), c,
+                [](const std::pair<uint8_t, PatNode *> &kid, uint8_t b) { return kid.first < b; });
+            if (it != node->lits.end() && it->first == c) {
+                set_add(ps->next, it->second, step);
+            }
+            set_add(ps->next, node->any, step);
+            for (auto &kid : node->classes) {
+                if (class_match(kid.first, c)) {
+                    set_add(ps->next, kid.second, step);
+                }
+            }
+        }
+        ps->cur.swap(ps->next);
+        if (ps->cur.empty()) {
+            return;
+        }
+    }
+    for (PatNode *node : ps->cur) {
+        out.insert(out.end(), node->pats.begin(), node->pats.end());
+    }
+}
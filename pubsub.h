@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+// proj
+#include "hashtable.h"
+
+
+struct Conn;
+
+// a channel with subscribers, in PubSub::channels by name
+struct PubChannel {
+    HNode node;
+    std::string name;
+    std::vector<Conn *> subs;
+};
+
+struct PatNode;
+
+// a pattern with subscribers, at the end of its path in the trie
+struct PubPattern {
+    std::string pattern;
+    PatNode *node = NULL;
+    std::vector<Conn *> subs;
+};
+
+// the pattern trie. a glob pattern, in Redis' syntax (`?`, `*`, `[abc]`,
+// `[^a-z]`, `\` escapes), is a path of tokens from the root: a literal
+// byte, '?', '*' or a whole [class]. patterns that share a prefix share its
+// nodes, so a channel is matched against all of them at once, see
+// ps_match().
+struct PatNode {
+    PatNode *parent = NULL;
+    // reached by a '*', which also takes more bytes
+    bool star = false;
+    std::vector<std::pair<uint8_t, PatNode *>> lits;    // sorted by byte
+    PatNode *any = NULL;
+    PatNode *kstar = NULL;
+    std::vector<std::pair<std::string, PatNode *>> classes;
+    // the patterns that end here: usually one, more if spelled differently,
+    // like "a" and "\a"
+    std::vector<PubPattern *> pats;
+    // ps_match(): in the set of the step with this number
+    uint64_t mark = 0;
+};
+
+// the channels and patterns that one shard's connections subscribe to
+struct PubSub {
+    HMap channels;
+    PatNode root;
+    size_t npatterns = 0;
+    // ps_match()'s scratch
+    uint64_t step = 0;
+    std::vector<PatNode *> cur;
+    std::vector<PatNode *> next;
+};
+
+PubChannel *ps_channel_find(PubSub *ps, std::string_view name);
+// the channel, new if it wasn't there
+PubChannel *ps_channel_add(PubSub *ps, std::string_view name);
+// once it has no subscribers left
+void ps_channel_del(PubSub *ps, PubChannel *ch);
+
+PubPattern *ps_pattern_find(PubSub *ps, std::string_view pattern);
+PubPattern *ps_pattern_add(PubSub *ps, std::string_view pattern);
+// once it has no subscribers left; prunes the trie
+void ps_pattern_del(PubSub *ps, PubPattern *pat);
+
+// appends the patterns that match `channel`, each once. one pass over the
+// channel, carrying the set of trie nodes that its prefix has reached: the
+// cost is in the branches that fit the channel, not in the number of
+// patterns, and a '*' never backtracks.
+void ps_match(PubSub *ps, std::string_view channel, std::vector<PubPattern *> &out);
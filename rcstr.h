@@ -0,0 +1,52 @@
+#pragma once
+
+// stdlib
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+// C++
+#include <atomic>
+#include <new>
+#include <string_view>
+
+
+// an immutable, reference counted string. stored values are RcStrs, so a
+// response can queue a reference to the value instead of copying it, and a
+// SET that replaces the value while it is still being written is harmless.
+// the count is atomic because a reply can cross shards.
+struct RcStr {
+    std::atomic<uint32_t> refs{1};
+    uint32_t len = 0;
+
+    char *data() { return (char *)(this + 1); }
+    std::string_view view() { return std::string_view(data(), len); }
+};
+
+// the bytes follow the header in the same allocation. this one leaves them
+// for the caller to fill in, before anyone else sees the string.
+inline RcStr *rcstr_alloc(size_t len) {
+    void *mem = malloc(sizeof(RcStr) + len);
+    assert(mem);
+    RcStr *str = new (mem) RcStr();
+    str->len = (uint32_t)len;
+    return str;
+}
+
+inline RcStr *rcstr_new(const char *data, size_t len) {
+    RcStr *str = rcstr_alloc(len);
+    memcpy(str->data(), data, len);
+    return str;
+}
+
+inline RcStr *rcstr_ref(RcStr *str) {
+    str->refs.fetch_add(1, std::memory_order_relaxed);
+    return str;
+}
+
+inline void rcstr_unref(RcStr *str) {
+    if (str->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        str->~RcStr();
+        free(str);
+    }
+}
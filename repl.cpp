@@ -0,0 +1,715 @@
+// stdlib
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+// system
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+// C++
+#include <algorithm>
+#include <thread>
+// proj
+#include "aof.h"
+#include "log.h"
+#include "protocol.h"
+#include "repl.h"
+
+
+// ReplReplica::state
+enum {
+    REPLICA_WAIT_SNAP = 0,  // for the child to finish the snapshot
+    REPLICA_SEND_SNAP = 1,  // `out`, then the snapshot file
+    REPLICA_ONLINE = 2,     // the stream, from the backlog
+};
+
+static const char *k_replica_states[] = {"wait_bgsave", "send_bulk", "online"};
+
+// the stream's PINGs, and the keepalives during a snapshot
+const uint64_t k_repl_ping_ms = 1000;
+
+static uint64_t repl_now_ms() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// a write to a replica that went away is an error, not a SIGPIPE
+static void block_sigpipe() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+// a reply frame, like make_response()
+static void append_reply(std::string &out, uint32_t status, std::string_view data) {
+    uint32_t len = 4 + (uint32_t)data.size();
+    out.append((const char *)&len, 4);
+    out.append((const char *)&status, 4);
+    out.append(data);
+}
+
+bool repl_init(Repl *repl, const char *snap_path) {
+    repl->snap_path = snap_path;
+    uint8_t rnd[20] = {};
+    if (getrandom(rnd, sizeof(rnd), 0) != (ssize_t)sizeof(rnd)) {
+        return false;
+    }
+    static const char hex[] = "0123456789abcdef";
+    for (uint8_t b : rnd) {
+        repl->replid.push_back(hex[b >> 4]);
+        repl->replid.push_back(hex[b & 15]);
+    }
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return false;
+    }
+    repl->wake_rfd = fds[0];
+    repl->wake_wfd = fds[1];
+    return true;
+}
+
+static void repl_wake(Repl *repl) {
+    // one wakeup per batch of submits, like aof_wake()
+    if (!repl->wake_pending.exchange(true)) {
+        uint8_t one = 1;
+        if (write(repl->wake_wfd, &one, 1) < 0 && errno != EAGAIN) {
+            LOG_WARN("[errno:%d] replication wakeup write()", errno);
+        }
+    }
+}
+
+void repl_feed(Repl *repl, std::string &&data) {
+    ReplBatch *batch = new ReplBatch();
+    batch->data = std::move(data);
+    repl->queue.push(batch);
+    repl_wake(repl);
+}
+
+// a PSYNC, from a shard to the replication thread
+struct ReplHandoff : MpscNode {
+    int fd = -1;
+    std::string replid;
+    int64_t offset = -1;
+};
+
+void repl_add_replica(Repl *repl, int fd, std::string_view replid, int64_t offset) {
+    ReplHandoff *h = new ReplHandoff();
+    h->fd = fd;
+    h->replid = replid;
+    h->offset = offset;
+    repl->handoffs.push(h);
+    repl_wake(repl);
+}
+
+// the first stream offset still in the backlog
+static uint64_t backlog_first(Repl *repl) {
+    return repl->offset.load(std::memory_order_relaxed) - repl->backlog_len;
+}
+
+static void backlog_append(Repl *repl, const char *data, size_t len) {
+    size_t size = repl->backlog.size();
+    uint64_t end = repl->offset.load(std::memory_order_relaxed) + len;
+    if (len > size) {
+        // only the tail stays
+        data += len - size;
+        len = size;
+    }
+    size_t pos = (size_t)((end - len) % size);
+    size_t n = std::min(len, size - pos);
+    memcpy(&repl->backlog[pos], data, n);
+    memcpy(&repl->backlog[0], data + n, len - n);
+    repl->backlog_len = std::min(size, repl->backlog_len + len);
+    repl->offset.store(end, std::memory_order_relaxed);
+}
+
+// the shards' batches, in the order they came in
+static void repl_take_queued(Repl *repl) {
+    while (MpscNode *node = repl->queue.pop()) {
+        ReplBatch *b = static_cast<ReplBatch *>(node);
+        backlog_append(repl, b->data.data(), b->data.size());
+        delete b;
+    }
+}
+
+static void replica_free(ReplReplica *r) {
+    (void)close(r->fd);
+    if (r->snap_fd >= 0) {
+        (void)close(r->snap_fd);
+    }
+    delete r;
+}
+
+// forks a child that writes the snapshot, at a point where its stream
+// offset is known: the shards are paused with all their batches queued
+static bool snapshot_start(Repl *repl) {
+    int fd = open(repl->snap_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOG_ERROR("[errno:%d] replication: can't create %s", errno, repl->snap_path.c_str());
+        return false;
+    }
+    (void)unlink(repl->snap_path.c_str());
+    if (repl->backlog.empty()) {
+        repl->backlog.resize(repl->backlog_size);
+    }
+
+    repl->pause();
+    // from here on every mutation goes into the stream
+    repl->active.store(true);
+    repl_take_queued(repl);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: the paused shards' memory, copy-on-write
+        _exit(repl->dump(fd) ? 0 : 1);
+    }
+    repl->resume();
+
+    if (pid < 0) {
+        LOG_ERROR("[errno:%d] replication fork()", errno);
+        (void)close(fd);
+        return false;
+    }
+    repl->child = pid;
+    repl->child_fd = fd;
+    repl->child_offset = repl->offset.load(std::memory_order_relaxed);
+    LOG_INFO("replication: snapshot at offset %llu started by pid %d",
+        (unsigned long long)repl->child_offset, (int)pid);
+    return true;
+}
+
+// the waiting replicas get the snapshot, or are dropped if it failed
+static void snapshot_done(Repl *repl, int status) {
+    struct stat st = {};
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && fstat(repl->child_fd, &st) == 0;
+    if (ok) {
+        LOG_INFO("replication: snapshot done, %lld bytes", (long long)st.st_size);
+    } else {
+        LOG_ERROR("replication: snapshot failed");
+    }
+    for (ReplReplica *r : repl->replicas) {
+        if (r->state != REPLICA_WAIT_SNAP) {
+            continue;
+        }
+        // each with its own file offset
+        r->snap_fd = ok ? dup(repl->child_fd) : -1;
+        if (r->snap_fd < 0) {
+            r->state = -1;  // dropped below
+            continue;
+        }
+        uint64_t size = (uint64_t)st.st_size;
+        r->out.append((const char *)&size, 8);
+        r->snap_size = (size_t)st.st_size;
+        r->snap_sent = 0;
+        r->offset = repl->child_offset;
+        r->state = REPLICA_SEND_SNAP;
+    }
+    (void)close(repl->child_fd);
+    repl->child_fd = -1;
+    repl->child = -1;
+}
+
+// PSYNC: continue from the backlog if it still has the replica's offset,
+// otherwise start over with a snapshot
+static void replica_new(Repl *repl, ReplHandoff *h) {
+    ReplReplica *r = new ReplReplica();
+    r->fd = h->fd;
+    // io_uring's accepts leave the socket blocking
+    fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL, 0) | O_NONBLOCK);
+    struct sockaddr_in addr = {};
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(r->fd, (struct sockaddr *)&addr, &addrlen) == 0) {
+        char ip[INET_ADDRSTRLEN] = "?";
+        (void)inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        r->addr = std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+    }
+    r->ack_ms = repl_now_ms();
+
+    uint64_t end = repl->offset.load(std::memory_order_relaxed);
+    bool partial = repl->active.load() && h->replid == repl->replid && h->offset >= 0
+        && (uint64_t)h->offset >= backlog_first(repl) && (uint64_t)h->offset <= end;
+    if (partial) {
+        append_reply(r->out, RES_OK, "CONTINUE " + repl->replid);
+        r->offset = (uint64_t)h->offset;
+        r->ack_offset = r->offset;
+        r->state = REPLICA_ONLINE;
+        LOG_INFO("replica %s: partial resync from offset %llu, %llu bytes behind",
+            r->addr.c_str(), (unsigned long long)r->offset,
+            (unsigned long long)(end - r->offset));
+    } else {
+        // one snapshot serves every replica that comes while it's taken:
+        // the stream after its offset is in the backlog
+        if (repl->child < 0 && !snapshot_start(repl)) {
+            replica_free(r);
+            return;
+        }
+        append_reply(r->out, RES_OK, "FULLRESYNC " + repl->replid + " "
+            + std::to_string(repl->child_offset));
+        r->state = REPLICA_WAIT_SNAP;
+        LOG_INFO("replica %s: full resync", r->addr.c_str());
+    }
+    repl->replicas.push_back(r);
+}
+
+static bool replica_has_output(Repl *repl, const ReplReplica *r) {
+    return !r->out.empty() || r->state == REPLICA_SEND_SNAP
+        || (r->state == REPLICA_ONLINE && r->offset < repl->offset.load(std::memory_order_relaxed));
+}
+
+// writes what the replica takes without blocking. false if it has to go.
+static bool replica_flush(Repl *repl, ReplReplica *r) {
+    while (!r->out.empty()) {
+        ssize_t rv = send(r->fd, r->out.data(), r->out.size(), MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+        r->out.erase(0, (size_t)rv);
+    }
+    if (r->state == REPLICA_WAIT_SNAP) {
+        return true;
+    }
+    if (r->state == REPLICA_SEND_SNAP) {
+        while ((size_t)r->snap_sent < r->snap_size) {
+            ssize_t rv = sendfile(r->fd, r->snap_fd, &r->snap_sent,
+                r->snap_size - (size_t)r->snap_sent);
+            if (rv < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN;
+            }
+            if (rv == 0) {
+                return false;
+            }
+        }
+        (void)close(r->snap_fd);
+        r->snap_fd = -1;
+        r->state = REPLICA_ONLINE;
+        r->ack_offset = r->offset;
+        r->ack_ms = repl_now_ms();
+        LOG_INFO("replica %s: snapshot sent, streaming from offset %llu", r->addr.c_str(),
+            (unsigned long long)r->offset);
+    }
+
+    uint64_t end = repl->offset.load(std::memory_order_relaxed);
+    if (r->offset < backlog_first(repl)) {
+        LOG_WARN("replica %s: fell out of the backlog", r->addr.c_str());
+        return false;
+    }
+    size_t size = repl->backlog.size();
+    while (r->offset < end) {
+        // the ring wraps at most once in what's left to send
+        size_t pos = (size_t)(r->offset % size);
+        size_t left = (size_t)(end - r->offset);
+        struct iovec iov[2];
+        iov[0] = {&repl->backlog[pos], std::min(left, size - pos)};
+        iov[1] = {&repl->backlog[0], left - iov[0].iov_len};
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+        ssize_t rv = sendmsg(r->fd, &msg, MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+        r->offset += (uint64_t)rv;
+    }
+    return true;
+}
+
+// REPLCONF ACK <offset>, the only thing a replica sends. false once the
+// connection is closed or broken.
+static bool replica_read(ReplReplica *r) {
+    while (true) {
+        char buf[4096];
+        ssize_t rv = read(r->fd, buf, sizeof(buf));
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return false;
+            }
+            break;
+        }
+        if (rv == 0) {
+            LOG_INFO("replica %s: closed", r->addr.c_str());
+            return false;
+        }
+        r->in.append(buf, (size_t)rv);
+    }
+    size_t pos = 0;
+    std::vector<std::string_view> cmd;
+    while (r->in.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, r->in.data() + pos, 4);
+        if (len > k_max_msg) {
+            return false;
+        }
+        if (r->in.size() - pos - 4 < len) {
+            break;
+        }
+        if (parse_req((const uint8_t *)r->in.data() + pos + 4, len, cmd) < 0) {
+            return false;
+        }
+        if (cmd.size() == 3 && cmd[0] == "replconf" && cmd[1] == "ack") {
+            r->ack_offset = strtoull(std::string(cmd[2]).c_str(), NULL, 10);
+            r->ack_ms = repl_now_ms();
+        }
+        pos += 4 + len;
+    }
+    r->in.erase(0, pos);
+    return true;
+}
+
+// what INFO shows, copied out for the shards
+static void repl_publish(Repl *repl) {
+    std::lock_guard<std::mutex> lock(repl->mu);
+    repl->stats.resize(repl->replicas.size());
+    for (size_t i = 0; i < repl->replicas.size(); i++) {
+        const ReplReplica *r = repl->replicas[i];
+        ReplReplicaStat &st = repl->stats[i];
+        st.addr = r->addr;
+        st.state = k_replica_states[r->state];
+        st.offset = r->offset;
+        st.ack_offset = r->ack_offset;
+        st.ack_ms = r->ack_ms;
+    }
+    repl->backlog_first = backlog_first(repl);
+}
+
+static void repl_main(Repl *repl) {
+    block_sigpipe();
+    std::vector<struct pollfd> pfds;
+    while (true) {
+        pfds.assign(1, {repl->wake_rfd, POLLIN, 0});
+        for (ReplReplica *r : repl->replicas) {
+            short events = POLLIN | (replica_has_output(repl, r) ? POLLOUT : 0);
+            pfds.push_back({r->fd, events, 0});
+        }
+        int timeout = -1;
+        if (!repl->replicas.empty()) {
+            uint64_t since = repl_now_ms() - repl->last_ping_ms;
+            timeout = since >= k_repl_ping_ms ? 0 : (int)(k_repl_ping_ms - since);
+        }
+        if (repl->child > 0 && (timeout < 0 || timeout > 100)) {
+            timeout = 100;  // check on the child
+        }
+        (void)poll(pfds.data(), pfds.size(), timeout);
+
+        // reset the wakeup before draining, so a submit racing with us re-arms it
+        uint8_t buf[256];
+        while (read(repl->wake_rfd, buf, sizeof(buf)) > 0) {
+        }
+        repl->wake_pending.store(false);
+
+        // the stream so far, before any new replica is placed in it
+        repl_take_queued(repl);
+        size_t npolled = repl->replicas.size();
+        while (MpscNode *node = repl->handoffs.pop()) {
+            ReplHandoff *h = static_cast<ReplHandoff *>(node);
+            replica_new(repl, h);
+            delete h;
+        }
+        uint64_t now = repl_now_ms();
+        if (now - repl->last_ping_ms >= k_repl_ping_ms) {
+            repl->last_ping_ms = now;
+            bool any_online = false;
+            for (ReplReplica *r : repl->replicas) {
+                if (r->state == REPLICA_WAIT_SNAP) {
+                    uint64_t zero = 0;
+                    r->out.append((const char *)&zero, 8);
+                }
+                any_online |= r->state != REPLICA_WAIT_SNAP;
+            }
+            // so that a replica can tell a quiet primary from a dead one
+            if (any_online) {
+                std::string ping;
+                append_req(ping, {"ping"});
+                backlog_append(repl, ping.data(), ping.size());
+            }
+        }
+        if (repl->child > 0) {
+            int status = 0;
+            if (waitpid(repl->child, &status, WNOHANG) == repl->child) {
+                snapshot_done(repl, status);
+            }
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < repl->replicas.size(); i++) {
+            ReplReplica *r = repl->replicas[i];
+            bool ok = r->state >= 0;
+            if (ok && i < npolled && pfds[i + 1].revents) {
+                ok = replica_read(r);
+            }
+            ok = ok && replica_flush(repl, r);
+            if (ok && r->state == REPLICA_ONLINE && repl->timeout_ms
+                && now - std::min(now, r->ack_ms) > repl->timeout_ms)
+            {
+                LOG_WARN("replica %s: no ack for %llu ms", r->addr.c_str(),
+                    (unsigned long long)(now - r->ack_ms));
+                ok = false;
+            }
+            if (!ok) {
+                LOG_INFO("replica %s: dropped", r->addr.c_str());
+                replica_free(r);
+                continue;
+            }
+            repl->replicas[kept++] = r;
+        }
+        repl->replicas.resize(kept);
+        repl_publish(repl);
+    }
+}
+
+void repl_start(Repl *repl) {
+    std::thread(repl_main, repl).detach();
+}
+
+void repl_info(Repl *repl, std::string &out) {
+    std::lock_guard<std::mutex> lock(repl->mu);
+    uint64_t end = repl->offset.load(std::memory_order_relaxed);
+    uint64_t now = repl_now_ms();
+    char buf[512];
+    snprintf(buf, sizeof(buf), "connected_slaves:%zu\n", repl->stats.size());
+    out += buf;
+    for (size_t i = 0; i < repl->stats.size(); i++) {
+        const ReplReplicaStat &st = repl->stats[i];
+        snprintf(buf, sizeof(buf),
+            "slave%zu:addr=%s,state=%s,offset=%llu,lag_bytes=%llu,last_ack_ms=%llu\n",
+            i, st.addr.c_str(), st.state, (unsigned long long)st.ack_offset,
+            (unsigned long long)(end - std::min(end, st.ack_offset)),
+            (unsigned long long)(now - std::min(now, st.ack_ms)));
+        out += buf;
+    }
+    snprintf(buf, sizeof(buf), "master_replid:%s\nmaster_repl_offset:%llu\n"
+        "repl_backlog_active:%d\nrepl_backlog_size:%zu\n"
+        "repl_backlog_first_byte_offset:%llu\nrepl_backlog_histlen:%llu\n",
+        repl->replid.c_str(), (unsigned long long)end, repl->active.load() ? 1 : 0,
+        repl->backlog_size, (unsigned long long)repl->backlog_first,
+        (unsigned long long)(end - std::min(end, repl->backlog_first)));
+    out += buf;
+}
+
+void repl_lag(Repl *repl, uint64_t &replicas, uint64_t &max_lag_bytes) {
+    std::lock_guard<std::mutex> lock(repl->mu);
+    uint64_t end = repl->offset.load(std::memory_order_relaxed);
+    replicas = repl->stats.size();
+    max_lag_bytes = 0;
+    for (const ReplReplicaStat &st : repl->stats) {
+        max_lag_bytes = std::max(max_lag_bytes, end - std::min(end, st.ack_offset));
+    }
+}
+
+// the replica side
+
+static bool read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t rv = read(fd, p, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        p += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+// a blocking connection, whose reads and writes time out after the link's
+// timeout
+static int link_connect(ReplLink *link) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    std::string port = std::to_string(link->port);
+    if (getaddrinfo(link->host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+        LOG_WARN("replication: can't resolve %s", link->host.c_str());
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        LOG_RATELIMITED(LL_WARN, 1, "[errno:%d] replication: can't connect to %s:%u", errno,
+            link->host.c_str(), link->port);
+        freeaddrinfo(res);
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+        return -1;
+    }
+    freeaddrinfo(res);
+    struct timeval tv = {};
+    tv.tv_sec = (time_t)(link->timeout_ms / 1000);
+    tv.tv_usec = (suseconds_t)(link->timeout_ms % 1000 * 1000);
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int val = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    return fd;
+}
+
+// receives the snapshot into `snap_path`: keepalives, its size, its bytes
+static bool link_download(ReplLink *link, int fd) {
+    uint64_t size = 0;
+    while (size == 0) {
+        if (!read_all(fd, &size, 8)) {
+            return false;
+        }
+    }
+    int out = open(link->snap_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        LOG_ERROR("[errno:%d] replication: can't create %s", errno, link->snap_path.c_str());
+        return false;
+    }
+    std::vector<char> buf(1 << 20);
+    uint64_t left = size;
+    while (left > 0) {
+        size_t n = (size_t)std::min<uint64_t>(left, buf.size());
+        if (!read_all(fd, buf.data(), n) || !aof_write_all(out, buf.data(), n)) {
+            (void)close(out);
+            return false;
+        }
+        left -= n;
+    }
+    (void)close(out);
+    LOG_INFO("replication: received a %llu byte snapshot", (unsigned long long)size);
+    return true;
+}
+
+// PSYNC with what we have, and whatever the primary makes of it
+static bool link_handshake(ReplLink *link, int fd) {
+    std::string replid, offset;
+    {
+        std::lock_guard<std::mutex> lock(link->mu);
+        replid = link->replid.empty() ? "?" : link->replid;
+    }
+    offset = replid == "?" ? "-1" : std::to_string(link->offset.load());
+    std::string req;
+    append_req(req, {"psync", replid, offset});
+    if (!aof_write_all(fd, req.data(), req.size())) {
+        return false;
+    }
+
+    uint32_t len = 0;
+    if (!read_all(fd, &len, 4) || len < 4 || len > 4096) {
+        return false;
+    }
+    std::string body(len, '\0');
+    if (!read_all(fd, &body[0], len)) {
+        return false;
+    }
+    uint32_t status = 0;
+    memcpy(&status, body.data(), 4);
+    std::string text = body.substr(4);
+    if (status != RES_OK) {
+        LOG_WARN("replication: the primary refused PSYNC: %s", text.c_str());
+        return false;
+    }
+    if (text.rfind("CONTINUE ", 0) == 0) {
+        link->full = false;
+        link->syncs_partial++;
+        LOG_INFO("replication: partial resync from offset %llu",
+            (unsigned long long)link->offset.load());
+        return true;
+    }
+    char id[64] = {};
+    unsigned long long start = 0;
+    if (sscanf(text.c_str(), "FULLRESYNC %63s %llu", id, &start) != 2) {
+        LOG_WARN("replication: unexpected PSYNC reply: %s", text.c_str());
+        return false;
+    }
+    link->state.store(LINK_SYNC);
+    if (!link_download(link, fd)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(link->mu);
+        link->replid = id;
+    }
+    link->offset.store(start);
+    link->full = true;
+    link->syncs_full++;
+    return true;
+}
+
+static void link_main(ReplLink *link) {
+    block_sigpipe();
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(link->mu);
+            link->cv.wait(lock, [link] { return link->state.load() == LINK_CONNECT; });
+        }
+        int fd = link_connect(link);
+        if (fd >= 0 && link_handshake(link, fd)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            link->fd = fd;
+            link->state.store(LINK_READY);
+            link->on_ready();
+            continue;
+        }
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+        link->state.store(LINK_CONNECT);
+        struct timespec ts = {1, 0};
+        nanosleep(&ts, NULL);
+    }
+}
+
+void repl_link_start(ReplLink *link) {
+    LOG_INFO("replication: replica of %s:%u", link->host.c_str(), link->port);
+    std::thread(link_main, link).detach();
+}
+
+void repl_link_lost(ReplLink *link, bool resync) {
+    std::lock_guard<std::mutex> lock(link->mu);
+    if (resync) {
+        link->replid.clear();
+    }
+    LOG_WARN("replication: lost the primary at offset %llu",
+        (unsigned long long)link->offset.load());
+    link->state.store(LINK_CONNECT);
+    link->cv.notify_one();
+}
+
+void repl_link_info(ReplLink *link, std::string &out) {
+    std::string replid;
+    {
+        std::lock_guard<std::mutex> lock(link->mu);
+        replid = link->replid;
+    }
+    int state = link->state.load();
+    char buf[512];
+    snprintf(buf, sizeof(buf), "master_host:%s\nmaster_port:%u\nmaster_link_status:%s\n"
+        "master_sync_in_progress:%d\nmaster_replid:%s\nslave_repl_offset:%llu\n"
+        "full_syncs:%llu\npartial_syncs:%llu\n",
+        link->host.c_str(), link->port, state == LINK_UP ? "up" : "down",
+        state == LINK_SYNC ? 1 : 0, replid.empty() ? "?" : replid.c_str(),
+        (unsigned long long)link->offset.load(), (unsigned long long)link->syncs_full.load(),
+        (unsigned long long)link->syncs_partial.load());
+    out += buf;
+}
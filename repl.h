@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+// C++
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+// proj
+#include "mpsc_queue.h"
+
+
+// replication. the stream a primary sends its replicas is the same as the
+// AOF's: every mutation, in the request wire format, in the order the
+// shards batched them. its bytes are numbered from the start of the
+// replication id (`replid`); a replica that knows the id and the offset it
+// got to can continue from there, as long as the primary's backlog still
+// has that part of the stream. otherwise it gets a full resync: a snapshot
+// taken at some offset, then the stream from that offset on.
+//
+// the handshake, on a connection to the primary's client port:
+//   replica: the request PSYNC <replid> <offset>, or PSYNC ? -1
+//   primary: a reply "CONTINUE <replid>", then the stream; or a reply
+//            "FULLRESYNC <replid> <offset>", then u64 0s as keepalives
+//            while the snapshot is being taken, its u64 size, its bytes,
+//            and the stream
+// the replica then sends REPLCONF ACK <offset> requests now and then, and
+// the primary puts a PING into the stream every second when it's quiet.
+
+// the mutations of one event loop iteration of one shard
+struct ReplBatch : MpscNode {
+    std::string data;
+};
+
+// a replica, as the primary sees it
+struct ReplReplica {
+    int fd = -1;
+    int state = 0;
+    std::string addr;           // ip:port
+    uint64_t offset = 0;        // the next stream byte to send
+    // a full resync: what goes out before the snapshot, and the snapshot
+    std::string out;
+    int snap_fd = -1;
+    off_t snap_sent = 0;
+    size_t snap_size = 0;
+    // what the replica said it has applied, and when (monotonic ms)
+    std::string in;
+    uint64_t ack_offset = 0;
+    uint64_t ack_ms = 0;
+};
+
+// what INFO shows of a replica
+struct ReplReplicaStat {
+    std::string addr;
+    const char *state = "";
+    uint64_t offset = 0;
+    uint64_t ack_offset = 0;
+    uint64_t ack_ms = 0;
+};
+
+// the primary side. all its io happens on one background thread, which
+// keeps the backlog, forks for the snapshots and writes to the replicas.
+struct Repl {
+    std::string replid;     // 40 hex chars, new on every start
+    size_t backlog_size = 16 << 20;
+    // drop a replica that hasn't acked for this long, 0 = never
+    uint64_t timeout_ms = 60 * 1000;
+    // where the snapshots for full resyncs are written; the file is
+    // unlinked as soon as it's open
+    std::string snap_path;
+
+    // callbacks into the server, called on the replication thread. like
+    // Aof's: the shards stop after they queued their last batch.
+    void (*pause)() = NULL;
+    void (*resume)() = NULL;
+    // in the forked child: write the snapshot to `fd`
+    bool (*dump)(int fd) = NULL;
+
+    // set once the first replica asks for a sync; from then on the shards
+    // feed their batches, see repl_feed()
+    std::atomic<bool> active{false};
+    // the end of the stream so far
+    std::atomic<uint64_t> offset{0};
+
+    // internal
+    MpscQueue queue;
+    // sockets handed over by the shards, see repl_add_replica()
+    MpscQueue handoffs;
+    int wake_rfd = -1;
+    int wake_wfd = -1;
+    std::atomic<bool> wake_pending{false};
+    // the last `backlog_len` bytes of the stream, at offset % backlog_size
+    std::vector<char> backlog;
+    size_t backlog_len = 0;
+    pid_t child = -1;
+    int child_fd = -1;          // the snapshot the child is writing
+    uint64_t child_offset = 0;  // the stream offset it was taken at
+    uint64_t last_ping_ms = 0;
+    std::vector<ReplReplica *> replicas;
+    // published after every round, for INFO on the shards
+    std::mutex mu;
+    std::vector<ReplReplicaStat> stats;
+    uint64_t backlog_first = 0;
+};
+
+// false with errno set on failure
+bool repl_init(Repl *repl, const char *snap_path);
+// starts the replication thread
+void repl_start(Repl *repl);
+// a shard's batch; only while `active`
+void repl_feed(Repl *repl, std::string &&data);
+// a connection that sent PSYNC, now the replication thread's
+void repl_add_replica(Repl *repl, int fd, std::string_view replid, int64_t offset);
+// the lines of INFO replication for a primary
+void repl_info(Repl *repl, std::string &out);
+// the replicas connected, and how many bytes behind the furthest one is
+void repl_lag(Repl *repl, uint64_t &replicas, uint64_t &max_lag_bytes);
+
+// ReplLink::state
+enum {
+    LINK_CONNECT = 0,   // the link thread is (re)connecting
+    LINK_SYNC = 1,      // receiving a snapshot
+    LINK_READY = 2,     // synced, for the server to take over
+    LINK_UP = 3,        // the server is applying the stream
+};
+
+// the replica side: a thread connects to the primary, does the handshake
+// and downloads the snapshot, then gives the socket to the server, which
+// applies the stream like requests from a client. when the server loses
+// the connection it calls repl_link_lost() and the thread reconnects,
+// continuing from `offset` if it can.
+struct ReplLink {
+    std::string host;
+    uint16_t port = 0;
+    // where a full resync's snapshot is received
+    std::string snap_path;
+    // no byte from the primary for this long closes the link
+    uint64_t timeout_ms = 60 * 1000;
+
+    // called on the link thread once the state is LINK_READY
+    void (*on_ready)() = NULL;
+
+    std::atomic<int> state{LINK_CONNECT};
+    // LINK_READY: the socket, and whether `snap_path` has a snapshot to load
+    // first, which replaces the whole dataset
+    int fd = -1;
+    bool full = false;
+    // the primary's replication id (under `mu`), and the stream offset
+    // applied so far, which only the link thread moves while the link is
+    // down and only the server while it's up
+    std::string replid;
+    std::atomic<uint64_t> offset{0};
+    std::atomic<uint64_t> syncs_full{0};
+    std::atomic<uint64_t> syncs_partial{0};
+
+    // internal
+    std::mutex mu;
+    std::condition_variable cv;
+};
+
+void repl_link_start(ReplLink *link);
+// the server's connection to the primary is gone. `resync`: what it got
+// is no good, the next sync has to be a full one.
+void repl_link_lost(ReplLink *link, bool resync);
+// the lines of INFO replication for a replica
+void repl_link_info(ReplLink *link, std::string &out);
@@ -1,331 +1,3703 @@
 // stdlib
 #include <assert.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
 // system
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/ip.h>
+#include <linux/errqueue.h>
 // C++
 #include <vector>
 #include <string>
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+// proj
+#include "aof.h"
+#include "buffer.h"
+#include "command.h"
+#include "common.h"
+#include "event_loop.h"
+#include "hashtable.h"
+#include "log.h"
+#include "mpsc_queue.h"
+#include "outqueue.h"
+#include "protocol.h"
+#include "rcstr.h"
+#include "repl.h"
+#include "server.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "uring.h"
+#include "zset.h"
+
+
+// values at least this big are sent with MSG_ZEROCOPY, 0 = never
+static size_t g_zerocopy_min = 0;
+// --event-loop uring: the shards run shard_run_uring() instead
+static bool g_uring = false;
 
-const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
-const size_t k_max_args = 200 * 1000;
-
-// Response::status
 enum {
-    RES_OK = 0,
-    RES_ERR = 1,    // error
-    RES_NX = 2,     // key not found
+    EVICT_NOEVICTION = 0,   // refuse writes over the limit
+    EVICT_ALLKEYS_LRU = 1,
+    EVICT_ALLKEYS_LFU = 2,
+    EVICT_VOLATILE_TTL = 3, // keys with the nearest expiry first
 };
 
-struct Conn {
-    int fd = -1;
+static const char *k_evict_policies[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl",
+};
+
+// memory limit over all shards, 0 = none. each shard keeps its slice of
+// the keyspace under maxmemory / number of shards.
+static size_t g_maxmemory = 0;
+static int g_evict_policy = EVICT_NOEVICTION;
+static size_t g_evict_samples = 5;
+// --activedefrag: compact the slab pages that deletes left sparse
+static bool g_activedefrag = false;
+
+// NULL when the AOF is off
+static Aof *g_aof = NULL;
+// SAVE/BGSAVE
+static Snapshot *g_snap = NULL;
+// replaying the AOF, which mustn't be appended to itself
+static bool g_loading = false;
+// replication: every server can be a primary, a replica also has a link
+// to its own (and refuses writes from anyone else)
+static Repl *g_repl = NULL;
+static ReplLink *g_link = NULL;
+// a replica's connection to its primary, on shard 0: its last ack, and
+// when the stream last moved
+static Conn *g_master = NULL;
+static uint64_t g_master_acked = 0;
+static uint64_t g_master_acked_ms = 0;
+static uint64_t g_master_moved_ms = 0;
+static uint16_t g_port = 1234;
+
+// connection timeouts, 0 = none
+static uint64_t g_idle_timeout_ms = 300 * 1000;     // no request in progress
+static uint64_t g_read_timeout_ms = 30 * 1000;      // to finish a request
+static uint64_t g_write_timeout_ms = 30 * 1000;     // without write progress
+
+// a connection's turn serves this many requests, or runs this long, before
+// the other ready connections get theirs. 0 = no limit.
+static uint32_t g_turn_reqs = 128;
+static uint64_t g_turn_us = 500;
+// output buffer limits, 0 = none. over the soft one a connection is neither
+// read from nor served until its output drains; a reply can still take it
+// past that, and over the hard one it is closed. a client that sends all of
+// a pipeline before reading any of it stalls at the soft limit, hence the
+// high default.
+static size_t g_output_soft = 64 << 20;
+static size_t g_output_hard = 0;
+// a subscriber whose output a message would take past this is dropped,
+// 0 = no limit
+static size_t g_pubsub_limit = 32 << 20;
+
+
+std::vector<Shard *> g_shards;
+
+static Shard *key_owner(uint64_t hcode) {
+    // the high bits, the low ones are the table's fingerprint
+    return g_shards[((hcode >> 32) * g_shards.size()) >> 32];
+}
+
+// the shard that owns the key of `cmd`; keyless and unknown commands run
+// locally
+static Shard *cmd_owner(Shard *local, const std::vector<std::string_view> &cmd) {
+    if (g_shards.size() == 1 || cmd.size() < 2) {
+        return local;
+    }
+    const Command *c = cmd_lookup(cmd[0]);
+    if (!c || (c->flags & CMD_NOKEY)) {
+        return local;
+    }
+    std::string_view key = cmd[1];
+    return key_owner(str_hash((const uint8_t *)key.data(), key.size()));
+}
+
+// a multi-key command cut down to the keys one shard owns
+struct MultiPart {
+    Shard *shard = NULL;
+    std::vector<std::string_view> cmd;
+};
+
+// splits a multi-key command by the shards that own its keys, keeping the
+// keys' order within each part. `key_part` gets the part of every key.
+static void multi_split(const Command *c, const std::vector<std::string_view> &cmd,
+    std::vector<MultiPart> &parts, std::vector<uint32_t> &key_part)
+{
+    for (size_t i = 1; i < cmd.size(); i += c->key_step) {
+        std::string_view key = cmd[i];
+        Shard *owner = key_owner(str_hash((const uint8_t *)key.data(), key.size()));
+        size_t p = 0;
+        while (p < parts.size() && parts[p].shard != owner) {
+            p++;
+        }
+        if (p == parts.size()) {
+            parts.emplace_back();
+            parts[p].shard = owner;
+            parts[p].cmd.push_back(cmd[0]);
+        }
+        parts[p].cmd.insert(parts[p].cmd.end(), cmd.begin() + i, cmd.begin() + i + c->key_step);
+        key_part.push_back((uint32_t)p);
+    }
+}
+
+// the command's parts if its keys span shards; false if one shard can run
+// all of it
+static bool multi_needs_split(const std::vector<std::string_view> &cmd,
+    std::vector<MultiPart> &parts, std::vector<uint32_t> &key_part)
+{
+    if (g_shards.size() == 1 || cmd.empty()) {
+        return false;
+    }
+    const Command *c = cmd_lookup(cmd[0]);
+    // malformed ones run whole, for the handler to reject
+    if (!c || !c->key_step || !cmd_arity_ok(c, cmd.size())
+        || (cmd.size() - 1) % c->key_step != 0)
+    {
+        return false;
+    }
+    multi_split(c, cmd, parts, key_part);
+    return parts.size() > 1;
+}
+
+// PUBLISH goes to every shard with subscribers, besides ours for the
+// reply; false if ours is the only one
+static bool publish_split(Shard *local, const std::vector<std::string_view> &cmd,
+    std::vector<MultiPart> &parts)
+{
+    if (g_shards.size() == 1 || cmd.size() != 3 || !str_eq_nocase(cmd[0], "publish")) {
+        return false;
+    }
+    for (Shard *shard : g_shards) {
+        if (shard == local || shard->stats.pubsub_channels.get()
+            || shard->stats.pubsub_patterns.get())
+        {
+            parts.emplace_back();
+            parts.back().shard = shard;
+            parts.back().cmd = cmd;
+        }
+    }
+    return parts.size() > 1;
+}
 
-    // application's intention, for the event loop
-    bool want_read = false;
-    bool want_write = false;
-    // tells event loop to destroy connection
-    bool want_close = false;
 
-    // buffered io
-    std::vector<uint8_t> incoming;  // input from read
-    std::vector<uint8_t> outgoing;  // output to write
+// a key to look up, without copying it out of the request
+struct LookupKey {
+    struct HNode node;
+    std::string_view key;
 };
 
-struct Response {
-    uint32_t status = 0;
-    std::vector<uint8_t> data;
+// the parts of an entry after its header, see Entry
+const size_t k_ttl_size = 12;
+
+static size_t entry_key_off(const Entry *ent) {
+    return sizeof(Entry) + (ent->has_ttl ? k_ttl_size : 0) + (ent->klen == k_klen_long ? 4 : 0);
+}
+
+static std::string_view entry_key(const Entry *ent) {
+    const char *key = (const char *)ent + entry_key_off(ent);
+    uint32_t len = ent->klen;
+    if (len == k_klen_long) {
+        memcpy(&len, key - 4, 4);
+    }
+    return std::string_view(key, len);
+}
+
+// the value's bytes: inline, an int64 or a pointer
+static char *entry_val(const Entry *ent) {
+    std::string_view key = entry_key(ent);
+    return (char *)key.data() + key.size();
+}
+
+static size_t entry_size_for(size_t klen, bool ttl, uint8_t enc, size_t vlen) {
+    return sizeof(Entry) + (ttl ? k_ttl_size : 0) + (klen >= k_klen_long ? 4 : 0) + klen
+        + (enc == ENC_INLINE ? vlen : 8);
+}
+
+static size_t entry_size(const Entry *ent) {
+    return entry_size_for(entry_key(ent).size(), ent->has_ttl, ent->enc, ent->vlen);
+}
+
+// in ms of the monotonic clock, 0 = no TTL
+static uint64_t entry_expire_at(const Entry *ent) {
+    uint64_t at = 0;
+    if (ent->has_ttl) {
+        memcpy(&at, (const char *)ent + sizeof(Entry), 8);
+    }
+    return at;
+}
+
+// the entry's slot in Shard::expires while it has a TTL
+static uint32_t entry_expire_idx(const Entry *ent) {
+    uint32_t idx = 0;
+    memcpy(&idx, (const char *)ent + sizeof(Entry) + 8, 4);
+    return idx;
+}
+
+static void entry_put_ttl(Entry *ent, uint64_t at, uint32_t idx) {
+    memcpy((char *)ent + sizeof(Entry), &at, 8);
+    memcpy((char *)ent + sizeof(Entry) + 8, &idx, 4);
+}
+
+static void *entry_ptr(const Entry *ent) {
+    void *ptr = NULL;
+    memcpy(&ptr, entry_val(ent), sizeof(ptr));
+    return ptr;
+}
+
+static RcStr *entry_rc(const Entry *ent) {
+    return (RcStr *)entry_ptr(ent);
+}
+
+static ZSet *entry_zset(const Entry *ent) {
+    return (ZSet *)entry_ptr(ent);
+}
+
+// enough for any int64
+const size_t k_int_buf = 24;
+
+// a string entry's value. integers are formatted into `buf`, otherwise it
+// views the entry or its RcStr.
+static std::string_view entry_str(const Entry *ent, char *buf) {
+    switch (ent->enc) {
+    case ENC_INLINE:
+        return std::string_view(entry_val(ent), ent->vlen);
+    case ENC_INT: {
+        int64_t v = 0;
+        memcpy(&v, entry_val(ent), 8);
+        int n = snprintf(buf, k_int_buf, "%lld", (long long)v);
+        return std::string_view(buf, (size_t)n);
+    }
+    default:
+        return entry_rc(ent)->view();
+    }
+}
+
+// a new entry for `key` from the shard's arena, with `vlen` bytes of value
+// if it's ENC_INLINE; the caller stores the value and inserts it
+static Entry *entry_new(Shard *shard, std::string_view key, uint64_t hcode, bool ttl,
+    uint8_t type, uint8_t enc, size_t vlen)
+{
+    Entry *ent = (Entry *)slab_alloc(&shard->slab, entry_size_for(key.size(), ttl, enc, vlen));
+    ent->node.hcode = hcode;
+    ent->access = 0;
+    ent->type = type;
+    ent->enc = enc;
+    ent->has_ttl = ttl;
+    ent->vlen = enc == ENC_INLINE ? (uint16_t)vlen : 0;
+    if (ttl) {
+        entry_put_ttl(ent, 0, 0);
+    }
+    char *p = (char *)ent + sizeof(Entry) + (ttl ? k_ttl_size : 0);
+    if (key.size() >= k_klen_long) {
+        ent->klen = k_klen_long;
+        uint32_t len = (uint32_t)key.size();
+        memcpy(p, &len, 4);
+        p += 4;
+    } else {
+        ent->klen = (uint8_t)key.size();
+    }
+    memcpy(p, key.data(), key.size());
+    return ent;
+}
+
+static void entry_put_ptr(Entry *ent, void *ptr) {
+    memcpy(entry_val(ent), &ptr, sizeof(ptr));
+}
+
+// `key` is always a LookupKey
+static bool entry_eq(HNode *node, HNode *key) {
+    struct Entry *ent = container_of(node, struct Entry, node);
+    struct LookupKey *lk = container_of(key, struct LookupKey, node);
+    return entry_key(ent) == lk->key;
+}
+
+static void lookup_key_init(LookupKey &lk, std::string_view key) {
+    lk.key = key;
+    lk.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+}
+
+static uint64_t get_monotonic_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static uint64_t get_monotonic_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+// whether mutations are wanted, by the AOF or by replicas
+static bool feed_wanted() {
+    return g_aof || (g_repl && g_repl->active.load(std::memory_order_relaxed));
+}
+
+// queues a mutation for the AOF and the replicas, with the batch of this
+// loop iteration
+static void aof_feed(Shard *shard, const std::vector<std::string_view> &cmd) {
+    if (!feed_wanted() || g_loading) {
+        return;
+    }
+    if (!shard->aof_batch) {
+        shard->aof_batch = new AofBatch();
+    }
+    append_req(shard->aof_batch->data, cmd);
+}
+
+// TTLs go in as absolute wall clock times, so they survive a restart
+static void aof_feed_expire(Shard *shard, std::string_view key, uint64_t unix_ms) {
+    std::string at = std::to_string(unix_ms);
+    aof_feed(shard, {"pexpireat", key, at});
+}
+
+static uint64_t shard_rand(Shard *shard) {
+    // xorshift64
+    shard->rng ^= shard->rng << 13;
+    shard->rng ^= shard->rng >> 7;
+    shard->rng ^= shard->rng << 17;
+    return shard->rng;
+}
+
+// what an entry costs, as far as the allocators are concerned
+static size_t entry_mem(const Entry *ent) {
+    size_t n = slab_usable(entry_size(ent));
+    if (ent->type == ENT_ZSET) {
+        n += sizeof(ZSet) + zset_mem_usage(entry_zset(ent));
+    } else if (ent->enc == ENC_PTR) {
+        n += sizeof(RcStr) + entry_rc(ent)->len;
+    }
+    return n;
+}
+
+static size_t shard_used_memory(Shard *shard) {
+    return shard->mem_entries + shard->mem_conns + hm_mem_usage(&shard->db)
+        + shard->expires.capacity() * sizeof(Entry *);
+}
+
+// LFU like redis: an 8-bit logarithmic counter, incremented on access with
+// probability 1 / ((counter - 5) * 10 + 1) and decremented once per minute
+// without access, so it takes ~1M hits to saturate
+const uint32_t k_lfu_init = 5;
+const uint32_t k_lfu_log_factor = 10;
+
+static uint32_t lfu_minutes(Shard *shard) {
+    return (uint32_t)(shard->now_ms / 60000) & 0xffffff;
+}
+
+// the counter after decaying for the minutes since the last access
+static uint32_t lfu_counter(Shard *shard, const Entry *ent) {
+    uint32_t counter = ent->access & 0xff;
+    uint32_t idle = (lfu_minutes(shard) - (ent->access >> 8)) & 0xffffff;
+    return idle >= counter ? 0 : counter - idle;
+}
+
+static void entry_touch(Shard *shard, Entry *ent) {
+    if (g_evict_policy == EVICT_ALLKEYS_LFU) {
+        uint32_t counter = lfu_counter(shard, ent);
+        uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+        uint64_t r = shard_rand(shard) % ((uint64_t)base * k_lfu_log_factor + 1);
+        if (counter < 255 && r == 0) {
+            counter++;
+        }
+        ent->access = lfu_minutes(shard) << 8 | counter;
+    } else {
+        ent->access = (uint32_t)shard->now_ms;
+    }
+}
+
+static void entry_touch_new(Shard *shard, Entry *ent) {
+    if (g_evict_policy == EVICT_ALLKEYS_LFU) {
+        // new keys get a few hits of credit, or they'd be evicted first
+        ent->access = lfu_minutes(shard) << 8 | k_lfu_init;
+    } else {
+        ent->access = (uint32_t)shard->now_ms;
+    }
+}
+
+// the active expiry cycle: every 100ms, at most 1ms of sampling
+const size_t k_expire_samples = 20;
+const uint64_t k_expire_period_ms = 100;
+const uint64_t k_expire_budget_us = 1000;
+
+// active defragmentation, with the same period and budget; the clock is
+// checked every this many groups of the table
+const uint64_t k_defrag_period_ms = 100;
+const uint64_t k_defrag_budget_us = 1000;
+const size_t k_defrag_groups = 64;
+
+// the entry, moved to a bigger allocation that has room for a TTL
+static Entry *entry_grow_ttl(Shard *shard, Entry *ent) {
+    size_t size = entry_size(ent);
+    Entry *moved = (Entry *)slab_alloc(&shard->slab, size + k_ttl_size);
+    memcpy(moved, ent, sizeof(Entry));
+    moved->has_ttl = 1;
+    memcpy((char *)moved + sizeof(Entry) + k_ttl_size, (char *)ent + sizeof(Entry),
+        size - sizeof(Entry));
+    entry_put_ttl(moved, 0, 0);
+    hm_replace(&shard->db, &ent->node, &moved->node);
+    shard->mem_entries += slab_usable(size + k_ttl_size) - slab_usable(size);
+    slab_free(&shard->slab, ent, size);
+    return moved;
+}
+
+// set or clear (0) the TTL, keeping Shard::expires in sync. returns the
+// entry, which moves if it had no room for a TTL yet; clearing never moves.
+static Entry *entry_set_ttl(Shard *shard, Entry *ent, uint64_t expire_at) {
+    uint64_t old = entry_expire_at(ent);
+    if (old && !expire_at) {
+        // swap with the last one to remove
+        uint32_t idx = entry_expire_idx(ent);
+        Entry *last = shard->expires.back();
+        shard->expires[idx] = last;
+        entry_put_ttl(last, entry_expire_at(last), idx);
+        shard->expires.pop_back();
+        entry_put_ttl(ent, 0, 0);
+    } else if (!old && expire_at) {
+        if (!ent->has_ttl) {
+            ent = entry_grow_ttl(shard, ent);
+        }
+        entry_put_ttl(ent, expire_at, (uint32_t)shard->expires.size());
+        shard->expires.push_back(ent);
+        // the cycle only runs while there are keys with a TTL
+        if (!tw_active(&shard->expire_timer)) {
+            tw_add(&shard->timers, &shard->expire_timer, shard->now_ms + k_expire_period_ms);
+        }
+    } else if (expire_at) {
+        entry_put_ttl(ent, expire_at, entry_expire_idx(ent));
+    }
+    return ent;
+}
+
+// frees the value, whatever its type
+static void entry_free_val(Entry *ent) {
+    if (ent->type == ENT_ZSET) {
+        ZSet *zset = entry_zset(ent);
+        zset_clear(zset);
+        delete zset;
+    } else if (ent->enc == ENC_PTR) {
+        // responses still being written keep their own reference
+        rcstr_unref(entry_rc(ent));
+    }
+}
+
+// the entry must already be out of the table
+static void entry_del(Shard *shard, Entry *ent) {
+    entry_set_ttl(shard, ent, 0);
+    shard->mem_entries -= entry_mem(ent);
+    entry_free_val(ent);
+    slab_free(&shard->slab, ent, entry_size(ent));
+}
+
+static bool entry_expired(Shard *shard, Entry *ent) {
+    uint64_t at = entry_expire_at(ent);
+    return at && at <= shard->now_ms;
+}
+
+// takes the entry out of the table and frees it; expired and evicted keys
+// go into the AOF as a del
+static void entry_remove(Shard *shard, Entry *ent) {
+    aof_feed(shard, {"del", entry_key(ent)});
+    LookupKey key;
+    key.key = entry_key(ent);
+    key.node.hcode = ent->node.hcode;
+    HNode *node = hm_delete(&shard->db, &key.node, &entry_eq);
+    assert(node == &ent->node);
+    entry_del(shard, ent);
+}
+
+// a lookup that expires the key lazily if its time is up
+static Entry *entry_lookup(Shard *shard, LookupKey &key) {
+    HNode *node = hm_lookup(&shard->db, &key.node, &entry_eq);
+    if (!node) {
+        return NULL;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(shard, ent)) {
+        entry_remove(shard, ent);
+        shard->stats.expired.add();
+        return NULL;
+    }
+    entry_touch(shard, ent);
+    return ent;
+}
+
+// eviction candidates with a higher score go first
+static uint64_t evict_score(Shard *shard, const Entry *ent) {
+    switch (g_evict_policy) {
+    case EVICT_ALLKEYS_LRU:
+        return (uint32_t)shard->now_ms - ent->access;   // idle ms
+    case EVICT_ALLKEYS_LFU:
+        return 255 - lfu_counter(shard, ent);
+    default:
+        return UINT64_MAX - entry_expire_at(ent);
+    }
+}
+
+// evicts keys until the shard is under its limit. approximate, like redis:
+// the best of a few random samples goes, so entries only need 4 bytes of
+// access state instead of a list kept in access order. returns false if
+// nothing can be evicted.
+static bool shard_evict(Shard *shard) {
+    while (shard_used_memory(shard) > shard->maxmemory) {
+        if (g_evict_policy == EVICT_NOEVICTION) {
+            return false;
+        }
+        Entry *victim = NULL;
+        uint64_t best = 0;
+        for (size_t i = 0; i < g_evict_samples; i++) {
+            Entry *ent = NULL;
+            if (g_evict_policy == EVICT_VOLATILE_TTL) {
+                if (shard->expires.empty()) {
+                    break;
+                }
+                ent = shard->expires[shard_rand(shard) % shard->expires.size()];
+            } else {
+                HNode *node = hm_random(&shard->db, shard_rand(shard));
+                if (!node) {
+                    break;
+                }
+                ent = container_of(node, Entry, node);
+            }
+            uint64_t score = evict_score(shard, ent);
+            if (!victim || score > best) {
+                victim = ent;
+                best = score;
+            }
+        }
+        if (!victim) {
+            return false;
+        }
+        entry_remove(shard, victim);
+        shard->stats.evicted.add();
+    }
+    return true;
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+    size_t i = 0;
+    bool neg = s.size() > 1 && s[0] == '-';
+    i += neg;
+    if (i == s.size() || s.size() - i > 18) {
+        return false;
+    }
+    int64_t v = 0;
+    for (; i < s.size(); i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        v = v * 10 + (s[i] - '0');
+    }
+    out = neg ? -v : v;
+    return true;
+}
+
+// a score: a finite or infinite double, not NaN
+static bool str2double(std::string_view s, double &out) {
+    char buf[64];
+    if (s.empty() || s.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    char *end = NULL;
+    out = strtod(buf, &end);
+    return end == buf + s.size() && !isnan(out);
+}
+
+static void out_int(Response &out, int64_t v) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", (long long)v);
+    out.data.insert(out.data.end(), buf, buf + n);
+}
+
+// the shortest of %.15g to %.17g that reads back as the same double
+static size_t fmt_double(char *buf, size_t size, double v) {
+    int n = 0;
+    for (int prec = 15; prec <= 17; prec++) {
+        n = snprintf(buf, size, "%.*g", prec, v);
+        if (strtod(buf, NULL) == v) {
+            break;
+        }
+    }
+    return (size_t)n;
+}
+
+static void out_err(Response &out, const char *msg) {
+    out.data.insert(out.data.end(), msg, msg + strlen(msg));
+    out.status = RES_ERR;
+}
+
+static const char k_err_readonly[] = "READONLY You can't write against a read only replica";
+static const char k_err_oom[] = "OOM command not allowed when used memory > 'maxmemory'";
+static const char k_err_wrongtype[] =
+    "WRONGTYPE Operation against a key holding the wrong kind of value";
+static const char k_err_float[] = "ERR value is not a valid float";
+static const char k_err_syntax[] = "ERR syntax error";
+
+static bool shards_save(Shard *self);
+static void do_info(Shard *shard, const std::vector<std::string_view> &cmd, Response &out);
+
+static void out_double(Response &out, double v) {
+    char buf[32];
+    size_t n = fmt_double(buf, sizeof(buf), v);
+    out.data.insert(out.data.end(), buf, buf + n);
+}
+
+// one member of a RES_ARR reply, and its score after it for WITHSCORES
+static void out_arr_zmember(Response &out, const ZIter &it, bool withscores) {
+    ZNode *znode = zit_node(it);
+    out_arr_push(out, std::string_view(znode->name, znode->len));
+    if (withscores) {
+        char buf[32];
+        size_t n = fmt_double(buf, sizeof(buf), zit_score(it));
+        out_arr_push(out, std::string_view(buf, n));
+    }
+}
+
+// the sorted set at `key`: NULL if there is none, or if the key holds
+// something else, which `out` then says
+static Entry *zset_entry_lookup(Shard *shard, LookupKey &key, Response &out) {
+    Entry *ent = entry_lookup(shard, key);
+    if (ent && ent->type != ENT_ZSET) {
+        out_err(out, k_err_wrongtype);
+        return NULL;
+    }
+    return ent;
+}
+
+// ZADD key score member [score member ...]: the number of new members
+static void do_zadd(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() % 2 != 0) {
+        out_err(out, k_err_syntax);
+        return;
+    }
+    // every score first, so that a bad one changes nothing
+    double score = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        if (!str2double(cmd[i], score)) {
+            out_err(out, k_err_float);
+            return;
+        }
+    }
+    if (shard->maxmemory && !shard_evict(shard)) {
+        out_err(out, k_err_oom);
+        return;
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = zset_entry_lookup(shard, key, out);
+    if (out.status == RES_ERR) {
+        return;
+    }
+    if (ent) {
+        shard->mem_entries -= entry_mem(ent);
+    } else {
+        ent = entry_new(shard, cmd[1], key.node.hcode, false, ENT_ZSET, ENC_PTR, 0);
+        entry_put_ptr(ent, new ZSet());
+        entry_touch_new(shard, ent);
+        hm_insert(&shard->db, &ent->node);
+    }
+    ZSet *zset = entry_zset(ent);
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        str2double(cmd[i], score);
+        added += zset_add(zset, cmd[i + 1], score);
+    }
+    shard->mem_entries += entry_mem(ent);
+    aof_feed(shard, cmd);
+    out_int(out, added);
+    out.status = RES_OK;
+}
+
+// ZREM key member [member ...]: the number removed. the key goes with the
+// last member.
+static void do_zrem(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = zset_entry_lookup(shard, key, out);
+    if (!ent) {
+        if (out.status != RES_ERR) {
+            out_int(out, 0);
+        }
+        return;
+    }
+    shard->mem_entries -= entry_mem(ent);
+    ZSet *zset = entry_zset(ent);
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        removed += zset_rem(zset, cmd[i]);
+    }
+    shard->mem_entries += entry_mem(ent);
+    if (removed) {
+        aof_feed(shard, cmd);
+    }
+    if (zset->size == 0) {
+        HNode *node = hm_delete(&shard->db, &key.node, &entry_eq);
+        assert(node == &ent->node);
+        entry_del(shard, ent);
+    }
+    out_int(out, removed);
+    out.status = RES_OK;
+}
+
+// the member cmd[2] of the sorted set at cmd[1]. NULL if there is none,
+// with `out` saying why
+static ZNode *zmember_lookup(Shard *shard, const std::vector<std::string_view> &cmd,
+    Entry *&ent, Response &out)
+{
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    ent = zset_entry_lookup(shard, key, out);
+    ZNode *znode = ent ? zset_lookup(entry_zset(ent), cmd[2]) : NULL;
+    if (!znode && out.status != RES_ERR) {
+        out.status = RES_NX;
+    }
+    return znode;
+}
+
+// ZSCORE key member
+static void do_zscore(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    Entry *ent = NULL;
+    if (ZNode *znode = zmember_lookup(shard, cmd, ent, out)) {
+        out_double(out, znode->score);
+    }
+}
+
+// ZRANK key member: 0-based, by score
+static void do_zrank(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    Entry *ent = NULL;
+    if (ZNode *znode = zmember_lookup(shard, cmd, ent, out)) {
+        out_int(out, (int64_t)zset_rank(entry_zset(ent), znode));
+    }
+}
+
+// ZRANGE key start stop [withscores]: by rank, negative ones from the end
+static void do_zrange(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    int64_t start = 0, stop = 0;
+    bool withscores = cmd.size() == 5;
+    if (cmd.size() > 5 || !str2int(cmd[2], start) || !str2int(cmd[3], stop)
+        || (withscores && !str_eq_nocase(cmd[4], "withscores")))
+    {
+        out_err(out, k_err_syntax);
+        return;
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = zset_entry_lookup(shard, key, out);
+    if (out.status == RES_ERR) {
+        return;
+    }
+    out_arr_begin(out);
+    uint32_t n = 0;
+    if (ent) {
+        ZSet *zset = entry_zset(ent);
+        int64_t size = (int64_t)zset->size;
+        start = start < 0 ? std::max<int64_t>(start + size, 0) : start;
+        stop = std::min(stop < 0 ? stop + size : stop, size - 1);
+        ZIter it;
+        if (start <= stop) {
+            it = zset_seek_rank(zset, (size_t)start);
+        }
+        for (int64_t i = start; i <= stop; i++, zit_next(it)) {
+            out_arr_zmember(out, it, withscores);
+            n++;
+        }
+    }
+    out_arr_end(out, withscores ? 2 * n : n);
+}
+
+// a ZRANGEBYSCORE bound: a score, "(" and a score to exclude it, -inf, +inf
+static bool parse_score_bound(std::string_view s, double &score, bool &exclusive) {
+    exclusive = !s.empty() && s[0] == '(';
+    if (exclusive) {
+        s.remove_prefix(1);
+    }
+    return str2double(s, score);
+}
+
+// ZRANGEBYSCORE key min max [withscores] [limit offset count]: a scan from
+// the first member >= min along the leaves; count < 0 = no limit
+static void do_zrangebyscore(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    double min = 0, max = 0;
+    bool min_ex = false, max_ex = false;
+    if (!parse_score_bound(cmd[2], min, min_ex) || !parse_score_bound(cmd[3], max, max_ex)) {
+        out_err(out, "ERR min or max is not a float");
+        return;
+    }
+    bool withscores = false;
+    int64_t offset = 0, count = -1;
+    for (size_t i = 4; i < cmd.size(); i++) {
+        if (str_eq_nocase(cmd[i], "withscores")) {
+            withscores = true;
+        } else if (str_eq_nocase(cmd[i], "limit") && i + 2 < cmd.size() && str2int(cmd[i + 1], offset)
+            && str2int(cmd[i + 2], count) && offset >= 0)
+        {
+            i += 2;
+        } else {
+            out_err(out, k_err_syntax);
+            return;
+        }
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = zset_entry_lookup(shard, key, out);
+    if (out.status == RES_ERR) {
+        return;
+    }
+    out_arr_begin(out);
+    uint32_t n = 0;
+    if (ent) {
+        ZIter it = zset_seek_score(entry_zset(ent), min, min_ex);
+        zit_skip(it, (size_t)offset);
+        for (; it.leaf && count != 0; zit_next(it), count--) {
+            double score = zit_score(it);
+            if (score > max || (max_ex && score == max)) {
+                break;
+            }
+            out_arr_zmember(out, it, withscores);
+            n++;
+        }
+    }
+    out_arr_end(out, withscores ? 2 * n : n);
+}
+
+// GET key
+static void do_get(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = entry_lookup(shard, key);
+
+    // did not find key in map
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+    if (ent->type != ENT_STR) {
+        out_err(out, k_err_wrongtype);
+        return;
+    }
+
+    if (ent->enc == ENC_PTR) {
+        // reference the value from the response, no copy
+        out.ref = rcstr_ref(entry_rc(ent));
+        return;
+    }
+    char buf[k_int_buf];
+    std::string_view val = entry_str(ent, buf);
+    out.data.assign(val.begin(), val.end());
+}
+
+// a string value on its way into an entry
+struct StrVal {
+    uint8_t enc = ENC_INLINE;
+    std::string_view bytes;     // ENC_INLINE
+    int64_t num = 0;            // ENC_INT
+    RcStr *rc = NULL;           // ENC_PTR, a reference for the entry
 };
 
-static std::map<std::string, std::string> g_data;
+// integers are stored as such if they'd format back to the same bytes
+static bool str_is_int(std::string_view s, int64_t &out) {
+    bool neg = !s.empty() && s[0] == '-';
+    if (!str2int(s, out) || (s.size() > (size_t)neg + 1 && s[neg] == '0') || s == "-0") {
+        return false;
+    }
+    return true;
+}
+
+// picks how `value` is stored. an RcStr whose bytes `value` are, one that
+// was streamed, is kept as it is instead of copied.
+static void strval_init(StrVal &v, std::string_view value, RcStr *streamed) {
+    if (streamed && value.data() == streamed->data()) {
+        v.enc = ENC_PTR;
+        v.rc = rcstr_ref(streamed);
+    } else if (str_is_int(value, v.num)) {
+        v.enc = ENC_INT;
+    } else if (value.size() <= k_inline_max) {
+        v.enc = ENC_INLINE;
+        v.bytes = value;
+    } else {
+        v.enc = ENC_PTR;
+        v.rc = rcstr_new(value.data(), value.size());
+    }
+}
 
-static void do_request(std::vector<std::string> &cmd, Response &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        // GET key request for redis
-        auto it = g_data.find(cmd[1]);
+static void entry_put_str(Entry *ent, const StrVal &v) {
+    switch (v.enc) {
+    case ENC_INLINE:
+        memcpy(entry_val(ent), v.bytes.data(), v.bytes.size());
+        break;
+    case ENC_INT:
+        memcpy(entry_val(ent), &v.num, 8);
+        break;
+    default:
+        entry_put_ptr(ent, v.rc);
+    }
+}
+
+// stores `value` at `key`; returns the RcStr it's kept in, NULL if it went
+// into the entry itself
+static RcStr *entry_set(Shard *shard, LookupKey &key, std::string_view value) {
+    Entry *ent = entry_lookup(shard, key);
+
+    // the only copy: from the request into the store, unless the value was
+    // streamed into its own RcStr already. values are immutable, an
+    // in-flight response keeps the old RcStr alive
+    StrVal v;
+    strval_init(v, value, shard->cmd_val);
+    size_t vlen = v.enc == ENC_INLINE ? value.size() : 0;
+    if (ent) {
+        // whatever the key held before
+        shard->mem_entries -= entry_mem(ent);
+        // like redis, overwriting a key drops its TTL
+        entry_set_ttl(shard, ent, 0);
+        entry_free_val(ent);
+        size_t size = entry_size(ent);
+        size_t new_size = entry_size_for(key.key.size(), ent->has_ttl, v.enc, vlen);
+        if (size <= k_slab_max && new_size <= k_slab_max
+            && slab_usable(size) == slab_usable(new_size))
+        {
+            // the same size class, so it fits where it is
+            ent->type = ENT_STR;
+            ent->enc = v.enc;
+            ent->vlen = (uint16_t)vlen;
+        } else {
+            Entry *moved = entry_new(shard, key.key, key.node.hcode, false, ENT_STR, v.enc, vlen);
+            moved->access = ent->access;
+            hm_replace(&shard->db, &ent->node, &moved->node);
+            slab_free(&shard->slab, ent, size);
+            ent = moved;
+        }
+    } else {
+        ent = entry_new(shard, key.key, key.node.hcode, false, ENT_STR, v.enc, vlen);
+        entry_touch_new(shard, ent);
+        hm_insert(&shard->db, &ent->node);
+    }
+    entry_put_str(ent, v);
+    shard->mem_entries += entry_mem(ent);
+    return v.rc;
+}
+
+// SET key value
+static void do_set(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    if (shard->maxmemory && !shard_evict(shard)) {
+        out_err(out, k_err_oom);
+        return;
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    RcStr *val = entry_set(shard, key, cmd[2]);
+    aof_feed(shard, cmd);
+    if (val) {
+        out.ref = rcstr_ref(val);
+    } else {
+        out.data.assign(cmd[2].begin(), cmd[2].end());
+    }
+    out.status = RES_OK;
+}
+
+// DEL key
+static void do_del(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    HNode *node = hm_delete(&shard->db, &key.node, &entry_eq);
+    if (node) {
+        entry_del(shard, container_of(node, Entry, node));
+        aof_feed(shard, cmd);
+    }
+    out.status = RES_OK;
+}
+
+// the batch commands work through their keys a window at a time: hash them
+// all and prefetch their groups, then the nodes those groups point to,
+// then probe. the misses of a window overlap instead of coming one by one.
+const size_t k_batch_keys = 16;
+
+// hashes the keys at cmd[first], cmd[first + step], ... and prefetches
+// their groups and nodes; returns how many there were, at most a window
+static size_t batch_prefetch(Shard *shard, const std::vector<std::string_view> &cmd,
+    size_t first, size_t step, LookupKey *keys)
+{
+    size_t n = 0;
+    for (size_t i = first; i < cmd.size() && n < k_batch_keys; i += step, n++) {
+        lookup_key_init(keys[n], cmd[i]);
+        hm_prefetch(&shard->db, keys[n].node.hcode);
+    }
+    for (size_t i = 0; i < n; i++) {
+        hm_prefetch_nodes(&shard->db, keys[i].node.hcode);
+    }
+    return n;
+}
+
+// MGET key [key ...]: an array with nil for keys that don't hold a string
+static void do_mget(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    LookupKey keys[k_batch_keys];
+    Entry *ents[k_batch_keys];
+    out_arr_begin(out);
+    for (size_t base = 1; base < cmd.size(); base += k_batch_keys) {
+        size_t n = batch_prefetch(shard, cmd, base, 1, keys);
+        for (size_t i = 0; i < n; i++) {
+            Entry *ent = entry_lookup(shard, keys[i]);
+            ents[i] = ent && ent->type == ENT_STR ? ent : NULL;
+            if (ents[i] && ent->enc == ENC_PTR) {
+                __builtin_prefetch(entry_rc(ent));
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (!ents[i]) {
+                out_arr_push_nil(out);
+            } else if (ents[i]->enc == ENC_PTR) {
+                out_arr_push_val(out, entry_rc(ents[i]));
+            } else {
+                char buf[k_int_buf];
+                out_arr_push(out, entry_str(ents[i], buf));
+            }
+        }
+    }
+    out_arr_end(out, (uint32_t)(cmd.size() - 1));
+}
+
+// MSET key value [key value ...]. atomic on one shard; when the keys span
+// shards, each sets its own at its own pace.
+static void do_mset(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() % 2 == 0) {
+        out_err(out, "ERR wrong number of arguments");
+        return;
+    }
+    if (shard->maxmemory && !shard_evict(shard)) {
+        out_err(out, k_err_oom);
+        return;
+    }
+    LookupKey keys[k_batch_keys];
+    for (size_t base = 1; base < cmd.size(); base += 2 * k_batch_keys) {
+        size_t n = batch_prefetch(shard, cmd, base, 2, keys);
+        for (size_t i = 0; i < n; i++) {
+            entry_set(shard, keys[i], cmd[base + 2 * i + 1]);
+        }
+    }
+    aof_feed(shard, cmd);
+    out.status = RES_OK;
+}
+
+// MDEL key [key ...]: how many there were
+static void do_mdel(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    LookupKey keys[k_batch_keys];
+    int64_t deleted = 0;
+    for (size_t base = 1; base < cmd.size(); base += k_batch_keys) {
+        size_t n = batch_prefetch(shard, cmd, base, 1, keys);
+        for (size_t i = 0; i < n; i++) {
+            if (HNode *node = hm_delete(&shard->db, &keys[i].node, &entry_eq)) {
+                entry_del(shard, container_of(node, Entry, node));
+                deleted++;
+            }
+        }
+    }
+    if (deleted) {
+        aof_feed(shard, cmd);
+    }
+    out_int(out, deleted);
+}
+
+// the EXPIREs: `arg` is how many `unit` ms from now, or a unix time in ms
+// if `unit` is 0
+static void expire_generic(Shard *shard, const std::vector<std::string_view> &cmd,
+    int64_t unit, Response &out)
+{
+    int64_t arg = 0;
+    if (!str2int(cmd[2], arg)) {
+        out_err(out, "ERR value is not an integer or out of range");
+        return;
+    }
+    int64_t unix_now = (int64_t)get_realtime_msec();
+    int64_t at = arg;
+    if (unit && (__builtin_mul_overflow(arg, unit, &at)
+        || __builtin_add_overflow(at, unix_now, &at)))
+    {
+        out_err(out, "ERR invalid expire time");
+        return;
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = entry_lookup(shard, key);
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+    if (at <= unix_now) {
+        entry_remove(shard, ent);   // already in the past
+    } else {
+        entry_set_ttl(shard, ent, shard->now_ms + (uint64_t)(at - unix_now));
+        aof_feed_expire(shard, cmd[1], (uint64_t)at);
+    }
+    out.status = RES_OK;
+}
+
+// EXPIRE key seconds
+static void do_expire(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    expire_generic(shard, cmd, 1000, out);
+}
+
+// PEXPIRE key milliseconds
+static void do_pexpire(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    expire_generic(shard, cmd, 1, out);
+}
+
+// PEXPIREAT key unix-time-milliseconds
+static void do_pexpireat(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    expire_generic(shard, cmd, 0, out);
+}
+
+// TTL and PTTL: the time left in `unit` ms, -1 if the key never expires
+static void ttl_generic(Shard *shard, const std::vector<std::string_view> &cmd,
+    int64_t unit, Response &out)
+{
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = entry_lookup(shard, key);
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+    int64_t left = -1;
+    if (uint64_t at = entry_expire_at(ent)) {
+        left = (int64_t)(at - shard->now_ms);
+        left = (left + unit / 2) / unit;
+    }
+    out_int(out, left);
+    out.status = RES_OK;
+}
+
+// TTL key
+static void do_ttl(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    ttl_generic(shard, cmd, 1000, out);
+}
+
+// PTTL key
+static void do_pttl(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    ttl_generic(shard, cmd, 1, out);
+}
+
+// PERSIST key: drop the TTL
+static void do_persist(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Entry *ent = entry_lookup(shard, key);
+    if (!ent) {
+        out.status = RES_NX;
+        return;
+    }
+    if (entry_expire_at(ent)) {
+        entry_set_ttl(shard, ent, 0);
+        aof_feed(shard, cmd);
+    }
+    out.status = RES_OK;
+}
+
+// BGREWRITEAOF: compact the AOF in a forked child
+static void do_bgrewriteaof(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    (void)shard;
+    (void)cmd;
+    if (!g_aof) {
+        out_err(out, "ERR no AOF configured (--appendonly)");
+        return;
+    }
+    aof_rewrite(g_aof);
+    out.status = RES_OK;
+}
+
+// BGSAVE: snapshot in a forked child
+static void do_bgsave(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    (void)shard;
+    (void)cmd;
+    if (!g_snap || !snap_bgsave(g_snap)) {
+        out_err(out, "ERR background save already in progress");
+        return;
+    }
+    out.status = RES_OK;
+}
+
+// SAVE: snapshot right here, with every shard stopped
+static void do_save(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    (void)cmd;
+    if (g_snap && g_snap->busy.load()) {
+        out_err(out, "ERR background save already in progress");
+    } else if (!g_snap || !shards_save(shard)) {
+        out_err(out, "ERR snapshot failed");
+    } else {
+        out.status = RES_OK;
+    }
+}
+
+// PING [message]
+static void do_ping(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    (void)shard;
+    std::string_view msg = cmd.size() > 1 ? cmd[1] : "PONG";
+    out.data.assign(msg.begin(), msg.end());
+    out.status = RES_OK;
+}
+
+// PSYNC from a client connection is taken over by the replication thread
+// before it gets here, see conn_intercept()
+static void do_psync(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    (void)shard;
+    (void)cmd;
+    out_err(out, "ERR a replica can't have replicas of its own");
+}
+
+// pub/sub. a shard keeps the subscriptions of its own connections. PUBLISH
+// runs on every shard that has any, see publish_split(), and each builds
+// the message's frame once and queues it by reference for all of its
+// subscribers. they get their messages written after the event loop
+// iteration, see shard_flush_pushes().
+
+static size_t conn_out_size(const Conn *conn);
+
+// the connection a (P)(UN)SUBSCRIBE acts on
+static Conn *pubsub_conn(Shard *shard, Response &out) {
+    if (!shard->cmd_conn) {
+        out_err(out, "ERR only a client connection can subscribe");
+    }
+    return shard->cmd_conn;
+}
+
+// the reply: how many channels and patterns the connection is subscribed
+// to now
+static void pubsub_reply(Shard *shard, Conn *conn, Response &out) {
+    shard->stats.pubsub_channels.set(hm_size(&shard->pubsub.channels));
+    shard->stats.pubsub_patterns.set(shard->pubsub.npatterns);
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+template <class T>
+static void vec_remove(std::vector<T> &v, T x) {
+    auto it = std::find(v.begin(), v.end(), x);
+    if (it != v.end()) {
+        *it = v.back();
+        v.pop_back();
+    }
+}
+
+static void conn_unsubscribe(Conn *conn, PubChannel *ch) {
+    vec_remove(ch->subs, conn);
+    vec_remove(conn->channels, ch);
+    if (ch->subs.empty()) {
+        ps_channel_del(&conn->shard->pubsub, ch);
+    }
+}
+
+static void conn_punsubscribe(Conn *conn, PubPattern *pat) {
+    vec_remove(pat->subs, conn);
+    vec_remove(conn->patterns, pat);
+    if (pat->subs.empty()) {
+        ps_pattern_del(&conn->shard->pubsub, pat);
+    }
+}
+
+// when it closes
+static void conn_unsubscribe_all(Conn *conn) {
+    while (!conn->channels.empty()) {
+        conn_unsubscribe(conn, conn->channels.back());
+    }
+    while (!conn->patterns.empty()) {
+        conn_punsubscribe(conn, conn->patterns.back());
+    }
+    conn->shard->stats.pubsub_channels.set(hm_size(&conn->shard->pubsub.channels));
+    conn->shard->stats.pubsub_patterns.set(conn->shard->pubsub.npatterns);
+}
+
+// SUBSCRIBE channel [channel ...]
+static void do_subscribe(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    Conn *conn = pubsub_conn(shard, out);
+    if (!conn) {
+        return;
+    }
+    for (size_t i = 1; i < cmd.size(); i++) {
+        PubChannel *ch = ps_channel_add(&shard->pubsub, cmd[i]);
+        if (std::find(conn->channels.begin(), conn->channels.end(), ch) == conn->channels.end()) {
+            ch->subs.push_back(conn);
+            conn->channels.push_back(ch);
+        }
+    }
+    pubsub_reply(shard, conn, out);
+}
+
+// UNSUBSCRIBE [channel ...], all of them without one
+static void do_unsubscribe(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    Conn *conn = pubsub_conn(shard, out);
+    if (!conn) {
+        return;
+    }
+    if (cmd.size() == 1) {
+        while (!conn->channels.empty()) {
+            conn_unsubscribe(conn, conn->channels.back());
+        }
+    }
+    for (size_t i = 1; i < cmd.size(); i++) {
+        PubChannel *ch = ps_channel_find(&shard->pubsub, cmd[i]);
+        if (ch && std::find(conn->channels.begin(), conn->channels.end(), ch)
+            != conn->channels.end())
+        {
+            conn_unsubscribe(conn, ch);
+        }
+    }
+    pubsub_reply(shard, conn, out);
+}
+
+// PSUBSCRIBE pattern [pattern ...]
+static void do_psubscribe(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    Conn *conn = pubsub_conn(shard, out);
+    if (!conn) {
+        return;
+    }
+    for (size_t i = 1; i < cmd.size(); i++) {
+        PubPattern *pat = ps_pattern_add(&shard->pubsub, cmd[i]);
+        if (std::find(conn->patterns.begin(), conn->patterns.end(), pat) == conn->patterns.end()) {
+            pat->subs.push_back(conn);
+            conn->patterns.push_back(pat);
+        }
+    }
+    pubsub_reply(shard, conn, out);
+}
+
+// PUNSUBSCRIBE [pattern ...], all of them without one
+static void do_punsubscribe(Shard *shard, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    Conn *conn = pubsub_conn(shard, out);
+    if (!conn) {
+        return;
+    }
+    if (cmd.size() == 1) {
+        while (!conn->patterns.empty()) {
+            conn_punsubscribe(conn, conn->patterns.back());
+        }
+    }
+    for (size_t i = 1; i < cmd.size(); i++) {
+        PubPattern *pat = ps_pattern_find(&shard->pubsub, cmd[i]);
+        if (pat && std::find(conn->patterns.begin(), conn->patterns.end(), pat)
+            != conn->patterns.end())
+        {
+            conn_punsubscribe(conn, pat);
+        }
+    }
+    pubsub_reply(shard, conn, out);
+}
+
+// queues a message for a subscriber. one already --pubsub-output-limit
+// behind is dropped instead: a slow consumer mustn't pile up everyone's
+// messages. false if it didn't get it.
+static bool conn_push(Conn *conn, RcStr *frame) {
+    Shard *shard = conn->shard;
+    if (conn->want_close) {
+        return false;
+    }
+    if (g_pubsub_limit && conn_out_size(conn) + frame->len > g_pubsub_limit) {
+        LOG_RATELIMITED(LL_WARN, 10, "dropping a subscriber with %zu bytes of output",
+            conn_out_size(conn));
+        shard->stats.pubsub_drops.add();
+        conn->want_close = true;
+    } else {
+        oq_append_shared(conn->outgoing, rcstr_ref(frame));
+        shard->stats.pubsub_messages.add();
+    }
+    if (!conn->push_queued) {
+        conn->push_queued = true;
+        shard->pushed.emplace_back(conn, conn->fd);
+    }
+    return !conn->want_close;
+}
+
+// PUBLISH channel message: to this shard's subscribers of the channel and
+// of the patterns that match it. replies with how many got it.
+static void do_publish(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    PubSub *ps = &shard->pubsub;
+    int64_t n = 0;
+    if (PubChannel *ch = ps_channel_find(ps, cmd[1])) {
+        RcStr *frame = make_push({"message", cmd[1], cmd[2]});
+        for (Conn *conn : ch->subs) {
+            n += conn_push(conn, frame);
+        }
+        rcstr_unref(frame);
+    }
+    std::vector<PubPattern *> pats;
+    ps_match(ps, cmd[1], pats);
+    for (PubPattern *pat : pats) {
+        RcStr *frame = make_push({"pmessage", pat->pattern, cmd[1], cmd[2]});
+        for (Conn *conn : pat->subs) {
+            n += conn_push(conn, frame);
+        }
+        rcstr_unref(frame);
+    }
+    out_int(out, n);
+}
+
+// the command table. its index is the ShardStats::cmds slot, with one
+// more for unknown commands.
+static constexpr Command k_commands[] = {
+    {"get", &do_get, 2, CMD_READONLY | CMD_FAST},
+    {"set", &do_set, 3, CMD_WRITE | CMD_FAST},
+    {"del", &do_del, 2, CMD_WRITE | CMD_FAST},
+    {"mget", &do_mget, -2, CMD_READONLY, 1},
+    {"mset", &do_mset, -3, CMD_WRITE, 2},
+    {"mdel", &do_mdel, -2, CMD_WRITE, 1},
+    {"expire", &do_expire, 3, CMD_WRITE | CMD_FAST},
+    {"pexpire", &do_pexpire, 3, CMD_WRITE | CMD_FAST},
+    {"pexpireat", &do_pexpireat, 3, CMD_WRITE | CMD_FAST},
+    {"ttl", &do_ttl, 2, CMD_READONLY | CMD_FAST},
+    {"pttl", &do_pttl, 2, CMD_READONLY | CMD_FAST},
+    {"persist", &do_persist, 2, CMD_WRITE | CMD_FAST},
+    {"zadd", &do_zadd, -4, CMD_WRITE | CMD_FAST},
+    {"zrem", &do_zrem, -3, CMD_WRITE | CMD_FAST},
+    {"zscore", &do_zscore, 3, CMD_READONLY | CMD_FAST},
+    {"zrank", &do_zrank, 3, CMD_READONLY | CMD_FAST},
+    {"zrange", &do_zrange, -4, CMD_READONLY},
+    {"zrangebyscore", &do_zrangebyscore, -4, CMD_READONLY},
+    {"bgrewriteaof", &do_bgrewriteaof, 1, CMD_ADMIN | CMD_NOKEY},
+    {"bgsave", &do_bgsave, 1, CMD_ADMIN | CMD_NOKEY},
+    {"save", &do_save, 1, CMD_ADMIN | CMD_NOKEY},
+    {"info", &do_info, -1, CMD_ADMIN | CMD_NOKEY},
+    {"ping", &do_ping, -1, CMD_FAST | CMD_NOKEY},
+    {"psync", &do_psync, 3, CMD_ADMIN | CMD_NOKEY},
+    {"subscribe", &do_subscribe, -2, CMD_NOKEY},
+    {"unsubscribe", &do_unsubscribe, -1, CMD_NOKEY},
+    {"psubscribe", &do_psubscribe, -2, CMD_NOKEY},
+    {"punsubscribe", &do_punsubscribe, -1, CMD_NOKEY},
+    {"publish", &do_publish, 3, CMD_NOKEY},
+};
+const size_t k_ncommands = sizeof(k_commands) / sizeof(k_commands[0]);
+const size_t k_ncmd_stats = k_ncommands + 1;
+static_assert(k_ncmd_stats <= k_cmd_stat_slots, "ShardStats::cmds is too small");
+
+static constexpr CmdIndex<64> k_cmd_index = cmd_index_build<64>(k_commands);
+
+const Command *cmd_lookup(std::string_view name) {
+    return cmd_index_find(k_cmd_index, k_commands, name);
+}
+
+static const char *cmd_stat_name(size_t slot) {
+    return slot < k_ncommands ? k_commands[slot].name.data() : "unknown";
+}
+
+// finds the command's handler and checks its arity
+static void do_command(Shard *shard, const Command *c, const std::vector<std::string_view> &cmd,
+    Response &out)
+{
+    if (!c) {
+        out_err(out, "ERR unknown command");
+    } else if (!cmd_arity_ok(c, cmd.size())) {
+        out_err(out, "ERR wrong number of arguments");
+    } else {
+        c->handler(shard, cmd, out);
+    }
+}
+
+void do_request(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (g_loading) {
+        do_command(shard, c, cmd, out);
+        return;
+    }
+    CmdStats &cs = shard->stats.cmds[c ? (size_t)(c - k_commands) : k_ncommands];
+    if (cs.calls.get() % k_lat_sample != 0) {
+        cs.calls.add();
+        do_command(shard, c, cmd, out);
+        return;
+    }
+    cs.calls.add();
+    uint64_t start = get_monotonic_nsec();
+    do_command(shard, c, cmd, out);
+    cmd_stats_record(cs, get_monotonic_nsec() - start);
+}
+
+// for the other shards' INFO
+static void shard_publish_stats(Shard *shard) {
+    shard->stats.keys.set(hm_size(&shard->db));
+    shard->stats.expires.set(shard->expires.size());
+    shard->stats.used_memory.set(shard_used_memory(shard));
+    shard->stats.slab_bytes.set(slab_mem_usage(&shard->slab));
+    shard->stats.slab_used.set(slab_mem_used(&shard->slab));
+    for (size_t i = 0; i < k_slab_classes; i++) {
+        shard->stats.slab_pages[i].set(shard->slab.classes[i].pages);
+        shard->stats.slab_objs[i].set(shard->slab.classes[i].used);
+    }
+    shard->stats.defrag_moved.set(shard->slab.defrag_moved);
+}
+
+// the sum of one counter over all shards
+static uint64_t stats_sum(Counter ShardStats::*field) {
+    uint64_t sum = 0;
+    for (Shard *shard : g_shards) {
+        sum += (shard->stats.*field).get();
+    }
+    return sum;
+}
+
+// one command's stats over all shards. `timed` is the number of calls in
+// `ns` and `hist`
+static void cmd_stats_sum(size_t slot, uint64_t &calls, uint64_t &timed, uint64_t &ns,
+    uint64_t *hist) {
+    calls = timed = ns = 0;
+    for (size_t b = 0; b < k_lat_buckets; b++) {
+        hist[b] = 0;
+    }
+    for (Shard *shard : g_shards) {
+        const CmdStats &cs = shard->stats.cmds[slot];
+        calls += cs.calls.get();
+        ns += cs.ns.get();
+        for (size_t b = 0; b < k_lat_buckets; b++) {
+            hist[b] += cs.hist[b].get();
+        }
+    }
+    for (size_t b = 0; b < k_lat_buckets; b++) {
+        timed += hist[b];
+    }
+}
+
+// the upper end of the bucket holding the `q` quantile, in ns
+static uint64_t hist_quantile(const uint64_t *hist, uint64_t total, double q) {
+    uint64_t rank = (uint64_t)(q * (double)total);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < k_lat_buckets; b++) {
+        seen += hist[b];
+        if (seen > rank) {
+            return (uint64_t)2 << b;
+        }
+    }
+    return (uint64_t)2 << (k_lat_buckets - 1);
+}
+
+static uint64_t g_start_ms = 0;
+
+static void info_append(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void info_append(std::string &out, const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    out.append(buf, (size_t)std::min(n, (int)sizeof(buf) - 1));
+}
+
+// the same numbers in the Prometheus text format
+static void info_prometheus(std::string &out) {
+    struct Metric {
+        const char *name;
+        const char *type;
+        uint64_t value;
+    };
+    uint64_t uptime = (get_monotonic_msec() - g_start_ms) / 1000;
+    const Metric metrics[] = {
+        {"kv_uptime_seconds", "gauge", uptime},
+        {"kv_connected_clients", "gauge", stats_sum(&ShardStats::conns)},
+        {"kv_connections_received_total", "counter", stats_sum(&ShardStats::conns_total)},
+        {"kv_net_input_bytes_total", "counter", stats_sum(&ShardStats::net_in)},
+        {"kv_net_output_bytes_total", "counter", stats_sum(&ShardStats::net_out)},
+        {"kv_keys", "gauge", stats_sum(&ShardStats::keys)},
+        {"kv_keys_with_ttl", "gauge", stats_sum(&ShardStats::expires)},
+        {"kv_expired_keys_total", "counter", stats_sum(&ShardStats::expired)},
+        {"kv_evicted_keys_total", "counter", stats_sum(&ShardStats::evicted)},
+        {"kv_used_memory_bytes", "gauge", stats_sum(&ShardStats::used_memory)},
+        {"kv_slab_bytes", "gauge", stats_sum(&ShardStats::slab_bytes)},
+        {"kv_slab_used_bytes", "gauge", stats_sum(&ShardStats::slab_used)},
+        {"kv_defrag_moved_total", "counter", stats_sum(&ShardStats::defrag_moved)},
+        {"kv_maxmemory_bytes", "gauge", g_maxmemory},
+        {"kv_event_loop_iterations_total", "counter", stats_sum(&ShardStats::loop_iters)},
+        {"kv_io_syscalls_total", "counter", stats_sum(&ShardStats::io_syscalls)},
+        {"kv_turn_yields_total", "counter", stats_sum(&ShardStats::turn_yields)},
+        {"kv_output_limit_pauses_total", "counter", stats_sum(&ShardStats::output_pauses)},
+        {"kv_output_limit_closes_total", "counter", stats_sum(&ShardStats::output_closes)},
+        {"kv_pubsub_channels", "gauge", stats_sum(&ShardStats::pubsub_channels)},
+        {"kv_pubsub_patterns", "gauge", stats_sum(&ShardStats::pubsub_patterns)},
+        {"kv_pubsub_messages_total", "counter", stats_sum(&ShardStats::pubsub_messages)},
+        {"kv_pubsub_dropped_clients_total", "counter", stats_sum(&ShardStats::pubsub_drops)},
+    };
+    for (const Metric &m : metrics) {
+        info_append(out, "# TYPE %s %s\n%s %llu\n", m.name, m.type, m.name,
+            (unsigned long long)m.value);
+    }
+    if (g_link) {
+        info_append(out, "# TYPE kv_repl_link_up gauge\nkv_repl_link_up %d\n"
+            "# TYPE kv_repl_offset gauge\nkv_repl_offset %llu\n",
+            g_link->state.load() == LINK_UP ? 1 : 0,
+            (unsigned long long)g_link->offset.load());
+    } else if (g_repl) {
+        uint64_t replicas = 0, lag = 0;
+        repl_lag(g_repl, replicas, lag);
+        info_append(out, "# TYPE kv_connected_replicas gauge\nkv_connected_replicas %llu\n"
+            "# TYPE kv_repl_offset gauge\nkv_repl_offset %llu\n"
+            "# TYPE kv_repl_max_lag_bytes gauge\nkv_repl_max_lag_bytes %llu\n",
+            (unsigned long long)replicas, (unsigned long long)g_repl->offset.load(),
+            (unsigned long long)lag);
+    }
+    info_append(out, "# TYPE kv_event_loop_wait_seconds_total counter\n"
+        "kv_event_loop_wait_seconds_total %.6f\n",
+        (double)stats_sum(&ShardStats::loop_wait_us) / 1e6);
+
+    // over the sampled calls; kv_commands_total has them all
+    info_append(out, "# TYPE kv_commands_total counter\n");
+    for (size_t slot = 0; slot < k_ncmd_stats; slot++) {
+        uint64_t calls = 0, timed = 0, ns = 0, hist[k_lat_buckets];
+        cmd_stats_sum(slot, calls, timed, ns, hist);
+        if (calls) {
+            info_append(out, "kv_commands_total{cmd=\"%s\"} %llu\n",
+                cmd_stat_name(slot), (unsigned long long)calls);
+        }
+    }
+    info_append(out, "# TYPE kv_command_duration_seconds histogram\n");
+    for (size_t slot = 0; slot < k_ncmd_stats; slot++) {
+        uint64_t calls = 0, timed = 0, ns = 0, hist[k_lat_buckets];
+        cmd_stats_sum(slot, calls, timed, ns, hist);
+        if (!timed) {
+            continue;
+        }
+        const char *name = cmd_stat_name(slot);
+        uint64_t cum = 0;
+        for (size_t b = 0; b < k_lat_buckets - 1 && cum < timed; b++) {
+            cum += hist[b];
+            info_append(out, "kv_command_duration_seconds_bucket{cmd=\"%s\",le=\"%g\"} %llu\n",
+                name, (double)((uint64_t)2 << b) / 1e9, (unsigned long long)cum);
+        }
+        info_append(out, "kv_command_duration_seconds_bucket{cmd=\"%s\",le=\"+Inf\"} %llu\n"
+            "kv_command_duration_seconds_sum{cmd=\"%s\"} %.9f\n"
+            "kv_command_duration_seconds_count{cmd=\"%s\"} %llu\n",
+            name, (unsigned long long)timed, name, (double)ns / 1e9,
+            name, (unsigned long long)timed);
+    }
+}
+
+// INFO [server|clients|stats|memory|replication|keyspace|slab|commandstats|
+// latencystats], all but the last three by default; INFO prometheus for the
+// text format
+static void do_info(Shard *shard, const std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() > 2) {
+        out_err(out, k_err_syntax);
+        return;
+    }
+    std::string_view section = cmd.size() == 2 ? cmd[1] : "";
+    shard_publish_stats(shard);
+    std::string text;
+    if (str_eq_nocase(section, "prometheus")) {
+        info_prometheus(text);
+        out.data.assign(text.begin(), text.end());
+        out.status = RES_OK;
+        return;
+    }
+    bool all = section.empty() || str_eq_nocase(section, "all");
+    bool found = false;
+    if (all || str_eq_nocase(section, "server")) {
+        info_append(text, "# Server\nuptime_in_seconds:%llu\nshards:%zu\nevent_loop:%s\n"
+            "tcp_port:%u\n",
+            (unsigned long long)(get_monotonic_msec() - g_start_ms) / 1000,
+            g_shards.size(), shard->loop ? shard->loop->name() : "io_uring", g_port);
+        found = true;
+    }
+    if (all || str_eq_nocase(section, "clients")) {
+        info_append(text, "# Clients\nconnected_clients:%llu\n"
+            "total_connections_received:%llu\n",
+            (unsigned long long)stats_sum(&ShardStats::conns),
+            (unsigned long long)stats_sum(&ShardStats::conns_total));
+        found = true;
+    }
+    if (all || str_eq_nocase(section, "stats")) {
+        uint64_t commands = 0;
+        for (size_t slot = 0; slot < k_ncmd_stats; slot++) {
+            for (Shard *s : g_shards) {
+                commands += s->stats.cmds[slot].calls.get();
+            }
+        }
+        info_append(text, "# Stats\ntotal_commands_processed:%llu\n"
+            "total_net_input_bytes:%llu\ntotal_net_output_bytes:%llu\n"
+            "expired_keys:%llu\nevicted_keys:%llu\n"
+            "event_loop_iterations:%llu\nevent_loop_wait_usec:%llu\n"
+            "io_syscalls:%llu\nturn_yields:%llu\n"
+            "output_limit_pauses:%llu\noutput_limit_closes:%llu\n"
+            "pubsub_channels:%llu\npubsub_patterns:%llu\n"
+            "pubsub_messages:%llu\npubsub_dropped_clients:%llu\n",
+            (unsigned long long)commands,
+            (unsigned long long)stats_sum(&ShardStats::net_in),
+            (unsigned long long)stats_sum(&ShardStats::net_out),
+            (unsigned long long)stats_sum(&ShardStats::expired),
+            (unsigned long long)stats_sum(&ShardStats::evicted),
+            (unsigned long long)stats_sum(&ShardStats::loop_iters),
+            (unsigned long long)stats_sum(&ShardStats::loop_wait_us),
+            (unsigned long long)stats_sum(&ShardStats::io_syscalls),
+            (unsigned long long)stats_sum(&ShardStats::turn_yields),
+            (unsigned long long)stats_sum(&ShardStats::output_pauses),
+            (unsigned long long)stats_sum(&ShardStats::output_closes),
+            (unsigned long long)stats_sum(&ShardStats::pubsub_channels),
+            (unsigned long long)stats_sum(&ShardStats::pubsub_patterns),
+            (unsigned long long)stats_sum(&ShardStats::pubsub_messages),
+            (unsigned long long)stats_sum(&ShardStats::pubsub_drops));
+        found = true;
+    }
+    if (all || str_eq_nocase(section, "memory")) {
+        uint64_t slab = stats_sum(&ShardStats::slab_bytes);
+        uint64_t slab_used = stats_sum(&ShardStats::slab_used);
+        info_append(text, "# Memory\nused_memory:%llu\nmaxmemory:%zu\nmaxmemory_policy:%s\n"
+            "slab_bytes:%llu\nslab_used_bytes:%llu\nslab_fragmentation_ratio:%.2f\n"
+            "active_defrag:%s\ndefrag_moved:%llu\n",
+            (unsigned long long)stats_sum(&ShardStats::used_memory), g_maxmemory,
+            k_evict_policies[g_evict_policy], (unsigned long long)slab,
+            (unsigned long long)slab_used, slab_used ? (double)slab / (double)slab_used : 1.0,
+            g_activedefrag ? "yes" : "no",
+            (unsigned long long)stats_sum(&ShardStats::defrag_moved));
+        found = true;
+    }
+    if ((all || str_eq_nocase(section, "replication")) && g_repl) {
+        text += g_link ? "# Replication\nrole:slave\n" : "# Replication\nrole:master\n";
+        if (g_link) {
+            repl_link_info(g_link, text);
+        } else {
+            repl_info(g_repl, text);
+        }
+        found = true;
+    }
+    if (str_eq_nocase(section, "slab")) {
+        // the size classes in use
+        text += "# Slab\n";
+        for (size_t i = 0; i < k_slab_classes; i++) {
+            uint64_t pages = 0, objs = 0;
+            for (Shard *s : g_shards) {
+                pages += s->stats.slab_pages[i].get();
+                objs += s->stats.slab_objs[i].get();
+            }
+            if (pages) {
+                info_append(text, "slab_class_%u:pages=%llu,entries=%llu,fill=%.2f\n",
+                    shard->slab.classes[i].size, (unsigned long long)pages,
+                    (unsigned long long)objs,
+                    (double)objs / (double)(pages * shard->slab.classes[i].per_page));
+            }
+        }
+        found = true;
+    }
+    if (all || str_eq_nocase(section, "keyspace")) {
+        info_append(text, "# Keyspace\nkeys:%llu\nexpires:%llu\n",
+            (unsigned long long)stats_sum(&ShardStats::keys),
+            (unsigned long long)stats_sum(&ShardStats::expires));
+        found = true;
+    }
+    if (str_eq_nocase(section, "commandstats") || str_eq_nocase(section, "latencystats")) {
+        bool lat = str_eq_nocase(section, "latencystats");
+        text += lat ? "# Latencystats\n" : "# Commandstats\n";
+        for (size_t slot = 0; slot < k_ncmd_stats; slot++) {
+            uint64_t calls = 0, timed = 0, ns = 0, hist[k_lat_buckets];
+            cmd_stats_sum(slot, calls, timed, ns, hist);
+            if (!timed) {
+                continue;
+            }
+            double per_call = (double)ns / (double)timed;
+            if (lat) {
+                info_append(text, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\n",
+                    cmd_stat_name(slot), (double)hist_quantile(hist, timed, 0.5) / 1e3,
+                    (double)hist_quantile(hist, timed, 0.99) / 1e3,
+                    (double)hist_quantile(hist, timed, 0.999) / 1e3);
+            } else {
+                // the total is extrapolated from the timed calls
+                info_append(text, "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.3f\n",
+                    cmd_stat_name(slot), (unsigned long long)calls,
+                    (unsigned long long)(per_call * (double)calls / 1e3), per_call / 1e3);
+            }
+        }
+        found = true;
+    }
+    if (!found) {
+        out_err(out, "ERR unknown INFO section");
+        return;
+    }
+    out.data.assign(text.begin(), text.end());
+    out.status = RES_OK;
+}
+
+static void msg(const char *msg) {
+    LOG_INFO("%s", msg);
+}
+
+static void msg_errno(const char *msg) {
+    LOG_WARN("[errno:%d] %s", errno, msg);
+}
+
+static void die(const char *msg) {
+    LOG_ERROR("[%d] %s", errno, msg);
+    log_flush();
+    abort();
+}
+
+static void shard_wake(Shard *to) {
+    // one wakeup per batch: skip the syscall if one is already pending
+    if (!to->wake_pending.exchange(true)) {
+        uint8_t one = 1;
+        if (write(to->wake_wfd, &one, 1) < 0 && errno != EAGAIN) {
+            msg_errno("shard wakeup write()");
+        }
+    }
+}
+
+static void shard_post(Shard *to, ShardMsg *m) {
+    to->inbox.push(m);
+    shard_wake(to);
+}
+
+static size_t aof_pending(Shard *shard) {
+    return shard->aof_batch ? shard->aof_batch->data.size() : 0;
+}
+
+// appendfsync always: the batch that a reply has to wait for, 0 if the
+// request changed nothing
+static uint64_t aof_wait_for(Shard *shard, size_t pending_before) {
+    // (less than before: SAVE paused the shard, which flushed the batch)
+    if (!g_aof || g_aof->fsync_policy != AOF_FSYNC_ALWAYS
+        || aof_pending(shard) <= pending_before)
+    {
+        return 0;
+    }
+    return shard->aof_seq + 1;  // the batch of this iteration
+}
+
+// a multi-key command with its keys on several shards: each owner runs its
+// part, ours right away, and the reply goes out when the last one is back
+struct MultiReq {
+    std::vector<ShardMsg *> parts;
+    std::vector<uint32_t> key_part;     // the part of every key, in order
+    uint32_t pending = 0;               // parts still out
+};
+
+static void multi_scatter(Conn *conn, std::vector<MultiPart> &parts,
+    std::vector<uint32_t> &key_part)
+{
+    Shard *shard = conn->shard;
+    MultiReq *mr = new MultiReq();
+    mr->key_part.swap(key_part);
+    mr->pending = (uint32_t)parts.size();
+    for (MultiPart &part : parts) {
+        ShardMsg *m = new ShardMsg();
+        m->origin = shard;
+        m->conn = conn;
+        m->multi = mr;
+        mr->parts.push_back(m);
+        if (part.shard != shard) {
+            append_req(m->req, part.cmd);
+            m->req.erase(0, 4);     // the body only, like a forwarded request
+            continue;
+        }
+        size_t aof_before = aof_pending(shard);
+        do_request(shard, part.cmd, m->resp);
+        m->done = true;
+        mr->pending--;
+        if (uint64_t seq = aof_wait_for(shard, aof_before)) {
+            conn->aof_wait = seq;
+        }
+    }
+    conn->awaiting_remote = true;
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (parts[i].shard != shard) {
+            shard_post(parts[i].shard, mr->parts[i]);
+        }
+    }
+}
+
+// a request this large whose last argument is too is streamed: once the
+// head is in, the value's bytes are read straight into the RcStr that the
+// store takes over, instead of growing `incoming` to the whole message and
+// copying out of it. the head has to be within the first k_stream_head_max.
+const size_t k_stream_min = 256 << 10;
+const size_t k_stream_head_max = 64 << 10;
+
+// for a message of `len` that isn't all in yet
+static void conn_stream_start(Conn *conn, uint32_t len) {
+    size_t avail = conn->incoming.size() - 4;
+    if (avail > k_stream_head_max) {
+        avail = k_stream_head_max;
+    }
+    int64_t off = parse_req_head(conn->incoming.data() + 4, avail, len, k_stream_min,
+        conn->shard->cmd);
+    if (off < 0 || (off == 0 && avail == k_stream_head_max)) {
+        conn->stream_skip = true;
+        return;
+    }
+    if (off == 0) {
+        return;     // want read
+    }
+    // what arrived of the value so far moves over, the rest goes there
+    // directly, see conn_on_data()
+    size_t head = 4 + (size_t)off;
+    conn->stream_val = rcstr_alloc(len - (size_t)off);
+    conn->stream_have = (uint32_t)(conn->incoming.size() - head);
+    conn->stream_head = (uint32_t)head;
+    memcpy(conn->stream_val->data(), conn->incoming.data() + head, conn->stream_have);
+    buf_truncate(conn->incoming, head);
+}
+
+// the arguments of a request whose last one was streamed into `val`
+static void parse_streamed(const uint8_t *head, size_t head_len, RcStr *val,
+    std::vector<std::string_view> &out)
+{
+    (void)parse_req_head(head, head_len, head_len + val->len, 0, out);
+    out.push_back(val->view());
+}
+
+// queues a reply, except on the primary's stream, which gets none
+static void conn_reply(Conn *conn, Response &resp) {
+    if (!conn->is_master) {
+        make_response(resp, conn->outgoing);
+        return;
+    }
+    if (resp.ref) {
+        rcstr_unref(resp.ref);
+        resp.ref = NULL;
+    }
+    for (auto &r : resp.refs) {
+        rcstr_unref(r.second);
+    }
+    resp.refs.clear();
+}
+
+// a PSYNC makes the connection a replica's, once the event loop has let go
+// of it, see conn_settle(); and a replica refuses writes from its clients.
+// true if the request was one of those.
+static bool conn_intercept(Conn *conn, const std::vector<std::string_view> &cmd) {
+    if (!g_link) {
+        int64_t offset = -1;
+        (void)str2int(cmd[2], offset);
+        conn->to_replica = true;
+        conn->psync_replid = cmd[1];
+        conn->psync_offset = offset;
+        return true;
+    }
+    const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c || !(c->flags & CMD_WRITE)) {
+        return false;
+    }
+    Response resp;
+    out_err(resp, k_err_readonly);
+    make_response(resp, conn->outgoing);
+    return true;
+}
+
+bool try_one_request(Conn *conn) {
+    // a response from another shard has to go out first
+    if (conn->awaiting_remote || conn->to_replica) {
+        return false;
+    }
+    // try to parse the protocol: message header
+    if (conn->incoming.size() < 4) {
+        return false;   // want read
+    }
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data(), 4);
+    if (len > k_max_msg) {
+        msg("too long");
+        conn->want_close = true;
+        return false;   // want close
+    }
+    const uint8_t *request = conn->incoming.data() + 4;
+    std::vector<std::string_view> &cmd = conn->shard->cmd;
+    size_t req_len = len;   // the part of the body in `incoming`
+    RcStr *val = NULL;      // the streamed last argument, ours now
+    if (conn->stream_val) {
+        if (conn->stream_have < conn->stream_val->len) {
+            return false;   // want read
+        }
+        val = conn->stream_val;
+        conn->stream_val = NULL;
+        req_len = conn->stream_head - 4;
+        parse_streamed(request, req_len, val, cmd);
+    } else {
+        // message body
+        if (4 + len > conn->incoming.size()) {
+            if (len >= k_stream_min && !conn->stream_skip) {
+                conn_stream_start(conn, len);
+            }
+            return false;   // want read
+        }
+        conn->stream_skip = false;
+
+        // got one request, do some application logic
+        if (parse_req(request, len, cmd) < 0) {
+            conn->want_close = true;
+            return false;
+        }
+    }
+
+    if (conn->is_master) {
+        // the primary's stream, counted as it's taken in
+        g_link->offset.store(g_link->offset.load(std::memory_order_relaxed) + 4 + len,
+            std::memory_order_relaxed);
+    } else if ((g_link || (cmd.size() == 3 && str_eq_nocase(cmd[0], "psync")))
+        && conn_intercept(conn, cmd))
+    {
+        buf_consume(conn->incoming, 4 + req_len);
+        if (val) {
+            rcstr_unref(val);
+        }
+        return !conn->to_replica;
+    }
+
+    std::vector<MultiPart> parts;
+    std::vector<uint32_t> key_part;
+    if (multi_needs_split(cmd, parts, key_part) || publish_split(conn->shard, cmd, parts)) {
+        // the parts are copies
+        multi_scatter(conn, parts, key_part);
+        buf_consume(conn->incoming, 4 + req_len);
+        if (val) {
+            rcstr_unref(val);
+        }
+        return false;
+    }
+
+    Shard *owner = cmd_owner(conn->shard, cmd);
+    if (owner != conn->shard) {
+        // hand it to the owning shard and stop until the reply is back
+        ShardMsg *m = new ShardMsg();
+        m->origin = conn->shard;
+        m->conn = conn;
+        m->req.assign((const char *)request, req_len);
+        m->val = val;
+        conn->awaiting_remote = true;
+        buf_consume(conn->incoming, 4 + req_len);
+        shard_post(owner, m);
+        return false;
+    }
+
+    Response &resp = conn->shard->resp;
+    resp.status = RES_OK;
+    resp.data.clear();
+    assert(!resp.ref && resp.refs.empty());
+    size_t aof_before = aof_pending(conn->shard);
+    conn->shard->cmd_val = val;
+    conn->shard->cmd_conn = conn;
+    do_request(conn->shard, cmd, resp);
+    conn->shard->cmd_val = NULL;
+    conn->shard->cmd_conn = NULL;
+    conn_reply(conn, resp);
+    if (uint64_t seq = aof_wait_for(conn->shard, aof_before)) {
+        conn->aof_wait = seq;
+    }
+
+    buf_consume(conn->incoming, 4 + req_len);
+    if (val) {
+        rcstr_unref(val);
+    }
+    // everything went well
+    return true;
+}
+
+#ifdef MSG_ZEROCOPY
+// sends the large value at the front of the queue with MSG_ZEROCOPY. only
+// refcounted values go this way: the kernel reads them after we return, so
+// the memory must not be reused until the completion arrives.
+static ssize_t write_zerocopy(Conn *conn, OutQueue::Seg *seg) {
+    struct iovec iov = {seg->ref->data() + seg->off, seg->len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t rv = sendmsg(conn->fd, &msg, MSG_ZEROCOPY);
+    if (rv > 0) {
+        conn->zc_pending.emplace_back(conn->zc_next_seq++, rcstr_ref(seg->ref));
+    }
+    return rv;
+}
+
+// drops the values whose MSG_ZEROCOPY sends have completed. the kernel
+// reports completions on the socket error queue, which also raises EV_ERR;
+// returns false if there was a real socket error as well.
+static bool handle_zerocopy_done(Conn *conn) {
+    while (true) {
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0) {
+            break;  // EAGAIN: all drained
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) {
+                continue;
+            }
+            // sends [ee_info, ee_data] are done
+            while (!conn->zc_pending.empty()
+                && (int32_t)(conn->zc_pending.front().first - serr.ee_data) <= 0) {
+                rcstr_unref(conn->zc_pending.front().second);
+                conn->zc_pending.pop_front();
+            }
+        }
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+#endif
+
+// the output a connection has queued, sent or not
+static size_t conn_out_size(const Conn *conn) {
+    return conn->outgoing.size() + conn->ring_out.size();
+}
+
+static bool conn_out_over_soft(const Conn *conn) {
+    return g_output_soft && conn_out_size(conn) >= g_output_soft;
+}
+
+// a whole request is waiting in `incoming`
+static bool conn_has_request(const Conn *conn) {
+    if (conn->stream_val) {
+        return conn->stream_have == conn->stream_val->len;
+    }
+    if (conn->incoming.size() < 4) {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data(), 4);
+    return len > k_max_msg || 4 + (size_t)len <= conn->incoming.size();
+}
+
+// reading more would only pile it up: requests are waiting already, or
+// the output is over the soft limit
+static bool conn_input_full(const Conn *conn) {
+    return conn_has_request(conn) || conn_out_over_soft(conn);
+}
+
+// the clock is only looked at every this many requests of a turn
+const uint32_t k_turn_clock_every = 16;
+
+static void turn_begin(Shard *shard) {
+    shard->turn_reqs = 0;
+    shard->turn_over = false;
+    if (g_turn_us) {
+        shard->turn_start_us = get_monotonic_usec();
+    }
+}
+
+// whether the turn is over, looking at the clock too
+static bool turn_check_clock(Shard *shard) {
+    if (!shard->turn_over && g_turn_us
+        && get_monotonic_usec() - shard->turn_start_us >= g_turn_us)
+    {
+        shard->turn_over = true;
+    }
+    return shard->turn_over;
+}
+
+// serves the requests in `incoming` for as long as the turn lasts and the
+// output stays under the soft limit
+static void conn_serve(Conn *conn) {
+    Shard *shard = conn->shard;
+    while (!shard->turn_over && !conn_out_over_soft(conn) && try_one_request(conn)) {
+        shard->turn_reqs++;
+        if (g_turn_reqs && shard->turn_reqs >= g_turn_reqs) {
+            shard->turn_over = true;
+        } else if (shard->turn_reqs % k_turn_clock_every == 0) {
+            (void)turn_check_clock(shard);
+        }
+    }
+    if (conn->want_close) {
+        return;
+    }
+    if (g_output_hard && conn_out_size(conn) > g_output_hard) {
+        LOG_RATELIMITED(LL_WARN, 10, "closing a client with %zu bytes of output,"
+            " over the hard limit", conn_out_size(conn));
+        shard->stats.output_closes.add();
+        conn->want_close = true;
+    } else if (conn_out_over_soft(conn) && conn_has_request(conn)) {
+        shard->stats.output_pauses.add();
+    }
+}
+
+static void conn_ring_send(Conn *conn);
+
+static void handle_write(Conn *conn) {
+    // make sure we have something to write
+    assert(conn->outgoing.size() > 0);
+
+    // appendfsync always: nothing goes out before the writes it acknowledges
+    // are on disk. park until the AOF thread says so.
+    Shard *shard = conn->shard;
+    if (conn->aof_wait > shard->aof_synced.load(std::memory_order_acquire)) {
+        conn->want_read = false;
+        conn->want_write = false;
+        if (!conn->aof_parked) {
+            conn->aof_parked = true;
+            shard->aof_conns.emplace_back(conn, conn->fd);
+        }
+        return;
+    }
+    // its queue entry, if any, is stale now
+    conn->aof_parked = false;
+    if (shard->ring) {
+        conn_ring_send(conn);
+        return;
+    }
+
+    // drain until EAGAIN, an edge-triggered loop won't tell us again
+    while (conn->outgoing.size() > 0) {
+        ssize_t rv = -1;
+#ifdef MSG_ZEROCOPY
+        OutQueue::Seg *seg = g_zerocopy_min ? oq_front_ref(conn->outgoing) : NULL;
+        if (seg && seg->len >= g_zerocopy_min) {
+            rv = write_zerocopy(conn, seg);
+            if (rv < 0 && errno == ENOBUFS) {
+                // out of pinned-memory budget, just copy this segment; the
+                // next one tries again
+                shard->stats.io_syscalls.add();
+                struct iovec iov;
+                rv = writev(conn->fd, &iov, oq_iov(conn->outgoing, &iov, 1));
+            }
+        } else
+#endif
+        {
+            // the headers and small values, and references to large values,
+            // all in one syscall
+            struct iovec iov[64];
+            int n = oq_iov(conn->outgoing, iov, 64);
+            rv = writev(conn->fd, iov, n);
+        }
+        shard->stats.io_syscalls.add();
+
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            // not actually ready
+            return;
+        }
+
+        // if we can't write, we just close the connection
+        if (rv < 0) {
+            conn->want_close = true;
+            return;
+        }
+
+        // remove the data which we have written from the outgoing queue
+        oq_consume(conn->outgoing, (size_t)rv);
+        conn->shard->stats.net_out.add((uint64_t)rv);
+        conn->last_io_ms = conn->shard->now_ms;
+    }
+
+    // has written all data, wants to go back to reading
+    conn->want_read = true;
+    conn->want_write = false;
+}
+
+// takes bytes read from the connection, for conn_serve()
+static void conn_on_data(Conn *conn, const uint8_t *data, size_t len) {
+    conn->last_io_ms = conn->shard->now_ms;
+    if (conn->incoming.size() == 0) {
+        conn->req_start_ms = conn->shard->now_ms;
+    }
+    conn->shard->stats.net_in.add((uint64_t)len);
+    if (conn->stream_val) {
+        // the value being streamed comes first, handle_read() may have read
+        // it into place already
+        uint8_t *dst = (uint8_t *)conn->stream_val->data() + conn->stream_have;
+        size_t n = std::min(len, (size_t)(conn->stream_val->len - conn->stream_have));
+        if (data != dst) {
+            memcpy(dst, data, n);
+        }
+        conn->stream_have += (uint32_t)n;
+        data += n;
+        len -= n;
+    }
+    if (len > 0) {
+        buf_append(conn->incoming, data, len);
+    }
+}
+
+// a turn of the connection: what the last one left over, then new input
+static void handle_read(Conn *conn) {
+    Shard *shard = conn->shard;
+    turn_begin(shard);
+    conn_serve(conn);
+    // want to do non-blocking reads, draining the socket until EAGAIN, or
+    // until the turn is over. the rest stays in the socket for the next one.
+    conn->more_input = false;
+    uint8_t buf[64 * 1024];
+    while (!conn->want_close) {
+        if (conn_input_full(conn) || turn_check_clock(shard)) {
+            conn->more_input = true;
+            break;
+        }
+        uint8_t *dst = buf;
+        size_t cap = sizeof(buf);
+        if (conn->stream_val) {
+            // the rest of a large value, into where it will be stored
+            dst = (uint8_t *)conn->stream_val->data() + conn->stream_have;
+            cap = conn->stream_val->len - conn->stream_have;
+        }
+        ssize_t rv = read(conn->fd, dst, cap);
+        conn->shard->stats.io_syscalls.add();
+
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;  // nothing more to read
+        }
+        // handle IO error
+        if (rv < 0) {
+            LOG_RATELIMITED(LL_WARN, 10, "[errno:%d] read() error", errno);
+            conn->want_close = true;
+            return; // want close
+        }
+        // handle EOF
+        if (rv == 0) {
+            if (conn->incoming.size() == 0) {
+                LOG_RATELIMITED(LL_INFO, 10, "client closed");
+            } else {
+                LOG_RATELIMITED(LL_WARN, 10, "unexpected EOF");
+            }
+            conn->want_close = true;
+            return; // want close
+        }
+
+        // instead of assuming we only have one request, we will
+        // implement pipelining by treating input as byte stream
+        conn_on_data(conn, dst, (size_t)rv);
+        conn_serve(conn);
+    }
+    if (conn->want_close) {
+        return;
+    }
+
+    if (conn->outgoing.size() > 0) {
+        // reading goes on while the output drains, up to the soft limit
+        conn->want_read = !conn_out_over_soft(conn);
+        conn->want_write = true;
+
+        // socket likely ready to write so do it
+        return handle_write(conn);
+    }
+
+}
+
+
+// make listening socket non blocking
+static void fd_set_nb(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+
+static Conn *conn_new(Shard *shard, int connfd);
+
+static Conn *handle_accept(Shard *shard) {
+    int fd = shard->listen_fd;
+    // boilerplate code for handling accept
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+    shard->stats.io_syscalls.add();
+    if (connfd < 0) {
+        return NULL;    // EAGAIN once the accept queue is drained
+    }
+
+    uint32_t ip = client_addr.sin_addr.s_addr;
+    LOG_RATELIMITED(LL_INFO, 10, "new client from %u.%u.%u.%u:%u",
+        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+        ntohs(client_addr.sin_port)
+    );
+
+    // set this new connection fd to non blocking mode
+    fd_set_nb(connfd);
+    return conn_new(shard, connfd);
+}
+
+// the Conn for an accepted socket
+static Conn *conn_new(Shard *shard, int connfd) {
+#ifdef SO_ZEROCOPY
+    if (g_zerocopy_min) {
+        int val = 1;
+        if (setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0) {
+            msg_errno("setsockopt(SO_ZEROCOPY)");
+        }
+    }
+#endif
+
+    // create custom Conn struct and return it
+    Conn *conn = new Conn();
+    conn->fd = connfd;
+    conn->shard = shard;
+    conn->want_read = true;
+    conn->last_io_ms = shard->now_ms;
+    return conn;
+}
+
+// the event loop interest a connection wants right now
+static uint32_t conn_interest(const Conn *conn) {
+    uint32_t events = 0;
+    if (conn->want_read) {
+        events |= EV_READ;
+    }
+    if (conn->want_write) {
+        events |= EV_WRITE;
+    }
+    return events;
+}
+
+// only talk to the kernel when want_read/want_write actually changed
+static void conn_update_interest(Conn *conn) {
+    uint32_t events = conn_interest(conn);
+    if (!conn->shard->loop || events == conn->ev_registered) {
+        return;
+    }
+    conn->shard->stats.io_syscalls.add();
+    if (conn->shard->loop->mod(conn->fd, events) < 0) {
+        msg_errno("event loop mod()");
+        conn->want_close = true;
+        return;
+    }
+    conn->ev_registered = events;
+}
+
+// which timeout applies to the connection in its current state
+static const char *conn_deadline(const Conn *conn, uint64_t &deadline) {
+    if (conn->is_master) {
+        // it goes by the stream's progress instead, see shard_repl_ack()
+        deadline = 0;
+        return "replication";
+    }
+    if (conn->outgoing.size() > 0 || conn->ring_out.size() > 0 || conn->awaiting_remote) {
+        deadline = g_write_timeout_ms ? conn->last_io_ms + g_write_timeout_ms : 0;
+        return "write";
+    }
+    if (conn->incoming.size() > 0) {
+        deadline = g_read_timeout_ms ? conn->req_start_ms + g_read_timeout_ms : 0;
+        return "read";
+    }
+    if (!conn->channels.empty() || !conn->patterns.empty()) {
+        // a subscriber is idle until there's something published
+        deadline = 0;
+        return "idle";
+    }
+    deadline = g_idle_timeout_ms ? conn->last_io_ms + g_idle_timeout_ms : 0;
+    return "idle";
+}
+
+// re-arm the timer after the connection did some io; O(1)
+static void conn_update_timer(Conn *conn) {
+    uint64_t deadline = 0;
+    (void)conn_deadline(conn, deadline);
+    if (deadline) {
+        tw_add(&conn->shard->timers, &conn->timer, deadline);
+    } else {
+        tw_del(&conn->shard->timers, &conn->timer);
+    }
+}
+
+// keep Shard::mem_conns up to date with the connection's buffers
+static void conn_update_mem(Conn *conn) {
+    size_t mem = conn->incoming.capacity() + conn->outgoing.bytes.capacity()
+        + conn->outgoing.segs.capacity() * sizeof(OutQueue::Seg)
+        + conn->ring_out.bytes.capacity() + conn->ring_out.segs.capacity() * sizeof(OutQueue::Seg)
+        + (conn->stream_val ? conn->stream_val->len : 0);
+    conn->shard->mem_conns += mem - conn->mem;
+    conn->mem = mem;
+}
+
+// frees a closed connection once nothing refers to it any more
+static void conn_release(Conn *conn) {
+    if (conn->dead && !conn->awaiting_remote && conn->ring_ops == 0) {
+        delete conn;
+    }
+}
+
+static void conn_ring_update_recv(Conn *conn);
+static void conn_ring_cancel_recv(Conn *conn);
+
+// takes the connection off its shard, all but the socket
+static void conn_detach(Conn *conn) {
+    Shard *shard = conn->shard;
+    shard->mem_conns -= conn->mem;
+    conn->mem = 0;
+    tw_del(&shard->timers, &conn->timer);
+    dlist_detach(&conn->ready);
+    shard->fd2conn[conn->fd] = NULL;
+    shard->stats.conns.sub();
+    conn_unsubscribe_all(conn);
+    if (conn == g_master) {
+        g_master = NULL;
+        repl_link_lost(g_link, false);
+    }
+}
+
+static void conn_destroy(Conn *conn) {
+    Shard *shard = conn->shard;
+    conn_detach(conn);
+    if (shard->ring) {
+        // ends the multishot recv and fails a send in flight, so that the
+        // kernel lets go of the connection
+        (void)shutdown(conn->fd, SHUT_RDWR);
+    } else {
+        (void)shard->loop->del(conn->fd);
+        shard->stats.io_syscalls.add();
+    }
+    (void)close(conn->fd);
+    // the owner shard of a forwarded request, or the kernel, may still hold
+    // a pointer to us
+    conn->dead = true;
+    conn_release(conn);
+}
+
+// PSYNC: the socket goes to the replication thread. with io_uring, only
+// once the recv is cancelled and nothing else is in flight.
+static void conn_handoff(Conn *conn) {
+    Shard *shard = conn->shard;
+    if (shard->ring) {
+        conn_ring_cancel_recv(conn);
+        if (conn->ring_ops > 0) {
+            return;     // back here when they complete
+        }
+    } else {
+        (void)shard->loop->del(conn->fd);
+        shard->stats.io_syscalls.add();
+    }
+    conn_detach(conn);
+    repl_add_replica(g_repl, conn->fd, conn->psync_replid, conn->psync_offset);
+    conn->dead = true;
+    conn_release(conn);
+}
+
+// a connection that can get on without a new event waits in Shard::ready
+// for its next turn
+static void conn_update_ready(Conn *conn) {
+    Shard *shard = conn->shard;
+    bool ready = false;
+    if (!conn->awaiting_remote && !conn_out_over_soft(conn)) {
+        // without io_uring a turn reads too, as far as want_read allows
+        ready = shard->ring ? conn_has_request(conn)
+            : conn->want_read && (conn->more_input || conn_has_request(conn));
+    }
+    if (!ready) {
+        dlist_detach(&conn->ready);
+    } else if (dlist_empty(&conn->ready)) {
+        dlist_insert_before(&shard->ready, &conn->ready);
+        shard->stats.turn_yields.add();
+    }
+}
+
+// after a connection did something: closes it if it wants to, or brings
+// its timer, memory, interest and place in line up to date
+static void conn_settle(Conn *conn) {
+    if (conn->want_close) {
+        conn_destroy(conn);
+        return;
+    }
+    if (conn->to_replica) {
+        conn_handoff(conn);
+        return;
+    }
+    conn_update_timer(conn);
+    conn_update_mem(conn);
+    if (conn->shard->ring) {
+        conn_ring_update_recv(conn);
+    } else {
+        conn_update_interest(conn);
+    }
+    conn_update_ready(conn);
+}
+
+// the next turn of a connection that was in line
+static void conn_turn(Conn *conn) {
+    if (conn->shard->ring) {
+        turn_begin(conn->shard);
+        conn_serve(conn);
+        if (!conn->want_close && conn->outgoing.size() > 0) {
+            conn->want_write = true;
+            handle_write(conn);
+        }
+    } else {
+        handle_read(conn);
+    }
+    conn_settle(conn);
+}
+
+// a turn for every connection in line, oldest first. one that runs out
+// again goes to the back, after the others' turns in the next round.
+static void shard_serve_ready(Shard *shard) {
+    if (dlist_empty(&shard->ready)) {
+        return;
+    }
+    Conn *last = container_of(shard->ready.prev, Conn, ready);
+    while (true) {
+        Conn *conn = container_of(shard->ready.next, Conn, ready);
+        dlist_detach(&conn->ready);
+        bool done = conn == last;
+        conn_turn(conn);
+        if (done) {
+            break;
+        }
+    }
+}
+
+// writes out what was published to subscribers during this iteration, once
+// per subscriber however many messages it got
+static void shard_flush_pushes(Shard *shard) {
+    for (auto &p : shard->pushed) {
+        Conn *conn = p.first;
+        // the connection may have been closed since
+        if (shard->fd2conn[p.second] != conn || !conn->push_queued) {
+            continue;
+        }
+        conn->push_queued = false;
+        if (!conn->want_close && conn->outgoing.size() > 0) {
+            conn->want_write = true;
+            handle_write(conn);
+        }
+        conn_settle(conn);
+    }
+    shard->pushed.clear();
+}
+
+static void conn_register(Conn *conn) {
+    Shard *shard = conn->shard;
+    // resize vector to make sure it can handle the new fd
+    if (shard->fd2conn.size() <= (size_t)conn->fd) {
+        shard->fd2conn.resize(conn->fd + 1);
+    }
+    conn_update_timer(conn);
+    conn_update_mem(conn);
+
+    // put it into the vec keyed by fd
+    shard->fd2conn[conn->fd] = conn;
+    shard->stats.conns.add();
+    shard->stats.conns_total.add();
+}
+
+static void shard_accept(Shard *shard) {
+    // accept everything that is queued up
+    while (Conn *conn = handle_accept(shard)) {
+        shard->stats.io_syscalls.add();
+        if (shard->loop->add(conn->fd, conn_interest(conn)) < 0) {
+            msg_errno("event loop add()");
+            (void)close(conn->fd);
+            delete conn;
+            continue;
+        }
+        conn->ev_registered = conn_interest(conn);
+        conn_register(conn);
+    }
+}
+
+// appendfsync always: let out what waited for batches now on disk
+static void shard_aof_resume(Shard *shard) {
+    uint64_t synced = shard->aof_synced.load(std::memory_order_acquire);
+    while (!shard->aof_replies.empty() && shard->aof_replies.front()->aof_wait <= synced) {
+        ShardMsg *m = shard->aof_replies.front();
+        shard->aof_replies.pop_front();
+        shard_post(m->origin, m);
+    }
+    while (!shard->aof_conns.empty()) {
+        Conn *conn = shard->aof_conns.front().first;
+        int fd = shard->aof_conns.front().second;
+        // the connection may have been closed while it waited
+        if (shard->fd2conn[fd] == conn && conn->aof_parked) {
+            if (conn->aof_wait > synced) {
+                break;
+            }
+            conn->aof_parked = false;
+            conn->want_write = true;
+            handle_write(conn);
+            conn_settle(conn);
+        }
+        shard->aof_conns.pop_front();
+    }
+}
+
+// hands this iteration's mutations to the AOF thread as one batch, and
+// to the replication thread
+static void shard_aof_flush(Shard *shard) {
+    if (!shard->aof_batch) {
+        return;
+    }
+    AofBatch *batch = shard->aof_batch;
+    shard->aof_batch = NULL;
+    if (g_repl && g_repl->active.load(std::memory_order_relaxed)) {
+        repl_feed(g_repl, g_aof ? std::string(batch->data) : std::move(batch->data));
+    }
+    if (!g_aof) {
+        delete batch;
+        return;
+    }
+    batch->owner = shard;
+    batch->seq = ++shard->aof_seq;
+    aof_submit(g_aof, batch);
+}
+
+// called on the AOF thread
+static void aof_on_synced(void *owner, uint64_t seq) {
+    Shard *shard = (Shard *)owner;
+    shard->aof_synced.store(seq, std::memory_order_release);
+    shard_wake(shard);
+}
+
+// stopping every shard for a fork() or a SAVE, see Aof::pause
+static std::mutex g_pause_mu;   // one pauser at a time
+static std::atomic<bool> g_pause_req{false};
+static std::atomic<uint32_t> g_paused{0};
+
+static void pause_sleep() {
+    struct timespec ts = {0, 50 * 1000};
+    nanosleep(&ts, NULL);
+}
+
+// between event loop iterations, when the shard's data is consistent
+static void shard_maybe_pause(Shard *shard) {
+    if (!g_pause_req.load()) {
+        return;
+    }
+    shard_aof_flush(shard);
+    g_paused.fetch_add(1);
+    while (g_pause_req.load()) {
+        pause_sleep();
+    }
+    g_paused.fetch_sub(1);
+}
+
+// `self` is the calling shard, if it is one; it doesn't stop itself
+static void shards_pause_from(Shard *self) {
+    if (self) {
+        // the holder may be waiting for this shard to stop
+        while (!g_pause_mu.try_lock()) {
+            shard_maybe_pause(self);
+            pause_sleep();
+        }
+    } else {
+        g_pause_mu.lock();
+    }
+    g_pause_req.store(true);
+    for (Shard *shard : g_shards) {
+        if (shard != self) {
+            shard_wake(shard);
+        }
+    }
+    while (g_paused.load() < g_shards.size() - (self ? 1 : 0)) {
+        pause_sleep();
+    }
+}
+
+static void shards_pause() {
+    shards_pause_from(NULL);
+}
+
+static void shards_resume() {
+    g_pause_req.store(false);
+    while (g_paused.load() > 0) {
+        pause_sleep();
+    }
+    g_pause_mu.unlock();
+}
+
+static bool shards_save(Shard *self) {
+    shards_pause_from(self);
+    bool ok = snap_save(g_snap);
+    shards_resume();
+    return ok;
+}
+
+// the AOF rewrite child: every key as a set, plus a pexpireat for TTLs
+struct DumpCtx {
+    int fd = -1;
+    bool ok = true;
+    std::string out;
+    uint64_t mono_now = 0;
+    uint64_t unix_now = 0;
+};
+
+// a sorted set as ZADDs of up to this many members
+const size_t k_dump_zadd_members = 64;
+
+static void dump_zset(DumpCtx *ctx, Entry *ent) {
+    std::vector<std::string> scores;
+    std::vector<std::string_view> cmd;
+    ZIter it = zset_seek_rank(entry_zset(ent), 0);
+    while (it.leaf) {
+        scores.clear();
+        cmd.assign({"zadd", entry_key(ent)});
+        for (ZIter i = it; i.leaf && scores.size() < k_dump_zadd_members; zit_next(i)) {
+            char buf[32];
+            scores.emplace_back(buf, fmt_double(buf, sizeof(buf), zit_score(i)));
+        }
+        // the views go in once `scores` won't reallocate any more
+        for (const std::string &score : scores) {
+            ZNode *znode = zit_node(it);
+            cmd.push_back(score);
+            cmd.push_back(std::string_view(znode->name, znode->len));
+            zit_next(it);
+        }
+        append_req(ctx->out, cmd);
+    }
+}
+
+static bool dump_entry(HNode *node, void *arg) {
+    DumpCtx *ctx = (DumpCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type == ENT_ZSET) {
+        dump_zset(ctx, ent);
+    } else {
+        char buf[k_int_buf];
+        append_req(ctx->out, {"set", entry_key(ent), entry_str(ent, buf)});
+    }
+    if (uint64_t expire_at = entry_expire_at(ent)) {
+        uint64_t at = ctx->unix_now + (expire_at - std::min(expire_at, ctx->mono_now));
+        std::string at_str = std::to_string(at);
+        append_req(ctx->out, {"pexpireat", entry_key(ent), at_str});
+    }
+    if (ctx->out.size() >= (1 << 20)) {
+        ctx->ok = aof_write_all(ctx->fd, ctx->out.data(), ctx->out.size());
+        ctx->out.clear();
+    }
+    return ctx->ok;
+}
+
+static bool aof_dump(int fd) {
+    DumpCtx ctx;
+    ctx.fd = fd;
+    ctx.mono_now = get_monotonic_msec();
+    ctx.unix_now = get_realtime_msec();
+    for (Shard *shard : g_shards) {
+        hm_foreach(&shard->db, &dump_entry, &ctx);
+    }
+    return ctx.ok && aof_write_all(fd, ctx.out.data(), ctx.out.size());
+}
+
+// the snapshot: every live key, TTLs as wall clock times
+struct SnapCtx {
+    SnapWriter w;
+    uint64_t mono_now = 0;
+    uint64_t unix_now = 0;
+};
+
+static bool snap_dump_entry(HNode *node, void *arg) {
+    SnapCtx *ctx = (SnapCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    uint64_t at = 0;
+    if (uint64_t expire_at = entry_expire_at(ent)) {
+        if (expire_at <= ctx->mono_now) {
+            return true;    // expired, just not removed yet
+        }
+        at = ctx->unix_now + (expire_at - ctx->mono_now);
+    }
+    if (ent->type == ENT_ZSET) {
+        ZSet *zset = entry_zset(ent);
+        snap_put_zset(&ctx->w, entry_key(ent), zset->size, at);
+        for (ZIter it = zset_seek_rank(zset, 0); it.leaf; zit_next(it)) {
+            ZNode *znode = zit_node(it);
+            snap_put_zmember(&ctx->w, std::string_view(znode->name, znode->len), zit_score(it));
+        }
+    } else {
+        char buf[k_int_buf];
+        snap_put(&ctx->w, entry_key(ent), entry_str(ent, buf), at);
+    }
+    return ctx->w.ok;
+}
+
+static bool snap_dump(int fd) {
+    SnapCtx ctx;
+    ctx.mono_now = get_monotonic_msec();
+    ctx.unix_now = get_realtime_msec();
+    uint64_t nkeys = 0;
+    for (Shard *shard : g_shards) {
+        nkeys += hm_size(&shard->db);
+    }
+    snap_begin(&ctx.w, fd, nkeys);
+    for (Shard *shard : g_shards) {
+        hm_foreach(&shard->db, &snap_dump_entry, &ctx);
+    }
+    return snap_end(&ctx.w);
+}
+
+static void snap_on_header(uint64_t nkeys, void *arg) {
+    (void)arg;
+    // the keys spread evenly over the shards, give or take
+    size_t per_shard = (size_t)(nkeys / g_shards.size());
+    for (Shard *shard : g_shards) {
+        hm_reserve(&shard->db, per_shard + per_shard / 16);
+    }
+}
+
+static void snap_on_record(const SnapRecord &rec, void *arg) {
+    uint64_t unix_now = *(uint64_t *)arg;
+    if (rec.expire_unix_ms && rec.expire_unix_ms <= unix_now) {
+        return;
+    }
+    uint64_t hcode = str_hash((const uint8_t *)rec.key.data(), rec.key.size());
+    Shard *shard = key_owner(hcode);
+    // keys are unique in a snapshot, no lookup needed
+    bool ttl = rec.expire_unix_ms != 0;
+    Entry *ent = NULL;
+    if (rec.type == SNAP_ZSET) {
+        // in score order, so the tree fills its nodes up as it goes
+        ZSet *zset = new ZSet();
+        std::string_view members = rec.val;
+        for (uint64_t i = 0; i < rec.zcount; i++) {
+            std::string_view member;
+            double score = 0;
+            snap_next_zmember(members, member, score);
+            zset_add(zset, member, score);
+        }
+        ent = entry_new(shard, rec.key, hcode, ttl, ENT_ZSET, ENC_PTR, 0);
+        entry_put_ptr(ent, zset);
+    } else {
+        StrVal v;
+        strval_init(v, rec.val, NULL);
+        ent = entry_new(shard, rec.key, hcode, ttl, ENT_STR, v.enc, rec.val.size());
+        entry_put_str(ent, v);
+    }
+    entry_touch_new(shard, ent);
+    hm_insert(&shard->db, &ent->node);
+    if (ttl) {
+        ent = entry_set_ttl(shard, ent, shard->now_ms + (rec.expire_unix_ms - unix_now));
+    }
+    shard->mem_entries += entry_mem(ent);
+}
+
+// replays one command from the AOF on the shard that owns its key. the
+// shard count may have changed since, so multi-key commands are split anew.
+static void aof_apply(std::vector<std::string_view> &cmd, void *arg) {
+    (void)arg;
+    std::vector<MultiPart> parts;
+    std::vector<uint32_t> key_part;
+    if (multi_needs_split(cmd, parts, key_part)) {
+        for (MultiPart &part : parts) {
+            Response resp;
+            do_request(part.shard, part.cmd, resp);
+        }
+        return;
+    }
+    Shard *owner = cmd_owner(g_shards[0], cmd);
+    Response resp;
+    do_request(owner, cmd, resp);
+}
+
+// puts the replies of a split command back together: an error if any part
+// failed, the elements in key order for arrays, the sum for counts
+static void multi_merge(MultiReq *mr, Response &out) {
+    for (ShardMsg *m : mr->parts) {
+        if (m->resp.status == RES_ERR) {
+            out.status = RES_ERR;
+            out.data = m->resp.data;
+            return;
+        }
+    }
+    Response &first = mr->parts[0]->resp;
+    if (first.status == RES_ARR) {
+        // every part's elements, in its keys' order; a value is inline or
+        // one of the part's references, in order
+        std::vector<size_t> pos(mr->parts.size(), 4), ref(mr->parts.size(), 0);
+        out_arr_begin(out);
+        for (uint32_t p : mr->key_part) {
+            Response &r = mr->parts[p]->resp;
+            uint32_t len = 0;
+            memcpy(&len, &r.data[pos[p]], 4);
+            pos[p] += 4;
+            if (len == k_arr_nil) {
+                out_arr_push_nil(out);
+            } else if (ref[p] < r.refs.size() && r.refs[ref[p]].first == pos[p]) {
+                out_arr_push_val(out, r.refs[ref[p]++].second);
+            } else {
+                out_arr_push(out, std::string_view((const char *)&r.data[pos[p]], len));
+                pos[p] += len;
+            }
+        }
+        out_arr_end(out, (uint32_t)mr->key_part.size());
+    } else if (!first.data.empty()) {
+        int64_t sum = 0;
+        for (ShardMsg *m : mr->parts) {
+            int64_t v = 0;
+            std::string_view s((const char *)m->resp.data.data(), m->resp.data.size());
+            if (str2int(s, v)) {
+                sum += v;
+            }
+        }
+        out_int(out, sum);
+    }
+}
+
+static void multi_free(MultiReq *mr) {
+    for (ShardMsg *m : mr->parts) {
+        delete m;
+    }
+    delete mr;
+}
+
+static void shard_handle_inbox(Shard *shard) {
+    // reset the wakeup before draining, so a post racing with us re-arms it
+    uint8_t buf[256];
+    do {
+        shard->stats.io_syscalls.add();
+    } while (read(shard->wake_rfd, buf, sizeof(buf)) > 0);
+    shard->wake_pending.store(false);
+
+    while (MpscNode *node = shard->inbox.pop()) {
+        ShardMsg *m = static_cast<ShardMsg *>(node);
+        if (!m->done) {
+            // a request for one of our keys: serve it and send it back
+            const uint8_t *req = (const uint8_t *)m->req.data();
+            if (m->val) {
+                parse_streamed(req, m->req.size(), m->val, shard->cmd);
+            } else {
+                (void)parse_req(req, m->req.size(), shard->cmd);
+            }
+            size_t aof_before = aof_pending(shard);
+            shard->cmd_val = m->val;
+            do_request(shard, shard->cmd, m->resp);
+            shard->cmd_val = NULL;
+            if (m->val) {
+                rcstr_unref(m->val);
+                m->val = NULL;
+            }
+            m->done = true;
+            m->aof_wait = aof_wait_for(shard, aof_before);
+            if (m->aof_wait) {
+                shard->aof_replies.push_back(m);    // after the fsync
+                continue;
+            }
+            shard_post(m->origin, m);
+            continue;
+        }
 
-        // did not find key in map
-        if (it == g_data.end()) {
-            out.status = RES_NX;
-            return;
+        // the reply to one of our own connections, or to the last
+        // outstanding part of one
+        MultiReq *mr = m->multi;
+        if (mr && --mr->pending > 0) {
+            continue;
+        }
+        Conn *conn = m->conn;
+        conn->awaiting_remote = false;
+        if (conn->dead) {
+            if (mr) {
+                multi_free(mr);
+            } else {
+                delete m;
+            }
+            conn_release(conn);
+            continue;
+        }
+        if (mr) {
+            Response resp;
+            multi_merge(mr, resp);
+            conn_reply(conn, resp);
+            multi_free(mr);
+        } else {
+            conn_reply(conn, m->resp);
+            delete m;
         }
 
-        // assign the value to the response
-        const std::string &val = it->second;
-        out.data.assign(val.begin(), val.end());
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        // SET key value request for redis
-        g_data[cmd[1]].swap(cmd[2]);
-        const std::string &val = g_data.find(cmd[1])->second;
-        out.data.assign(val.begin(), val.end());
-        out.status = RES_OK;
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        // DEL key request for redis
-        g_data.erase(cmd[1]);
-        out.status = RES_OK;
-    } else {
-        // unrecognized command
-        out.status = RES_ERR;
+        // resume the requests that were pipelined behind it, for a turn
+        turn_begin(shard);
+        conn_serve(conn);
+        if (!conn->want_close && conn->outgoing.size() > 0) {
+            conn->want_read = !conn_out_over_soft(conn);
+            conn->want_write = true;
+            handle_write(conn);
+        }
+        conn_settle(conn);
     }
+    shard_aof_resume(shard);
 }
 
-static void msg(const char *msg) {
-    fprintf(stderr, "%s\n", msg);
-}
-
-static void msg_errno(const char *msg) {
-    fprintf(stderr, "[errno:%d] %s\n", errno, msg);
-}
-
-static void die(const char *msg) {
-    fprintf(stderr, "[%d] %s\n", errno, msg);
-    abort();
+static void conn_timeout(Conn *conn) {
+    uint64_t deadline = 0;
+    const char *kind = conn_deadline(conn, deadline);
+    LOG_RATELIMITED(LL_INFO, 10, "closing fd %d: %s timeout", conn->fd, kind);
+    conn_destroy(conn);
 }
 
-static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
-    // inserts data to data + len into the end of the buffer
-    buf.insert(buf.end(), data, data + len);
+// deletes expired keys that nobody reads. like redis, it samples random
+// keys with a TTL, and goes for another round while more than a quarter of
+// the sample had expired. returns whether it stopped on the time budget.
+static bool shard_active_expire(Shard *shard) {
+    uint64_t start = get_monotonic_usec();
+    while (!shard->expires.empty()) {
+        size_t nsample = std::min(k_expire_samples, shard->expires.size());
+        size_t nexpired = 0;
+        for (size_t i = 0; i < nsample && !shard->expires.empty(); i++) {
+            Entry *ent = shard->expires[shard_rand(shard) % shard->expires.size()];
+            if (entry_expired(shard, ent)) {
+                entry_remove(shard, ent);
+                shard->stats.expired.add();
+                nexpired++;
+            }
+        }
+        if (nexpired * 4 <= nsample) {
+            return false;   // mostly live keys left
+        }
+        if (get_monotonic_usec() - start >= k_expire_budget_us) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static void buf_consume(std::vector<uint8_t> &buf, size_t len) {
-    // removes length len from the beginning of the buffer
-    buf.erase(buf.begin(), buf.begin() + len);
+// moves an entry out of a page the defragmentation pass is emptying
+static HNode *defrag_entry(HNode *node, void *arg) {
+    Shard *shard = (Shard *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    size_t size = entry_size(ent);
+    if (!slab_should_move(&shard->slab, ent, size)) {
+        return node;
+    }
+    Entry *moved = (Entry *)slab_alloc(&shard->slab, size);
+    memcpy(moved, ent, size);
+    if (entry_expire_at(moved)) {
+        shard->expires[entry_expire_idx(moved)] = moved;
+    }
+    slab_free(&shard->slab, ent, size);
+    shard->slab.defrag_moved++;
+    return &moved->node;
 }
 
-static bool read_u32(const uint8_t *&curr, const uint8_t *end, uint32_t &out) {
-    // if there isn't enough space to read 4 bytes, return false
-    if (curr + 4 > end) {
-        return false;
+// one time slice of a defragmentation pass, which starts if a size class
+// has pages to gain. returns whether the pass goes on.
+static bool shard_defrag_step(Shard *shard) {
+    if (!shard->slab.defragging) {
+        if (!slab_defrag_begin(&shard->slab)) {
+            return false;
+        }
+        shard->defrag_cursor = 0;
     }
-
-    // update out and curr
-    memcpy(&out, curr, 4);
-    curr += 4;
+    uint64_t start = get_monotonic_usec();
+    do {
+        shard->defrag_cursor = hm_scan(&shard->db, shard->defrag_cursor, k_defrag_groups,
+            &defrag_entry, shard);
+        if (shard->defrag_cursor == 0) {
+            // what the scan missed, if a resize moved it, stays put
+            slab_defrag_end(&shard->slab);
+            return false;
+        }
+    } while (get_monotonic_usec() - start < k_defrag_budget_us);
     return true;
 }
 
-static bool read_str(const uint8_t *&curr, const uint8_t *end, size_t n, std::string &out) {
-    if (curr + n > end) {
-        return false;
+void shard_defrag(Shard *shard) {
+    while (shard_defrag_step(shard)) {
     }
-    out.assign(curr, curr + n);
-    curr += n;
-    return true;
 }
 
-static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
-    // find end pointer of data
-    const uint8_t *end = data + size;
+// a replica tells its primary how far it has applied the stream, for the
+// lag numbers: this often while it moves, every second when it doesn't. a
+// stream that doesn't move for the timeout, PINGs included, is dead.
+const uint64_t k_repl_ack_ms = 100;
 
-    // find num of arguments in the request
-    uint32_t nstr = 0;
-    // if you can't read the number of arguments, return -1
-    if (!read_u32(data, end, nstr)) {
-        return -1;
+static void shard_repl_ack(Shard *shard) {
+    Conn *conn = g_master;
+    if (!conn) {
+        return;
     }
-    // if the number of arguments is greater than the max, return -1
-    if (nstr > k_max_args) {
-        return -1;
+    uint64_t offset = g_link->offset.load(std::memory_order_relaxed);
+    if (offset != g_master_acked) {
+        g_master_moved_ms = shard->now_ms;
+    } else if (g_link->timeout_ms && shard->now_ms - g_master_moved_ms >= g_link->timeout_ms) {
+        LOG_WARN("replication: nothing from the primary for %llu ms",
+            (unsigned long long)(shard->now_ms - g_master_moved_ms));
+        conn_destroy(conn);
+        return;
     }
-
-    // read the arguments
-    while (out.size() < nstr) {
-        uint32_t len = 0;  
-        if (!read_u32(data, end, len)) {
-            return -1;
-        }
-        out.push_back(std::string());
-        if(!read_str(data, end, len, out.back())) {
-            return -1;
-        }
+    if (offset != g_master_acked || shard->now_ms - g_master_acked_ms >= 1000) {
+        std::string off = std::to_string(offset);
+        std::string req;
+        append_req(req, {"replconf", "ack", off});
+        oq_append(conn->outgoing, (const uint8_t *)req.data(), req.size());
+        g_master_acked = offset;
+        g_master_acked_ms = shard->now_ms;
+        conn->want_write = true;
+        handle_write(conn);
+        conn_settle(conn);
     }
-
-    // if there's still data left, return -1
-    if (data != end) {
-        return -1;
+    if (g_master) {
+        tw_add(&shard->timers, &shard->repl_timer, shard->now_ms + k_repl_ack_ms);
     }
-    return 0;
-
-}
-
-static void make_response(const Response &resp, std::vector<uint8_t> &out) {
-    uint32_t resp_len = 4 + (uint32_t)resp.data.size();
-
-    printf("Response Length: %u\n", resp_len);
-    printf("Response Status: %u\n", resp.status);
-    std::string response_data(resp.data.begin(), resp.data.end());
-    printf("Response Data (%lu bytes): %s\n", resp.data.size(), response_data.c_str());
-    // appends response length, then response status and finally response data to buffer
-    buf_append(out, (const uint8_t *)&resp_len, 4);
-    buf_append(out, (const uint8_t *)&resp.status, 4);
-    buf_append(out, resp.data.data(), resp.data.size());
 }
 
-static bool try_one_request(Conn *conn) {
-    // try to parse the protocol: message header
-    if (conn->incoming.size() < 4) {
-        return false;   // want read
+static void shard_on_timer(Timer *timer, void *arg) {
+    Shard *shard = (Shard *)arg;
+    if (timer == &shard->repl_timer) {
+        shard_repl_ack(shard);
+        return;
     }
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
-    if (len > k_max_msg) {
-        msg("too long");
-        conn->want_close = true;
-        return false;   // want close
+    if (timer == &shard->defrag_timer) {
+        // like the expiry cycle: back soon while a pass is under way
+        uint64_t delay = shard_defrag_step(shard) ? 3 : k_defrag_period_ms;
+        tw_add(&shard->timers, &shard->defrag_timer, shard->now_ms + delay);
+        return;
     }
-    // message body
-    if (4 + len > conn->incoming.size()) {
-        return false;   // want read
+    if (timer != &shard->expire_timer) {
+        conn_timeout(container_of(timer, Conn, timer));
+        return;
     }
-    const uint8_t *request = &conn->incoming[4];
-
-    // got one request, do some application logic
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
-        conn->want_close = true;
-        return false;
+    bool behind = shard_active_expire(shard);
+    if (!shard->expires.empty()) {
+        // come back soon if there is a backlog of expired keys, still
+        // leaving most of the time for requests
+        uint64_t delay = behind ? 3 : k_expire_period_ms;
+        tw_add(&shard->timers, &shard->expire_timer, shard->now_ms + delay);
     }
+}
 
-    Response resp;
-    do_request(cmd, resp);
-    make_response(resp, conn->outgoing);
+// the io_uring loop. accepts and reads are multishot: armed once, they
+// complete for every connection and every chunk of data, reads into buffers
+// the kernel picks from shard->ring_bufs. sends are SENDMSGs of the output
+// queue. everything queued up while handling one round of completions is
+// submitted by the single io_uring_enter() that waits for the next round.
+const uint32_t k_ring_entries = 1024;
+const uint32_t k_ring_bufs = 1024;          // per shard, a power of 2
+const uint32_t k_ring_buf_size = 4096;
 
-    buf_consume(conn->incoming, 4 + len);
-    // everything went well
-    return true;
+// user_data: a Conn pointer, or NULL, with the kind of op in the low bits
+enum {
+    UD_ACCEPT = 0,
+    UD_WAKE = 1,
+    UD_RECV = 2,
+    UD_SEND = 3,
+    UD_CANCEL = 4,
+};
+const uint64_t k_ud_kind = 7;
+// with whole requests waiting, input beyond this pauses the recv; short
+// of it, the recv isn't worth cancelling and arming again
+const size_t k_ring_input_max = 64 << 10;
+
+static struct io_uring_sqe *shard_sqe(Shard *shard) {
+    struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+    if (!sqe) {
+        // the submission queue is full, hand it over now
+        int rv = uring_submit_and_wait(shard->ring, 0, 0);
+        shard->stats.io_syscalls.add();
+        if (rv < 0 && rv != -EINTR) {
+            errno = -rv;
+            die("io_uring_enter()");
+        }
+        sqe = uring_get_sqe(shard->ring);
+        assert(sqe);
+    }
+    return sqe;
 }
 
-static void handle_write(Conn *conn) {
-    // make sure we have something to write
-    assert(conn->outgoing.size() > 0);
+static void ring_arm_accept(Shard *shard) {
+    uring_prep_accept_multishot(shard_sqe(shard), shard->listen_fd, UD_ACCEPT);
+}
 
-    ssize_t rv = write(conn->fd, conn->outgoing.data(), conn->outgoing.size());
+static void ring_arm_wake(Shard *shard) {
+    uring_prep_poll_multishot(shard_sqe(shard), shard->wake_rfd, POLLIN, UD_WAKE);
+}
 
-    if (rv < 0 && errno == EAGAIN) {
-        // not actually ready
-        return;
+static void ring_arm_recv(Conn *conn) {
+    uring_prep_recv_multishot(shard_sqe(conn->shard), conn->fd, conn->shard->ring_bufs->bgid,
+        (uint64_t)(uintptr_t)conn | UD_RECV);
+    conn->ring_ops++;
+    conn->ring_recv = true;
+}
+
+static void conn_ring_cancel_recv(Conn *conn) {
+    if (conn->ring_recv && !conn->ring_recv_cancel) {
+        uring_prep_cancel(shard_sqe(conn->shard), (uint64_t)(uintptr_t)conn | UD_RECV,
+            (uint64_t)(uintptr_t)conn | UD_CANCEL);
+        conn->ring_ops++;
+        conn->ring_recv_cancel = true;
     }
+}
 
-    // if we can't write, we just close the connection
-    if (rv < 0) {
-        conn->want_close = true;
-        return;
+// reading pauses like it does with the other loops, by cancelling the
+// multishot recv, and resumes by arming it again
+static void conn_ring_update_recv(Conn *conn) {
+    bool pause = conn_out_over_soft(conn)
+        || (conn_has_request(conn) && conn->incoming.size() >= k_ring_input_max);
+    if (pause) {
+        conn_ring_cancel_recv(conn);
+    } else if (!conn->ring_recv) {
+        ring_arm_recv(conn);
     }
+}
 
-    // remove the data which we have written from the outgoing buffer
-    buf_consume(conn->outgoing, (size_t)rv);    
+// sends the front of `ring_out`
+static void conn_ring_submit_send(Conn *conn) {
+    int n = oq_iov(conn->ring_out, conn->ring_iov, k_ring_iov);
+    conn->ring_msg = {};
+    conn->ring_msg.msg_iov = conn->ring_iov;
+    conn->ring_msg.msg_iovlen = (size_t)n;
+    uring_prep_sendmsg(shard_sqe(conn->shard), conn->fd, &conn->ring_msg, MSG_NOSIGNAL,
+        (uint64_t)(uintptr_t)conn | UD_SEND);
+    conn->ring_ops++;
+}
 
-    // has written all data, wants to go back to reading
+// handle_write() for io_uring. one send in flight per connection, which
+// `ring_out` is non-empty for; output queued meanwhile goes out when it
+// completes.
+static void conn_ring_send(Conn *conn) {
+    if (conn->ring_out.size() > 0) {
+        return;
+    }
     if (conn->outgoing.size() == 0) {
         conn->want_read = true;
         conn->want_write = false;
+        return;
     }
+    oq_swap(conn->ring_out, conn->outgoing);
+    conn_ring_submit_send(conn);
 }
 
-static void handle_read(Conn *conn) {
-    // want to do a non-blocking read
-    uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+static void ring_on_accept(Shard *shard, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        ring_arm_accept(shard);
+    }
+    if (cqe->res < 0) {
+        LOG_RATELIMITED(LL_WARN, 10, "[errno:%d] accept() error", -cqe->res);
+        return;
+    }
+    Conn *conn = conn_new(shard, cqe->res);
+    conn_register(conn);
+    ring_arm_recv(conn);
+}
 
-    if (rv < 0 && errno == EAGAIN) {
-        return; // actually not ready
+static void ring_on_recv(Conn *conn, const struct io_uring_cqe *cqe) {
+    Shard *shard = conn->shard;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // armed again by conn_ring_update_recv(), unless reading is paused
+        conn->ring_ops--;
+        conn->ring_recv = false;
+        conn->ring_recv_cancel = false;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && !conn->dead) {
+            conn_on_data(conn, uring_buf(shard->ring_bufs, bid), (size_t)cqe->res);
+            // unless it's in line for a turn already
+            if (dlist_empty(&conn->ready)) {
+                turn_begin(shard);
+                conn_serve(conn);
+            }
+        }
+        uring_buf_recycle(shard->ring_bufs, bid);
     }
-    // handle IO error
-    if (rv < 0) {
-        msg_errno("read() error");
+    if (conn->dead) {
+        conn_release(conn);
+        return;
+    }
+    if (cqe->res == 0) {
+        LOG_RATELIMITED(LL_INFO, 10, "client closed");
+        conn->want_close = true;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        LOG_RATELIMITED(LL_WARN, 10, "[errno:%d] recv() error", -cqe->res);
         conn->want_close = true;
-        return; // want close
     }
-    // handle EOF
-    if (rv == 0) {
-        if (conn->incoming.size() == 0) {
-            msg("client closed");
-        } else {
-            msg("unexpected EOF");
-        }
+    if (!conn->want_close && conn->outgoing.size() > 0) {
+        conn->want_write = true;
+        handle_write(conn);
+    }
+}
+
+static void ring_on_send(Conn *conn, const struct io_uring_cqe *cqe) {
+    conn->ring_ops--;
+    if (conn->dead) {
+        conn_release(conn);
+        return;
+    }
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        conn_ring_submit_send(conn);
+        return;
+    }
+    if (cqe->res < 0) {
         conn->want_close = true;
-        return; // want close
+        return;
+    }
+    oq_consume(conn->ring_out, (size_t)cqe->res);
+    conn->shard->stats.net_out.add((uint64_t)cqe->res);
+    conn->last_io_ms = conn->shard->now_ms;
+    if (conn->ring_out.size() > 0) {
+        conn_ring_submit_send(conn);    // a short send
+    } else if (conn->outgoing.size() > 0) {
+        handle_write(conn);     // which may have to wait for the AOF
+    } else {
+        conn_ring_send(conn);
     }
+}
 
-    // add new data to the incoming buffer for connection
-    buf_append(conn->incoming, buf, (size_t)rv);
+static void ring_complete(Shard *shard, const struct io_uring_cqe *cqe) {
+    uint64_t kind = cqe->user_data & k_ud_kind;
+    if (kind == UD_ACCEPT) {
+        ring_on_accept(shard, cqe);
+        return;
+    }
+    if (kind == UD_WAKE) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring_arm_wake(shard);
+        }
+        shard_handle_inbox(shard);
+        return;
+    }
 
-    // instead of assuming we only have one request, we will
-    // implement pipelining by treating input as byte stream
-    while (try_one_request(conn)) {
+    Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~k_ud_kind);
+    if (kind == UD_CANCEL) {
+        conn->ring_ops--;
+        if (conn->dead) {
+            conn_release(conn);
+            return;
+        }
+        if (cqe->res < 0) {
+            conn->ring_recv_cancel = false;     // missed it, try again
+        }
+    } else if (kind == UD_RECV) {
+        ring_on_recv(conn, cqe);
+    } else {
+        ring_on_send(conn, cqe);
     }
+    if (conn->dead) {
+        return;     // possibly freed
+    }
+    conn_settle(conn);
+}
 
-    if (conn->outgoing.size() > 0) {
-        conn->want_read = false;
-        conn->want_write = true;
+static bool flush_collect(HNode *node, void *arg) {
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
 
-        // socket likely ready to write so do it
-        return handle_write(conn);
+// drops every key, for a full resync
+static void shard_flush(Shard *shard) {
+    std::vector<Entry *> ents;
+    hm_foreach(&shard->db, &flush_collect, &ents);
+    hm_clear(&shard->db);
+    for (Entry *ent : ents) {
+        entry_del(shard, ent);
     }
-
 }
 
+// called on the link thread
+static void link_on_ready() {
+    shard_wake(g_shards[0]);
+}
 
-// make listening socket non blocking
-static void fd_set_nb(int fd) {
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+// shard 0 takes the link over once it's synced. a snapshot from the primary
+// replaces the dataset, with every shard stopped; then the stream comes in
+// like a client's pipelined requests.
+static void shard_repl_adopt(Shard *shard) {
+    ReplLink *link = g_link;
+    if (link->full) {
+        uint64_t start = get_monotonic_msec();
+        shards_pause_from(shard);
+        for (Shard *s : g_shards) {
+            shard_flush(s);
+        }
+        uint64_t unix_now = get_realtime_msec();
+        int64_t nrec = snap_load(link->snap_path.c_str(), &snap_on_header, &snap_on_record,
+            &unix_now);
+        // an idle shard wouldn't until its next event
+        for (Shard *s : g_shards) {
+            shard_publish_stats(s);
+        }
+        shards_resume();
+        (void)unlink(link->snap_path.c_str());
+        if (nrec < 0) {
+            LOG_ERROR("replication: the primary's snapshot doesn't load");
+            (void)close(link->fd);
+            repl_link_lost(link, true);
+            return;
+        }
+        LOG_INFO("replication: loaded %lld keys in %llu ms", (long long)nrec,
+            (unsigned long long)(get_monotonic_msec() - start));
+        if (g_aof) {
+            aof_rewrite(g_aof);     // it has none of them
+        }
+    }
+    Conn *conn = conn_new(shard, link->fd);
+    conn->is_master = true;
+    if (shard->ring) {
+        conn_register(conn);
+        ring_arm_recv(conn);
+    } else {
+        if (shard->loop->add(conn->fd, conn_interest(conn)) < 0) {
+            msg_errno("event loop add()");
+            (void)close(conn->fd);
+            delete conn;
+            repl_link_lost(link, false);
+            return;
+        }
+        conn->ev_registered = conn_interest(conn);
+        conn_register(conn);
+    }
+    link->state.store(LINK_UP);
+    g_master = conn;
+    g_master_acked = link->offset.load(std::memory_order_relaxed);
+    g_master_acked_ms = g_master_moved_ms = shard->now_ms;
+    tw_add(&shard->timers, &shard->repl_timer, shard->now_ms + k_repl_ack_ms);
 }
 
+static void shard_repl_check(Shard *shard) {
+    if (g_link && shard->id == 0 && g_link->state.load() == LINK_READY) {
+        shard_repl_adopt(shard);
+    }
+}
 
-static Conn *handle_accept(int fd) {
-    // boilerplate code for handling accept
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
-    if (connfd < 0) {
-        return NULL;
+static void shard_run_uring(Shard *shard) {
+    // set up on the shard's own thread, the only one to submit to it
+    shard->ring = new Uring();
+    if (!uring_init(shard->ring, k_ring_entries)) {
+        die("io_uring_setup()");
     }
+    shard->ring_bufs = new UringBufRing();
+    if (!uring_buf_ring_init(shard->ring, shard->ring_bufs, 0, k_ring_bufs, k_ring_buf_size)) {
+        die("io_uring provided buffers");
+    }
+    ring_arm_accept(shard);
+    ring_arm_wake(shard);
 
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-        ntohs(client_addr.sin_port)
-    );
+    while (true) {
+        // submits and waits for completions, or the next deadline. with
+        // connections in line, only submits and picks up what's there.
+        bool idle = dlist_empty(&shard->ready);
+        int timeout_ms = (int)tw_next_timeout(&shard->timers);
+        uint64_t wait_start = get_monotonic_usec();
+        int rv = uring_submit_and_wait(shard->ring, idle ? 1 : 0, timeout_ms);
+        shard->stats.io_syscalls.add();
+        // EBUSY: the completion queue overflowed, draining it fixes that
+        if (rv < 0 && rv != -EINTR && rv != -ETIME && rv != -EBUSY) {
+            errno = -rv;
+            die("io_uring_enter()");
+        }
+        uint64_t woke = get_monotonic_usec();
+        shard->now_ms = woke / 1000;
+        shard->stats.loop_iters.add();
+        shard->stats.loop_wait_us.add(woke - wait_start);
+
+        while (struct io_uring_cqe *cqe = uring_peek_cqe(shard->ring)) {
+            // handlers may submit, which may need the slot back
+            struct io_uring_cqe copy = *cqe;
+            uring_cqe_seen(shard->ring);
+            ring_complete(shard, &copy);
+        }
+        shard_serve_ready(shard);
 
-    // set this new connection fd to non blocking mode
-    fd_set_nb(connfd);
+        // close the connections that ran out of time, expire keys
+        tw_advance(&shard->timers, shard->now_ms, &shard_on_timer, shard);
+        shard_flush_pushes(shard);
 
-    // create custom Conn struct and return it
-    Conn *conn = new Conn();
-    conn->fd = connfd;
-    conn->want_read = true;
-    return conn;
+        shard_repl_check(shard);
+        shard_publish_stats(shard);
+        // group commit: one AOF batch per iteration
+        shard_aof_flush(shard);
+        shard_maybe_pause(shard);
+    }
 }
 
-
-static void do_something(int connfd)
-{
-    // connfd is a file descriptor for the connected socket
-    char rbuf[64] = {};
-    // leaves 1 byte for null terminator
-    ssize_t n = read(connfd, rbuf, sizeof(rbuf) - 1);
-    if (n < 0)
-    {
-        msg("read() error");
-        return;
+static void shard_run(Shard *shard) {
+    if (g_uring) {
+        return shard_run_uring(shard);
     }
-    printf("client says: %s\n", rbuf);
+    std::vector<Event> events;
+    while (true) {
+        // this block waits for the readiness of the fds, or the next
+        // deadline. with connections in line, it only polls.
+        int timeout_ms = dlist_empty(&shard->ready) ? (int)tw_next_timeout(&shard->timers) : 0;
+        uint64_t wait_start = get_monotonic_usec();
+        int rv = shard->loop->wait(events, timeout_ms);
+        shard->stats.io_syscalls.add();
+        // EINTR is not an error, no fds are ready
+        if (rv < 0 && errno != EINTR) {
+            die("event loop wait()");
+        }
+        uint64_t woke = get_monotonic_usec();
+        shard->now_ms = woke / 1000;
+        shard->stats.loop_iters.add();
+        shard->stats.loop_wait_us.add(woke - wait_start);
+
+        for (const Event &ev : events) {
+            if (ev.fd == shard->listen_fd) {
+                shard_accept(shard);
+                continue;
+            }
+            if (ev.fd == shard->wake_rfd) {
+                shard_handle_inbox(shard);
+                continue;
+            }
+
+            Conn *conn = shard->fd2conn[ev.fd];
+            if (!conn) {
+                continue;
+            }
+
+            // if conn is ready, then read/write to it based on flags. one
+            // in line gets its turn when it's up.
+            if ((ev.events & EV_READ) && conn->want_read) {
+                if (dlist_empty(&conn->ready)) {
+                    handle_read(conn);
+                } else {
+                    conn->more_input = true;
+                }
+            }
+            if ((ev.events & EV_WRITE) && conn->want_write && !conn->want_close) {
+                handle_write(conn);
+            }
+
+            bool err = ev.events & EV_ERR;
+#ifdef MSG_ZEROCOPY
+            // zerocopy completions also show up as errors
+            if (err && !conn->zc_pending.empty()) {
+                err = !handle_zerocopy_done(conn);
+            }
+#endif
+
+            // delete conn from fd2conn on error or if the connection wants to close
+            if (err) {
+                conn_destroy(conn);
+                continue;
+            }
+            conn_settle(conn);
+        }
+        shard_serve_ready(shard);
+
+        // close the connections that ran out of time, expire keys
+        tw_advance(&shard->timers, shard->now_ms, &shard_on_timer, shard);
+        shard_flush_pushes(shard);
 
-    char wbuf[] = "world";
-    write(connfd, wbuf, strlen(wbuf));
+        shard_repl_check(shard);
+        shard_publish_stats(shard);
+        // group commit: one AOF batch per iteration
+        shard_aof_flush(shard);
+        shard_maybe_pause(shard);
+    }
 }
 
-int main()
-{
+static int listen_socket(bool reuseport) {
     // AF_INET: IPv4
     // SOCK_STREAM: TCP
     int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -337,10 +3709,15 @@ int main()
     // Set the SO_REUSEADDR option to allow binding to an address that is already in use
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    // with several shards, each binds its own socket and the kernel spreads
+    // incoming connections between them
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+        die("setsockopt(SO_REUSEPORT)");
+    }
 
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(g_port);
     addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
 
     // changed (const sockaddr *) to (const struct sockaddr *)
@@ -359,83 +3736,291 @@ int main()
         die("listen()");
     }
 
-    // map of the client connected, keyed by fd
-    std::vector<Conn *> fd2conn;
-    std::vector<struct pollfd> poll_args;
-    while (true) {
-        // remove any existing values
-        poll_args.clear();
-
-        // this is the listening sockets, which I want first
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
+    // the accept loop drains the queue, so it must not block
+    fd_set_nb(fd);
+    return fd;
+}
 
-        // now we have connection sockets
-        for (Conn *conn : fd2conn) {
-            // if conn is NULL, move on
-            if (!conn) {
-                continue;
-            }
+static Shard *shard_new(uint32_t id, const char *backend, bool reuseport) {
+    Shard *shard = new Shard();
+    shard->id = id;
+    shard->now_ms = get_monotonic_msec();
+    tw_init(&shard->timers, shard->now_ms);
+    if (g_activedefrag) {
+        tw_add(&shard->timers, &shard->defrag_timer, shard->now_ms + k_defrag_period_ms);
+    }
+    shard->listen_fd = listen_socket(reuseport);
+    if (g_uring) {
+        // a multishot accept on a non-blocking socket ends once the queue
+        // is empty
+        fcntl(shard->listen_fd, F_SETFL,
+            fcntl(shard->listen_fd, F_GETFL, 0) & ~O_NONBLOCK);
+    }
 
-            // POLLERR here in case conn does not want_read or want_write
-            // because then it shouldn't be here
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
+    int fds[2];
+    if (pipe(fds) < 0) {
+        die("pipe()");
+    }
+    shard->wake_rfd = fds[0];
+    shard->wake_wfd = fds[1];
+    fd_set_nb(shard->wake_rfd);
+    fd_set_nb(shard->wake_wfd);
+    if (g_uring) {
+        return shard;   // the ring is set up by shard_run_uring()
+    }
 
-            // ideally only one of these is true, and we set it's value
-            if (conn->want_read) {
-                pfd.events |= POLLIN;
-            }
-            if (conn->want_write) {
-                pfd.events |= POLLOUT;
-            }
-            poll_args.push_back(pfd);
-        }
+    shard->loop = event_loop_new(backend);
+    if (!shard->loop) {
+        die("event_loop_new()");
+    }
+    if (shard->loop->add(shard->listen_fd, EV_READ) < 0
+        || shard->loop->add(shard->wake_rfd, EV_READ) < 0) {
+        die("event loop add()");
+    }
+    return shard;
+}
 
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--event-loop epoll|poll|uring] [--threads N]"
+        " [--zerocopy-min BYTES]\n"
+        "       [--log-level debug|info|warn|error] [--log-file PATH]\n"
+        "       [--idle-timeout SEC] [--read-timeout SEC] [--write-timeout SEC]\n"
+        "       [--turn-requests N] [--turn-usec USEC]\n"
+        "       [--output-soft-limit BYTES[k|m|g]] [--output-hard-limit BYTES[k|m|g]]\n"
+        "       [--pubsub-output-limit BYTES[k|m|g]]\n"
+        "       [--maxmemory BYTES[k|m|g]] [--maxmemory-samples N]\n"
+        "       [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]"
+        " [--activedefrag]\n"
+        "       [--appendonly PATH] [--appendfsync always|everysec|no]"
+        " [--aof-rewrite-min BYTES]\n"
+        "       [--dbfilename PATH] [--port N]\n"
+        "       [--replicaof HOST:PORT] [--repl-backlog-size BYTES[k|m|g]]"
+        " [--repl-timeout SEC]\n",
+        argv0);
+    exit(EXIT_FAILURE);
+}
 
-        // this block waits for the readiness of the fds
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), -1);
-        if (rv < 0 && errno == EINTR) {
-            // not an error, no fds are ready
-            continue;
-        }
-        if (rv < 0) {
-            die("poll");
-        }
+// "100", "64k", "512mb", "2g"
+static size_t parse_bytes(const char *s) {
+    char *end = NULL;
+    size_t n = (size_t)strtoull(s, &end, 10);
+    switch (*end | 0x20) {
+    case 'k': return n << 10;
+    case 'm': return n << 20;
+    case 'g': return n << 30;
+    default: return n;
+    }
+}
 
-        if (poll_args[0].revents) {
-            if (Conn *conn = handle_accept(fd)) {
-                // resize vector to make sure it can handle the listening socket (fd)
-                if (fd2conn.size() <= (size_t)conn->fd) {
-                    fd2conn.resize(conn->fd + 1);
+int server_main(int argc, char **argv)
+{
+    const char *backend = NULL;     // NULL = best available
+    const char *log_file = NULL;    // NULL = stderr
+    const char *aof_path = NULL;    // NULL = no AOF
+    int aof_fsync = AOF_FSYNC_EVERYSEC;
+    size_t aof_rewrite_min = 64 << 20;
+    const char *snap_path = "dump.kvs";
+    const char *replicaof = NULL;
+    size_t repl_backlog = 16 << 20;
+    uint64_t repl_timeout_ms = 60 * 1000;
+    uint32_t nthreads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--event-loop") == 0 && i + 1 < argc) {
+            backend = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nthreads = (uint32_t)atoi(argv[++i]);
+            if (nthreads < 1 || nthreads > 1024) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--zerocopy-min") == 0 && i + 1 < argc) {
+            g_zerocopy_min = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            g_log_level = log_level_parse(argv[++i]);
+            if (g_log_level < 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            log_file = argv[++i];
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            g_idle_timeout_ms = (uint64_t)atol(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--read-timeout") == 0 && i + 1 < argc) {
+            g_read_timeout_ms = (uint64_t)atol(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--write-timeout") == 0 && i + 1 < argc) {
+            g_write_timeout_ms = (uint64_t)atol(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--turn-requests") == 0 && i + 1 < argc) {
+            g_turn_reqs = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--turn-usec") == 0 && i + 1 < argc) {
+            g_turn_us = (uint64_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--output-soft-limit") == 0 && i + 1 < argc) {
+            g_output_soft = parse_bytes(argv[++i]);
+        } else if (strcmp(argv[i], "--output-hard-limit") == 0 && i + 1 < argc) {
+            g_output_hard = parse_bytes(argv[++i]);
+        } else if (strcmp(argv[i], "--pubsub-output-limit") == 0 && i + 1 < argc) {
+            g_pubsub_limit = parse_bytes(argv[++i]);
+        } else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+            g_maxmemory = parse_bytes(argv[++i]);
+        } else if (strcmp(argv[i], "--maxmemory-samples") == 0 && i + 1 < argc) {
+            g_evict_samples = (size_t)atol(argv[++i]);
+            if (g_evict_samples < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            g_evict_policy = -1;
+            for (int p = 0; p < 4; p++) {
+                if (strcmp(name, k_evict_policies[p]) == 0) {
+                    g_evict_policy = p;
                 }
-
-                // put it into the vec keyed by fd
-                fd2conn[conn->fd] = conn;
             }
+            if (g_evict_policy < 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--activedefrag") == 0) {
+            g_activedefrag = true;
+        } else if (strcmp(argv[i], "--appendonly") == 0 && i + 1 < argc) {
+            aof_path = argv[++i];
+        } else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "always") == 0) {
+                aof_fsync = AOF_FSYNC_ALWAYS;
+            } else if (strcmp(name, "everysec") == 0) {
+                aof_fsync = AOF_FSYNC_EVERYSEC;
+            } else if (strcmp(name, "no") == 0) {
+                aof_fsync = AOF_FSYNC_NO;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--aof-rewrite-min") == 0 && i + 1 < argc) {
+            aof_rewrite_min = parse_bytes(argv[++i]);
+        } else if (strcmp(argv[i], "--dbfilename") == 0 && i + 1 < argc) {
+            snap_path = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            int port = atoi(argv[++i]);
+            if (port < 1 || port > 65535) {
+                usage(argv[0]);
+            }
+            g_port = (uint16_t)port;
+        } else if (strcmp(argv[i], "--replicaof") == 0 && i + 1 < argc) {
+            replicaof = argv[++i];
+            const char *colon = strrchr(replicaof, ':');
+            if (!colon || colon == replicaof || atoi(colon + 1) < 1 || atoi(colon + 1) > 65535) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--repl-backlog-size") == 0 && i + 1 < argc) {
+            repl_backlog = parse_bytes(argv[++i]);
+            if (repl_backlog < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--repl-timeout") == 0 && i + 1 < argc) {
+            repl_timeout_ms = (uint64_t)atol(argv[++i]) * 1000;
+        } else {
+            usage(argv[0]);
         }
+    }
 
-        // skip the 1st (fd), which we set up manually
-        for (size_t i = 1; i < poll_args.size(); i++) {
-            // current connection pollfd struct
-            struct pollfd curr = poll_args[i];
-            uint32_t ready = curr.revents;
-            Conn *conn = fd2conn[curr.fd];
+    g_start_ms = get_monotonic_msec();
+    if (!log_init(log_file)) {
+        die("log file");
+    }
 
-            // if conn is ready, then read/write to it based on flags
-            if (ready & POLLIN) {
-                handle_read(conn);
-            }
-            if (ready & POLLOUT) {
-                handle_write(conn);
-            }
+    if (backend && strcmp(backend, "uring") == 0) {
+        g_uring = uring_supported();
+        backend = NULL;
+        if (!g_uring) {
+            LOG_WARN("io_uring is not available, using the default event loop");
+        } else if (g_zerocopy_min) {
+            LOG_WARN("--zerocopy-min is not supported with io_uring");
+            g_zerocopy_min = 0;
+        }
+    }
+    if (replicaof && g_maxmemory) {
+        // evicting would leave the replica with fewer keys than its primary
+        LOG_WARN("--maxmemory is ignored on a replica");
+        g_maxmemory = 0;
+    }
+    for (uint32_t i = 0; i < nthreads; i++) {
+        g_shards.push_back(shard_new(i, backend, nthreads > 1));
+        g_shards[i]->maxmemory = g_maxmemory / nthreads;
+    }
+    LOG_INFO("event loop: %s, %u shard(s), port %u",
+        g_uring ? "io_uring" : g_shards[0]->loop->name(), nthreads, g_port);
+    if (g_maxmemory) {
+        LOG_INFO("maxmemory: %zu bytes, %s", g_maxmemory, k_evict_policies[g_evict_policy]);
+    }
 
-            // delete conn from fd2conn if we have POLLERR or the connection wants to close
-            if (ready & POLLERR || conn->want_close) {
-                (void)close(conn->fd);
-                fd2conn[conn->fd] = NULL;
-                delete conn;
-            }
+    if (!aof_path) {
+        // the AOF, when there is one, is the more recent of the two
+        uint64_t start = get_monotonic_msec();
+        uint64_t unix_now = get_realtime_msec();
+        int64_t nrec = snap_load(snap_path, &snap_on_header, &snap_on_record, &unix_now);
+        if (nrec < 0) {
+            die("snapshot load");
+        }
+        if (nrec > 0) {
+            LOG_INFO("snapshot: loaded %lld keys in %llu ms", (long long)nrec,
+                (unsigned long long)(get_monotonic_msec() - start));
+        }
+    }
+    g_snap = new Snapshot();
+    g_snap->pause = &shards_pause;
+    g_snap->resume = &shards_resume;
+    g_snap->dump = &snap_dump;
+    if (!snap_init(g_snap, snap_path)) {
+        die("snapshot init");
+    }
+    snap_start(g_snap);
+
+    if (aof_path) {
+        // replay first, before anything can be appended
+        g_loading = true;
+        uint64_t start = get_monotonic_msec();
+        int64_t ncmd = aof_load(aof_path, &aof_apply, NULL);
+        if (ncmd < 0) {
+            die("AOF load");
+        }
+        g_loading = false;
+        LOG_INFO("AOF: replayed %lld commands in %llu ms", (long long)ncmd,
+            (unsigned long long)(get_monotonic_msec() - start));
+
+        g_aof = new Aof();
+        g_aof->fsync_policy = aof_fsync;
+        g_aof->rewrite_min_size = aof_rewrite_min;
+        g_aof->on_synced = &aof_on_synced;
+        g_aof->pause = &shards_pause;
+        g_aof->resume = &shards_resume;
+        g_aof->dump = &aof_dump;
+        if (!aof_open(g_aof, aof_path)) {
+            die("AOF open");
         }
+        aof_start(g_aof);
+    }
+
+    g_repl = new Repl();
+    g_repl->backlog_size = repl_backlog;
+    g_repl->timeout_ms = repl_timeout_ms;
+    g_repl->pause = &shards_pause;
+    g_repl->resume = &shards_resume;
+    g_repl->dump = &snap_dump;
+    if (!repl_init(g_repl, (std::string(snap_path) + ".repl").c_str())) {
+        die("replication init");
+    }
+    repl_start(g_repl);
+    if (replicaof) {
+        const char *colon = strrchr(replicaof, ':');
+        g_link = new ReplLink();
+        g_link->host.assign(replicaof, (size_t)(colon - replicaof));
+        g_link->port = (uint16_t)atoi(colon + 1);
+        g_link->snap_path = std::string(snap_path) + ".sync";
+        g_link->timeout_ms = repl_timeout_ms;
+        g_link->on_ready = &link_on_ready;
+        repl_link_start(g_link);
+    }
 
+    // one reactor per thread; shard 0 runs on the main thread
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < nthreads; i++) {
+        threads.emplace_back(shard_run, g_shards[i]);
     }
-};
\ No newline at end of file
+    shard_run(g_shards[0]);
+    return 0;
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// system
+#include <sys/socket.h>
+// C++
+#include <atomic>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+// proj
+#include "aof.h"
+#include "buffer.h"
+#include "command.h"
+#include "event_loop.h"
+#include "hashtable.h"
+#include "mpsc_queue.h"
+#include "outqueue.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "rcstr.h"
+#include "slab.h"
+#include "stats.h"
+#include "timer.h"
+#include "zset.h"
+
+
+struct Shard;
+struct Entry;
+struct Uring;
+struct UringBufRing;
+
+// iovecs per io_uring send
+const int k_ring_iov = 16;
+
+struct Conn {
+    int fd = -1;
+    // the reactor thread that owns this connection
+    Shard *shard = NULL;
+
+    // application's intention, for the event loop
+    bool want_read = false;
+    bool want_write = false;
+    // tells event loop to destroy connection
+    bool want_close = false;
+    // interest currently registered with the event loop (EV_READ/EV_WRITE)
+    uint32_t ev_registered = 0;
+    // a request is being served by another shard; pipelined requests behind
+    // it wait so that responses stay in order
+    bool awaiting_remote = false;
+    // closed while awaiting_remote or with io_uring ops in flight, freed
+    // once those are back
+    bool dead = false;
+    // a turn ended with work left, whole requests in `incoming` or input
+    // still in the socket: waits in Shard::ready for the next one
+    DList ready;
+    // the last read stopped short of EAGAIN
+    bool more_input = false;
+    // a replica's link to its primary: the replication stream, applied
+    // without replies
+    bool is_master = false;
+    // sent PSYNC: goes to the replication thread, with these arguments,
+    // once the event loop has let go of it
+    bool to_replica = false;
+    std::string psync_replid;
+    int64_t psync_offset = -1;
+    // pub/sub: what it subscribes to, and whether it's in Shard::pushed
+    std::vector<PubChannel *> channels;
+    std::vector<PubPattern *> patterns;
+    bool push_queued = false;
+
+    // buffered io
+    Buffer incoming;    // input from read
+    OutQueue outgoing;  // output to write
+
+    // the idle, read or write deadline, whichever applies right now
+    Timer timer;
+    uint64_t last_io_ms = 0;    // last successful read or write
+    uint64_t req_start_ms = 0;  // when the partial request in `incoming` began
+    // buffer bytes counted in Shard::mem_conns
+    size_t mem = 0;
+    // appendfsync always: output is held until this AOF batch is on disk
+    uint64_t aof_wait = 0;
+    bool aof_parked = false;
+
+    // values sent with MSG_ZEROCOPY stay pinned until the kernel reports the
+    // send call (by sequence number) as complete
+    uint32_t zc_next_seq = 0;
+    std::deque<std::pair<uint32_t, RcStr *>> zc_pending;
+
+    // a large last argument is read straight into the RcStr that will store
+    // it: `incoming` keeps the request up to its bytes (`stream_head`), which
+    // go to `stream_val` instead, `stream_have` of them so far
+    RcStr *stream_val = NULL;
+    uint32_t stream_have = 0;
+    uint32_t stream_head = 0;
+    // the request in `incoming` can't be streamed, don't look again
+    bool stream_skip = false;
+
+    // io_uring: a send in flight owns `ring_out` and the iovecs into it,
+    // while new responses queue up in `outgoing`. the kernel holds on to the
+    // connection until `ring_ops` is back to 0.
+    OutQueue ring_out;
+    struct msghdr ring_msg = {};
+    struct iovec ring_iov[k_ring_iov];
+    uint32_t ring_ops = 0;
+    // the multishot recv is armed; cancelled while reading is paused
+    bool ring_recv = false;
+    bool ring_recv_cancel = false;
+
+    ~Conn() {
+        for (auto &p : zc_pending) {
+            rcstr_unref(p.second);
+        }
+        if (stream_val) {
+            rcstr_unref(stream_val);
+        }
+    }
+};
+
+struct MultiReq;
+
+// a request forwarded to the shard that owns its key. the owner fills in
+// `resp` and posts the same message back to `origin`.
+struct ShardMsg : MpscNode {
+    Shard *origin = NULL;
+    Conn *conn = NULL;
+    bool done = false;
+    // one part of a multi-key command whose keys live on several shards
+    MultiReq *multi = NULL;
+    // a copy of the request body; the sender's incoming buffer moves on
+    std::string req;
+    // a streamed last argument, not in `req`
+    RcStr *val = NULL;
+    Response resp;
+    // appendfsync always: the reply goes back once this batch is on disk
+    uint64_t aof_wait = 0;
+
+    ~ShardMsg() {
+        if (val) {
+            rcstr_unref(val);
+        }
+    }
+};
+
+// slots in ShardStats::cmds, one per command plus one for unknown ones
+const size_t k_cmd_stat_slots = 32;
+
+// what INFO reports. a shard only ever writes its own, and they are
+// aligned so that two shards' counters never share a cache line.
+struct alignas(64) ShardStats {
+    Counter conns;              // connected right now
+    Counter conns_total;
+    Counter net_in;             // bytes
+    Counter net_out;
+    Counter expired;
+    Counter evicted;
+    Counter loop_iters;
+    Counter loop_wait_us;       // blocked in the event loop's wait
+    // network syscalls: waits, accepts, reads, writes, interest changes
+    Counter io_syscalls;
+    // published once per event loop iteration, for the other shards
+    Counter keys;
+    Counter expires;
+    Counter used_memory;
+    // the entries' slab arena: bytes in pages and in live entries, and
+    // pages and entries per size class
+    Counter slab_bytes;
+    Counter slab_used;
+    Counter slab_pages[k_slab_classes];
+    Counter slab_objs[k_slab_classes];
+    Counter defrag_moved;
+    // turns that ended with work left, and connections whose output went
+    // over the soft limit (paused) or the hard one (closed)
+    Counter turn_yields;
+    Counter output_pauses;
+    Counter output_closes;
+    // pub/sub: channels and patterns with subscribers here, messages queued
+    // for subscribers, and subscribers dropped for falling behind
+    Counter pubsub_channels;
+    Counter pubsub_patterns;
+    Counter pubsub_messages;
+    Counter pubsub_drops;
+    CmdStats cmds[k_cmd_stat_slots];
+};
+
+// one reactor thread. every shard has its own listening socket, connections
+// and slice of the keyspace, so the request path never takes a lock; keys
+// owned by another shard go through that shard's inbox.
+struct Shard {
+    uint32_t id = 0;
+    EventLoop *loop = NULL;     // NULL with io_uring
+    Uring *ring = NULL;
+    UringBufRing *ring_bufs = NULL;
+    int listen_fd = -1;
+    // self-pipe, readable when the inbox may be non-empty
+    int wake_rfd = -1;
+    int wake_wfd = -1;
+    std::atomic<bool> wake_pending{false};
+    MpscQueue inbox;
+
+    // map of the client connected, keyed by fd
+    std::vector<Conn *> fd2conn;
+    // connections waiting for another turn, in the order they ran out
+    DList ready;
+    // the turn of the connection being served: requests so far, since when
+    uint32_t turn_reqs = 0;
+    uint64_t turn_start_us = 0;
+    bool turn_over = false;
+    // connection deadlines, in ms of the monotonic clock
+    TimerWheel timers;
+    uint64_t now_ms = 0;    // as of the last wakeup
+    // this shard's slice of the keyspace, its entries from `slab`
+    HMap db;
+    SlabArena slab;
+    // the keys with a TTL, in no particular order, for the active expiry
+    // cycle to sample from
+    std::vector<Entry *> expires;
+    Timer expire_timer;
+    // --activedefrag: a pass over the table moves the entries out of the
+    // slab pages it is emptying, a slice at a time
+    Timer defrag_timer;
+    size_t defrag_cursor = 0;
+    // a replica's acks to its primary, on shard 0
+    Timer repl_timer;
+    // the subscriptions of this shard's connections, and the connections
+    // that PUBLISH queued messages for in this iteration, with their fds
+    PubSub pubsub;
+    std::vector<std::pair<Conn *, int>> pushed;
+    uint64_t rng = 0x9e3779b97f4a7c15;
+
+    // memory accounting, in bytes
+    size_t mem_entries = 0;     // keys, values and entries
+    size_t mem_conns = 0;       // connection buffers
+    size_t maxmemory = 0;       // this shard's share of g_maxmemory
+
+    // the mutations of this event loop iteration, for the AOF
+    AofBatch *aof_batch = NULL;
+    uint64_t aof_seq = 0;                   // batches submitted
+    std::atomic<uint64_t> aof_synced{0};    // batches on disk (always)
+    // appendfsync always: connections and remote replies waiting for a
+    // batch, in batch order
+    std::deque<std::pair<Conn *, int>> aof_conns;
+    std::deque<ShardMsg *> aof_replies;
+
+    ShardStats stats;
+
+    // per-request scratch, reused so the request path doesn't allocate
+    std::vector<std::string_view> cmd;
+    // the RcStr that `cmd`'s last argument views, if it was streamed;
+    // stored as is instead of copied
+    RcStr *cmd_val = NULL;
+    // the connection it came from, when it's served right there; for the
+    // commands that act on it, like SUBSCRIBE
+    Conn *cmd_conn = NULL;
+    Response resp;
+};
+
+// Entry::type
+enum {
+    ENT_STR = 0,
+    ENT_ZSET = 1,
+};
+
+// Entry::enc, how the value is stored
+enum {
+    ENC_INLINE = 0,     // `vlen` bytes after the key
+    ENC_INT = 1,        // an int64 after the key, for canonical integers
+    ENC_PTR = 2,        // a pointer after the key: an RcStr, or a ZSet
+};
+
+// string values shorter than this go in the entry. the longer ones are
+// RcStrs, which responses reference instead of copying.
+const size_t k_inline_max = k_ref_min - 1;
+// Entry::klen of a key too long for it: a u32 length precedes the key
+const uint8_t k_klen_long = 255;
+
+// one key, in one allocation from the shard's slab arena: this header, then
+// the TTL if the entry has room for one (u64 expires_at, u32 slot in
+// Shard::expires), the key and the value. everything past the header is
+// unaligned and goes through the accessors in server.cpp. an entry that
+// changes size is reallocated and replaced in the table.
+struct Entry {
+    struct HNode node;
+    // for eviction. LRU: the ms clock of the last access, wrapping. LFU: the
+    // minutes clock of the last decay (24 bits) and a log counter (8 bits).
+    uint32_t access;
+    uint8_t type : 2;
+    uint8_t enc : 2;
+    uint8_t has_ttl : 1;    // a TTL is set, or was
+    uint8_t klen;
+    uint16_t vlen;
+};
+
+static_assert(sizeof(Entry) == 16, "Entry header grew");
+
+extern std::vector<Shard *> g_shards;
+
+// the command called `name`, in any case; NULL if there's none
+const Command *cmd_lookup(std::string_view name);
+// runs one command against the shard's keyspace
+void do_request(Shard *shard, const std::vector<std::string_view> &cmd, Response &out);
+// parses and serves the first request in `conn->incoming`, if it's all
+// there; false if there is none or it has to wait
+bool try_one_request(Conn *conn);
+// a whole active defragmentation pass, which --activedefrag spreads over
+// timer ticks
+void shard_defrag(Shard *shard);
+int server_main(int argc, char **argv);
@@ -0,0 +1,237 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+// system
+#include <sys/mman.h>
+// C++
+#include <new>
+// proj
+#include "common.h"
+#include "slab.h"
+
+
+// page states
+enum : uint8_t {
+    PAGE_PARTIAL = 0,
+    PAGE_FULL = 1,
+    PAGE_EVAC = 2,
+    PAGE_FREE = 3,
+};
+
+// objects start one cache line into the page
+const size_t k_page_hdr = 64;
+// pages are mapped 64 at a time
+const size_t k_chunk_size = 64 * k_slab_page;
+
+static_assert(sizeof(SlabPage) <= k_page_hdr, "page header too big");
+
+static size_t class_size(uint32_t cls) {
+    if (cls < 16) {
+        return (cls + 1) * 8;
+    }
+    size_t p = 7 + (cls - 16) / 4;
+    return ((size_t)1 << p) + ((cls - 16) % 4 + 1) * ((size_t)1 << (p - 2));
+}
+
+uint32_t slab_class(size_t size) {
+    assert(size <= k_slab_max);
+    if (size <= 128) {
+        return size ? (uint32_t)((size + 7) / 8 - 1) : 0;
+    }
+    // size is in (2^p, 2^(p + 1)], split into 4 steps
+    uint32_t p = 63 - (uint32_t)__builtin_clzll(size - 1);
+    size_t step = (size_t)1 << (p - 2);
+    size_t idx = (size - ((size_t)1 << p) + step - 1) / step - 1;
+    return 16 + (p - 7) * 4 + (uint32_t)idx;
+}
+
+size_t slab_usable(size_t size) {
+    return size > k_slab_max ? size : class_size(slab_class(size));
+}
+
+SlabArena::SlabArena() {
+    for (uint32_t i = 0; i < k_slab_classes; i++) {
+        classes[i].size = (uint32_t)class_size(i);
+        classes[i].per_page = (uint32_t)((k_slab_page - k_page_hdr) / classes[i].size);
+    }
+}
+
+SlabArena::~SlabArena() {
+    for (void *chunk : chunks) {
+        munmap(chunk, k_chunk_size);
+    }
+}
+
+static SlabPage *page_of(const void *ptr) {
+    return (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_slab_page - 1));
+}
+
+// a chunk of k_slab_page aligned pages: map more than needed and trim
+static bool chunk_new(SlabArena *arena) {
+    size_t len = k_chunk_size + k_slab_page;
+    uint8_t *mem = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    uint8_t *start = (uint8_t *)(((uintptr_t)mem + k_slab_page - 1) & ~(uintptr_t)(k_slab_page - 1));
+    if (start > mem) {
+        munmap(mem, (size_t)(start - mem));
+    }
+    size_t tail = (size_t)(mem + len - (start + k_chunk_size));
+    if (tail) {
+        munmap(start + k_chunk_size, tail);
+    }
+    arena->chunks.push_back(start);
+    arena->chunk_next = start;
+    arena->chunk_end = start + k_chunk_size;
+    return true;
+}
+
+static SlabPage *page_new(SlabArena *arena, uint32_t cls) {
+    void *mem = NULL;
+    if (!arena->free_pages.empty()) {
+        mem = arena->free_pages.back();
+        arena->free_pages.pop_back();
+    } else {
+        if (arena->chunk_next == arena->chunk_end && !chunk_new(arena)) {
+            abort();    // like a failed malloc
+        }
+        mem = arena->chunk_next;
+        arena->chunk_next += k_slab_page;
+    }
+    SlabPage *page = new (mem) SlabPage();
+    page->cls = (uint16_t)cls;
+    return page;
+}
+
+// the page's memory goes back to the kernel; the address range stays ours
+static void page_release(SlabArena *arena, SlabPage *page) {
+    page->state = PAGE_FREE;
+    (void)madvise(page, k_slab_page, MADV_DONTNEED);
+    arena->free_pages.push_back(page);
+}
+
+void *slab_alloc(SlabArena *arena, size_t size) {
+    if (size > k_slab_max) {
+        void *ptr = malloc(size);
+        assert(ptr);
+        arena->large_bytes += size;
+        arena->large_count++;
+        return ptr;
+    }
+    uint32_t cls = slab_class(size);
+    SlabClass *c = &arena->classes[cls];
+    if (dlist_empty(&c->partial)) {
+        SlabPage *page = page_new(arena, cls);
+        dlist_insert_before(&c->partial, &page->node);
+        c->pages++;
+    }
+    SlabPage *page = container_of(c->partial.next, SlabPage, node);
+    void *obj = page->free;
+    if (obj) {
+        page->free = *(void **)obj;
+    } else {
+        obj = (uint8_t *)page + k_page_hdr + (size_t)page->bump * c->size;
+        page->bump++;
+    }
+    page->used++;
+    c->used++;
+    if (page->used == c->per_page) {
+        dlist_detach(&page->node);
+        page->state = PAGE_FULL;
+    }
+    return obj;
+}
+
+void slab_free(SlabArena *arena, void *ptr, size_t size) {
+    if (size > k_slab_max) {
+        arena->large_bytes -= size;
+        arena->large_count--;
+        free(ptr);
+        return;
+    }
+    SlabPage *page = page_of(ptr);
+    SlabClass *c = &arena->classes[page->cls];
+    assert(page->state != PAGE_FREE && page->used > 0);
+    *(void **)ptr = page->free;
+    page->free = ptr;
+    page->used--;
+    c->used--;
+    if (page->state == PAGE_FULL) {
+        // first in line for the next allocation
+        dlist_insert_before(c->partial.next, &page->node);
+        page->state = PAGE_PARTIAL;
+    }
+    if (page->used > 0) {
+        return;
+    }
+    // an empty page goes, unless it's all the room the class has left: a
+    // key that comes and goes shouldn't cost a page fault and a madvise()
+    bool alone = c->partial.next == &page->node && c->partial.prev == &page->node;
+    if (page->state == PAGE_PARTIAL && alone) {
+        return;
+    }
+    dlist_detach(&page->node);
+    c->pages--;
+    page_release(arena, page);
+}
+
+size_t slab_mem_usage(const SlabArena *arena) {
+    size_t n = arena->large_bytes;
+    for (const SlabClass &c : arena->classes) {
+        n += c.pages * k_slab_page;
+    }
+    return n;
+}
+
+size_t slab_mem_used(const SlabArena *arena) {
+    size_t n = arena->large_bytes;
+    for (const SlabClass &c : arena->classes) {
+        n += c.used * c.size;
+    }
+    return n;
+}
+
+bool slab_defrag_begin(SlabArena *arena) {
+    assert(!arena->defragging);
+    bool any = false;
+    for (SlabClass &c : arena->classes) {
+        // not worth it under an eighth of the class's pages to gain
+        size_t needed = (c.used + c.per_page - 1) / c.per_page;
+        if ((c.pages - needed) * 8 < c.pages || c.pages - needed == 0) {
+            continue;
+        }
+        DList *next = NULL;
+        for (DList *node = c.partial.next; node != &c.partial; node = next) {
+            next = node->next;
+            SlabPage *page = container_of(node, SlabPage, node);
+            // an empty page is where the moved objects go first
+            if (page->used == 0 || page->used >= c.per_page / 2) {
+                continue;
+            }
+            dlist_detach(node);
+            dlist_insert_before(&c.evacuating, node);
+            page->state = PAGE_EVAC;
+            any = true;
+        }
+    }
+    arena->defragging = any;
+    return any;
+}
+
+bool slab_should_move(const SlabArena *arena, const void *ptr, size_t size) {
+    return arena->defragging && size <= k_slab_max && page_of(ptr)->state == PAGE_EVAC;
+}
+
+void slab_defrag_end(SlabArena *arena) {
+    for (SlabClass &c : arena->classes) {
+        while (!dlist_empty(&c.evacuating)) {
+            DList *node = c.evacuating.next;
+            dlist_detach(node);
+            dlist_insert_before(&c.partial, node);
+            container_of(node, SlabPage, node)->state = PAGE_PARTIAL;
+        }
+    }
+    arena->defragging = false;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <vector>
+// proj
+#include "list.h"
+
+
+// size-classed arenas for small objects. objects of one class are carved
+// out of 64KB pages, so they cost their class size and nothing else: no
+// per-object header, and pages are only ever shared by one size. objects
+// bigger than k_slab_max come from malloc instead.
+//
+// one arena per thread, nothing is locked.
+const size_t k_slab_page = 64 << 10;
+const size_t k_slab_max = 2048;
+// 8-byte steps up to 128, then 4 steps per power of 2
+const size_t k_slab_classes = 16 + 4 * 4;
+
+// at the start of every page, which is k_slab_page aligned
+struct SlabPage {
+    DList node;         // in its class's `partial` or `evacuating` list
+    void *free = NULL;  // freed objects, linked through their first 8 bytes
+    uint32_t used = 0;  // live objects
+    uint32_t bump = 0;  // objects from here on were never handed out
+    uint16_t cls = 0;
+    uint8_t state = 0;
+};
+
+struct SlabClass {
+    uint32_t size = 0;      // object size
+    uint32_t per_page = 0;
+    // pages with room, most recently freed into first; full pages are in
+    // no list
+    DList partial;
+    // pages the defragmentation pass is emptying: nothing new goes there
+    DList evacuating;
+    size_t pages = 0;
+    size_t used = 0;        // live objects
+};
+
+struct SlabArena {
+    SlabClass classes[k_slab_classes];
+    // empty pages, already given back to the kernel
+    std::vector<SlabPage *> free_pages;
+    // the mappings pages are carved from, and the unused rest of the last
+    std::vector<void *> chunks;
+    uint8_t *chunk_next = NULL;
+    uint8_t *chunk_end = NULL;
+    // objects too big for a class
+    size_t large_bytes = 0;
+    size_t large_count = 0;
+    // objects moved by defragmentation passes
+    size_t defrag_moved = 0;
+    bool defragging = false;
+
+    SlabArena();
+    ~SlabArena();
+    SlabArena(const SlabArena &) = delete;
+    SlabArena &operator=(const SlabArena &) = delete;
+};
+
+void *slab_alloc(SlabArena *arena, size_t size);
+// `size` must be what the object was allocated with
+void slab_free(SlabArena *arena, void *ptr, size_t size);
+// the bytes an object of `size` really takes
+size_t slab_usable(size_t size);
+// the class of `size`, for objects up to k_slab_max
+uint32_t slab_class(size_t size);
+
+// bytes in pages that hold objects, and in large objects
+size_t slab_mem_usage(const SlabArena *arena);
+// bytes of live objects, large ones included
+size_t slab_mem_used(const SlabArena *arena);
+
+// active defragmentation: slab_defrag_begin() picks the pages of each class
+// that are less than half full and stops allocating from them. the owner
+// then goes over its objects and moves every one that slab_should_move()
+// says so into a fresh slab_alloc(), which fills up the fuller pages, and
+// the picked pages empty out and go back to the kernel. slab_defrag_end()
+// returns whatever wasn't moved to use. false if there is nothing to do.
+bool slab_defrag_begin(SlabArena *arena);
+bool slab_should_move(const SlabArena *arena, const void *ptr, size_t size);
+void slab_defrag_end(SlabArena *arena);
@@ -0,0 +1,479 @@
+// stdlib
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+// system
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+// C++
+#include <thread>
+// proj
+#include "log.h"
+#include "snapshot.h"
+
+
+const char k_snap_magic[6] = {'K', 'V', 'S', 'N', 'A', 'P'};
+const uint16_t k_snap_version = 2;     // 1 had no sorted sets
+const size_t k_snap_header = 6 + 2 + 8 + 8;
+const size_t k_snap_flush = 1 << 20;
+
+static uint32_t g_crc_table[256];
+
+static bool crc32c_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        g_crc_table[i] = c;
+    }
+    return true;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t n) {
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t)c;
+    while (n-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw) {
+        return ~crc32c_hw(crc, p, len);
+    }
+#endif
+    static const bool init = crc32c_init_table();
+    (void)init;
+    while (len-- > 0) {
+        crc = g_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint64_t snap_now_ms() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t snap_unix_ms() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+// writer
+
+static void put_u64(std::string &out, uint64_t v) {
+    out.append((const char *)&v, 8);
+}
+
+static void put_varint(std::string &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static void snap_flush(SnapWriter *w) {
+    if (w->ok && !w->buf.empty()) {
+        w->crc = crc32c(w->crc, w->buf.data(), w->buf.size());
+        w->ok = write_all(w->fd, w->buf.data(), w->buf.size());
+    }
+    w->buf.clear();
+}
+
+void snap_begin(SnapWriter *w, int fd, uint64_t nkeys) {
+    w->fd = fd;
+    w->crc = 0;
+    w->ok = true;
+    w->buf.clear();
+    w->buf.reserve(k_snap_flush + 4096);
+    w->buf.append(k_snap_magic, sizeof(k_snap_magic));
+    w->buf.append((const char *)&k_snap_version, 2);
+    put_u64(w->buf, nkeys);
+    put_u64(w->buf, snap_unix_ms());
+}
+
+void snap_put(SnapWriter *w, std::string_view key, std::string_view val,
+    uint64_t expire_unix_ms)
+{
+    if (expire_unix_ms) {
+        w->buf.push_back((char)SNAP_STR_TTL);
+        put_u64(w->buf, expire_unix_ms);
+    } else {
+        w->buf.push_back((char)SNAP_STR);
+    }
+    put_varint(w->buf, key.size());
+    w->buf.append(key);
+    put_varint(w->buf, val.size());
+    w->buf.append(val);
+    if (w->buf.size() >= k_snap_flush) {
+        snap_flush(w);
+    }
+}
+
+void snap_put_zset(SnapWriter *w, std::string_view key, uint64_t count,
+    uint64_t expire_unix_ms)
+{
+    if (expire_unix_ms) {
+        w->buf.push_back((char)SNAP_ZSET_TTL);
+        put_u64(w->buf, expire_unix_ms);
+    } else {
+        w->buf.push_back((char)SNAP_ZSET);
+    }
+    put_varint(w->buf, key.size());
+    w->buf.append(key);
+    put_varint(w->buf, count);
+}
+
+void snap_put_zmember(SnapWriter *w, std::string_view member, double score) {
+    w->buf.append((const char *)&score, 8);
+    put_varint(w->buf, member.size());
+    w->buf.append(member);
+    if (w->buf.size() >= k_snap_flush) {
+        snap_flush(w);
+    }
+}
+
+bool snap_end(SnapWriter *w) {
+    w->buf.push_back((char)SNAP_EOF);
+    snap_flush(w);
+    uint32_t crc = w->crc;
+    return w->ok && write_all(w->fd, (const char *)&crc, 4);
+}
+
+// loader
+
+static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_bytes(const uint8_t *&p, const uint8_t *end, std::string_view &out) {
+    uint64_t len = 0;
+    if (!get_varint(p, end, len) || (uint64_t)(end - p) < len) {
+        return false;
+    }
+    out = std::string_view((const char *)p, (size_t)len);
+    p += len;
+    return true;
+}
+
+// steps over the members of a sorted set
+static bool skip_zmembers(const uint8_t *&p, const uint8_t *end, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        std::string_view member;
+        if (end - p < 8) {
+            return false;
+        }
+        p += 8;
+        if (!get_bytes(p, end, member)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void snap_next_zmember(std::string_view &val, std::string_view &member, double &score) {
+    const uint8_t *p = (const uint8_t *)val.data();
+    const uint8_t *end = p + val.size();
+    memcpy(&score, p, 8);
+    p += 8;
+    bool ok = get_bytes(p, end, member);
+    assert(ok);
+    (void)ok;
+    val = std::string_view((const char *)p, (size_t)(end - p));
+}
+
+int64_t snap_load(const char *path, void (*on_header)(uint64_t nkeys, void *arg),
+    void (*on_record)(const SnapRecord &rec, void *arg), void *arg)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < k_snap_header + 5) {
+        (void)close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    (void)madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    uint16_t version = 0;
+    memcpy(&version, data + 6, 2);
+    if (memcmp(data, k_snap_magic, 6) != 0 || version < 1 || version > k_snap_version) {
+        (void)munmap((void *)data, size);
+        return -1;
+    }
+    uint64_t nkeys = 0;
+    memcpy(&nkeys, data + 8, 8);
+    on_header(nkeys, arg);
+
+    // one pass: parse, and checksum what's behind us a chunk at a time
+    // while it is still in the cache
+    const uint8_t *p = data + k_snap_header;
+    const uint8_t *end = data + size - 4;
+    const uint8_t *summed = data;
+    uint32_t crc = 0;
+    int64_t nrec = 0;
+    bool ok = false;
+    while (p < end) {
+        if ((size_t)(p - summed) >= k_snap_flush) {
+            crc = crc32c(crc, summed, (size_t)(p - summed));
+            summed = p;
+        }
+        uint8_t type = *p++;
+        if (type == SNAP_EOF) {
+            ok = p == end;
+            break;
+        }
+        SnapRecord rec;
+        if (type == SNAP_STR_TTL || type == SNAP_ZSET_TTL) {
+            if (end - p < 8) {
+                break;
+            }
+            memcpy(&rec.expire_unix_ms, p, 8);
+            p += 8;
+        } else if (type != SNAP_STR && type != SNAP_ZSET) {
+            break;
+        }
+        rec.type = type == SNAP_ZSET || type == SNAP_ZSET_TTL ? SNAP_ZSET : SNAP_STR;
+        if (!get_bytes(p, end, rec.key)) {
+            break;
+        }
+        if (rec.type == SNAP_STR) {
+            if (!get_bytes(p, end, rec.val)) {
+                break;
+            }
+        } else {
+            if (!get_varint(p, end, rec.zcount)) {
+                break;
+            }
+            const uint8_t *members = p;
+            if (!skip_zmembers(p, end, rec.zcount)) {
+                break;
+            }
+            rec.val = std::string_view((const char *)members, (size_t)(p - members));
+        }
+        on_record(rec, arg);
+        nrec++;
+    }
+    if (ok) {
+        crc = crc32c(crc, summed, (size_t)(p - summed));
+        uint32_t expect = 0;
+        memcpy(&expect, end, 4);
+        ok = crc == expect;
+    }
+    (void)munmap((void *)data, size);
+    return ok ? nrec : -1;
+}
+
+// saving
+
+// pages no longer shared with the parent: whatever either side wrote since
+// the fork, so each of them was copied once
+static size_t private_dirty_bytes() {
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) {
+        return 0;
+    }
+    size_t total = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long kb = 0;
+        if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) {
+            total += (size_t)kb << 10;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+// the dump into a temporary file, renamed over the old one once it's on disk
+static bool snap_write(Snapshot *snap) {
+    std::string tmp = snap->path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = snap->dump(fd) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), snap->path.c_str()) == 0;
+    if (!ok) {
+        (void)unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+bool snap_save(Snapshot *snap) {
+    if (snap->busy.exchange(true)) {
+        return false;
+    }
+    uint64_t start = snap_now_ms();
+    bool ok = snap_write(snap);
+    if (ok) {
+        LOG_INFO("SAVE done in %llu ms", (unsigned long long)(snap_now_ms() - start));
+    } else {
+        LOG_ERROR("[errno:%d] SAVE failed", errno);
+    }
+    snap->busy.store(false);
+    return ok;
+}
+
+static void bgsave_start(Snapshot *snap) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        LOG_ERROR("[errno:%d] BGSAVE pipe()", errno);
+        snap->busy.store(false);
+        return;
+    }
+
+    uint64_t paused_at = snap_now_ms();
+    snap->pause();
+    struct timespec t0 = {}, t1 = {};
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: the paused shards' memory, copy-on-write
+        bool ok = snap_write(snap);
+        size_t cow = private_dirty_bytes();
+        (void)write(fds[1], &cow, sizeof(cow));
+        _exit(ok ? 0 : 1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    snap->resume();
+    (void)close(fds[1]);
+
+    if (pid < 0) {
+        LOG_ERROR("[errno:%d] BGSAVE fork()", errno);
+        (void)close(fds[0]);
+        snap->busy.store(false);
+        return;
+    }
+    uint64_t fork_us = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000
+        + (uint64_t)(t1.tv_nsec - t0.tv_nsec) / 1000;
+    LOG_INFO("BGSAVE started by pid %d: fork() took %llu us, shards paused %llu ms",
+        (int)pid, (unsigned long long)fork_us,
+        (unsigned long long)(snap_now_ms() - paused_at));
+    snap->child = pid;
+    snap->cow_rfd = fds[0];
+    snap->child_start_ms = paused_at;
+}
+
+static void bgsave_done(Snapshot *snap, int status) {
+    size_t cow = 0;
+    if (read(snap->cow_rfd, &cow, sizeof(cow)) != sizeof(cow)) {
+        cow = 0;
+    }
+    (void)close(snap->cow_rfd);
+    snap->cow_rfd = -1;
+    snap->child = -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        LOG_INFO("BGSAVE done in %llu ms, %zu MB of copy-on-write",
+            (unsigned long long)(snap_now_ms() - snap->child_start_ms), cow >> 20);
+    } else {
+        LOG_ERROR("BGSAVE failed");
+    }
+    snap->busy.store(false);
+}
+
+static void snap_main(Snapshot *snap) {
+    while (true) {
+        // the child's end of the pipe closes when it exits
+        struct pollfd pfds[2] = {{snap->wake_rfd, POLLIN, 0}, {snap->cow_rfd, POLLIN, 0}};
+        (void)poll(pfds, snap->child > 0 ? 2 : 1, snap->child > 0 ? 100 : -1);
+        uint8_t buf[64];
+        while (read(snap->wake_rfd, buf, sizeof(buf)) > 0) {
+        }
+
+        if (snap->child > 0) {
+            int status = 0;
+            if (waitpid(snap->child, &status, WNOHANG) == snap->child) {
+                bgsave_done(snap, status);
+            }
+            continue;
+        }
+        if (snap->bgsave_requested.exchange(false)) {
+            bgsave_start(snap);
+        }
+    }
+}
+
+bool snap_init(Snapshot *snap, const char *path) {
+    snap->path = path;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return false;
+    }
+    snap->wake_rfd = fds[0];
+    snap->wake_wfd = fds[1];
+    return true;
+}
+
+void snap_start(Snapshot *snap) {
+    std::thread(snap_main, snap).detach();
+}
+
+bool snap_bgsave(Snapshot *snap) {
+    if (snap->busy.exchange(true)) {
+        return false;
+    }
+    snap->bgsave_requested.store(true);
+    uint8_t one = 1;
+    if (write(snap->wake_wfd, &one, 1) < 0 && errno != EAGAIN) {
+        LOG_WARN("[errno:%d] snapshot wakeup write()", errno);
+    }
+    return true;
+}
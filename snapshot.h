@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+// C++
+#include <atomic>
+#include <string>
+#include <string_view>
+
+
+// CRC-32C (Castagnoli), the SSE4.2 instruction where there is one.
+// chainable: crc32c(crc32c(0, a), b) == crc32c(0, a + b)
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// the snapshot file:
+//   header: "KVSNAP" u16 version, u64 key count, u64 unix ms when taken
+//   records: u8 type, [u64 unix ms expiry], varint key len, key, value
+//     string value: varint len, bytes
+//     sorted set value: varint count, then count times f64 score,
+//                       varint member len, member; in score order
+//   end: u8 SNAP_EOF, u32 CRC-32C of everything before it
+// integers are little endian. the key count is only a sizing hint.
+enum {
+    SNAP_STR = 0,
+    SNAP_STR_TTL = 1,
+    SNAP_ZSET = 2,
+    SNAP_ZSET_TTL = 3,
+    SNAP_EOF = 0xff,
+};
+
+// serializes the records through a buffer, checksumming as it goes
+struct SnapWriter {
+    int fd = -1;
+    std::string buf;
+    uint32_t crc = 0;
+    bool ok = true;
+};
+
+void snap_begin(SnapWriter *w, int fd, uint64_t nkeys);
+// `expire_unix_ms` 0 = no TTL
+void snap_put(SnapWriter *w, std::string_view key, std::string_view val,
+    uint64_t expire_unix_ms);
+// a sorted set: snap_put_zset(), then snap_put_zmember() `count` times
+void snap_put_zset(SnapWriter *w, std::string_view key, uint64_t count,
+    uint64_t expire_unix_ms);
+void snap_put_zmember(SnapWriter *w, std::string_view member, double score);
+bool snap_end(SnapWriter *w);
+
+struct SnapRecord {
+    uint8_t type = SNAP_STR;    // SNAP_STR or SNAP_ZSET
+    std::string_view key;
+    // a string, or the encoded members of a sorted set
+    std::string_view val;
+    uint64_t zcount = 0;
+    uint64_t expire_unix_ms = 0;
+};
+
+// decodes the next member from a SNAP_ZSET record's `val`, which it
+// advances; the loader has already checked them all
+void snap_next_zmember(std::string_view &val, std::string_view &member, double &score);
+
+// streams the records of the file to `on_record`, straight out of an mmap.
+// `on_header` gets the key count first, to pre-size the tables. returns the
+// number of records, 0 if there is no file, -1 if it's unreadable or fails
+// its checksum (the records seen until then have been passed on).
+int64_t snap_load(const char *path, void (*on_header)(uint64_t nkeys, void *arg),
+    void (*on_record)(const SnapRecord &rec, void *arg), void *arg);
+
+// point-in-time snapshots. BGSAVE forks, on a background thread, with the
+// shards paused just for the fork(); the child writes the copy-on-write
+// image of the dataset while the parent keeps serving.
+struct Snapshot {
+    std::string path;
+
+    // callbacks into the server
+    // stop the shards at a consistent point, and let them go again
+    void (*pause)() = NULL;
+    void (*resume)() = NULL;
+    // write the dataset to `fd` with a SnapWriter; in the child for BGSAVE
+    bool (*dump)(int fd) = NULL;
+
+    // internal
+    int wake_rfd = -1;
+    int wake_wfd = -1;
+    std::atomic<bool> bgsave_requested{false};
+    std::atomic<bool> busy{false};      // a save is running
+    pid_t child = -1;
+    int cow_rfd = -1;                   // the child reports its dirty pages here
+    uint64_t child_start_ms = 0;
+};
+
+// false with errno set on failure
+bool snap_init(Snapshot *snap, const char *path);
+// starts the thread that runs BGSAVEs
+void snap_start(Snapshot *snap);
+// false if a save is already running
+bool snap_bgsave(Snapshot *snap);
+// SAVE: writes the snapshot in the calling thread, which must have stopped
+// everything else. false if a save is already running or on error.
+bool snap_save(Snapshot *snap);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <atomic>
+
+
+// a counter that only its own thread writes and any thread may read. relaxed
+// atomics keep a read from tearing, while an update stays a plain load, add
+// and store: no locked instruction, no fence.
+struct Counter {
+    std::atomic<uint64_t> v{0};
+
+    void add(uint64_t n = 1) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void sub(uint64_t n = 1) {
+        v.store(v.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+    void set(uint64_t n) {
+        v.store(n, std::memory_order_relaxed);
+    }
+    uint64_t get() const {
+        return v.load(std::memory_order_relaxed);
+    }
+};
+
+// latencies in power-of-2 ns buckets: bucket i counts [2^i, 2^(i+1)) ns,
+// the last one everything above
+const size_t k_lat_buckets = 40;
+
+// one call in k_lat_sample is timed, the first included: two clock reads
+// cost about as much as a GET itself
+const uint64_t k_lat_sample = 16;
+
+struct CmdStats {
+    Counter calls;
+    Counter ns;     // total time of the timed calls
+    Counter hist[k_lat_buckets];    // the timed calls
+};
+
+static inline size_t lat_bucket(uint64_t ns) {
+    size_t b = ns ? 63 - (size_t)__builtin_clzll(ns) : 0;
+    return b < k_lat_buckets ? b : k_lat_buckets - 1;
+}
+
+static inline void cmd_stats_record(CmdStats &s, uint64_t ns) {
+    s.ns.add(ns);
+    s.hist[lat_bucket(ns)].add();
+}
@@ -0,0 +1,163 @@
+// unit test of Buffer: appends and consumes come back in order, the
+// consumed prefix is reclaimed lazily, growth is geometric, a large buffer
+// is given back once emptied, and buf_truncate/buf_swap.
+//
+// usage: test_buffer, exits non-zero on the first failure
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+// C++
+#include <string>
+// proj
+#include "../buffer.h"
+
+// like assert(), but also with NDEBUG
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+static void append_str(Buffer &buf, const std::string &s) {
+    buf_append(buf, (const uint8_t *)s.data(), s.size());
+}
+
+static std::string contents(const Buffer &buf) {
+    return std::string((const char *)buf.data(), buf.size());
+}
+
+// `len` bytes of a pattern that starts at `from`, so misplaced bytes show
+static std::string pattern(size_t from, size_t len) {
+    std::string s(len, 0);
+    for (size_t i = 0; i < len; i++) {
+        s[i] = (char)('a' + (from + i) % 26);
+    }
+    return s;
+}
+
+static void test_round_trip() {
+    Buffer buf;
+    CHECK(buf.size() == 0 && buf.capacity() == 0);
+    // append and consume in uneven steps, checking the front each time
+    size_t in = 0, out = 0;
+    for (size_t round = 0; round < 1000; round++) {
+        size_t n = (round * 37) % 500 + 1;
+        append_str(buf, pattern(in, n));
+        in += n;
+        size_t take = (round * 53) % (buf.size() + 1);
+        CHECK(contents(buf).substr(0, take) == pattern(out, take));
+        buf_consume(buf, take);
+        out += take;
+        CHECK(buf.size() == in - out);
+    }
+    CHECK(contents(buf) == pattern(out, in - out));
+    buf_consume(buf, buf.size());
+    CHECK(buf.size() == 0);
+    // an emptied buffer starts over at the front
+    CHECK(buf.data() == buf.buffer_begin);
+}
+
+static void test_lazy_compaction() {
+    Buffer buf;
+    append_str(buf, pattern(0, 4096));
+    size_t cap = buf.capacity();
+    CHECK(cap == 4096);
+
+    // a little consumed: no room at the end, and moving the rest would cost
+    // more than the consume freed, so it grows instead
+    buf_consume(buf, 100);
+    const uint8_t *before = buf.data();
+    CHECK(before == buf.buffer_begin + 100);
+    append_str(buf, pattern(4096, 50));
+    CHECK(buf.capacity() > cap);
+    CHECK(contents(buf) == pattern(100, 4046));
+
+    // most of it consumed: the rest is moved to the front, no new allocation
+    Buffer b2;
+    append_str(b2, pattern(0, 4096));
+    buf_consume(b2, 3000);
+    const uint8_t *base = b2.buffer_begin;
+    append_str(b2, pattern(4096, 1000));
+    CHECK(b2.buffer_begin == base);
+    CHECK(b2.capacity() == 4096);
+    CHECK(b2.data() == b2.buffer_begin);
+    CHECK(contents(b2) == pattern(3000, 2096));
+
+    // with room at the end, consuming never moves anything
+    buf_consume(b2, 1000);
+    CHECK(b2.data() == b2.buffer_begin + 1000);
+    append_str(b2, pattern(5096, 10));
+    CHECK(b2.data() == b2.buffer_begin + 1000);
+    CHECK(contents(b2) == pattern(4000, 1106));
+}
+
+static void test_growth_and_release() {
+    Buffer buf;
+    // geometric: few reallocations for many small appends
+    size_t reallocs = 0;
+    size_t cap = 0;
+    std::string chunk = pattern(0, 100);
+    for (size_t i = 0; i < 20000; i++) {
+        append_str(buf, chunk);
+        if (buf.capacity() != cap) {
+            CHECK(buf.capacity() >= 2 * cap);
+            cap = buf.capacity();
+            reallocs++;
+        }
+    }
+    CHECK(buf.size() == 2000000);
+    CHECK(reallocs <= 12);
+    for (size_t i = 0; i < 20000; i += 1000) {
+        CHECK(memcmp(buf.data() + i * 100, chunk.data(), 100) == 0);
+    }
+    // one append bigger than double the capacity gets all of it at once
+    Buffer big;
+    append_str(big, pattern(0, 10));
+    append_str(big, pattern(10, 100000));
+    CHECK(big.capacity() >= 100010);
+    CHECK(contents(big) == pattern(0, 100010));
+
+    // over 1 MB: emptying it gives the memory back
+    CHECK(buf.capacity() > (1 << 20));
+    buf_consume(buf, buf.size());
+    CHECK(buf.capacity() == 0 && buf.data() == NULL);
+    // and it's usable again
+    append_str(buf, "again");
+    CHECK(contents(buf) == "again");
+
+    // a smaller one keeps its allocation for the next request
+    buf_consume(big, big.size());
+    CHECK(big.capacity() >= 100010);
+}
+
+static void test_truncate_swap() {
+    Buffer buf;
+    append_str(buf, "hello world");
+    buf_consume(buf, 6);
+    buf_truncate(buf, 3);
+    CHECK(contents(buf) == "wor");
+    append_str(buf, "ms");
+    CHECK(contents(buf) == "worms");
+    buf_truncate(buf, 0);
+    CHECK(buf.size() == 0);
+    buf_truncate(buf, 0);
+    CHECK(buf.size() == 0);
+
+    Buffer other;
+    append_str(buf, "left");
+    append_str(other, "right");
+    buf_swap(buf, other);
+    CHECK(contents(buf) == "right" && contents(other) == "left");
+}
+
+int main() {
+    test_round_trip();
+    test_lazy_compaction();
+    test_growth_and_release();
+    test_truncate_swap();
+    printf("test_buffer: ok\n");
+    return 0;
+}
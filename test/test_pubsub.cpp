@@ -0,0 +1,293 @@
+// unit test of the pattern trie: ps_match() against a plain recursive glob
+// matcher with Redis' rules, over generated patterns (escapes, `?`, `*`
+// chains, classes with `^`, ranges, ranges ending in `]`, unclosed classes,
+// and random bytes) and channels. then deletes the patterns in random order,
+// checking that matches stay right and ps_pattern_del() leaves no dead
+// branches, down to an empty trie.
+//
+// usage: test_pubsub, exits non-zero on the first failure
+// stdlib
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+// C++
+#include <algorithm>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+// proj
+#include "../pubsub.h"
+
+// like assert(), but also with NDEBUG
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rnd() {
+    // xorshift64
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+static char pick(const char *alphabet) {
+    return alphabet[rnd() % strlen(alphabet)];
+}
+
+// matches [class] at the front of `pat` against `c`. returns the bytes the
+// class takes up; an unclosed one takes the rest of the pattern.
+static size_t ref_class(std::string_view pat, uint8_t c, bool &matched) {
+    size_t i = 1;
+    bool negate = i < pat.size() && pat[i] == '^';
+    if (negate) {
+        i++;
+    }
+    matched = false;
+    while (i < pat.size()) {
+        if (pat[i] == '\\' && i + 1 < pat.size()) {
+            matched |= (uint8_t)pat[i + 1] == c;
+            i += 2;
+        } else if (pat[i] == ']') {
+            i++;
+            break;
+        } else if (i + 2 < pat.size() && pat[i + 1] == '-') {
+            uint8_t lo = (uint8_t)pat[i], hi = (uint8_t)pat[i + 2];
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            matched |= c >= lo && c <= hi;
+            i += 3;
+        } else {
+            matched |= (uint8_t)pat[i] == c;
+            i++;
+        }
+    }
+    matched ^= negate;
+    return i;
+}
+
+// Redis' glob rules, the slow way: does `pat` match all of `s`. what's left
+// of the pattern once the channel runs out matches if it's all '*'s. (Redis
+// doesn't match even "*" against an empty channel, so the test doesn't use
+// one.)
+static bool ref_match(std::string_view pat, std::string_view s) {
+    if (pat.empty()) {
+        return s.empty();
+    }
+    if (s.empty()) {
+        return pat.find_first_not_of('*') == std::string_view::npos;
+    }
+    switch (pat[0]) {
+    case '*':
+        for (size_t i = 0; i <= s.size(); i++) {
+            if (ref_match(pat.substr(1), s.substr(i))) {
+                return true;
+            }
+        }
+        return false;
+    case '?':
+        return ref_match(pat.substr(1), s.substr(1));
+    case '[': {
+        bool matched = false;
+        size_t len = ref_class(pat, (uint8_t)s[0], matched);
+        return matched && ref_match(pat.substr(len), s.substr(1));
+    }
+    case '\\':
+        if (pat.size() >= 2) {
+            return pat[1] == s[0] && ref_match(pat.substr(2), s.substr(1));
+        }
+        return s[0] == '\\' && ref_match(pat.substr(1), s.substr(1));
+    default:
+        return pat[0] == s[0] && ref_match(pat.substr(1), s.substr(1));
+    }
+}
+
+// the bytes that patterns and channels are made of: few, so they collide
+static const char k_bytes[] = "ab-]^[\\*?";
+
+static std::string random_class(bool last) {
+    std::string cls = "[";
+    if (rnd() % 3 == 0) {
+        cls += '^';
+    }
+    for (uint64_t n = rnd() % 4; n > 0; n--) {
+        switch (rnd() % 4) {
+        case 0:
+            cls += '\\';
+            cls += pick(k_bytes);
+            break;
+        case 1:
+            // a range, which may end in ']' or go backwards
+            cls += pick("ab-");
+            cls += '-';
+            cls += pick("ab]");
+            break;
+        default:
+            cls += pick("ab-^");
+            break;
+        }
+    }
+    // unclosed, which only makes sense at the end
+    if (!last || rnd() % 6) {
+        cls += ']';
+    }
+    return cls;
+}
+
+static std::string random_pattern() {
+    std::string pat;
+    uint64_t ntok = rnd() % 6;
+    if (rnd() % 4 == 0) {
+        // any bytes at all
+        for (uint64_t i = 0; i < ntok; i++) {
+            pat += pick(k_bytes);
+        }
+        return pat;
+    }
+    for (uint64_t i = 0; i < ntok; i++) {
+        switch (rnd() % 6) {
+        case 0:
+            pat += '\\';
+            pat += pick(k_bytes);
+            break;
+        case 1:
+            pat += '?';
+            break;
+        case 2:
+            pat.append(1 + rnd() % 3, '*');
+            break;
+        case 3:
+            pat += random_class(i + 1 == ntok);
+            break;
+        default:
+            pat += pick("ab-");
+            break;
+        }
+    }
+    return pat;
+}
+
+static std::string random_channel() {
+    std::string ch;
+    for (uint64_t n = 1 + rnd() % 7; n > 0; n--) {
+        ch += rnd() % 2 ? pick("ab") : pick(k_bytes);
+    }
+    return ch;
+}
+
+static void check_matches(PubSub *ps, const std::set<std::string> &pats,
+    const std::string &channel)
+{
+    std::vector<PubPattern *> out;
+    ps_match(ps, channel, out);
+    std::set<std::string> got;
+    for (PubPattern *pat : out) {
+        CHECK(pats.count(pat->pattern));
+        CHECK(got.insert(pat->pattern).second);     // each once
+    }
+    for (const std::string &pat : pats) {
+        bool want = ref_match(pat, channel);
+        if (want != (got.count(pat) > 0)) {
+            fprintf(stderr, "pattern '%s', channel '%s': want %d\n", pat.c_str(),
+                channel.c_str(), (int)want);
+            CHECK(false);
+        }
+    }
+}
+
+// every node below `node` leads to a pattern; returns the patterns
+static size_t check_trie(const PatNode *node) {
+    std::vector<const PatNode *> kids;
+    for (const auto &[byte, kid] : node->lits) {
+        kids.push_back(kid);
+    }
+    for (const auto &[cls, kid] : node->classes) {
+        kids.push_back(kid);
+    }
+    if (node->any) {
+        kids.push_back(node->any);
+    }
+    if (node->kstar) {
+        kids.push_back(node->kstar);
+    }
+    size_t count = node->pats.size();
+    for (const PatNode *kid : kids) {
+        CHECK(kid->parent == node);
+        size_t under = check_trie(kid);
+        CHECK(under > 0);
+        count += under;
+    }
+    for (const PubPattern *pat : node->pats) {
+        CHECK(pat->node == node);
+    }
+    return count;
+}
+
+static void test_match() {
+    for (int round = 0; round < 1000; round++) {
+        PubSub ps;
+        std::set<std::string> pats;
+        for (int i = 0; i < 30; i++) {
+            std::string pat = random_pattern();
+            PubPattern *p = ps_pattern_add(&ps, pat);
+            CHECK(p->pattern == pat);
+            CHECK(ps_pattern_find(&ps, pat) == p);
+            CHECK(ps_pattern_add(&ps, pat) == p);
+            pats.insert(pat);
+        }
+        CHECK(ps.npatterns == pats.size());
+        CHECK(check_trie(&ps.root) == pats.size());
+        for (int k = 0; k < 50; k++) {
+            check_matches(&ps, pats, random_channel());
+        }
+
+        // delete in random order
+        std::vector<std::string> order(pats.begin(), pats.end());
+        for (size_t i = order.size(); i > 1; i--) {
+            std::swap(order[i - 1], order[rnd() % i]);
+        }
+        for (const std::string &pat : order) {
+            PubPattern *p = ps_pattern_find(&ps, pat);
+            CHECK(p);
+            ps_pattern_del(&ps, p);
+            pats.erase(pat);
+            CHECK(!ps_pattern_find(&ps, pat));
+            CHECK(ps.npatterns == pats.size());
+            CHECK(check_trie(&ps.root) == pats.size());
+            for (int k = 0; k < 5; k++) {
+                check_matches(&ps, pats, random_channel());
+            }
+        }
+        CHECK(ps.root.lits.empty() && ps.root.classes.empty());
+        CHECK(!ps.root.any && !ps.root.kstar && ps.root.pats.empty());
+    }
+}
+
+static void test_examples() {
+    // the reference itself, on the cases that are easy to get wrong
+    CHECK(ref_match("h?llo", "hello") && !ref_match("h?llo", "hllo"));
+    CHECK(ref_match("h*llo", "hllo") && ref_match("h***o", "hello"));
+    CHECK(ref_match("h[^e]llo", "hallo") && !ref_match("h[^e]llo", "hello"));
+    CHECK(ref_match("h[a-b]llo", "hbllo") && ref_match("h[b-a]llo", "hallo"));
+    CHECK(ref_match("[a-]]", "]") && ref_match("[a-]]", "^") && !ref_match("[a-]]", "b"));
+    CHECK(!ref_match("[]a", "a") && ref_match("[\\]]", "]"));
+    CHECK(ref_match("a[bc", "ab") && ref_match("a[bc", "ac"));
+    CHECK(ref_match("\\*", "*") && !ref_match("\\*", "a"));
+    CHECK(ref_match("a\\", "a\\"));
+    CHECK(ref_match("a*", "a") && !ref_match("a?", "a"));
+}
+
+int main() {
+    test_examples();
+    test_match();
+    printf("test_pubsub: ok\n");
+    return 0;
+}
@@ -0,0 +1,287 @@
+// unit test of ZSet against a std::set: random ZADD, score updates and ZREM,
+// and after each step zset_rank, zset_seek_rank, zset_seek_score (inclusive
+// and exclusive), the order of the leaf list, the key counts and separators
+// of every node, and the memory accounting.
+//
+// usage: test_zset, exits non-zero on the first failure
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+// C++
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+// proj
+#include "../zset.h"
+
+// like assert(), but also with NDEBUG
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+// the same order as the tree: by score, then by name
+typedef std::set<std::pair<double, std::string>> RefSet;
+
+struct Ref {
+    RefSet sorted;
+    std::map<std::string, double> score;
+};
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rnd() {
+    // xorshift64
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+static std::string znode_name(const ZNode *znode) {
+    return std::string(znode->name, znode->len);
+}
+
+// the whole tree, in order
+struct Walk {
+    std::vector<ZLeaf *> leaves;
+    std::vector<ZNode *> items;
+    size_t leaf_bytes = 0;
+    size_t inner_bytes = 0;
+};
+
+// checks the node and returns the keys under it. `lo` is the smallest key
+// under it, if it isn't the leftmost node.
+static uint32_t walk_node(Walk &w, void *node, uint32_t level, double lo_score,
+    const ZNode *lo_item)
+{
+    if (level == 0) {
+        ZLeaf *leaf = (ZLeaf *)node;
+        CHECK(leaf->n > 0 && leaf->n <= k_zleaf_keys);
+        if (lo_item) {
+            CHECK(leaf->score[0] == lo_score && leaf->item[0] == lo_item);
+        }
+        for (uint32_t i = 0; i < leaf->n; i++) {
+            CHECK(leaf->score[i] == leaf->item[i]->score);
+            w.items.push_back(leaf->item[i]);
+        }
+        w.leaves.push_back(leaf);
+        w.leaf_bytes += sizeof(ZLeaf);
+        return leaf->n;
+    }
+    ZInner *in = (ZInner *)node;
+    CHECK(in->n >= 2 && in->n <= k_zinner_kids);
+    w.inner_bytes += sizeof(ZInner);
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < in->n; i++) {
+        // separator i - 1 is the smallest key under child i
+        double s = i > 0 ? in->score[i - 1] : lo_score;
+        const ZNode *z = i > 0 ? in->item[i - 1] : lo_item;
+        uint32_t count = walk_node(w, in->kid[i], level - 1, s, z);
+        CHECK(in->count[i] == count);
+        total += count;
+    }
+    return total;
+}
+
+static void check_zset(ZSet *zset, const Ref &ref) {
+    CHECK(zset->size == ref.sorted.size());
+    CHECK(hm_size(&zset->members) == ref.sorted.size());
+    if (ref.sorted.empty()) {
+        CHECK(!zset->root && zset->height == 0 && zset->mem == 0);
+        CHECK(!zset_seek_rank(zset, 0).leaf);
+        CHECK(!zset_seek_score(zset, 0, false).leaf);
+        return;
+    }
+
+    // the tree, in order, is the reference
+    Walk w;
+    uint32_t count = walk_node(w, zset->root, zset->height, 0, NULL);
+    CHECK(count == zset->size);
+    CHECK(w.items.size() == ref.sorted.size());
+    size_t name_bytes = 0;
+    size_t rank = 0;
+    for (const auto &[score, name] : ref.sorted) {
+        ZNode *znode = w.items[rank];
+        CHECK(znode->score == score && znode_name(znode) == name);
+        CHECK(zset_lookup(zset, name) == znode);
+        CHECK(zset_rank(zset, znode) == rank);
+        name_bytes += offsetof(ZNode, name) + znode->len;
+        rank++;
+    }
+    CHECK(zset->mem == w.leaf_bytes + w.inner_bytes + name_bytes);
+
+    // the leaf list visits the same leaves, and ends
+    ZLeaf *leaf = w.leaves[0];
+    for (size_t i = 0; i < w.leaves.size(); i++) {
+        CHECK(leaf == w.leaves[i]);
+        leaf = leaf->next;
+    }
+    CHECK(leaf == NULL);
+
+    // seek by rank, a few of them and just past the end
+    for (int k = 0; k < 4; k++) {
+        size_t r = rnd() % zset->size;
+        ZIter it = zset_seek_rank(zset, r);
+        CHECK(it.leaf && zit_node(it) == w.items[r]);
+        // and iterate on from there for a bit
+        for (size_t j = r + 1; j < r + 20 && j < zset->size; j++) {
+            zit_next(it);
+            CHECK(it.leaf && zit_node(it) == w.items[j]);
+        }
+        ZIter skip = zset_seek_rank(zset, 0);
+        zit_skip(skip, r);
+        CHECK(skip.leaf && zit_node(skip) == w.items[r]);
+    }
+    CHECK(!zset_seek_rank(zset, zset->size).leaf);
+    ZIter last = zset_seek_rank(zset, zset->size - 1);
+    zit_next(last);
+    CHECK(!last.leaf);
+
+    // seek by score: scores in the set, between them and outside of them
+    for (int k = 0; k < 6; k++) {
+        double min = (double)((int64_t)(rnd() % 130) - 5) / 2;
+        for (bool exclusive : {false, true}) {
+            auto ref_it = ref.sorted.lower_bound({min, std::string()});
+            while (exclusive && ref_it != ref.sorted.end() && ref_it->first == min) {
+                ++ref_it;
+            }
+            ZIter it = zset_seek_score(zset, min, exclusive);
+            if (ref_it == ref.sorted.end()) {
+                CHECK(!it.leaf);
+            } else {
+                CHECK(it.leaf);
+                CHECK(zit_score(it) == ref_it->first);
+                CHECK(znode_name(zit_node(it)) == ref_it->second);
+            }
+        }
+    }
+}
+
+static void ref_add(Ref &ref, const std::string &name, double score) {
+    auto it = ref.score.find(name);
+    if (it != ref.score.end()) {
+        ref.sorted.erase({it->second, name});
+    }
+    ref.score[name] = score;
+    ref.sorted.insert({score, name});
+}
+
+static std::string random_name(size_t space) {
+    // names share prefixes and differ in length, for the ties
+    std::string name = "m" + std::to_string(rnd() % space);
+    if (rnd() % 4 == 0) {
+        name += "x";
+    }
+    return name;
+}
+
+// a random step: mostly ZADD (new or an update) while growing, mostly ZREM
+// while shrinking
+static void random_step(ZSet *zset, Ref &ref, bool grow, size_t space) {
+    uint64_t op = rnd() % 100;
+    if (op < (grow ? 70u : 30u)) {
+        std::string name = random_name(space);
+        // few distinct scores, so many members tie on them
+        double score = (double)(rnd() % 120) / 2;
+        bool is_new = !ref.score.count(name);
+        CHECK(zset_add(zset, name, score) == is_new);
+        ref_add(ref, name, score);
+    } else if (op < (grow ? 85u : 40u) && !ref.score.empty()) {
+        // update one that's there
+        auto it = ref.sorted.begin();
+        std::advance(it, (long)(rnd() % ref.sorted.size()));
+        std::string name = it->second;
+        double score = (double)(rnd() % 120) / 2;
+        CHECK(!zset_add(zset, name, score));
+        ref_add(ref, name, score);
+    } else {
+        // one that's there, or maybe not
+        std::string name = random_name(space);
+        if (rnd() % 2 && !ref.score.empty()) {
+            auto pick = ref.sorted.begin();
+            std::advance(pick, (long)(rnd() % ref.sorted.size()));
+            name = pick->second;
+        }
+        auto it = ref.score.find(name);
+        bool there = it != ref.score.end();
+        CHECK(zset_rem(zset, name) == there);
+        if (there) {
+            ref.sorted.erase({it->second, name});
+            ref.score.erase(it);
+        }
+    }
+}
+
+static void test_random() {
+    ZSet zset;
+    Ref ref;
+    // grow to a few levels, then shrink back to nothing, twice
+    for (int round = 0; round < 2; round++) {
+        while (ref.sorted.size() < 1500) {
+            random_step(&zset, ref, true, 4000);
+            check_zset(&zset, ref);
+        }
+        while (!ref.sorted.empty()) {
+            random_step(&zset, ref, false, 4000);
+            check_zset(&zset, ref);
+        }
+    }
+    // a small set, churning around the leaf and root boundaries
+    for (int i = 0; i < 20000; i++) {
+        random_step(&zset, ref, ref.sorted.size() < 40, 60);
+        check_zset(&zset, ref);
+    }
+    zset_clear(&zset);
+}
+
+static void test_in_order() {
+    // ascending inserts split at the right edge, descending at the left
+    ZSet zset;
+    Ref ref;
+    for (int i = 0; i < 3000; i++) {
+        std::string name = "k" + std::to_string(i);
+        CHECK(zset_add(&zset, name, (double)i));
+        ref_add(ref, name, (double)i);
+        if (i % 97 == 0) {
+            check_zset(&zset, ref);
+        }
+    }
+    check_zset(&zset, ref);
+    for (int i = 0; i < 3000; i++) {
+        std::string name = "k" + std::to_string(i);
+        CHECK(!zset_add(&zset, name, (double)-i));
+        ref_add(ref, name, (double)-i);
+        if (i % 97 == 0) {
+            check_zset(&zset, ref);
+        }
+    }
+    check_zset(&zset, ref);
+    // remove from the front
+    for (int i = 2999; i >= 0; i--) {
+        std::string name = "k" + std::to_string(i);
+        CHECK(zset_rem(&zset, name));
+        ref.sorted.erase({(double)-i, name});
+        ref.score.erase(name);
+        if (i % 97 == 0) {
+            check_zset(&zset, ref);
+        }
+    }
+    check_zset(&zset, ref);
+    CHECK(!zset_rem(&zset, "k0"));
+    zset_clear(&zset);
+}
+
+int main() {
+    test_random();
+    test_in_order();
+    printf("test_zset: ok\n");
+    return 0;
+}
@@ -0,0 +1,145 @@
+// stdlib
+#include <assert.h>
+// proj
+#include "common.h"
+#include "timer.h"
+
+
+const uint64_t k_wheel_mask = k_wheel_slots - 1;
+// furthest deadline the wheel can file directly
+const uint64_t k_wheel_span = (uint64_t)1 << (k_wheel_bits * k_wheel_levels);
+
+// the level and slot for a deadline, relative to the current tick
+static void tw_place(TimerWheel *tw, Timer *t) {
+    // a deadline already passed (only seen when cascading) goes in the
+    // slot about to be processed
+    uint64_t expire = t->expire > tw->now ? t->expire : tw->now;
+    if (expire - tw->now >= k_wheel_span) {
+        // too far out: wait in the last slot of the top level for now
+        expire = tw->now + k_wheel_span - 1;
+    }
+    uint64_t delta = expire - tw->now;
+    size_t level = 0;
+    while (level + 1 < k_wheel_levels && delta >= ((uint64_t)1 << (k_wheel_bits * (level + 1)))) {
+        level++;
+    }
+    size_t slot = (size_t)(expire >> (k_wheel_bits * level)) & k_wheel_mask;
+    dlist_insert_before(&tw->slots[level][slot], &t->node);
+    tw->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void tw_unlink(TimerWheel *tw, Timer *t) {
+    // clear the slot bit if this was its last timer
+    DList *next = t->node.next;
+    dlist_detach(&t->node);
+    if (dlist_empty(next)) {
+        for (size_t level = 0; level < k_wheel_levels; level++) {
+            DList *base = tw->slots[level];
+            if (next >= base && next < base + k_wheel_slots) {
+                tw->occupied[level] &= ~((uint64_t)1 << (next - base));
+                break;
+            }
+        }
+    }
+}
+
+void tw_init(TimerWheel *tw, uint64_t now) {
+    tw->now = now;
+    tw->count = 0;
+    for (size_t level = 0; level < k_wheel_levels; level++) {
+        for (size_t slot = 0; slot < k_wheel_slots; slot++) {
+            dlist_init(&tw->slots[level][slot]);
+        }
+        tw->occupied[level] = 0;
+    }
+}
+
+void tw_add(TimerWheel *tw, Timer *t, uint64_t expire) {
+    if (tw_active(t)) {
+        tw_unlink(tw, t);
+    } else {
+        tw->count++;
+    }
+    // the current tick's slot has been processed already
+    t->expire = expire > tw->now ? expire : tw->now + 1;
+    tw_place(tw, t);
+}
+
+void tw_del(TimerWheel *tw, Timer *t) {
+    if (tw_active(t)) {
+        tw_unlink(tw, t);
+        tw->count--;
+    }
+}
+
+// re-files every timer of a higher-level slot that is coming due
+static void tw_cascade(TimerWheel *tw, size_t level, size_t slot) {
+    DList *head = &tw->slots[level][slot];
+    tw->occupied[level] &= ~((uint64_t)1 << slot);
+    while (!dlist_empty(head)) {
+        Timer *t = container_of(head->next, Timer, node);
+        dlist_detach(&t->node);
+        tw_place(tw, t);
+    }
+}
+
+int64_t tw_next_timeout(TimerWheel *tw) {
+    if (tw->count == 0) {
+        return -1;
+    }
+    int64_t best = -1;
+    for (size_t level = 0; level < k_wheel_levels; level++) {
+        uint64_t bits = tw->occupied[level];
+        if (!bits) {
+            continue;
+        }
+        // the first occupied slot after the current one, wrapping around
+        size_t shift = k_wheel_bits * level;
+        size_t cur = (size_t)(tw->now >> shift) & k_wheel_mask;
+        size_t rot = (cur + 1) & k_wheel_mask;
+        uint64_t rotated = rot ? (bits >> rot) | (bits << (k_wheel_slots - rot)) : bits;
+        uint64_t d = (uint64_t)__builtin_ctzll(rotated) + 1;
+        // level 0 slots are processed on their tick, higher ones cascade at
+        // the start of their range
+        uint64_t when = ((tw->now >> shift) + d) << shift;
+        int64_t wait = (int64_t)(when - tw->now);
+        if (best < 0 || wait < best) {
+            best = wait;
+        }
+    }
+    return best;
+}
+
+void tw_advance(TimerWheel *tw, uint64_t now, void (*f)(Timer *, void *), void *arg) {
+    while (tw->now < now) {
+        // jump straight to the next tick that has anything to do
+        int64_t wait = tw_next_timeout(tw);
+        if (wait < 0 || tw->now + (uint64_t)wait > now) {
+            tw->now = now;
+            break;
+        }
+        tw->now += (uint64_t)wait;
+        // cascade from the top, so timers falling through several levels
+        // end up in the right place
+        size_t top = 0;
+        while (top + 1 < k_wheel_levels
+            && ((tw->now >> (k_wheel_bits * top)) & k_wheel_mask) == 0)
+        {
+            top++;
+        }
+        for (size_t level = top; level > 0; level--) {
+            tw_cascade(tw, level, (size_t)(tw->now >> (k_wheel_bits * level)) & k_wheel_mask);
+        }
+
+        size_t slot = (size_t)tw->now & k_wheel_mask;
+        DList *head = &tw->slots[0][slot];
+        tw->occupied[0] &= ~((uint64_t)1 << slot);
+        while (!dlist_empty(head)) {
+            Timer *t = container_of(head->next, Timer, node);
+            assert(t->expire <= tw->now);
+            dlist_detach(&t->node);
+            tw->count--;
+            f(t, arg);
+        }
+    }
+}
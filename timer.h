@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// proj
+#include "list.h"
+
+
+// timer node, should be embedded into the payload
+struct Timer {
+    DList node;             // empty when not scheduled
+    uint64_t expire = 0;    // in ticks (ms)
+};
+
+const size_t k_wheel_bits = 6;
+const size_t k_wheel_slots = 1 << k_wheel_bits;
+const size_t k_wheel_levels = 4;
+
+// hierarchical timer wheel: level L has 64 slots of 64^L ticks each, so
+// add/del are O(1) list operations and an idle timer is only touched when
+// its slot cascades down a level. the 4 levels cover 64^4 ms (~4.6 hours);
+// later deadlines park in the top level and are re-filed on each cascade.
+struct TimerWheel {
+    uint64_t now = 0;       // the last tick processed
+    size_t count = 0;
+    DList slots[k_wheel_levels][k_wheel_slots];
+    uint64_t occupied[k_wheel_levels] = {};     // bit per non-empty slot
+};
+
+void tw_init(TimerWheel *tw, uint64_t now);
+// (re)schedules `t`; a deadline in the past fires on the next tick
+void tw_add(TimerWheel *tw, Timer *t, uint64_t expire);
+void tw_del(TimerWheel *tw, Timer *t);
+inline bool tw_active(Timer *t) {
+    return !dlist_empty(&t->node);
+}
+// ticks until the wheel next needs tw_advance(), -1 if it is empty. may be
+// earlier than the next deadline, when a higher level is due to cascade.
+int64_t tw_next_timeout(TimerWheel *tw);
+// runs `f` for each timer that expired up to `now`. `t` is already removed,
+// so `f` may free it or schedule it again.
+void tw_advance(TimerWheel *tw, uint64_t now, void (*f)(Timer *, void *), void *arg);
@@ -0,0 +1,206 @@
+// stdlib
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+// system
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// proj
+#include "uring.h"
+
+
+static int sys_setup(uint32_t entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+    const void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(Uring *ring, uint32_t entries) {
+    struct io_uring_params p = {};
+    // one thread submits and reaps, so the kernel can run completion work
+    // when we enter instead of interrupting us for it (linux 6.1)
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;     // multishot ops complete many times
+    int fd = sys_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        p = {};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        fd = sys_setup(entries, &p);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    // waits with a timeout need EXT_ARG (linux 5.11)
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        return false;
+    }
+    *ring = Uring{};
+    ring->fd = fd;
+    ring->features = p.features;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return false;
+    }
+    ring->cq_ring = ring->sq_ring;  // one mapping for both
+    size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_free(ring);
+        return false;
+    }
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    uint8_t *sq = (uint8_t *)ring->sq_ring;
+    ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    // SQE i always sits in slot i, so the index array is set up once
+    uint32_t *array = (uint32_t *)(sq + p.sq_off.array);
+    for (uint32_t i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    uint8_t *cq = (uint8_t *)ring->cq_ring;
+    ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+void uring_free(Uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    *ring = Uring{};
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(Uring *ring, uint32_t wait_nr, int timeout_ms) {
+    uint32_t to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    // always: with DEFER_TASKRUN the kernel only runs the work that posts
+    // completions on an enter that asks for events, even for 0 of them
+    uint32_t flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (wait_nr && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    arg.sigmask_sz = _NSIG / 8;
+    int rv = sys_enter(ring->fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg,
+        sizeof(arg));
+    return rv < 0 ? -errno : rv;
+}
+
+bool uring_buf_ring_init(Uring *ring, UringBufRing *bufs, uint16_t bgid, uint32_t nbufs,
+    uint32_t buf_size)
+{
+    *bufs = UringBufRing{};
+    size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) {
+        return false;
+    }
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(br, ring_size);
+        return false;
+    }
+    bufs->br = (struct io_uring_buf_ring *)br;
+    bufs->bufs = (uint8_t *)mmap(NULL, (size_t)nbufs * buf_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bufs->nbufs = nbufs;
+    bufs->buf_size = buf_size;
+    bufs->bgid = bgid;
+    if (bufs->bufs == MAP_FAILED) {
+        bufs->bufs = NULL;
+        uring_buf_ring_free(ring, bufs);
+        return false;
+    }
+    for (uint32_t i = 0; i < nbufs; i++) {
+        uring_buf_recycle(bufs, (uint16_t)i);
+    }
+    return true;
+}
+
+void uring_buf_ring_free(Uring *ring, UringBufRing *bufs) {
+    if (bufs->br) {
+        struct io_uring_buf_reg reg = {};
+        reg.bgid = bufs->bgid;
+        (void)sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(bufs->br, bufs->nbufs * sizeof(struct io_uring_buf));
+    }
+    if (bufs->bufs) {
+        munmap(bufs->bufs, (size_t)bufs->nbufs * bufs->buf_size);
+    }
+    *bufs = UringBufRing{};
+}
+
+bool uring_supported() {
+    Uring ring;
+    if (!uring_init(&ring, 8)) {
+        return false;
+    }
+    UringBufRing bufs;
+    int fds[2] = {-1, -1};
+    bool ok = uring_buf_ring_init(&ring, &bufs, 0, 2, 64)
+        && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+    if (ok) {
+        // a multishot recv that gets one byte and stays armed
+        uring_prep_recv_multishot(uring_get_sqe(&ring), fds[0], 0, 1);
+        ok = write(fds[1], "x", 1) == 1 && uring_submit_and_wait(&ring, 1, 1000) >= 0;
+        struct io_uring_cqe *cqe = ok ? uring_peek_cqe(&ring) : NULL;
+        ok = cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE)
+            && (cqe->flags & IORING_CQE_F_BUFFER);
+    }
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    uring_buf_ring_free(&ring, &bufs);
+    uring_free(&ring);
+    return ok;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// system
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+
+// a minimal io_uring on the raw syscalls: the two rings, SQE and CQE access
+// and a ring of provided buffers. one thread per ring.
+struct Uring {
+    int fd = -1;
+    uint32_t features = 0;
+    // submission queue. SQEs are filled in at `sqe_tail` and published to
+    // the kernel by the next uring_submit_and_wait()
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+    uint32_t sqe_tail = 0;
+    struct io_uring_sqe *sqes = NULL;
+    // completion queue
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+    // the mappings
+    void *sq_ring = NULL;
+    void *cq_ring = NULL;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+};
+
+// false if the kernel lacks io_uring or the features below need
+bool uring_init(Uring *ring, uint32_t entries);
+void uring_free(Uring *ring);
+
+// the next SQE, zeroed; NULL if the queue is full until the next submit
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+// submits the queued SQEs and waits until `wait_nr` completions are there
+// or `timeout_ms` passed (-1 = no limit). with `wait_nr` 0 it doesn't wait
+// but still reaps what completed. one syscall; returns its result or
+// -errno.
+int uring_submit_and_wait(Uring *ring, uint32_t wait_nr, int timeout_ms);
+
+// the oldest unseen completion, or NULL
+static inline struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    uint32_t head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+    uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+// into a buffer picked from group `bgid`, for as long as there is data
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t bgid,
+    uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+// `msg` and its iovecs must stay put until the completion
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+    const struct msghdr *msg, uint32_t flags, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+}
+
+// cancels the op that was submitted with `target` for its user_data
+static inline void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+    uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+    uint32_t events, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+// buffers the kernel picks from for IOSQE_BUFFER_SELECT reads. a completion
+// names its buffer, which goes back with uring_buf_recycle() once used.
+struct UringBufRing {
+    struct io_uring_buf_ring *br = NULL;
+    uint8_t *bufs = NULL;
+    uint32_t nbufs = 0;     // a power of 2
+    uint32_t buf_size = 0;
+    uint16_t bgid = 0;
+    uint16_t tail = 0;
+};
+
+bool uring_buf_ring_init(Uring *ring, UringBufRing *bufs, uint16_t bgid, uint32_t nbufs,
+    uint32_t buf_size);
+void uring_buf_ring_free(Uring *ring, UringBufRing *bufs);
+
+static inline uint8_t *uring_buf(const UringBufRing *bufs, uint16_t bid) {
+    return bufs->bufs + (size_t)bid * bufs->buf_size;
+}
+
+static inline void uring_buf_recycle(UringBufRing *bufs, uint16_t bid) {
+    // not br->bufs: in C++ the header's flexible array member comes after an
+    // empty struct, which is a byte here, so it lands at the wrong offset
+    struct io_uring_buf *buf = (struct io_uring_buf *)bufs->br + (bufs->tail & (bufs->nbufs - 1));
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(bufs, bid);
+    buf->len = bufs->buf_size;
+    buf->bid = bid;
+    bufs->tail++;
+    __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+// whether everything the server's io_uring loop uses works here: multishot
+// recv into provided buffers is the newest of it (linux 6.0)
+bool uring_supported();
@@ -0,0 +1,495 @@
+// stdlib
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+// proj
+#include "common.h"
+#include "zset.h"
+
+
+static_assert(sizeof(ZLeaf) == 256, "ZLeaf should be 4 cache lines");
+static_assert(sizeof(ZInner) == 448, "ZInner should be 7 cache lines");
+
+// a name to look up
+struct ZLookup {
+    HNode node;
+    std::string_view name;
+};
+
+static bool znode_eq(HNode *node, HNode *key) {
+    ZNode *znode = container_of(node, ZNode, node);
+    ZLookup *lk = container_of(key, ZLookup, node);
+    return std::string_view(znode->name, znode->len) == lk->name;
+}
+
+static void zlookup_init(ZLookup &lk, std::string_view name) {
+    lk.name = name;
+    lk.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+}
+
+// tree order: by score, then by name
+static int zkey_cmp(double s1, const ZNode *a, double s2, const ZNode *b) {
+    if (s1 != s2) {
+        return s1 < s2 ? -1 : 1;
+    }
+    if (a == b) {
+        return 0;
+    }
+    int r = memcmp(a->name, b->name, a->len < b->len ? a->len : b->len);
+    if (r) {
+        return r;
+    }
+    return a->len < b->len ? -1 : a->len > b->len ? 1 : 0;
+}
+
+// how many of the `n` sorted keys are <= (s, z). a linear scan: the scores
+// are a few cache lines at most, and the prefetcher likes it.
+static uint32_t zkeys_upper(const double *score, ZNode *const *item, uint32_t n,
+    double s, const ZNode *z)
+{
+    uint32_t i = 0;
+    while (i < n && score[i] < s) {
+        i++;
+    }
+    while (i < n && score[i] == s && zkey_cmp(score[i], item[i], s, z) <= 0) {
+        i++;
+    }
+    return i;
+}
+
+static ZLeaf *leaf_new(ZSet *zset) {
+    ZLeaf *leaf = new ZLeaf();
+    zset->mem += sizeof(ZLeaf);
+    return leaf;
+}
+
+static ZInner *inner_new(ZSet *zset) {
+    ZInner *in = new ZInner();
+    zset->mem += sizeof(ZInner);
+    return in;
+}
+
+static void leaf_insert_at(ZLeaf *leaf, uint32_t pos, double s, ZNode *z) {
+    uint32_t tail = leaf->n - pos;
+    memmove(&leaf->score[pos + 1], &leaf->score[pos], tail * sizeof(double));
+    memmove(&leaf->item[pos + 1], &leaf->item[pos], tail * sizeof(ZNode *));
+    leaf->score[pos] = s;
+    leaf->item[pos] = z;
+    leaf->n++;
+}
+
+// the keys under a node
+static uint32_t zt_count(void *node, uint32_t level) {
+    if (level == 0) {
+        return ((ZLeaf *)node)->n;
+    }
+    ZInner *in = (ZInner *)node;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < in->n; i++) {
+        count += in->count[i];
+    }
+    return count;
+}
+
+static void zt_first(void *node, uint32_t level, double &s, ZNode *&z) {
+    for (; level > 0; level--) {
+        node = ((ZInner *)node)->kid[0];
+    }
+    s = ((ZLeaf *)node)->score[0];
+    z = ((ZLeaf *)node)->item[0];
+}
+
+// a node split off to the right, and the smallest key under it
+struct ZSplit {
+    void *node = NULL;
+    double score = 0;
+    ZNode *item = NULL;
+    uint32_t count = 0;
+};
+
+// `split` becomes child `pos` (> 0)
+static void inner_insert_at(ZInner *in, uint32_t pos, const ZSplit &split) {
+    uint32_t tail = in->n - pos;
+    memmove(&in->kid[pos + 1], &in->kid[pos], tail * sizeof(void *));
+    memmove(&in->count[pos + 1], &in->count[pos], tail * sizeof(uint32_t));
+    memmove(&in->score[pos], &in->score[pos - 1], tail * sizeof(double));
+    memmove(&in->item[pos], &in->item[pos - 1], tail * sizeof(ZNode *));
+    in->kid[pos] = split.node;
+    in->count[pos] = split.count;
+    in->score[pos - 1] = split.score;
+    in->item[pos - 1] = split.item;
+    in->n++;
+}
+
+// removes child `pos` (> 0) and the separator in front of it
+static void inner_remove_at(ZInner *in, uint32_t pos) {
+    uint32_t tail = in->n - pos - 1;
+    memmove(&in->kid[pos], &in->kid[pos + 1], tail * sizeof(void *));
+    memmove(&in->count[pos], &in->count[pos + 1], tail * sizeof(uint32_t));
+    memmove(&in->score[pos - 1], &in->score[pos], tail * sizeof(double));
+    memmove(&in->item[pos - 1], &in->item[pos], tail * sizeof(ZNode *));
+    in->n--;
+}
+
+// a full node splits in half, except at the right edge of the tree when
+// the new key goes last: then the new node starts out (nearly) empty, so
+// keys added in order (timestamps, counters, a snapshot being loaded)
+// leave full nodes behind instead of half empty ones
+static ZSplit zt_insert(ZSet *zset, void *node, uint32_t level, bool rightmost,
+    double s, ZNode *z)
+{
+    ZSplit split;
+    if (level == 0) {
+        ZLeaf *leaf = (ZLeaf *)node;
+        uint32_t pos = zkeys_upper(leaf->score, leaf->item, leaf->n, s, z);
+        if (leaf->n < k_zleaf_keys) {
+            leaf_insert_at(leaf, pos, s, z);
+            return split;
+        }
+        ZLeaf *right = leaf_new(zset);
+        uint32_t keep = rightmost && pos == leaf->n ? leaf->n : (leaf->n + 1) / 2;
+        right->n = leaf->n - keep;
+        memcpy(right->score, &leaf->score[keep], right->n * sizeof(double));
+        memcpy(right->item, &leaf->item[keep], right->n * sizeof(ZNode *));
+        leaf->n = keep;
+        right->next = leaf->next;
+        leaf->next = right;
+        if (pos < keep) {
+            leaf_insert_at(leaf, pos, s, z);
+        } else {
+            leaf_insert_at(right, pos - keep, s, z);
+        }
+        split.node = right;
+        split.score = right->score[0];
+        split.item = right->item[0];
+        split.count = right->n;
+        return split;
+    }
+
+    ZInner *in = (ZInner *)node;
+    uint32_t i = zkeys_upper(in->score, in->item, in->n - 1, s, z);
+    ZSplit kid = zt_insert(zset, in->kid[i], level - 1, rightmost && i == in->n - 1, s, z);
+    in->count[i] += 1;
+    in->count[i] -= kid.count;  // moved to the new child, if any
+    if (!kid.node) {
+        return split;
+    }
+    if (in->n < k_zinner_kids) {
+        inner_insert_at(in, i + 1, kid);
+        return split;
+    }
+    // children [keep, n) move right, and the separator in front of them
+    // goes up a level. the right edge keeps two, an inner node never has
+    // fewer.
+    ZInner *right = inner_new(zset);
+    uint32_t keep = rightmost && i + 1 == in->n ? in->n - 1 : in->n / 2;
+    right->n = in->n - keep;
+    memcpy(right->kid, &in->kid[keep], right->n * sizeof(void *));
+    memcpy(right->count, &in->count[keep], right->n * sizeof(uint32_t));
+    memcpy(right->score, &in->score[keep], (right->n - 1) * sizeof(double));
+    memcpy(right->item, &in->item[keep], (right->n - 1) * sizeof(ZNode *));
+    split.node = right;
+    split.score = in->score[keep - 1];
+    split.item = in->item[keep - 1];
+    in->n = keep;
+    if (i + 1 <= keep) {
+        inner_insert_at(in, i + 1, kid);
+    } else {
+        inner_insert_at(right, i + 1 - keep, kid);
+    }
+    split.count = zt_count(right, level);
+    return split;
+}
+
+static void zt_merge_or_share(ZSet *zset, ZInner *in, uint32_t j, uint32_t level);
+
+// removes (s, z), which is under `node`. true if the node is now less than
+// half full.
+static bool zt_erase(ZSet *zset, void *node, uint32_t level, double s, ZNode *z) {
+    if (level == 0) {
+        ZLeaf *leaf = (ZLeaf *)node;
+        uint32_t pos = zkeys_upper(leaf->score, leaf->item, leaf->n, s, z);
+        assert(pos > 0 && leaf->item[pos - 1] == z);
+        pos--;
+        uint32_t tail = leaf->n - pos - 1;
+        memmove(&leaf->score[pos], &leaf->score[pos + 1], tail * sizeof(double));
+        memmove(&leaf->item[pos], &leaf->item[pos + 1], tail * sizeof(ZNode *));
+        leaf->n--;
+        return leaf->n < k_zleaf_keys / 2;
+    }
+
+    ZInner *in = (ZInner *)node;
+    uint32_t i = zkeys_upper(in->score, in->item, in->n - 1, s, z);
+    bool under = zt_erase(zset, in->kid[i], level - 1, s, z);
+    in->count[i]--;
+    if (i > 0 && in->item[i - 1] == z && in->count[i] > 0) {
+        // it was the child's smallest key
+        zt_first(in->kid[i], level - 1, in->score[i - 1], in->item[i - 1]);
+    }
+    if (under) {
+        zt_merge_or_share(zset, in, i > 0 ? i - 1 : 0, level);
+    }
+    return in->n < k_zinner_kids / 2;
+}
+
+// children `j` and `j + 1` become one if they fit in one node, or else
+// split their keys evenly
+static void zt_merge_or_share(ZSet *zset, ZInner *in, uint32_t j, uint32_t level) {
+    assert(in->n >= 2);
+    if (level == 1) {
+        ZLeaf *l = (ZLeaf *)in->kid[j];
+        ZLeaf *r = (ZLeaf *)in->kid[j + 1];
+        uint32_t total = l->n + r->n;
+        double score[2 * k_zleaf_keys];
+        ZNode *item[2 * k_zleaf_keys];
+        memcpy(score, l->score, l->n * sizeof(double));
+        memcpy(item, l->item, l->n * sizeof(ZNode *));
+        memcpy(&score[l->n], r->score, r->n * sizeof(double));
+        memcpy(&item[l->n], r->item, r->n * sizeof(ZNode *));
+        if (total <= k_zleaf_keys) {
+            memcpy(l->score, score, total * sizeof(double));
+            memcpy(l->item, item, total * sizeof(ZNode *));
+            l->n = total;
+            l->next = r->next;
+            delete r;
+            zset->mem -= sizeof(ZLeaf);
+            in->count[j] = total;
+            inner_remove_at(in, j + 1);
+            return;
+        }
+        l->n = total / 2;
+        r->n = total - l->n;
+        memcpy(l->score, score, l->n * sizeof(double));
+        memcpy(l->item, item, l->n * sizeof(ZNode *));
+        memcpy(r->score, &score[l->n], r->n * sizeof(double));
+        memcpy(r->item, &item[l->n], r->n * sizeof(ZNode *));
+        in->count[j] = l->n;
+        in->count[j + 1] = r->n;
+        in->score[j] = r->score[0];
+        in->item[j] = r->item[0];
+        return;
+    }
+
+    // the same for inner nodes, with separator j coming down in between
+    ZInner *l = (ZInner *)in->kid[j];
+    ZInner *r = (ZInner *)in->kid[j + 1];
+    uint32_t total = l->n + r->n;
+    void *kid[2 * k_zinner_kids];
+    uint32_t count[2 * k_zinner_kids];
+    double score[2 * k_zinner_kids];
+    ZNode *item[2 * k_zinner_kids];
+    memcpy(kid, l->kid, l->n * sizeof(void *));
+    memcpy(count, l->count, l->n * sizeof(uint32_t));
+    memcpy(&kid[l->n], r->kid, r->n * sizeof(void *));
+    memcpy(&count[l->n], r->count, r->n * sizeof(uint32_t));
+    memcpy(score, l->score, (l->n - 1) * sizeof(double));
+    memcpy(item, l->item, (l->n - 1) * sizeof(ZNode *));
+    score[l->n - 1] = in->score[j];
+    item[l->n - 1] = in->item[j];
+    memcpy(&score[l->n], r->score, (r->n - 1) * sizeof(double));
+    memcpy(&item[l->n], r->item, (r->n - 1) * sizeof(ZNode *));
+
+    uint32_t nl = total <= k_zinner_kids ? total : total / 2;
+    l->n = nl;
+    memcpy(l->kid, kid, nl * sizeof(void *));
+    memcpy(l->count, count, nl * sizeof(uint32_t));
+    memcpy(l->score, score, (nl - 1) * sizeof(double));
+    memcpy(l->item, item, (nl - 1) * sizeof(ZNode *));
+    in->count[j] = zt_count(l, level - 1);
+    if (nl == total) {
+        delete r;
+        zset->mem -= sizeof(ZInner);
+        inner_remove_at(in, j + 1);
+        return;
+    }
+    r->n = total - nl;
+    memcpy(r->kid, &kid[nl], r->n * sizeof(void *));
+    memcpy(r->count, &count[nl], r->n * sizeof(uint32_t));
+    memcpy(r->score, &score[nl], (r->n - 1) * sizeof(double));
+    memcpy(r->item, &item[nl], (r->n - 1) * sizeof(ZNode *));
+    in->count[j + 1] = zt_count(r, level - 1);
+    in->score[j] = score[nl - 1];
+    in->item[j] = item[nl - 1];
+}
+
+static void zt_tree_insert(ZSet *zset, double s, ZNode *z) {
+    if (!zset->root) {
+        zset->root = leaf_new(zset);
+        zset->height = 0;
+    }
+    ZSplit split = zt_insert(zset, zset->root, zset->height, true, s, z);
+    if (split.node) {
+        // a new root
+        ZInner *in = inner_new(zset);
+        in->n = 2;
+        in->kid[0] = zset->root;
+        in->kid[1] = split.node;
+        in->count[0] = (uint32_t)zset->size - split.count;
+        in->count[1] = split.count;
+        in->score[0] = split.score;
+        in->item[0] = split.item;
+        zset->root = in;
+        zset->height++;
+    }
+}
+
+static void zt_tree_erase(ZSet *zset, double s, ZNode *z) {
+    zt_erase(zset, zset->root, zset->height, s, z);
+    if (zset->height > 0 && ((ZInner *)zset->root)->n == 1) {
+        ZInner *in = (ZInner *)zset->root;
+        zset->root = in->kid[0];
+        zset->height--;
+        delete in;
+        zset->mem -= sizeof(ZInner);
+    } else if (zset->height == 0 && ((ZLeaf *)zset->root)->n == 0) {
+        delete (ZLeaf *)zset->root;
+        zset->mem -= sizeof(ZLeaf);
+        zset->root = NULL;
+    }
+}
+
+ZNode *zset_lookup(ZSet *zset, std::string_view name) {
+    ZLookup lk;
+    zlookup_init(lk, name);
+    HNode *node = hm_lookup(&zset->members, &lk.node, &znode_eq);
+    return node ? container_of(node, ZNode, node) : NULL;
+}
+
+bool zset_add(ZSet *zset, std::string_view name, double score) {
+    ZLookup lk;
+    zlookup_init(lk, name);
+    HNode *node = hm_lookup(&zset->members, &lk.node, &znode_eq);
+    if (node) {
+        ZNode *znode = container_of(node, ZNode, node);
+        if (znode->score != score) {
+            // moves within the tree
+            zt_tree_erase(zset, znode->score, znode);
+            znode->score = score;
+            zt_tree_insert(zset, score, znode);
+        }
+        return false;
+    }
+    size_t bytes = offsetof(ZNode, name) + name.size();
+    ZNode *znode = (ZNode *)malloc(bytes);
+    assert(znode);
+    znode->node.hcode = lk.node.hcode;
+    znode->score = score;
+    znode->len = (uint32_t)name.size();
+    memcpy(znode->name, name.data(), name.size());
+    hm_insert(&zset->members, &znode->node);
+    zset->size++;
+    zset->mem += bytes;
+    zt_tree_insert(zset, score, znode);
+    return true;
+}
+
+bool zset_rem(ZSet *zset, std::string_view name) {
+    ZLookup lk;
+    zlookup_init(lk, name);
+    HNode *node = hm_delete(&zset->members, &lk.node, &znode_eq);
+    if (!node) {
+        return false;
+    }
+    ZNode *znode = container_of(node, ZNode, node);
+    zt_tree_erase(zset, znode->score, znode);
+    zset->size--;
+    zset->mem -= offsetof(ZNode, name) + znode->len;
+    free(znode);
+    return true;
+}
+
+size_t zset_rank(ZSet *zset, const ZNode *znode) {
+    size_t rank = 0;
+    void *node = zset->root;
+    for (uint32_t level = zset->height; level > 0; level--) {
+        ZInner *in = (ZInner *)node;
+        uint32_t i = zkeys_upper(in->score, in->item, in->n - 1, znode->score, znode);
+        for (uint32_t k = 0; k < i; k++) {
+            rank += in->count[k];
+        }
+        node = in->kid[i];
+    }
+    ZLeaf *leaf = (ZLeaf *)node;
+    return rank + zkeys_upper(leaf->score, leaf->item, leaf->n, znode->score, znode) - 1;
+}
+
+ZIter zset_seek_rank(ZSet *zset, size_t rank) {
+    ZIter it;
+    if (rank >= zset->size) {
+        return it;
+    }
+    void *node = zset->root;
+    for (uint32_t level = zset->height; level > 0; level--) {
+        ZInner *in = (ZInner *)node;
+        uint32_t i = 0;
+        while (rank >= in->count[i]) {
+            rank -= in->count[i];
+            i++;
+        }
+        node = in->kid[i];
+    }
+    it.leaf = (ZLeaf *)node;
+    it.idx = (uint32_t)rank;
+    return it;
+}
+
+ZIter zset_seek_score(ZSet *zset, double min, bool exclusive) {
+    ZIter it;
+    if (!zset->root) {
+        return it;
+    }
+    // the last child whose smallest key is below the bound: it may hold
+    // keys past it, or else the next leaf starts with the first one
+    void *node = zset->root;
+    for (uint32_t level = zset->height; level > 0; level--) {
+        ZInner *in = (ZInner *)node;
+        uint32_t i = 0;
+        while (i < in->n - 1 && (in->score[i] < min || (exclusive && in->score[i] == min))) {
+            i++;
+        }
+        node = in->kid[i];
+    }
+    ZLeaf *leaf = (ZLeaf *)node;
+    uint32_t i = 0;
+    while (i < leaf->n && (leaf->score[i] < min || (exclusive && leaf->score[i] == min))) {
+        i++;
+    }
+    it.leaf = leaf;
+    it.idx = i;
+    if (i == leaf->n) {
+        it.leaf = leaf->next;
+        it.idx = 0;
+    }
+    return it;
+}
+
+static void zt_free(void *node, uint32_t level) {
+    if (level == 0) {
+        ZLeaf *leaf = (ZLeaf *)node;
+        for (uint32_t i = 0; i < leaf->n; i++) {
+            free(leaf->item[i]);
+        }
+        delete leaf;
+        return;
+    }
+    ZInner *in = (ZInner *)node;
+    for (uint32_t i = 0; i < in->n; i++) {
+        zt_free(in->kid[i], level - 1);
+    }
+    delete in;
+}
+
+void zset_clear(ZSet *zset) {
+    if (zset->root) {
+        zt_free(zset->root, zset->height);
+    }
+    hm_clear(&zset->members);
+    zset->root = NULL;
+    zset->height = 0;
+    zset->size = 0;
+    zset->mem = 0;
+}
+
+size_t zset_mem_usage(ZSet *zset) {
+    return zset->mem + hm_mem_usage(&zset->members);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <string_view>
+// proj
+#include "hashtable.h"
+
+
+// a member: in the member table by name, and in the tree by (score, name).
+// the name follows the struct in the same allocation.
+struct ZNode {
+    HNode node;
+    double score;
+    uint32_t len;
+    char name[0];
+};
+
+// B+tree nodes are whole cache lines. a node keeps its scores in their own
+// array, so a search scans contiguous doubles and only reads a member's
+// name to break a tie.
+const uint32_t k_zleaf_keys = 15;
+const uint32_t k_zinner_kids = 16;
+
+// 256 bytes
+struct alignas(64) ZLeaf {
+    uint32_t n;
+    ZLeaf *next;                        // the leaves are a list, for scans
+    double score[k_zleaf_keys];
+    ZNode *item[k_zleaf_keys];
+};
+
+// 448 bytes. separator i is the smallest key under child i + 1, and the
+// key counts under each child give the ranks.
+struct alignas(64) ZInner {
+    uint32_t n;                         // children
+    double score[k_zinner_kids - 1];
+    ZNode *item[k_zinner_kids - 1];
+    void *kid[k_zinner_kids];
+    uint32_t count[k_zinner_kids];
+};
+
+// a sorted set: members ordered by score, then name
+struct ZSet {
+    HMap members;
+    void *root = NULL;
+    uint32_t height = 0;    // inner levels above the leaves
+    size_t size = 0;
+    size_t mem = 0;         // tree nodes and members, in bytes
+};
+
+// adds the member or updates its score; true if it's new
+bool zset_add(ZSet *zset, std::string_view name, double score);
+// false if there's no such member
+bool zset_rem(ZSet *zset, std::string_view name);
+ZNode *zset_lookup(ZSet *zset, std::string_view name);
+// 0-based, in score order
+size_t zset_rank(ZSet *zset, const ZNode *znode);
+void zset_clear(ZSet *zset);
+size_t zset_mem_usage(ZSet *zset);
+
+// a position in score order. `leaf` is NULL past the end.
+struct ZIter {
+    ZLeaf *leaf = NULL;
+    uint32_t idx = 0;
+};
+
+ZIter zset_seek_rank(ZSet *zset, size_t rank);
+// the first member with a score >= `min`, or > `min` if `exclusive`
+ZIter zset_seek_score(ZSet *zset, double min, bool exclusive);
+
+static inline ZNode *zit_node(const ZIter &it) {
+    return it.leaf->item[it.idx];
+}
+
+static inline double zit_score(const ZIter &it) {
+    return it.leaf->score[it.idx];
+}
+
+static inline void zit_next(ZIter &it) {
+    if (++it.idx == it.leaf->n) {
+        it.leaf = it.leaf->next;
+        it.idx = 0;
+    }
+}
+
+// moves `n` members on, a leaf at a time where it can
+static inline void zit_skip(ZIter &it, size_t n) {
+    while (it.leaf && n >= it.leaf->n - it.idx) {
+        n -= it.leaf->n - it.idx;
+        it.leaf = it.leaf->next;
+        it.idx = 0;
+    }
+    if (it.leaf) {
+        it.idx += (uint32_t)n;
+    }
+}